@@ -0,0 +1,59 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2020, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file atomic.h
+ * @author Andreas Schwier
+ * @brief Atomic operations on counters shared between threads without a lock
+ */
+
+#ifndef _ATOMIC_H_
+#define _ATOMIC_H_
+
+#ifdef _WIN32
+#include <windows.h>
+
+#define atomic_inc(p)		InterlockedIncrement(p)
+#define atomic_dec(p)		InterlockedDecrement(p)
+#define atomic_get(p)		InterlockedCompareExchange(p, 0, 0)
+#define atomic_set(p, v)	InterlockedExchange(p, v)
+#define atomic_add64(p, v)	InterlockedExchangeAdd64(p, v)
+#define atomic_get64(p)		InterlockedCompareExchange64(p, 0, 0)
+#define atomic_cas_ptr(p, o, n)	(InterlockedCompareExchangePointer((PVOID volatile *)(p), n, o) == (o))
+#define atomic_get_ptr(p)	InterlockedCompareExchangePointer((PVOID volatile *)(p), NULL, NULL)
+#else
+#define atomic_inc(p)		__sync_add_and_fetch(p, 1)
+#define atomic_dec(p)		__sync_sub_and_fetch(p, 1)
+#define atomic_get(p)		__sync_add_and_fetch(p, 0)
+#define atomic_set(p, v)	(void)__sync_lock_test_and_set(p, v)
+#define atomic_add64(p, v)	__sync_add_and_fetch(p, v)
+#define atomic_get64(p)		__sync_add_and_fetch(p, 0)
+#define atomic_cas_ptr(p, o, n)	__sync_bool_compare_and_swap(p, o, n)
+#define atomic_get_ptr(p)	__sync_val_compare_and_swap(p, NULL, NULL)
+#endif
+
+#endif
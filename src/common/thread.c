@@ -0,0 +1,657 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2020, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file thread.c
+ * @author Andreas Schwier
+ * @brief Defines procedures for cross platform thread handling
+ */
+
+#include <stdlib.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <time.h>
+#endif
+
+#include "thread.h"
+
+
+
+struct thread_start {
+	void (*func)(void *);
+	void *arg;
+};
+
+
+
+#ifdef _WIN32
+static unsigned __stdcall thread_main(void *p)
+#else
+static void *thread_main(void *p)
+#endif
+{
+	struct thread_start ts = *(struct thread_start *)p;
+
+	free(p);
+	ts.func(ts.arg);
+	return 0;
+}
+
+
+
+int thread_create(THREAD *thread, void (*func)(void *), void *arg) {
+	struct thread_start *ts;
+	int rc;
+
+	ts = (struct thread_start *)calloc(1, sizeof(*ts));
+	if (ts == NULL)
+		return -1;
+
+	ts->func = func;
+	ts->arg = arg;
+
+#ifdef _WIN32
+	*thread = (HANDLE)_beginthreadex(NULL, 0, thread_main, ts, 0, NULL);
+	rc = (*thread == 0 ? -1 : 0);
+#else
+	rc = pthread_create(thread, NULL, thread_main, ts);
+#endif
+
+	if (rc != 0)
+		free(ts);
+
+	return rc;
+}
+
+
+
+int thread_join(THREAD *thread) {
+#ifdef _WIN32
+	if (WaitForSingleObject(*thread, INFINITE) == WAIT_FAILED)
+		return -1;
+	return (CloseHandle(*thread) == 0 ? -1 : 0);
+#else
+	return pthread_join(*thread, NULL);
+#endif
+}
+
+
+
+void thread_sleep(int ms) {
+#ifdef _WIN32
+	Sleep(ms);
+#else
+	usleep(ms * 1000);
+#endif
+}
+
+
+
+/**
+ * Return a monotonic time in milliseconds, which wraps around
+ */
+unsigned long thread_ticks() {
+#ifdef _WIN32
+	return GetTickCount();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+
+
+/**
+ * Return a monotonic time in microseconds
+ */
+unsigned long long thread_micros() {
+#ifdef _WIN32
+	LARGE_INTEGER freq, cnt;
+
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&cnt);
+	return (cnt.QuadPart / freq.QuadPart) * 1000000 + (cnt.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+
+
+/**
+ * Return the number of processors available
+ */
+int thread_processors() {
+#ifdef _WIN32
+	SYSTEM_INFO si;
+
+	GetSystemInfo(&si);
+	return (int)si.dwNumberOfProcessors;
+#else
+	long n;
+
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int)n : 1;
+#endif
+}
+
+
+
+static THREAD_ID thread_self() {
+#ifdef _WIN32
+	return GetCurrentThreadId();
+#else
+	return pthread_self();
+#endif
+}
+
+
+
+static int thread_equal(THREAD_ID a, THREAD_ID b) {
+#ifdef _WIN32
+	return a == b;
+#else
+	return pthread_equal(a, b);
+#endif
+}
+
+
+
+int ticket_lock_init(struct ticket_lock *lock) {
+	lock->next = 0;
+	lock->serving = 0;
+	lock->depth = 0;
+#ifdef _WIN32
+	InitializeCriticalSection(&lock->cs);
+	InitializeConditionVariable(&lock->cv);
+	return 0;
+#else
+	if (pthread_mutex_init(&lock->mutex, NULL) != 0)
+		return -1;
+	if (pthread_cond_init(&lock->cv, NULL) != 0) {
+		pthread_mutex_destroy(&lock->mutex);
+		return -1;
+	}
+	return 0;
+#endif
+}
+
+
+
+void ticket_lock_acquire(struct ticket_lock *lock) {
+	unsigned long ticket;
+	THREAD_ID self = thread_self();
+
+#ifdef _WIN32
+	EnterCriticalSection(&lock->cs);
+#else
+	pthread_mutex_lock(&lock->mutex);
+#endif
+
+	if ((lock->depth > 0) && thread_equal(lock->owner, self)) {
+		lock->depth++;
+	} else {
+		ticket = lock->next++;
+		while (ticket != lock->serving) {
+#ifdef _WIN32
+			SleepConditionVariableCS(&lock->cv, &lock->cs, INFINITE);
+#else
+			pthread_cond_wait(&lock->cv, &lock->mutex);
+#endif
+		}
+		lock->owner = self;
+		lock->depth = 1;
+	}
+
+#ifdef _WIN32
+	LeaveCriticalSection(&lock->cs);
+#else
+	pthread_mutex_unlock(&lock->mutex);
+#endif
+}
+
+
+
+/**
+ * Acquire the lock only if no other thread holds or waits for it
+ *
+ * @return 0 if the lock was acquired, -1 otherwise
+ */
+int ticket_lock_tryacquire(struct ticket_lock *lock) {
+	THREAD_ID self = thread_self();
+	int rc = -1;
+
+#ifdef _WIN32
+	EnterCriticalSection(&lock->cs);
+#else
+	pthread_mutex_lock(&lock->mutex);
+#endif
+
+	if ((lock->depth > 0) && thread_equal(lock->owner, self)) {
+		lock->depth++;
+		rc = 0;
+	} else if (lock->next == lock->serving) {
+		lock->next++;
+		lock->owner = self;
+		lock->depth = 1;
+		rc = 0;
+	}
+
+#ifdef _WIN32
+	LeaveCriticalSection(&lock->cs);
+#else
+	pthread_mutex_unlock(&lock->mutex);
+#endif
+	return rc;
+}
+
+
+
+void ticket_lock_release(struct ticket_lock *lock) {
+#ifdef _WIN32
+	EnterCriticalSection(&lock->cs);
+#else
+	pthread_mutex_lock(&lock->mutex);
+#endif
+
+	if (--lock->depth == 0) {
+		lock->serving++;
+#ifdef _WIN32
+		WakeAllConditionVariable(&lock->cv);
+#else
+		pthread_cond_broadcast(&lock->cv);
+#endif
+	}
+
+#ifdef _WIN32
+	LeaveCriticalSection(&lock->cs);
+#else
+	pthread_mutex_unlock(&lock->mutex);
+#endif
+}
+
+
+
+/**
+ * Return the number of threads holding or waiting for the lock
+ */
+int ticket_lock_pending(struct ticket_lock *lock) {
+	int pending;
+
+#ifdef _WIN32
+	EnterCriticalSection(&lock->cs);
+#else
+	pthread_mutex_lock(&lock->mutex);
+#endif
+
+	pending = (int)(lock->next - lock->serving);
+
+#ifdef _WIN32
+	LeaveCriticalSection(&lock->cs);
+#else
+	pthread_mutex_unlock(&lock->mutex);
+#endif
+	return pending;
+}
+
+
+
+void ticket_lock_destroy(struct ticket_lock *lock) {
+#ifdef _WIN32
+	DeleteCriticalSection(&lock->cs);
+#else
+	pthread_cond_destroy(&lock->cv);
+	pthread_mutex_destroy(&lock->mutex);
+#endif
+}
+
+
+
+int rw_lock_init(struct rw_lock *lock) {
+	lock->readers = 0;
+	lock->writer = 0;
+	lock->waitingWriters = 0;
+#ifdef _WIN32
+	InitializeCriticalSection(&lock->cs);
+	InitializeConditionVariable(&lock->cv);
+	return 0;
+#else
+	if (pthread_mutex_init(&lock->mutex, NULL) != 0)
+		return -1;
+	if (pthread_cond_init(&lock->cv, NULL) != 0) {
+		pthread_mutex_destroy(&lock->mutex);
+		return -1;
+	}
+	return 0;
+#endif
+}
+
+
+
+static void rw_lock_enter(struct rw_lock *lock) {
+#ifdef _WIN32
+	EnterCriticalSection(&lock->cs);
+#else
+	pthread_mutex_lock(&lock->mutex);
+#endif
+}
+
+
+
+static void rw_lock_leave(struct rw_lock *lock) {
+#ifdef _WIN32
+	LeaveCriticalSection(&lock->cs);
+#else
+	pthread_mutex_unlock(&lock->mutex);
+#endif
+}
+
+
+
+static void rw_lock_wait(struct rw_lock *lock) {
+#ifdef _WIN32
+	SleepConditionVariableCS(&lock->cv, &lock->cs, INFINITE);
+#else
+	pthread_cond_wait(&lock->cv, &lock->mutex);
+#endif
+}
+
+
+
+static void rw_lock_wakeup(struct rw_lock *lock) {
+#ifdef _WIN32
+	WakeAllConditionVariable(&lock->cv);
+#else
+	pthread_cond_broadcast(&lock->cv);
+#endif
+}
+
+
+
+void rw_lock_acquire_shared(struct rw_lock *lock) {
+	rw_lock_enter(lock);
+
+	while (lock->writer || lock->waitingWriters)
+		rw_lock_wait(lock);
+
+	lock->readers++;
+
+	rw_lock_leave(lock);
+}
+
+
+
+void rw_lock_release_shared(struct rw_lock *lock) {
+	rw_lock_enter(lock);
+
+	if ((--lock->readers == 0) && lock->waitingWriters)
+		rw_lock_wakeup(lock);
+
+	rw_lock_leave(lock);
+}
+
+
+
+void rw_lock_acquire_exclusive(struct rw_lock *lock) {
+	rw_lock_enter(lock);
+
+	lock->waitingWriters++;
+	while (lock->writer || lock->readers)
+		rw_lock_wait(lock);
+	lock->waitingWriters--;
+
+	lock->writer = 1;
+
+	rw_lock_leave(lock);
+}
+
+
+
+void rw_lock_release_exclusive(struct rw_lock *lock) {
+	rw_lock_enter(lock);
+
+	lock->writer = 0;
+	rw_lock_wakeup(lock);
+
+	rw_lock_leave(lock);
+}
+
+
+
+void rw_lock_destroy(struct rw_lock *lock) {
+#ifdef _WIN32
+	DeleteCriticalSection(&lock->cs);
+#else
+	pthread_cond_destroy(&lock->cv);
+	pthread_mutex_destroy(&lock->mutex);
+#endif
+}
+
+
+
+static void worker_pool_lock(struct worker_pool *pool) {
+#ifdef _WIN32
+	EnterCriticalSection(&pool->cs);
+#else
+	pthread_mutex_lock(&pool->mutex);
+#endif
+}
+
+
+
+static void worker_pool_unlock(struct worker_pool *pool) {
+#ifdef _WIN32
+	LeaveCriticalSection(&pool->cs);
+#else
+	pthread_mutex_unlock(&pool->mutex);
+#endif
+}
+
+
+
+static void worker_pool_wait(struct worker_pool *pool) {
+#ifdef _WIN32
+	SleepConditionVariableCS(&pool->cv, &pool->cs, INFINITE);
+#else
+	pthread_cond_wait(&pool->cv, &pool->mutex);
+#endif
+}
+
+
+
+static void worker_pool_wakeup(struct worker_pool *pool) {
+#ifdef _WIN32
+	WakeAllConditionVariable(&pool->cv);
+#else
+	pthread_cond_broadcast(&pool->cv);
+#endif
+}
+
+
+
+/**
+ * Remove a job from the queue, so that no further workers join
+ *
+ * Must be called with the pool locked
+ */
+static void worker_pool_close_job(struct worker_pool *pool, struct worker_job *job) {
+	struct worker_job **pjob;
+
+	for (pjob = &pool->jobs; *pjob; pjob = &(*pjob)->next) {
+		if (*pjob == job) {
+			*pjob = job->next;
+			break;
+		}
+	}
+}
+
+
+
+static void worker_main(void *arg) {
+	struct worker_pool *pool = (struct worker_pool *)arg;
+	struct worker_job *job;
+
+	worker_pool_lock(pool);
+
+	while (!pool->stop) {
+		job = pool->jobs;
+
+		if (job == NULL) {
+			worker_pool_wait(pool);
+			continue;
+		}
+
+		job->running++;
+		worker_pool_unlock(pool);
+
+		job->func(job->arg);
+
+		worker_pool_lock(pool);
+		worker_pool_close_job(pool, job);	// All work has been taken once func returns
+		if (--job->running == 0)
+			worker_pool_wakeup(pool);
+	}
+
+	worker_pool_unlock(pool);
+}
+
+
+
+/**
+ * Create a pool of worker threads
+ *
+ * @param pool the pool created
+ * @param threads the number of worker threads
+ * @return 0 or -1 if the pool could not be created
+ */
+int worker_pool_create(struct worker_pool **pool, int threads) {
+	struct worker_pool *p;
+	int i;
+
+	p = (struct worker_pool *)calloc(1, sizeof(struct worker_pool) + (threads - 1) * sizeof(THREAD));
+	if (p == NULL)
+		return -1;
+
+#ifdef _WIN32
+	InitializeCriticalSection(&p->cs);
+	InitializeConditionVariable(&p->cv);
+#else
+	if (pthread_mutex_init(&p->mutex, NULL) != 0) {
+		free(p);
+		return -1;
+	}
+	if (pthread_cond_init(&p->cv, NULL) != 0) {
+		pthread_mutex_destroy(&p->mutex);
+		free(p);
+		return -1;
+	}
+#endif
+
+	for (i = 0; i < threads; i++) {
+		if (thread_create(&p->thread[i], worker_main, p) != 0)
+			break;
+		p->numberOfThreads++;
+	}
+
+	if (p->numberOfThreads == 0) {
+		worker_pool_destroy(p);
+		return -1;
+	}
+
+	*pool = p;
+	return 0;
+}
+
+
+
+/**
+ * Run a job in the calling thread and in all idle workers
+ *
+ * The function is called once in each participating thread and must take units of work from
+ * a shared counter until none is left. It must not return before all work has been taken.
+ * worker_pool_run() returns after all participating threads completed.
+ *
+ * @param pool the worker pool
+ * @param func the function processing the work
+ * @param arg the argument passed to func
+ */
+void worker_pool_run(struct worker_pool *pool, void (*func)(void *), void *arg) {
+	struct worker_job job, **pjob;
+
+	job.func = func;
+	job.arg = arg;
+	job.running = 0;
+	job.next = NULL;
+
+	worker_pool_lock(pool);
+	for (pjob = &pool->jobs; *pjob; pjob = &(*pjob)->next);
+	*pjob = &job;
+	worker_pool_wakeup(pool);
+	worker_pool_unlock(pool);
+
+	func(arg);
+
+	worker_pool_lock(pool);
+	worker_pool_close_job(pool, &job);
+	while (job.running > 0)
+		worker_pool_wait(pool);
+	worker_pool_unlock(pool);
+}
+
+
+
+/**
+ * Terminate the worker threads and release the pool
+ *
+ * Must not be called while jobs are running
+ */
+void worker_pool_destroy(struct worker_pool *pool) {
+	int i;
+
+	worker_pool_lock(pool);
+	pool->stop = 1;
+	worker_pool_wakeup(pool);
+	worker_pool_unlock(pool);
+
+	for (i = 0; i < pool->numberOfThreads; i++) {
+		thread_join(&pool->thread[i]);
+	}
+
+#ifdef _WIN32
+	DeleteCriticalSection(&pool->cs);
+#else
+	pthread_cond_destroy(&pool->cv);
+	pthread_mutex_destroy(&pool->mutex);
+#endif
+	free(pool);
+}
@@ -0,0 +1,135 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2020, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file thread.h
+ * @author Andreas Schwier
+ * @brief Defines procedures for cross platform thread handling
+ */
+
+#ifndef _THREAD_H_
+#define _THREAD_H_
+
+#include "mutex.h"
+
+#ifdef _WIN32
+#define THREAD HANDLE
+#define THREAD_ID DWORD
+#else
+#define THREAD pthread_t
+#define THREAD_ID pthread_t
+#endif
+
+/**
+ * Recursive lock granting access in the order of arrival
+ */
+struct ticket_lock {
+#ifdef _WIN32
+	CRITICAL_SECTION cs;
+	CONDITION_VARIABLE cv;
+#else
+	pthread_mutex_t mutex;
+	pthread_cond_t cv;
+#endif
+	unsigned long next;                 // Next ticket to be handed out
+	unsigned long serving;              // Ticket currently holding the lock
+	THREAD_ID owner;                    // Thread currently holding the lock
+	int depth;                          // Recursion depth of owner
+};
+
+/**
+ * Reader-writer lock preferring writers
+ *
+ * Readers and writers wait on a condition variable. A waiting writer stops new readers,
+ * so a thread must not acquire the lock shared recursively.
+ */
+struct rw_lock {
+#ifdef _WIN32
+	CRITICAL_SECTION cs;
+	CONDITION_VARIABLE cv;
+#else
+	pthread_mutex_t mutex;
+	pthread_cond_t cv;
+#endif
+	int readers;                        // Threads holding the lock shared
+	int writer;                         // A thread holds the lock exclusive
+	int waitingWriters;                 // Threads waiting to acquire the lock exclusive
+};
+
+/**
+ * Work submitted to a worker pool
+ */
+struct worker_job {
+	void (*func)(void *);               // Function processing the work
+	void *arg;                          // Argument passed to func
+	int running;                        // Number of workers running func
+	struct worker_job *next;            // Next job in the queue
+};
+
+/**
+ * Threads sharing the processing of jobs with the thread submitting them
+ */
+struct worker_pool {
+#ifdef _WIN32
+	CRITICAL_SECTION cs;
+	CONDITION_VARIABLE cv;
+#else
+	pthread_mutex_t mutex;
+	pthread_cond_t cv;
+#endif
+	struct worker_job *jobs;            // Jobs open for workers to join
+	int stop;                           // Workers shall terminate
+	int numberOfThreads;                // Number of worker threads
+	THREAD thread[1];                   // Worker threads
+};
+
+int thread_create(THREAD *thread, void (*func)(void *), void *arg);
+int thread_join(THREAD *thread);
+void thread_sleep(int ms);
+unsigned long thread_ticks();
+unsigned long long thread_micros();
+int thread_processors();
+
+int ticket_lock_init(struct ticket_lock *lock);
+void ticket_lock_acquire(struct ticket_lock *lock);
+int ticket_lock_tryacquire(struct ticket_lock *lock);
+void ticket_lock_release(struct ticket_lock *lock);
+int ticket_lock_pending(struct ticket_lock *lock);
+void ticket_lock_destroy(struct ticket_lock *lock);
+
+int rw_lock_init(struct rw_lock *lock);
+void rw_lock_acquire_shared(struct rw_lock *lock);
+void rw_lock_release_shared(struct rw_lock *lock);
+void rw_lock_acquire_exclusive(struct rw_lock *lock);
+void rw_lock_release_exclusive(struct rw_lock *lock);
+void rw_lock_destroy(struct rw_lock *lock);
+
+int worker_pool_create(struct worker_pool **pool, int threads);
+void worker_pool_run(struct worker_pool *pool, void (*func)(void *), void *arg);
+void worker_pool_destroy(struct worker_pool *pool);
+
+#endif
@@ -85,6 +85,48 @@ CK_RV p11UnlockMutex(CK_VOID_PTR pMutex)
 
 
 
+CK_RV p11CreateRWLock(CK_VOID_PTR_PTR ppLock)
+{
+	return CKR_OK;
+}
+
+
+
+CK_RV p11DestroyRWLock(CK_VOID_PTR pLock)
+{
+	return CKR_OK;
+}
+
+
+
+CK_RV p11LockShared(CK_VOID_PTR pLock)
+{
+	return CKR_OK;
+}
+
+
+
+CK_RV p11UnlockShared(CK_VOID_PTR pLock)
+{
+	return CKR_OK;
+}
+
+
+
+CK_RV p11LockExclusive(CK_VOID_PTR pLock)
+{
+	return CKR_OK;
+}
+
+
+
+CK_RV p11UnlockExclusive(CK_VOID_PTR pLock)
+{
+	return CKR_OK;
+}
+
+
+
 /**
  * Map P11 error codes to CSP error codes
  */
@@ -1160,7 +1202,7 @@ static DWORD WINAPI CardRSADecrypt(__in PCARD_DATA pCardData,
 		FUNC_FAILS(SCARD_E_NO_KEY_CONTAINER, "bContainerIndex invalid");
 
 	keytype = CKK_RSA;
-	if (findAttribute(p11prikey, CKA_KEY_TYPE, &attr)) {
+	if (findAttribute(p11prikey, CKA_KEY_TYPE, &attr) >= 0) {
 		keytype = *(CK_KEY_TYPE *)attr->attrData.pValue;
 	}
 
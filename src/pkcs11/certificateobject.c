@@ -100,6 +100,13 @@ int populateIssuerSubjectSerial(struct p11Object_t *pObject)
 		return -1;
 	}
 
+	/* Keep the certificate value in place while adding the attributes decoded from it */
+	if (reserveAttributes(pObject, 3, pattr->attrData.ulValueLen) != CKR_OK) {
+		return -1;
+	}
+
+	findAttribute(pObject, CKA_VALUE, &pattr);
+
 	cursor = pattr->attrData.pValue;
 	buflen = pattr->attrData.ulValueLen;
 
@@ -202,6 +209,13 @@ int populateCVCAttributes(struct p11Object_t *pObject)
 		return -1;
 	}
 
+	/* Keep the certificate value in place while adding the attributes decoded from it */
+	if (reserveAttributes(pObject, 7, pattr->attrData.ulValueLen) != CKR_OK) {
+		return -1;
+	}
+
+	findAttribute(pObject, CKA_VALUE, &pattr);
+
 	if (cvcDecode(pattr->attrData.pValue, pattr->attrData.ulValueLen, &cvc) < 0) {
 		return -1;
 	}
@@ -249,33 +249,43 @@ static CK_RV verifyDigestInfo(RSA *key, const unsigned char *data, int data_len,
 
 
 /**
- * Verify with RSA key
+ * Release a key kept in the key cache of an object
  */
-static CK_RV verifyRSA(struct p11Object_t *obj, CK_MECHANISM_TYPE mech, CK_BYTE_PTR in, CK_ULONG in_len, CK_BYTE_PTR signature, CK_ULONG signature_len)
+static void freeKey(void *key)
+{
+	EVP_PKEY_free((EVP_PKEY *)key);
+}
+
+
+
+/**
+ * Decode RSA public key from CKA_MODULUS and CKA_PUBLIC_EXPONENT
+ */
+static CK_RV decodeRSAKey(struct p11Object_t *obj, EVP_PKEY **pkey)
 {
 	struct p11Attribute_t *modulus;
 	struct p11Attribute_t *public_exponent;
 	RSA *rsa;
-	EVP_PKEY *pkey;
-	CK_RV rv;
+	EVP_PKEY *key;
+	int rc;
 
 	FUNC_CALLED();
 
-	rv = findAttribute(obj, CKA_MODULUS, &modulus);
+	rc = findAttribute(obj, CKA_MODULUS, &modulus);
 
-	if (rv == -1)
+	if (rc == -1)
 		FUNC_FAILS(CKR_TEMPLATE_INCOMPLETE, "CKA_MODULUS not found");
 
-	if (modulus->attrData.ulValueLen != signature_len)
-		FUNC_FAILS(CKR_SIGNATURE_LEN_RANGE, "Length of modulus does not match signature length");
-
-	rv = findAttribute(obj, CKA_PUBLIC_EXPONENT, &public_exponent);
+	rc = findAttribute(obj, CKA_PUBLIC_EXPONENT, &public_exponent);
 
-	if (rv == -1)
+	if (rc == -1)
 		FUNC_FAILS(CKR_TEMPLATE_INCOMPLETE, "CKA_EXPONENT not found");
 
 	rsa = RSA_new();
 
+	if (rsa == NULL)
+		FUNC_FAILS(CKR_HOST_MEMORY, "Out of memory");
+
 	#if (OPENSSL_VERSION_NUMBER < 0x10100000)
 	rsa->n = BN_bin2bn(modulus->attrData.pValue, modulus->attrData.ulValueLen, NULL);
 	rsa->e = BN_bin2bn(public_exponent->attrData.pValue, public_exponent->attrData.ulValueLen, NULL);
@@ -286,8 +296,204 @@ static CK_RV verifyRSA(struct p11Object_t *obj, CK_MECHANISM_TYPE mech, CK_BYTE_
 	RSA_set0_key(rsa, new_n, new_e, NULL);
 	#endif
 
-	pkey = EVP_PKEY_new();
-	EVP_PKEY_assign_RSA(pkey, rsa);
+	key = EVP_PKEY_new();
+
+	if ((key == NULL) || !EVP_PKEY_assign_RSA(key, rsa)) {
+		RSA_free(rsa);
+		EVP_PKEY_free(key);
+		FUNC_FAILS(CKR_HOST_MEMORY, "Out of memory");
+	}
+
+	*pkey = key;
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * Decode EC public key from CKA_EC_PARAMS and CKA_EC_POINT
+ */
+static CK_RV decodeECKey(struct p11Object_t *obj, EVP_PKEY **pkey)
+{
+	struct p11Attribute_t *ecparam;
+	struct p11Attribute_t *ecpoint;
+	const unsigned char *po;
+	unsigned char *ppo;
+	EC_GROUP *ecg = NULL;
+	EC_POINT *ecp = NULL;
+	EC_KEY *ec = NULL;
+	EVP_PKEY *key = NULL;
+	CK_RV rv = CKR_OK;
+	int rc, len;
+
+	FUNC_CALLED();
+
+	rc = findAttribute(obj, CKA_EC_PARAMS, &ecparam);
+
+	if (rc == -1)
+		FUNC_FAILS(CKR_GENERAL_ERROR, "CKA_EC_PARAMS not found");
+
+	rc = findAttribute(obj, CKA_EC_POINT, &ecpoint);
+
+	if (rc == -1)
+		FUNC_FAILS(CKR_GENERAL_ERROR, "CKA_EC_POINT not found");
+
+	po = ecparam->attrData.pValue;
+
+	if (d2i_ECPKParameters(&ecg, &po, ecparam->attrData.ulValueLen) == NULL) {
+		FUNC_FAILVIAOUT(CKR_ATTRIBUTE_VALUE_INVALID, "d2i_ECPKParameters() could not decode curve");
+	}
+
+	ec = EC_KEY_new();
+
+	if (ec == NULL) {
+		FUNC_FAILVIAOUT(CKR_HOST_MEMORY, "Out of memory");
+	}
+
+	ecp = EC_POINT_new(ecg);
+
+	if (ecp == NULL) {
+		FUNC_FAILVIAOUT(CKR_HOST_MEMORY, "Out of memory");
+	}
+
+	ppo = (CK_BYTE_PTR)ecpoint->attrData.pValue + 1;	// Skip tag 04
+	len = asn1Length(&ppo);
+
+	if (!EC_POINT_oct2point(ecg, ecp, ppo, len, NULL)) {
+		FUNC_FAILVIAOUT(CKR_ATTRIBUTE_VALUE_INVALID, "EC_POINT_oct2point() could not decode point");
+	}
+
+	if (!EC_KEY_set_group(ec, ecg)) {
+		FUNC_FAILVIAOUT(CKR_GENERAL_ERROR, "EC_KEY_set_group() failed");
+	}
+
+	if (!EC_KEY_set_public_key(ec, ecp)) {
+		FUNC_FAILVIAOUT(CKR_GENERAL_ERROR, "EC_KEY_set_public_key() failed");
+	}
+
+#if (OPENSSL_VERSION_NUMBER < 0x30000000)
+	// Precomputed multiples of the generator speed up all further verifications with this key.
+	// OpenSSL 3 maps the curve to its built-in implementation when the key is first used.
+	EC_KEY_precompute_mult(ec, NULL);
+#endif
+
+	key = EVP_PKEY_new();
+
+	if (key == NULL) {
+		FUNC_FAILVIAOUT(CKR_HOST_MEMORY, "Out of memory");
+	}
+
+	if (!EVP_PKEY_assign_EC_KEY(key, ec)) {
+		FUNC_FAILVIAOUT(CKR_GENERAL_ERROR, "EVP_PKEY_assign_EC_KEY() failed");
+	}
+
+	ec = NULL;
+	*pkey = key;
+	key = NULL;
+
+out:
+	if (ecg != NULL)
+		EC_GROUP_free(ecg);
+
+	if (ecp != NULL)
+		EC_POINT_free(ecp);
+
+	if (ec != NULL)
+		EC_KEY_free(ec);
+
+	if (key != NULL)
+		EVP_PKEY_free(key);
+
+	FUNC_RETURNS(rv);
+}
+
+
+
+/**
+ * Return the public key decoded from the object attributes
+ *
+ * The key is decoded on first use and kept with the object until the key material
+ * changes. The key remains owned by the object and must not be freed by the caller.
+ */
+static CK_RV getPublicKey(struct p11Object_t *obj, CK_KEY_TYPE keyType, EVP_PKEY **pkey)
+{
+	EVP_PKEY *key;
+	CK_RV rv;
+
+	FUNC_CALLED();
+
+	key = (EVP_PKEY *)getCachedKey(obj);
+
+	if (key != NULL) {
+		*pkey = key;
+		FUNC_RETURNS(CKR_OK);
+	}
+
+	// Only decoding reads the attributes, which C_SetAttributeValue replaces under the lock
+	if (obj->token) {
+		p11LockShared(obj->token->objectLock);
+	}
+
+	if (keyType == CKK_RSA) {
+		rv = decodeRSAKey(obj, &key);
+	} else {
+		rv = decodeECKey(obj, &key);
+	}
+
+	if (obj->token) {
+		p11UnlockShared(obj->token->objectLock);
+	}
+
+	// The object owns the key from now on, which may be replaced by the key of a concurrent thread
+	if (rv == CKR_OK) {
+		key = (EVP_PKEY *)cacheKey(obj, key, freeKey);
+		if (key == NULL) {
+			rv = CKR_HOST_MEMORY;
+		}
+	}
+
+	if (rv != CKR_OK) {
+		FUNC_FAILS(rv, "Could not decode public key");
+	}
+
+	*pkey = key;
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * Verify with RSA key
+ */
+static CK_RV verifyRSA(struct p11Object_t *obj, CK_MECHANISM_TYPE mech, CK_BYTE_PTR in, CK_ULONG in_len, CK_BYTE_PTR signature, CK_ULONG signature_len)
+{
+	struct p11Attribute_t *modulus;
+	RSA *rsa;
+	EVP_PKEY *pkey;
+	CK_RV rv;
+
+	FUNC_CALLED();
+
+	rv = findAttribute(obj, CKA_MODULUS, &modulus);
+
+	if (rv == -1)
+		FUNC_FAILS(CKR_TEMPLATE_INCOMPLETE, "CKA_MODULUS not found");
+
+	if (modulus->attrData.ulValueLen != signature_len)
+		FUNC_FAILS(CKR_SIGNATURE_LEN_RANGE, "Length of modulus does not match signature length");
+
+	rv = getPublicKey(obj, CKK_RSA, &pkey);
+
+	if (rv != CKR_OK)
+		FUNC_FAILS(rv, "Could not obtain RSA key");
+
+	#if (OPENSSL_VERSION_NUMBER < 0x10100000)
+	rsa = pkey->pkey.rsa;
+	#else
+	rsa = (RSA *)EVP_PKEY_get0_RSA(pkey);
+	#endif
 
 	switch (mech) {
 		case CKM_SHA1_RSA_PKCS:
@@ -343,8 +549,6 @@ static CK_RV verifyRSA(struct p11Object_t *obj, CK_MECHANISM_TYPE mech, CK_BYTE_
 			break;
 	}
 
-	EVP_PKEY_free(pkey);
-
 	FUNC_RETURNS(rv);
 }
 
@@ -368,74 +572,18 @@ static const EVP_MD *getHashForHashLen(int len) {
  */
 static CK_RV verifyECDSA(struct p11Object_t *obj, CK_MECHANISM_TYPE mech, CK_BYTE_PTR in, CK_ULONG in_len, CK_BYTE_PTR signature, CK_ULONG signature_len)
 {
-	struct p11Attribute_t *ecparam;
-	struct p11Attribute_t *ecpoint;
-	const unsigned char *po;
-	unsigned char *ppo;
 	unsigned char wrappedSig[140];
-	EC_GROUP *ecg = NULL;
-	EC_POINT *ecp = NULL;
-	EC_KEY *ec = NULL;
 	EVP_PKEY *pkey = NULL;
 	const EVP_MD *md = NULL;
 	CK_RV rv;
-	int rc, len;
+	int len;
 
 	FUNC_CALLED();
 
-	rc = findAttribute(obj, CKA_EC_PARAMS, &ecparam);
-
-	if (rc == -1)
-		FUNC_FAILS(CKR_GENERAL_ERROR, "CKA_EC_PARAMS not found");
-
-	rc = findAttribute(obj, CKA_EC_POINT, &ecpoint);
-
-	if (rc == -1)
-		FUNC_FAILS(CKR_GENERAL_ERROR, "CKA_EC_POINT not found");
-
-	po = ecparam->attrData.pValue;
-
-	ecg = NULL;
-	if (d2i_ECPKParameters(&ecg, &po, ecparam->attrData.ulValueLen) == NULL) {
-		FUNC_FAILVIAOUT(CKR_ATTRIBUTE_VALUE_INVALID, "d2i_ECPKParameters() could not decode curve");
-	}
-
-	ec = EC_KEY_new();
-
-	if (ec == NULL) {
-		FUNC_FAILVIAOUT(CKR_HOST_MEMORY, "Out of memory");
-	}
-
-	ecp = EC_POINT_new(ecg);
-
-	if (ecp == NULL) {
-		FUNC_FAILVIAOUT(CKR_HOST_MEMORY, "Out of memory");
-	}
-
-	ppo = (CK_BYTE_PTR)ecpoint->attrData.pValue + 1;	// Skip tag 04
-	len = asn1Length(&ppo);
-
-	if (!EC_POINT_oct2point(ecg, ecp, ppo, len, NULL)) {
-		FUNC_FAILVIAOUT(CKR_ATTRIBUTE_VALUE_INVALID, "EC_POINT_oct2point() could not decode point");
-	}
-
-	if (!EC_KEY_set_group(ec, ecg)) {
-		FUNC_FAILVIAOUT(CKR_GENERAL_ERROR, "EC_KEY_set_group() failed");
-	}
-
-	if (!EC_KEY_set_public_key(ec, ecp)) {
-		FUNC_FAILVIAOUT(CKR_GENERAL_ERROR, "EC_KEY_set_public_key() failed");
-	}
-
-	pkey = EVP_PKEY_new();
+	rv = getPublicKey(obj, CKK_EC, &pkey);
 
-	if (pkey == NULL) {
-		FUNC_FAILVIAOUT(CKR_HOST_MEMORY, "Out of memory");
-	}
-
-	if (!EVP_PKEY_assign_EC_KEY(pkey, ec)) {
-		FUNC_FAILVIAOUT(CKR_GENERAL_ERROR, "EVP_PKEY_assign_EC_KEY() failed");
-	}
+	if (rv != CKR_OK)
+		FUNC_FAILS(rv, "Could not obtain EC key");
 
 	len = sizeof(wrappedSig);
 	if (cvcWrapECDSASignature(signature, signature_len, wrappedSig, &len) < 0) {
@@ -465,15 +613,6 @@ static CK_RV verifyECDSA(struct p11Object_t *obj, CK_MECHANISM_TYPE mech, CK_BYT
 	}
 
 out:
-	if (ecg != NULL)
-		EC_GROUP_free(ecg);
-
-	if (ecp != NULL)
-		EC_POINT_free(ecp);
-
-	if (pkey != NULL)
-		EVP_PKEY_free(pkey);
-
 	FUNC_RETURNS(rv);
 }
 
@@ -510,8 +649,8 @@ CK_RV stripOAEPPadding(unsigned char *raw, int rawlen, CK_BYTE_PTR pData, CK_ULO
 static CK_RV encryptRSA(struct p11Object_t *obj, int padding, CK_BYTE_PTR in, CK_ULONG in_len, CK_BYTE_PTR out, CK_ULONG_PTR out_len)
 {
 	struct p11Attribute_t *modulus;
-	struct p11Attribute_t *public_exponent;
 	unsigned char raw[512];
+	EVP_PKEY *pkey;
 	RSA *rsa;
 	CK_RV rv = 0;
 	int rc;
@@ -533,38 +672,28 @@ static CK_RV encryptRSA(struct p11Object_t *obj, int padding, CK_BYTE_PTR in, CK
 		FUNC_FAILS(CKR_BUFFER_TOO_SMALL, "Length of output buffer too small");
 	}
 
-	rc = findAttribute(obj, CKA_PUBLIC_EXPONENT, &public_exponent);
+	rv = getPublicKey(obj, CKK_RSA, &pkey);
 
-	if (rc == -1)
-		FUNC_FAILS(CKR_TEMPLATE_INCOMPLETE, "CKA_EXPONENT not found");
-
-	rsa = RSA_new();
+	if (rv != CKR_OK)
+		FUNC_FAILS(rv, "Could not obtain RSA key");
 
 	#if (OPENSSL_VERSION_NUMBER < 0x10100000)
-	rsa->n = BN_bin2bn(modulus->attrData.pValue, modulus->attrData.ulValueLen, NULL);
-	rsa->e = BN_bin2bn(public_exponent->attrData.pValue, public_exponent->attrData.ulValueLen, NULL);
+	rsa = pkey->pkey.rsa;
 	#else
-	BIGNUM *new_n = BN_bin2bn(modulus->attrData.pValue, modulus->attrData.ulValueLen, NULL);
-	BIGNUM *new_e = BN_bin2bn(public_exponent->attrData.pValue, public_exponent->attrData.ulValueLen, NULL);
-
-	RSA_set0_key(rsa, new_n, new_e, NULL);
+	rsa = (RSA *)EVP_PKEY_get0_RSA(pkey);
 	#endif
 
-
 	if (padding == RSA_PKCS1_OAEP_PADDING) {
 #if (OPENSSL_VERSION_NUMBER >= 0x10002000)
 		rc = RSA_padding_add_PKCS1_OAEP_mgf1(raw, modulus->attrData.ulValueLen, in, in_len, NULL, 0, EVP_sha256(), NULL);
 		rc = RSA_public_encrypt(modulus->attrData.ulValueLen, raw, out, rsa, RSA_NO_PADDING);
 #else
-		RSA_free(rsa);
 		FUNC_RETURNS(CKR_FUNCTION_NOT_SUPPORTED);
 #endif
 	} else {
 		rc = RSA_public_encrypt(in_len, in, out, rsa, padding);
 	}
 
-	RSA_free(rsa);
-
 	if (rc < 0) {
 		rv = translateError();
 		FUNC_FAILS(rv, "RSA_private_encrypt() failed");
@@ -849,3 +978,372 @@ CK_RV cryptoDigestFinal(struct p11Session_t * session, CK_BYTE_PTR pDigest, CK_U
 
 	FUNC_RETURNS(CKR_OK);
 }
+
+
+
+static const unsigned char digestInfoSHA1[] = { 0x30, 0x21, 0x30, 0x09, 0x06, 0x05, 0x2B, 0x0E, 0x03, 0x02, 0x1A, 0x05, 0x00, 0x04, 0x14 };
+static const unsigned char digestInfoSHA224[] = { 0x30, 0x2D, 0x30, 0x0D, 0x06, 0x09, 0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x04, 0x05, 0x00, 0x04, 0x1C };
+static const unsigned char digestInfoSHA256[] = { 0x30, 0x31, 0x30, 0x0D, 0x06, 0x09, 0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x01, 0x05, 0x00, 0x04, 0x20 };
+static const unsigned char digestInfoSHA384[] = { 0x30, 0x41, 0x30, 0x0D, 0x06, 0x09, 0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x02, 0x05, 0x00, 0x04, 0x30 };
+static const unsigned char digestInfoSHA512[] = { 0x30, 0x51, 0x30, 0x0D, 0x06, 0x09, 0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x03, 0x05, 0x00, 0x04, 0x40 };
+
+
+
+/**
+ * Start hashing the input of a hash-then-sign mechanism on the host
+ *
+ * The hash is later signed with the mechanism returned in rawMech, which for PKCS#1 v1.5
+ * signatures expects a DigestInfo and for PSS and ECDSA signatures the plain hash.
+ *
+ * @param mech      the signature mechanism
+ * @param rawMech   the mechanism signing the hash
+ * @param ctx       the hash context, released with cryptoSignHashFree()
+ * @return          CKR_OK or CKR_MECHANISM_INVALID if the mechanism does not hash the input
+ */
+CK_RV cryptoSignHashInit(CK_MECHANISM_TYPE mech, CK_MECHANISM_TYPE *rawMech, void **ctx)
+{
+	EVP_MD_CTX *md_ctx;
+	const EVP_MD *md;
+	CK_RV rv;
+
+	FUNC_CALLED();
+
+	switch(mech) {
+	case CKM_SHA1_RSA_PKCS:
+		md = EVP_sha1();
+		*rawMech = CKM_RSA_PKCS;
+		break;
+	case CKM_SHA224_RSA_PKCS:
+		md = EVP_sha224();
+		*rawMech = CKM_RSA_PKCS;
+		break;
+	case CKM_SHA256_RSA_PKCS:
+		md = EVP_sha256();
+		*rawMech = CKM_RSA_PKCS;
+		break;
+	case CKM_SHA384_RSA_PKCS:
+		md = EVP_sha384();
+		*rawMech = CKM_RSA_PKCS;
+		break;
+	case CKM_SHA512_RSA_PKCS:
+		md = EVP_sha512();
+		*rawMech = CKM_RSA_PKCS;
+		break;
+	case CKM_SHA1_RSA_PKCS_PSS:
+		md = EVP_sha1();
+		*rawMech = CKM_SC_HSM_PSS_SHA1;
+		break;
+	case CKM_SHA256_RSA_PKCS_PSS:
+		md = EVP_sha256();
+		*rawMech = CKM_SC_HSM_PSS_SHA256;
+		break;
+	case CKM_ECDSA_SHA1:
+		md = EVP_sha1();
+		*rawMech = CKM_ECDSA;
+		break;
+	case CKM_SC_HSM_ECDSA_SHA224:
+		md = EVP_sha224();
+		*rawMech = CKM_ECDSA;
+		break;
+	case CKM_SC_HSM_ECDSA_SHA256:
+		md = EVP_sha256();
+		*rawMech = CKM_ECDSA;
+		break;
+	default:
+		FUNC_FAILS(CKR_MECHANISM_INVALID, "Mechanism does not hash the input");
+	}
+
+	md_ctx = EVP_MD_CTX_create();
+
+	if (md_ctx == NULL) {
+		FUNC_FAILS(CKR_HOST_MEMORY, "Out of memory");
+	}
+
+	if (!EVP_DigestInit_ex(md_ctx, md, NULL)) {
+		rv = translateError();
+		EVP_MD_CTX_destroy(md_ctx);
+		FUNC_FAILS(rv, "EVP_DigestInit_ex() failed");
+	}
+
+	*ctx = md_ctx;
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+CK_RV cryptoSignHashUpdate(void *ctx, CK_BYTE_PTR pPart, CK_ULONG ulPartLen)
+{
+	CK_RV rv;
+
+	FUNC_CALLED();
+
+	if (!EVP_DigestUpdate((EVP_MD_CTX *)ctx, pPart, ulPartLen)) {
+		rv = translateError();
+		FUNC_FAILS(rv, "EVP_DigestUpdate() failed");
+	}
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * Obtain the input for the raw signature mechanism from the hash context
+ *
+ * The hash is computed on a copy of the context, so that the call can be repeated if the
+ * signature buffer passed to C_SignFinal() was too small.
+ *
+ * @param ctx       the hash context
+ * @param rawMech   the mechanism signing the hash
+ * @param pHash     the buffer receiving the hash or DigestInfo
+ * @param pulHashLen the size of the buffer on input, the length of the result on output
+ * @return          CKR_OK or any other Cryptoki error code
+ */
+CK_RV cryptoSignHashFinal(void *ctx, CK_MECHANISM_TYPE rawMech, CK_BYTE_PTR pHash, CK_ULONG_PTR pulHashLen)
+{
+	EVP_MD_CTX *md_ctx;
+	const unsigned char *prefix;
+	unsigned int md_len;
+	int prefixLen, rc;
+	CK_RV rv;
+
+	FUNC_CALLED();
+
+	md_len = (unsigned int)EVP_MD_CTX_size((EVP_MD_CTX *)ctx);
+	prefix = NULL;
+	prefixLen = 0;
+
+	if (rawMech == CKM_RSA_PKCS) {
+		switch(md_len) {
+		case 20: prefix = digestInfoSHA1; prefixLen = sizeof(digestInfoSHA1); break;
+		case 28: prefix = digestInfoSHA224; prefixLen = sizeof(digestInfoSHA224); break;
+		case 32: prefix = digestInfoSHA256; prefixLen = sizeof(digestInfoSHA256); break;
+		case 48: prefix = digestInfoSHA384; prefixLen = sizeof(digestInfoSHA384); break;
+		case 64: prefix = digestInfoSHA512; prefixLen = sizeof(digestInfoSHA512); break;
+		default:
+			FUNC_FAILS(CKR_MECHANISM_INVALID, "No DigestInfo for hash");
+		}
+	}
+
+	if (*pulHashLen < prefixLen + md_len) {
+		FUNC_FAILS(CKR_BUFFER_TOO_SMALL, "Buffer too small");
+	}
+
+	md_ctx = EVP_MD_CTX_create();
+
+	if (md_ctx == NULL) {
+		FUNC_FAILS(CKR_HOST_MEMORY, "Out of memory");
+	}
+
+	rc = EVP_MD_CTX_copy_ex(md_ctx, (EVP_MD_CTX *)ctx) && EVP_DigestFinal_ex(md_ctx, pHash + prefixLen, &md_len);
+
+	EVP_MD_CTX_destroy(md_ctx);
+
+	if (!rc) {
+		rv = translateError();
+		FUNC_FAILS(rv, "EVP_DigestFinal_ex() failed");
+	}
+
+	if (prefixLen) {
+		memcpy(pHash, prefix, prefixLen);
+	}
+
+	*pulHashLen = prefixLen + md_len;
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+void cryptoSignHashFree(void *ctx)
+{
+	EVP_MD_CTX_destroy((EVP_MD_CTX *)ctx);
+}
+
+
+
+/**
+ * State of a CTR_DRBG as defined in NIST SP 800-90A, using AES-256 without derivation function
+ */
+struct ctr_drbg {
+	EVP_CIPHER_CTX *cipher;             // AES-256 in ECB mode keyed with key
+	unsigned char key[32];
+	unsigned char v[16];
+};
+
+
+
+static void incrementDRBGCounter(unsigned char *v)
+{
+	int i;
+
+	for (i = 15; (i >= 0) && (++v[i] == 0); i--);
+}
+
+
+
+/**
+ * CTR_DRBG_Update() as defined in section 10.2.1.2 of SP 800-90A
+ */
+static int updateDRBG(struct ctr_drbg *drbg, CK_BYTE_PTR providedData)
+{
+	unsigned char temp[CTR_DRBG_SEEDLEN];
+	int i, len;
+
+	for (i = 0; i < CTR_DRBG_SEEDLEN; i += 16) {
+		incrementDRBGCounter(drbg->v);
+		memcpy(temp + i, drbg->v, 16);
+	}
+
+	if (!EVP_EncryptUpdate(drbg->cipher, temp, &len, temp, CTR_DRBG_SEEDLEN)) {
+		OPENSSL_cleanse(temp, sizeof(temp));
+		return -1;
+	}
+
+	if (providedData) {
+		for (i = 0; i < CTR_DRBG_SEEDLEN; i++) {
+			temp[i] ^= providedData[i];
+		}
+	}
+
+	memcpy(drbg->key, temp, sizeof(drbg->key));
+	memcpy(drbg->v, temp + sizeof(drbg->key), sizeof(drbg->v));
+	OPENSSL_cleanse(temp, sizeof(temp));
+
+	return EVP_EncryptInit_ex(drbg->cipher, NULL, NULL, drbg->key, NULL) ? 0 : -1;
+}
+
+
+
+/**
+ * Instantiate a CTR_DRBG with AES-256 and no derivation function
+ *
+ * @param ctx       the DRBG state, released with cryptoDRBGFree()
+ * @param pSeed     CTR_DRBG_SEEDLEN bytes of entropy input
+ * @return          CKR_OK or any other Cryptoki error code
+ */
+CK_RV cryptoDRBGInstantiate(void **ctx, CK_BYTE_PTR pSeed)
+{
+	struct ctr_drbg *drbg;
+	CK_RV rv;
+
+	FUNC_CALLED();
+
+	drbg = calloc(1, sizeof(struct ctr_drbg));
+	if (drbg == NULL) {
+		FUNC_FAILS(CKR_HOST_MEMORY, "Out of memory");
+	}
+
+	drbg->cipher = EVP_CIPHER_CTX_new();
+
+	if ((drbg->cipher == NULL) ||
+		!EVP_EncryptInit_ex(drbg->cipher, EVP_aes_256_ecb(), NULL, drbg->key, NULL) ||
+		!EVP_CIPHER_CTX_set_padding(drbg->cipher, 0) ||
+		updateDRBG(drbg, pSeed)) {
+		rv = translateError();
+		cryptoDRBGFree(drbg);
+		FUNC_FAILS(rv, "Instantiating DRBG failed");
+	}
+
+	*ctx = drbg;
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * Reseed the CTR_DRBG
+ *
+ * @param ctx       the DRBG state
+ * @param pSeed     CTR_DRBG_SEEDLEN bytes of entropy input
+ * @return          CKR_OK or any other Cryptoki error code
+ */
+CK_RV cryptoDRBGReseed(void *ctx, CK_BYTE_PTR pSeed)
+{
+	CK_RV rv;
+
+	FUNC_CALLED();
+
+	if (updateDRBG((struct ctr_drbg *)ctx, pSeed)) {
+		rv = translateError();
+		FUNC_FAILS(rv, "Reseeding DRBG failed");
+	}
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * Generate random data with the CTR_DRBG
+ *
+ * Requests larger than CTR_DRBG_MAX_REQUEST are split into several generate calls.
+ *
+ * @param ctx       the DRBG state
+ * @param pData     the buffer receiving the random data
+ * @param ulDataLen the number of bytes to generate
+ * @return          CKR_OK or any other Cryptoki error code
+ */
+CK_RV cryptoDRBGGenerate(void *ctx, CK_BYTE_PTR pData, CK_ULONG ulDataLen)
+{
+	struct ctr_drbg *drbg = (struct ctr_drbg *)ctx;
+	unsigned char blocks[1024];
+	CK_ULONG request, n, i;
+	int len;
+	CK_RV rv;
+
+	FUNC_CALLED();
+
+	while (ulDataLen > 0) {
+		request = ulDataLen > CTR_DRBG_MAX_REQUEST ? CTR_DRBG_MAX_REQUEST : ulDataLen;
+		ulDataLen -= request;
+
+		while (request > 0) {
+			n = request > sizeof(blocks) ? sizeof(blocks) : (request + 15) & ~(CK_ULONG)15;
+
+			for (i = 0; i < n; i += 16) {
+				incrementDRBGCounter(drbg->v);
+				memcpy(blocks + i, drbg->v, 16);
+			}
+
+			if (!EVP_EncryptUpdate(drbg->cipher, blocks, &len, blocks, (int)n)) {
+				OPENSSL_cleanse(blocks, sizeof(blocks));
+				rv = translateError();
+				FUNC_FAILS(rv, "Generating random data failed");
+			}
+
+			n = request < n ? request : n;
+			memcpy(pData, blocks, n);
+			pData += n;
+			request -= n;
+		}
+
+		if (updateDRBG(drbg, NULL)) {
+			OPENSSL_cleanse(blocks, sizeof(blocks));
+			rv = translateError();
+			FUNC_FAILS(rv, "Updating DRBG failed");
+		}
+	}
+
+	OPENSSL_cleanse(blocks, sizeof(blocks));
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+void cryptoDRBGFree(void *ctx)
+{
+	struct ctr_drbg *drbg = (struct ctr_drbg *)ctx;
+
+	if (drbg == NULL)
+		return;
+
+	if (drbg->cipher != NULL)
+		EVP_CIPHER_CTX_free(drbg->cipher);
+
+	OPENSSL_cleanse(drbg, sizeof(*drbg));
+	free(drbg);
+}
@@ -36,6 +36,16 @@
 
 #include <pkcs11/object.h>
 
+/**
+ * Length of the entropy input for the CTR_DRBG with AES-256 and no derivation function
+ */
+#define CTR_DRBG_SEEDLEN		48
+
+/**
+ * Maximum number of bytes produced by a single CTR_DRBG generate call
+ */
+#define CTR_DRBG_MAX_REQUEST	65536
+
 
 
 void cryptoInitialize();
@@ -49,6 +59,14 @@ CK_RV cryptoDigestInit(struct p11Session_t * session, CK_MECHANISM_PTR mech);
 CK_RV cryptoDigest(struct p11Session_t * session, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen);
 CK_RV cryptoDigestUpdate(struct p11Session_t * session, CK_BYTE_PTR pPart, CK_ULONG ulPartLen);
 CK_RV cryptoDigestFinal(struct p11Session_t * session, CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen);
+CK_RV cryptoSignHashInit(CK_MECHANISM_TYPE mech, CK_MECHANISM_TYPE *rawMech, void **ctx);
+CK_RV cryptoSignHashUpdate(void *ctx, CK_BYTE_PTR pPart, CK_ULONG ulPartLen);
+CK_RV cryptoSignHashFinal(void *ctx, CK_MECHANISM_TYPE rawMech, CK_BYTE_PTR pHash, CK_ULONG_PTR pulHashLen);
+void cryptoSignHashFree(void *ctx);
+CK_RV cryptoDRBGInstantiate(void **ctx, CK_BYTE_PTR pSeed);
+CK_RV cryptoDRBGReseed(void *ctx, CK_BYTE_PTR pSeed);
+CK_RV cryptoDRBGGenerate(void *ctx, CK_BYTE_PTR pData, CK_ULONG ulDataLen);
+void cryptoDRBGFree(void *ctx);
 
 
 #endif /* ___CRYPTO_INC___ */
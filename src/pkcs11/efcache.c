@@ -0,0 +1,544 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2020, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *
+ *
+ * @file    efcache.c
+ * @author  Andreas Schwier
+ * @brief   Persistent cache for the content of elementary files read from a token
+ *
+ * Loading the objects from a token with many keys requires to read the PKCS#15 descriptions
+ * and certificates of all keys, which takes seconds on every process start. The cache keeps
+ * the content of these files in a file per token, named after the token serial number.
+ *
+ * The cache is validated against the file list enumerated from the token. If the CRC32 of
+ * the file list is unchanged, then all cached files are used. Otherwise only files still listed
+ * are taken from the cache and newly listed files are read from the token.
+ *
+ * The cache is enabled with the environment variable PKCS11_OBJECT_CACHE. A value of 1 places
+ * the cache in $XDG_CACHE_HOME/sc-hsm-embedded (or %LOCALAPPDATA%\sc-hsm-embedded on Windows),
+ * any other value except 0 is used as directory name.
+ *
+ * A value of shm places the cache in shared memory below /dev/shm. This is intended for servers
+ * with many worker processes: The first worker publishes the files read from the token and all
+ * other workers load their objects from memory rather than from the token. Files are replaced
+ * atomically, so a worker never sees a partially written cache.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#include <process.h>
+#define getpid _getpid
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <pkcs11/p11generic.h>
+#include <pkcs11/crc32.h>
+#include <pkcs11/efcache.h>
+
+#ifdef DEBUG
+#include <common/debug.h>
+#endif
+
+static unsigned char magic[] = { 'E', 'F', 'C', '1' };
+
+
+
+#ifdef __linux__
+/**
+ * Create the cache directory in shared memory, which is only accepted if owned and only accessible by the user
+ */
+static int getSharedMemoryDirectory(char *dir, size_t len)
+{
+	struct stat st;
+
+	if (len < 48)
+		return FALSE;
+
+	sprintf(dir, "/dev/shm/sc-hsm-embedded-%d", (int)getuid());
+	mkdir(dir, 0700);
+
+	if (lstat(dir, &st) || !S_ISDIR(st.st_mode) || (st.st_uid != getuid()) || (st.st_mode & 077)) {
+#ifdef DEBUG
+		debug("Directory %s rejected as cache\n", dir);
+#endif
+		return FALSE;
+	}
+	return TRUE;
+}
+#endif
+
+
+
+/**
+ * Determine the directory for cache files
+ *
+ * @param dir the buffer receiving the directory name
+ * @param len the size of the buffer
+ * @return TRUE if the cache is enabled
+ */
+static int getCacheDirectory(char *dir, size_t len)
+{
+	char *po, *home, *prefix;
+
+	po = getenv("PKCS11_OBJECT_CACHE");
+	if (!po || (*po == '0') || (*po == 0))
+		return FALSE;
+
+	if (!strcmp(po, "shm")) {
+#ifdef __linux__
+		return getSharedMemoryDirectory(dir, len);
+#else
+		po = "1";			// Use default location on other platforms
+#endif
+	}
+
+	if (strcmp(po, "1")) {
+		if (strlen(po) >= len)
+			return FALSE;
+		strcpy(dir, po);
+		return TRUE;
+	}
+
+#ifdef _WIN32
+	home = getenv("LOCALAPPDATA");
+	prefix = "";
+#else
+	home = getenv("XDG_CACHE_HOME");
+	prefix = "";
+	if ((home == NULL) || (*home == 0)) {
+		home = getenv("HOME");
+		prefix = "/.cache";
+	}
+#endif
+	if (home == NULL)
+		return FALSE;
+
+	if (strlen(home) + strlen(prefix) + 16 >= len)
+		return FALSE;
+
+#ifdef _WIN32
+	sprintf(dir, "%s\\sc-hsm-embedded", home);
+	_mkdir(dir);
+#else
+	sprintf(dir, "%s%s", home, prefix);
+	mkdir(dir, 0700);
+	strcat(dir, "/sc-hsm-embedded");
+	mkdir(dir, 0700);
+#endif
+	return TRUE;
+}
+
+
+
+/**
+ * Determine the name of the cache file for the token with the given serial number
+ *
+ * @param serial the serial number as found in CK_TOKEN_INFO
+ * @param seriallen the length of the serial number
+ * @param path the buffer receiving the file name
+ * @param len the size of the buffer
+ * @return TRUE if the cache is enabled
+ */
+static int getCacheFileName(unsigned char *serial, size_t seriallen, char *path, size_t len)
+{
+	char dir[FILENAME_MAX], name[40], *p;
+	int i;
+
+	while ((seriallen > 0) && (serial[seriallen - 1] == ' '))
+		seriallen--;
+
+	if ((seriallen == 0) || (seriallen > sizeof(name) - 8))
+		return FALSE;
+
+	p = name;
+	for (i = 0; i < seriallen; i++) {
+		*p++ = isalnum(serial[i]) ? serial[i] : '_';
+	}
+	strcpy(p, ".cache");
+
+	if (!getCacheDirectory(dir, sizeof(dir)))
+		return FALSE;
+
+	if (strlen(dir) + strlen(name) + 2 > len)
+		return FALSE;
+
+#ifdef _WIN32
+	sprintf(path, "%s\\%s", dir, name);
+#else
+	sprintf(path, "%s/%s", dir, name);
+#endif
+	return TRUE;
+}
+
+
+
+static int isListed(struct ef_cache *cache, unsigned short fid)
+{
+	int i;
+
+	for (i = 0; i + 1 < cache->listlen; i += 2) {
+		if ((cache->filelist[i] == (fid >> 8)) && (cache->filelist[i + 1] == (fid & 0xFF)))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+
+
+static struct ef_cache_entry *findEntry(struct ef_cache *cache, unsigned short fid)
+{
+	int i;
+
+	for (i = 0; i < cache->numberOfEntries; i++) {
+		if (cache->entry[i].fid == fid)
+			return &cache->entry[i];
+	}
+	return NULL;
+}
+
+
+
+static int addEntry(struct ef_cache *cache, unsigned short fid, unsigned char *content, int len)
+{
+	struct ef_cache_entry *entry;
+
+	entry = findEntry(cache, fid);
+
+	if (entry == NULL) {
+		if (cache->numberOfEntries >= MAX_EF_CACHE_ENTRIES)
+			return -1;
+		entry = &cache->entry[cache->numberOfEntries++];
+		entry->fid = fid;
+	} else {
+		free(entry->content);
+	}
+
+	entry->content = NULL;
+	entry->len = len;
+
+	if (len > 0) {
+		entry->content = malloc(len);
+		if (entry->content == NULL) {
+			entry->len = -1;
+			return -1;
+		}
+		memcpy(entry->content, content, len);
+	}
+	return 0;
+}
+
+
+
+/**
+ * Read the cache file and retain all entries that are still valid for the current file list
+ */
+static void readCacheFile(struct ef_cache *cache)
+{
+	FILE *fp;
+	unsigned char hdr[10], scr[4], *content;
+	unsigned long hash;
+	unsigned short fid;
+	int i, cnt, len, keep;
+
+	fp = fopen(cache->path, "rb");
+	if (fp == NULL) {
+		cache->dirty = TRUE;
+		return;
+	}
+
+	if ((fread(hdr, 1, sizeof(hdr), fp) != sizeof(hdr)) || memcmp(hdr, magic, sizeof(magic))) {
+		fclose(fp);
+		cache->dirty = TRUE;
+		return;
+	}
+
+	hash = ((unsigned long)hdr[4] << 24) | (hdr[5] << 16) | (hdr[6] << 8) | hdr[7];
+	cnt = (hdr[8] << 8) | hdr[9];
+
+	if (hash != cache->hash)
+		cache->dirty = TRUE;
+
+	content = malloc(0x10000);
+	if (content == NULL) {
+		fclose(fp);
+		return;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		if (fread(scr, 1, sizeof(scr), fp) != sizeof(scr))
+			break;
+
+		fid = (scr[0] << 8) | scr[1];
+		len = (scr[2] << 8) | scr[3];
+
+		if (len == 0xFFFF) {
+			len = -1;
+		} else if (fread(content, 1, len, fp) != len) {
+			break;
+		}
+
+		if (hash == cache->hash) {
+			keep = TRUE;
+		} else if (len < 0) {
+			keep = !isListed(cache, fid);		// File still absent
+		} else {
+			keep = isListed(cache, fid);		// File still present
+		}
+
+		if (keep)
+			addEntry(cache, fid, content, len);
+	}
+
+	if (i < cnt) {
+#ifdef DEBUG
+		debug("Cache file %s truncated\n", cache->path);
+#endif
+		cache->dirty = TRUE;
+	}
+
+	free(content);
+	fclose(fp);
+}
+
+
+
+/**
+ * Write the cache file. The content is written to a temporary file first, which then replaces
+ * the cache file in a single step, so that concurrent processes never see a partial file.
+ */
+static void writeCacheFile(struct ef_cache *cache)
+{
+	FILE *fp;
+	char tmp[FILENAME_MAX + 16];
+	unsigned char hdr[10], scr[4];
+	struct ef_cache_entry *entry;
+	int i, ok;
+#ifndef _WIN32
+	int fd;
+#endif
+
+	if (strlen(cache->path) + 16 > sizeof(tmp))
+		return;
+
+	sprintf(tmp, "%s.%d", cache->path, (int)getpid());
+
+#ifdef _WIN32
+	fp = fopen(tmp, "wb");
+#else
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	fp = fd < 0 ? NULL : fdopen(fd, "wb");
+#endif
+	if (fp == NULL) {
+#ifdef DEBUG
+		debug("Can not create cache file %s\n", tmp);
+#endif
+		return;
+	}
+
+	memcpy(hdr, magic, sizeof(magic));
+	hdr[4] = (unsigned char)(cache->hash >> 24);
+	hdr[5] = (unsigned char)(cache->hash >> 16);
+	hdr[6] = (unsigned char)(cache->hash >> 8);
+	hdr[7] = (unsigned char)(cache->hash);
+	hdr[8] = (unsigned char)(cache->numberOfEntries >> 8);
+	hdr[9] = (unsigned char)(cache->numberOfEntries);
+
+	ok = fwrite(hdr, 1, sizeof(hdr), fp) == sizeof(hdr);
+
+	for (i = 0; ok && (i < cache->numberOfEntries); i++) {
+		entry = &cache->entry[i];
+		scr[0] = entry->fid >> 8;
+		scr[1] = entry->fid & 0xFF;
+		scr[2] = entry->len < 0 ? 0xFF : entry->len >> 8;
+		scr[3] = entry->len < 0 ? 0xFF : entry->len & 0xFF;
+		ok = fwrite(scr, 1, sizeof(scr), fp) == sizeof(scr);
+		if (ok && (entry->len > 0))
+			ok = fwrite(entry->content, 1, entry->len, fp) == entry->len;
+	}
+
+	if (fclose(fp) != 0)
+		ok = FALSE;
+
+	if (ok) {
+#ifdef _WIN32
+		remove(cache->path);
+#endif
+		ok = rename(tmp, cache->path) == 0;
+	}
+
+	if (!ok) {
+#ifdef DEBUG
+		debug("Writing cache file %s failed\n", cache->path);
+#endif
+		remove(tmp);
+	}
+}
+
+
+
+/**
+ * Open the cache for the token with the given serial number
+ *
+ * The file list must remain valid until the cache is closed.
+ *
+ * @param serial the serial number as found in CK_TOKEN_INFO
+ * @param seriallen the length of the serial number
+ * @param filelist the list of file identifiers enumerated from the token
+ * @param listlen the length of the file list
+ * @param cache the pointer receiving the cache or NULL if caching is disabled
+ * @return CKR_OK or any other Cryptoki error code
+ */
+int openEFCache(unsigned char *serial, size_t seriallen, unsigned char *filelist, int listlen, struct ef_cache **cache)
+{
+	struct ef_cache *pcache;
+
+	FUNC_CALLED();
+
+	*cache = NULL;
+
+	pcache = (struct ef_cache *)calloc(1, sizeof(struct ef_cache));
+
+	if (pcache == NULL) {
+		FUNC_FAILS(CKR_HOST_MEMORY, "Out of memory");
+	}
+
+	if (!getCacheFileName(serial, seriallen, pcache->path, sizeof(pcache->path))) {
+		free(pcache);
+		FUNC_RETURNS(CKR_OK);
+	}
+
+	pcache->filelist = filelist;
+	pcache->listlen = listlen;
+	pcache->hash = crc32(0, filelist, listlen);
+
+	readCacheFile(pcache);
+
+#ifdef DEBUG
+	debug("Cache %s provides %d files\n", pcache->path, pcache->numberOfEntries);
+#endif
+
+	*cache = pcache;
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * Get the content of a file from the cache
+ *
+ * @param cache the cache
+ * @param fid the file identifier
+ * @param content the buffer receiving the content
+ * @param len the size of the buffer
+ * @return the length of the content, -1 if the file is known to be absent or EF_CACHE_MISS
+ */
+int getCachedEF(struct ef_cache *cache, unsigned short fid, unsigned char *content, size_t len)
+{
+	struct ef_cache_entry *entry;
+
+	entry = findEntry(cache, fid);
+
+	if ((entry == NULL) || (entry->len > (int)len))
+		return EF_CACHE_MISS;
+
+	if (entry->len > 0)
+		memcpy(content, entry->content, entry->len);
+
+	return entry->len;
+}
+
+
+
+/**
+ * Add the content of a file read from the token to the cache
+ *
+ * A file that could not be read is only recorded as absent, if it is not listed by the token.
+ *
+ * @param cache the cache
+ * @param fid the file identifier
+ * @param content the content of the file
+ * @param len the length of the content or -1 if the file could not be read
+ */
+void putCachedEF(struct ef_cache *cache, unsigned short fid, unsigned char *content, int len)
+{
+	if ((len < 0) && isListed(cache, fid))
+		return;
+
+	if ((len >= 0xFFFF) || (addEntry(cache, fid, content, len < 0 ? -1 : len) < 0))
+		return;
+
+	cache->dirty = TRUE;
+}
+
+
+
+/**
+ * Close the cache, writing the cache file if it changed
+ *
+ * @param cache the cache, which may be NULL
+ */
+void closeEFCache(struct ef_cache *cache)
+{
+	int i;
+
+	if (cache == NULL)
+		return;
+
+	if (cache->dirty)
+		writeCacheFile(cache);
+
+	for (i = 0; i < cache->numberOfEntries; i++)
+		free(cache->entry[i].content);
+
+	free(cache);
+}
+
+
+
+/**
+ * Remove the cache file for a token, e.g. after a file on the token was changed
+ *
+ * @param serial the serial number as found in CK_TOKEN_INFO
+ * @param seriallen the length of the serial number
+ */
+void removeEFCache(unsigned char *serial, size_t seriallen)
+{
+	char path[FILENAME_MAX];
+
+	if (getCacheFileName(serial, seriallen, path, sizeof(path)))
+		remove(path);
+}
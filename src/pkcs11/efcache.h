@@ -0,0 +1,64 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2020, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *
+ *
+ * @file    efcache.h
+ * @author  Andreas Schwier
+ * @brief   Persistent cache for the content of elementary files read from a token
+ */
+
+#ifndef ___EFCACHE_H_INC___
+#define ___EFCACHE_H_INC___
+
+#include <stdio.h>
+
+#define MAX_EF_CACHE_ENTRIES	256
+#define EF_CACHE_MISS		-2
+
+struct ef_cache_entry {
+	unsigned short fid;                         /**< File identifier                                  */
+	int len;                                    /**< Length of content or -1 if the file is absent    */
+	unsigned char *content;                     /**< Content of the file                              */
+};
+
+struct ef_cache {
+	char path[FILENAME_MAX];                    /**< Location of the cache file                       */
+	unsigned long hash;                         /**< CRC32 of the file list enumerated from the token */
+	int dirty;                                  /**< Cache file must be written                       */
+	unsigned char *filelist;                    /**< File list enumerated from the token              */
+	int listlen;                                /**< Length of the file list                          */
+	int numberOfEntries;
+	struct ef_cache_entry entry[MAX_EF_CACHE_ENTRIES];
+};
+
+int openEFCache(unsigned char *serial, size_t seriallen, unsigned char *filelist, int listlen, struct ef_cache **cache);
+int getCachedEF(struct ef_cache *cache, unsigned short fid, unsigned char *content, size_t len);
+void putCachedEF(struct ef_cache *cache, unsigned short fid, unsigned char *content, int len);
+void closeEFCache(struct ef_cache *cache);
+void removeEFCache(unsigned char *serial, size_t seriallen);
+
+#endif /* ___EFCACHE_H_INC___ */
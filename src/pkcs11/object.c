@@ -35,6 +35,7 @@
 #include <ctype.h>
 #include <string.h>
 #include <pkcs11/object.h>
+#include <common/atomic.h>
 
 CK_BBOOL ckTrue = CK_TRUE, ckFalse = CK_FALSE;
 CK_MECHANISM_TYPE ckMechType = CK_UNAVAILABLE_INFORMATION;
@@ -613,36 +614,347 @@ int validateAttribute(CK_ATTRIBUTE_PTR pTemplate, size_t size)
 
 
 
+#define ARENA_ALIGN(l)		(((l) + sizeof(double) - 1) & ~(sizeof(double) - 1))
+#define ARENA_CHUNK_SIZE	16384
+#define ARENA_MAX_BLOCK		(ARENA_CLASSES * ARENA_CLASS_SIZE)
+
+
+
+/**
+ * Create an empty arena
+ *
+ * @param arena     Address of the pointer set to the new arena
+ * @return          CKR_OK or CKR_HOST_MEMORY
+ */
+int createArena(struct p11Arena_t **arena)
+{
+	struct p11Arena_t *a;
+
+	a = (struct p11Arena_t *)calloc(1, sizeof(struct p11Arena_t));
+	if (a == NULL)
+		return CKR_HOST_MEMORY;
+
+	if (p11CreateMutex(&a->mutex) != CKR_OK) {
+		free(a);
+		return CKR_HOST_MEMORY;
+	}
+
+	*arena = a;
+	return CKR_OK;
+}
+
+
+
+static int arenaClass(size_t size)
+{
+	return (int)((size + ARENA_CLASS_SIZE - 1) / ARENA_CLASS_SIZE) - 1;
+}
+
+
+
+/**
+ * Allocate memory from an arena
+ *
+ * The size is rounded up to a multiple of ARENA_CLASS_SIZE. A block of that size released
+ * before is reused, otherwise memory is taken in sequence from the current chunk. The unused
+ * end of a full chunk is kept as a released block.
+ *
+ * @param arena     The arena
+ * @param size      The number of bytes required, at most ARENA_MAX_BLOCK
+ * @return          The memory or NULL if out of memory or too large
+ */
+void *allocateFromArena(struct p11Arena_t *arena, size_t size)
+{
+	struct p11ArenaChunk_t *chunk;
+	void *p;
+	int cls;
+
+	if ((size == 0) || (size > ARENA_MAX_BLOCK))
+		return NULL;
+
+	cls = arenaClass(size);
+	size = (cls + 1) * ARENA_CLASS_SIZE;
+
+	p11LockMutex(arena->mutex);
+
+	p = arena->freeList[cls];
+	if (p != NULL) {
+		arena->freeList[cls] = *(void **)p;
+		p11UnlockMutex(arena->mutex);
+		return p;
+	}
+
+	chunk = arena->chunk;
+	if ((chunk == NULL) || (chunk->used + size > chunk->size)) {
+		chunk = (struct p11ArenaChunk_t *)malloc(ARENA_ALIGN(sizeof(struct p11ArenaChunk_t)) + ARENA_CHUNK_SIZE);
+		if (chunk == NULL) {
+			p11UnlockMutex(arena->mutex);
+			return NULL;
+		}
+
+		if ((arena->chunk != NULL) && (arena->chunk->used < arena->chunk->size)) {
+			p = (unsigned char *)arena->chunk + ARENA_ALIGN(sizeof(struct p11ArenaChunk_t)) + arena->chunk->used;
+			cls = arenaClass(arena->chunk->size - arena->chunk->used);
+			*(void **)p = arena->freeList[cls];
+			arena->freeList[cls] = p;
+			arena->chunk->used = arena->chunk->size;
+		}
+
+		chunk->size = ARENA_CHUNK_SIZE;
+		chunk->used = 0;
+		chunk->next = arena->chunk;
+		arena->chunk = chunk;
+	}
+
+	p = (unsigned char *)chunk + ARENA_ALIGN(sizeof(struct p11ArenaChunk_t)) + chunk->used;
+	chunk->used += size;
+
+	p11UnlockMutex(arena->mutex);
+	return p;
+}
+
+
+
+/**
+ * Return memory to an arena for reuse
+ *
+ * @param arena     The arena from which the memory was allocated
+ * @param p         The memory
+ * @param size      The number of bytes requested in allocateFromArena()
+ */
+void releaseToArena(struct p11Arena_t *arena, void *p, size_t size)
+{
+	int cls;
+
+	cls = arenaClass(size);
+
+	p11LockMutex(arena->mutex);
+	*(void **)p = arena->freeList[cls];
+	arena->freeList[cls] = p;
+	p11UnlockMutex(arena->mutex);
+}
+
+
+
+/**
+ * Release all memory allocated from an arena and the arena
+ *
+ * @param arena     Address of the pointer to the arena, set to NULL
+ */
+void freeArena(struct p11Arena_t **arena)
+{
+	struct p11ArenaChunk_t *chunk;
+
+	if (*arena == NULL)
+		return;
+
+	while ((chunk = (*arena)->chunk) != NULL) {
+		(*arena)->chunk = chunk->next;
+		free(chunk);
+	}
+
+	p11DestroyMutex((*arena)->mutex);
+	free(*arena);
+	*arena = NULL;
+}
+
+
+
+#define ATTRIBUTE_ALIGN(l)	(((l) + sizeof(CK_ULONG) - 1) & ~(sizeof(CK_ULONG) - 1))
+#define MIN_ATTRIBUTES		16
+#define MIN_ATTRIBUTE_VALUES	256
+
+
+
+static unsigned char *attributeValues(struct p11AttributeBlock_t *block)
+{
+	return (unsigned char *)&block->attr[block->capacity];
+}
+
+
+
+/**
+ * Release an attribute block to the arena it was allocated from or to the heap
+ */
+static void freeAttributeBlock(struct p11AttributeBlock_t *block)
+{
+	if (block->arena == NULL) {
+		free(block);
+		return;
+	}
+
+	releaseToArena(block->arena, block, sizeof(struct p11AttributeBlock_t) + (block->capacity - 1) * sizeof(struct p11Attribute_t) + block->size);
+}
+
+
+
+/**
+ * Make room for additional attributes and values in the attribute block of the object
+ *
+ * A new block is allocated if the current block is too small. Values are compacted
+ * into the new block, dropping space left by removed or replaced values.
+ *
+ * @param object    The object
+ * @param count     The number of attributes to be added
+ * @param size      The number of bytes to be added to the value area
+ * @return          CKR_OK or CKR_HOST_MEMORY
+ */
+static int growAttributeBlock(struct p11Object_t *object, CK_ULONG count, size_t size)
+{
+	struct p11AttributeBlock_t *old = object->attributes, *block;
+	unsigned char *po;
+	CK_ULONG capacity, i;
+	size_t live, values;
+
+	if (old && (old->count + count <= old->capacity) && (old->used + size <= old->size)) {
+		return CKR_OK;
+	}
+
+	capacity = MIN_ATTRIBUTES;
+	live = 0;
+
+	if (old) {
+		capacity = old->capacity;
+		for (i = 0; i < old->count; i++) {
+			live += ATTRIBUTE_ALIGN(old->attr[i].attrData.ulValueLen);
+		}
+		count += old->count;
+	}
+
+	while (capacity < count) {
+		capacity <<= 1;
+	}
+
+	values = MIN_ATTRIBUTE_VALUES;
+	if (old && (old->size > values)) {
+		values = old->size;
+	}
+	while (values < live + size) {
+		values <<= 1;
+	}
+
+	block = (struct p11AttributeBlock_t *)malloc(sizeof(struct p11AttributeBlock_t) + (capacity - 1) * sizeof(struct p11Attribute_t) + values);
+
+	if (block == NULL) {
+		return CKR_HOST_MEMORY;
+	}
+
+	block->count = 0;
+	block->capacity = capacity;
+	block->used = 0;
+	block->size = values;
+	block->arena = NULL;
+
+	if (old) {
+		po = attributeValues(block);
+		for (i = 0; i < old->count; i++) {
+			block->attr[i].attrData = old->attr[i].attrData;
+			block->attr[i].attrData.pValue = po + block->used;
+			memcpy(po + block->used, old->attr[i].attrData.pValue, old->attr[i].attrData.ulValueLen);
+			block->used += ATTRIBUTE_ALIGN(old->attr[i].attrData.ulValueLen);
+		}
+		block->count = old->count;
+		freeAttributeBlock(old);
+	}
+
+	object->attributes = block;
+	return CKR_OK;
+}
+
+
+
+/**
+ * Locate the first attribute with a type not lower than the given type
+ *
+ * @param block     The attribute block
+ * @param type      The attribute type
+ * @return          The position of the attribute or the position at which it would be inserted
+ */
+static CK_ULONG lowerBoundAttribute(struct p11AttributeBlock_t *block, CK_ATTRIBUTE_TYPE type)
+{
+	CK_ULONG lo = 0, hi = block->count, mid;
+
+	while (lo < hi) {
+		mid = lo + ((hi - lo) >> 1);
+		if (block->attr[mid].attrData.type < type) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+
+
+/**
+ * Reserve space for attributes to be added to the object
+ *
+ * Attributes added within the reservation do not move existing values. This allows to
+ * add attributes whose values refer to parts of another attribute of the same object.
+ *
+ * @param object    The object
+ * @param count     The number of attributes to be added
+ * @param size      The total size of the values to be added
+ * @return          CKR_OK or CKR_HOST_MEMORY
+ */
+int reserveAttributes(struct p11Object_t *object, CK_ULONG count, size_t size)
+{
+	return growAttributeBlock(object, count, size + count * (sizeof(CK_ULONG) - 1));
+}
+
+
+
 int addAttribute(struct p11Object_t *object, CK_ATTRIBUTE_PTR pTemplate)
 {
-	struct p11Attribute_t *pAttribute, **ppAttribute;
+	struct p11AttributeBlock_t *block;
+	unsigned char *src, *po;
+	CK_ULONG pos;
+	size_t ofs = 0;
+	int inblock, rc;
 
 	if (pTemplate->ulValueLen && (pTemplate->pValue == NULL))
 		return CKR_TEMPLATE_INCONSISTENT;
 
-	pAttribute = (struct p11Attribute_t *) calloc (1, sizeof(struct p11Attribute_t));
+	src = (unsigned char *)pTemplate->pValue;
+	block = object->attributes;
 
-	if (pAttribute == NULL) {
-		return CKR_HOST_MEMORY;
+	/* The value may refer to another attribute of this object */
+	inblock = block && src && (src >= attributeValues(block)) && (src < attributeValues(block) + block->size);
+	if (inblock) {
+		ofs = src - attributeValues(block);
 	}
 
-	pAttribute->attrData = *pTemplate;
+	rc = growAttributeBlock(object, 1, ATTRIBUTE_ALIGN(pTemplate->ulValueLen));
+
+	if (rc != CKR_OK) {
+		return rc;
+	}
 
-	pAttribute->attrData.pValue = calloc(pAttribute->attrData.ulValueLen, 1);
+	block = object->attributes;
+	if (inblock) {
+		src = attributeValues(block) + ofs;
+	}
 
-	if (pAttribute->attrData.pValue == NULL) {
-		free(pAttribute);
-		return CKR_TEMPLATE_INCONSISTENT;
+	/* Insert behind attributes of the same type to preserve the order of addition */
+	pos = lowerBoundAttribute(block, pTemplate->type);
+	while ((pos < block->count) && (block->attr[pos].attrData.type == pTemplate->type)) {
+		pos++;
 	}
 
-	if (pTemplate->pValue)
-		memcpy(pAttribute->attrData.pValue, pTemplate->pValue, pAttribute->attrData.ulValueLen);
+	memmove(&block->attr[pos + 1], &block->attr[pos], (block->count - pos) * sizeof(struct p11Attribute_t));
 
-	ppAttribute = &object->attrList;
-	while (*ppAttribute != NULL) {
-		ppAttribute = &((*ppAttribute)->next);
+	po = attributeValues(block) + block->used;
+	if (src) {
+		memcpy(po, src, pTemplate->ulValueLen);
 	}
-	*ppAttribute = pAttribute;
+
+	block->attr[pos].attrData.type = pTemplate->type;
+	block->attr[pos].attrData.pValue = po;
+	block->attr[pos].attrData.ulValueLen = pTemplate->ulValueLen;
+
+	block->used += ATTRIBUTE_ALIGN(pTemplate->ulValueLen);
+	block->count++;
 
 	return CKR_OK;
 }
@@ -651,23 +963,23 @@ int addAttribute(struct p11Object_t *object, CK_ATTRIBUTE_PTR pTemplate)
 
 int findAttribute(struct p11Object_t *object, CK_ATTRIBUTE_TYPE type, struct p11Attribute_t **attribute)
 {
-	struct p11Attribute_t *attr;
-	int pos = 0;            /* remember the current position in the list */
+	struct p11AttributeBlock_t *block = object->attributes;
+	CK_ULONG pos;
 
-	attr = object->attrList;
 	*attribute = NULL;
 
-	while (attr != NULL) {
-		if (attr->attrData.type == type) {
-			*attribute = attr;
-			return pos;
-		}
+	if (block == NULL) {
+		return -1;
+	}
 
-		attr = attr->next;
-		pos++;
+	pos = lowerBoundAttribute(block, type);
+
+	if ((pos >= block->count) || (block->attr[pos].attrData.type != type)) {
+		return -1;
 	}
 
-	return -1;
+	*attribute = &block->attr[pos];
+	return (int)pos;
 }
 
 
@@ -687,23 +999,78 @@ int findAttributeInTemplate(CK_ATTRIBUTE_TYPE attributeType, CK_ATTRIBUTE_PTR pT
 
 
 
-int removeAttribute(struct p11Object_t *object, CK_ATTRIBUTE_PTR attributeTemplate)
+/**
+ * Replace the value of an existing attribute
+ *
+ * The value is updated in place if it fits, otherwise it is appended to the value area.
+ *
+ * @param object    The object
+ * @param pTemplate The attribute with the new value
+ * @return          CKR_OK, CKR_TEMPLATE_INCOMPLETE if the attribute does not exist or CKR_HOST_MEMORY
+ */
+int setAttribute(struct p11Object_t *object, CK_ATTRIBUTE_PTR pTemplate)
 {
-	struct p11Attribute_t *pAttr, **ppAttr;
+	struct p11AttributeBlock_t *block;
+	struct p11Attribute_t *attr;
+	unsigned char *po;
+	int pos, rc;
+
+	if (pTemplate->ulValueLen && (pTemplate->pValue == NULL))
+		return CKR_TEMPLATE_INCONSISTENT;
 
-	ppAttr = &object->attrList;
-	while (*ppAttr && ((*ppAttr)->attrData.type != attributeTemplate->type)) {
-		ppAttr = &((*ppAttr)->next);
+	pos = findAttribute(object, pTemplate->type, &attr);
+
+	if (pos < 0) {
+		return CKR_TEMPLATE_INCOMPLETE;
 	}
 
-	if (*ppAttr == NULL)
-		return CKR_GENERAL_ERROR;
+	if (pTemplate->ulValueLen > attr->attrData.ulValueLen) {
+		rc = growAttributeBlock(object, 0, ATTRIBUTE_ALIGN(pTemplate->ulValueLen));
+
+		if (rc != CKR_OK) {
+			return rc;
+		}
+
+		block = object->attributes;
+		attr = &block->attr[pos];
+		po = attributeValues(block) + block->used;
+		block->used += ATTRIBUTE_ALIGN(pTemplate->ulValueLen);
+		attr->attrData.pValue = po;
+	}
 
-	pAttr = *ppAttr;
-	*ppAttr = (*ppAttr)->next;
+	if (pTemplate->ulValueLen) {
+		memcpy(attr->attrData.pValue, pTemplate->pValue, pTemplate->ulValueLen);
+	}
+	attr->attrData.ulValueLen = pTemplate->ulValueLen;
 
-	free(pAttr->attrData.pValue);
-	free(pAttr);
+	switch(pTemplate->type) {
+	case CKA_KEY_TYPE:
+	case CKA_MODULUS:
+	case CKA_PUBLIC_EXPONENT:
+	case CKA_EC_PARAMS:
+	case CKA_EC_POINT:
+		invalidateKeyCache(object);
+		break;
+	}
+
+	return CKR_OK;
+}
+
+
+
+int removeAttribute(struct p11Object_t *object, CK_ATTRIBUTE_PTR attributeTemplate)
+{
+	struct p11AttributeBlock_t *block = object->attributes;
+	struct p11Attribute_t *attr;
+	int pos;
+
+	pos = findAttribute(object, attributeTemplate->type, &attr);
+
+	if (pos < 0)
+		return CKR_GENERAL_ERROR;
+
+	block->count--;
+	memmove(&block->attr[pos], &block->attr[pos + 1], (block->count - pos) * sizeof(struct p11Attribute_t));
 
 	return CKR_OK;
 }
@@ -712,11 +1079,111 @@ int removeAttribute(struct p11Object_t *object, CK_ATTRIBUTE_PTR attributeTempla
 
 int removeAllAttributes(struct p11Object_t *object)
 {
-	while(object->attrList) {
-		if (removeAttribute(object, &object->attrList->attrData) != CKR_OK)
-			return CKR_GENERAL_ERROR;
+	if (object->attributes) {
+		freeAttributeBlock(object->attributes);
+		object->attributes = NULL;
+	}
+
+	return CKR_OK;
+}
+
+
+
+/**
+ * Copy all attributes from one object to another object without attributes
+ *
+ * @param dst       The object receiving the attributes
+ * @param src       The object providing the attributes
+ * @return          CKR_OK or CKR_HOST_MEMORY
+ */
+int copyAttributes(struct p11Object_t *dst, struct p11Object_t *src)
+{
+	struct p11AttributeBlock_t *block;
+	size_t len;
+	CK_ULONG i;
+
+	dst->attributes = NULL;
+
+	if (src->attributes == NULL) {
+		return CKR_OK;
+	}
+
+	len = sizeof(struct p11AttributeBlock_t) + (src->attributes->capacity - 1) * sizeof(struct p11Attribute_t) + src->attributes->size;
+	block = (struct p11AttributeBlock_t *)malloc(len);
+
+	if (block == NULL) {
+		return CKR_HOST_MEMORY;
+	}
+
+	memcpy(block, src->attributes, len);
+	block->arena = NULL;
+
+	for (i = 0; i < block->count; i++) {
+		block->attr[i].attrData.pValue = attributeValues(block) + ((unsigned char *)src->attributes->attr[i].attrData.pValue - attributeValues(src->attributes));
+	}
+
+	dst->attributes = block;
+	return CKR_OK;
+}
+
+
+
+/**
+ * Move the attributes of an object into an arena
+ *
+ * The attributes are compacted to the space actually used. The block is returned to the arena
+ * when the object is freed or the block is reallocated because attributes are added or enlarged.
+ * Attributes too large for an arena block, like most certificates, remain on the heap.
+ *
+ * @param object    The object
+ * @param arena     The arena receiving the attributes or NULL to leave them on the heap
+ * @return          CKR_OK or CKR_HOST_MEMORY
+ */
+int moveAttributesToArena(struct p11Object_t *object, struct p11Arena_t *arena)
+{
+	struct p11AttributeBlock_t *old = object->attributes, *block;
+	unsigned char *po;
+	size_t live, len;
+	CK_ULONG i;
+
+	if ((arena == NULL) || (old == NULL) || (old->arena == arena)) {
+		return CKR_OK;
+	}
+
+	live = 0;
+	for (i = 0; i < old->count; i++) {
+		live += ATTRIBUTE_ALIGN(old->attr[i].attrData.ulValueLen);
+	}
+
+	len = sizeof(struct p11AttributeBlock_t) + (old->count ? old->count - 1 : 0) * sizeof(struct p11Attribute_t) + live;
+
+	if (len > ARENA_MAX_BLOCK) {
+		return CKR_OK;
+	}
+
+	block = (struct p11AttributeBlock_t *)allocateFromArena(arena, len);
+
+	if (block == NULL) {
+		return CKR_HOST_MEMORY;
 	}
 
+	block->count = old->count;
+	block->capacity = old->count ? old->count : 1;
+	block->used = 0;
+	block->size = live;
+	block->arena = arena;
+
+	po = attributeValues(block);
+	for (i = 0; i < old->count; i++) {
+		block->attr[i].attrData = old->attr[i].attrData;
+		block->attr[i].attrData.pValue = po + block->used;
+		memcpy(po + block->used, old->attr[i].attrData.pValue, old->attr[i].attrData.ulValueLen);
+		block->used += ATTRIBUTE_ALIGN(old->attr[i].attrData.ulValueLen);
+	}
+
+	freeAttributeBlock(old);
+
+	object->attributes = block;
 	return CKR_OK;
 }
 
@@ -743,6 +1210,20 @@ void addObjectToList(struct p11Object_t **list, struct p11Object_t *object)
 
 
 
+static void freeKeyCacheList(struct p11KeyCache_t *cache)
+{
+	struct p11KeyCache_t *next;
+
+	while (cache) {
+		next = cache->next;
+		cache->freeKey(cache->key);
+		free(cache);
+		cache = next;
+	}
+}
+
+
+
 /**
  * Free unlinked PKCS11 object
  *
@@ -752,15 +1233,113 @@ void addObjectToList(struct p11Object_t **list, struct p11Object_t *object)
  */
 void freeObject(struct p11Object_t *object)
 {
+	invalidateKeyCache(object);
+	freeKeyCacheList(object->retiredKeys);
 	removeAllAttributes(object);
 	free(object);
 }
 
 
 
+/**
+ * Release a reference to an object obtained with findObject() or findSessionObject()
+ *
+ * The object is freed with the last reference, which may be the one held by the list of
+ * token or session objects.
+ *
+ * @param object    The object or NULL
+ */
+void releaseObject(struct p11Object_t *object)
+{
+	if ((object != NULL) && (atomic_dec(&object->refCount) == 0))
+		freeObject(object);
+}
+
+
+
+/**
+ * Return the key decoded from the attributes of the object
+ *
+ * @param object    The object
+ * @return          The cached key or NULL if the key has not been decoded yet
+ */
+void *getCachedKey(struct p11Object_t *object)
+{
+	struct p11KeyCache_t *cache = object->keyCache;
+
+	return cache ? cache->key : NULL;
+}
+
+
+
+/**
+ * Cache the key decoded from the attributes of the object
+ *
+ * The object takes ownership of the key in all cases, so the caller must not
+ * release it. If another thread cached a key concurrently, then the key passed
+ * is released and the key from the cache is returned instead.
+ *
+ * @param object    The object
+ * @param key       The decoded key
+ * @param freeKey   The function to release the key
+ * @return          The key to use or NULL if no memory is available
+ */
+void *cacheKey(struct p11Object_t *object, void *key, void (*freeKey)(void *key))
+{
+	struct p11KeyCache_t *cache;
+	void *cached;
+
+	cache = calloc(1, sizeof(struct p11KeyCache_t));
+
+	if (cache == NULL) {
+		freeKey(key);
+		return NULL;
+	}
+
+	cache->key = key;
+	cache->freeKey = freeKey;
+
+	while (!atomic_cas_ptr(&object->keyCache, NULL, cache)) {
+		// The key of the winner stays valid until the object is freed, even if invalidated
+		cached = getCachedKey(object);
+		if (cached != NULL) {
+			freeKey(key);
+			free(cache);
+			return cached;
+		}
+	}
+
+	return key;
+}
+
+
+
+/**
+ * Discard the decoded key after the key material of the object changed
+ *
+ * The key is kept until the object is freed, as it may still be in use by
+ * an operation that obtained it before.
+ *
+ * @param object    The object
+ */
+void invalidateKeyCache(struct p11Object_t *object)
+{
+	struct p11KeyCache_t *cache = object->keyCache;
+
+	if (cache == NULL) {
+		return;
+	}
+
+	object->keyCache = NULL;
+	cache->next = object->retiredKeys;
+	object->retiredKeys = cache;
+}
+
+
+
 /**
  * Remove a PKCS11 object from a linked list of objects
- * The object is removed and allocated memory freed
+ * The object is removed and the reference held by the list released
  *
  * @param list address of the pointer to the first entry in the list
  * @param handle the handle of the object to be removed
@@ -780,7 +1359,7 @@ int removeObjectFromList(struct p11Object_t **list, CK_OBJECT_HANDLE handle)
 	object = *list;
 	*list = (*list)->next;
 
-	freeObject(object);
+	releaseObject(object);
 
 	return CKR_OK;
 }
@@ -802,21 +1381,464 @@ void removeAllObjectsFromList(struct p11Object_t **list)
 
 
 
+/*
+ * Marks an entry whose object was removed, so that probing continues past it
+ */
+static struct p11Object_t removedEntry;
+
+#define MIN_INDEX_SIZE		16
+
+
+
+static CK_ULONG indexPosition(CK_OBJECT_HANDLE handle, CK_ULONG size)
+{
+	// Handles are mostly consecutive, which the multiplication spreads over the table
+	return (CK_ULONG)(handle * 2654435761UL) & (size - 1);
+}
+
+
+
+/**
+ * Replace the table with a table for at least twice the number of objects
+ *
+ * The replaced table is kept for threads still searching it, older tables are released.
+ *
+ * @param ppIndex address of the pointer to the table, NULL for an empty index
+ * @return CKR_OK or CKR_HOST_MEMORY
+ */
+static int growObjectIndex(struct p11ObjectIndex_t **ppIndex)
+{
+	struct p11ObjectIndex_t *old = *ppIndex, *index;
+	struct p11Object_t *object;
+	CK_ULONG size, live, i, j;
+
+	live = 0;
+	if (old != NULL) {
+		for (i = 0; i < old->size; i++) {
+			if ((old->entry[i] != NULL) && (old->entry[i] != &removedEntry))
+				live++;
+		}
+	}
+
+	size = MIN_INDEX_SIZE;
+	while (size < (live + 1) * 2)
+		size <<= 1;
+
+	index = (struct p11ObjectIndex_t *)calloc(1, sizeof(struct p11ObjectIndex_t) + (size - 1) * sizeof(struct p11Object_t *));
+	if (index == NULL)
+		return CKR_HOST_MEMORY;
+
+	index->size = size;
+	index->retired = old;
+
+	if (old != NULL) {
+		freeObjectIndex(&old->retired);
+
+		for (i = 0; i < old->size; i++) {
+			object = old->entry[i];
+			if ((object == NULL) || (object == &removedEntry))
+				continue;
+
+			j = indexPosition(object->handle, size);
+			while (index->entry[j] != NULL)
+				j = (j + 1) & (size - 1);
+
+			index->entry[j] = object;
+			index->used++;
+		}
+	}
+
+	*ppIndex = index;
+	return CKR_OK;
+}
+
+
+
+/**
+ * Add a PKCS11 object to the index of objects by handle
+ *
+ * @param ppIndex address of the pointer to the table, NULL for an empty index
+ * @param object the object to be added
+ * @return CKR_OK or CKR_HOST_MEMORY
+ */
+int addObjectToIndex(struct p11ObjectIndex_t **ppIndex, struct p11Object_t *object)
+{
+	struct p11ObjectIndex_t *index;
+	CK_ULONG i;
+	int rc;
+
+	index = *ppIndex;
+
+	// Keep at least a quarter of the entries empty, so that a search terminates quickly
+	if ((index == NULL) || ((index->used + 1) * 4 > index->size * 3)) {
+		rc = growObjectIndex(ppIndex);
+		if (rc != CKR_OK)
+			return rc;
+		index = *ppIndex;
+	}
+
+	i = indexPosition(object->handle, index->size);
+	while ((index->entry[i] != NULL) && (index->entry[i] != &removedEntry))
+		i = (i + 1) & (index->size - 1);
+
+	if (index->entry[i] == NULL)
+		index->used++;
+
+	index->entry[i] = object;
+	return CKR_OK;
+}
+
+
+
+/**
+ * Find a PKCS11 object in the index of objects by handle
+ *
+ * @param index the table or NULL for an empty index
+ * @param handle the handle of the object
+ * @return the object or NULL if not found
+ */
+struct p11Object_t *findObjectInIndex(struct p11ObjectIndex_t *index, CK_OBJECT_HANDLE handle)
+{
+	struct p11Object_t *object;
+	CK_ULONG i;
+
+	if (index == NULL)
+		return NULL;
+
+	i = indexPosition(handle, index->size);
+	while ((object = index->entry[i]) != NULL) {
+		if ((object != &removedEntry) && (object->handle == handle))
+			return object;
+		i = (i + 1) & (index->size - 1);
+	}
+
+	return NULL;
+}
+
+
+
+/**
+ * Remove a PKCS11 object from the index of objects by handle
+ *
+ * The object itself is not freed.
+ *
+ * @param index the table or NULL for an empty index
+ * @param handle the handle of the object
+ */
+void removeObjectFromIndex(struct p11ObjectIndex_t *index, CK_OBJECT_HANDLE handle)
+{
+	struct p11Object_t *object;
+	CK_ULONG i;
+
+	if (index == NULL)
+		return;
+
+	i = indexPosition(handle, index->size);
+	while ((object = index->entry[i]) != NULL) {
+		if ((object != &removedEntry) && (object->handle == handle)) {
+			index->entry[i] = &removedEntry;
+			return;
+		}
+		i = (i + 1) & (index->size - 1);
+	}
+}
+
+
+
+/**
+ * Free the index of objects by handle and all replaced tables
+ *
+ * The objects are not freed.
+ *
+ * @param ppIndex address of the pointer to the table
+ */
+void freeObjectIndex(struct p11ObjectIndex_t **ppIndex)
+{
+	struct p11ObjectIndex_t *index;
+
+	while (*ppIndex != NULL) {
+		index = *ppIndex;
+		*ppIndex = index->retired;
+		free(index);
+	}
+}
+
+
+
+/*
+ * Attributes applications typically search for
+ */
+static CK_ATTRIBUTE_TYPE indexedAttributes[] = { CKA_CLASS, CKA_ID, CKA_LABEL, CKA_KEY_TYPE };
+
+#define MIN_ATTRIBUTE_INDEX_SIZE	64
+
+
+
+int isIndexedAttribute(CK_ATTRIBUTE_TYPE type)
+{
+	int i;
+
+	for (i = 0; i < (int)(sizeof(indexedAttributes) / sizeof(*indexedAttributes)); i++) {
+		if (indexedAttributes[i] == type)
+			return CK_TRUE;
+	}
+	return CK_FALSE;
+}
+
+
+
+static CK_ULONG attributeHash(CK_ATTRIBUTE_PTR attr)
+{
+	unsigned char *po = (unsigned char *)attr->pValue;
+	CK_ULONG i, hash;
+
+	// FNV-1a over the value, seeded with the attribute type
+	hash = (CK_ULONG)(2166136261UL ^ attr->type);
+	for (i = 0; i < attr->ulValueLen; i++) {
+		hash ^= po[i];
+		hash *= 16777619UL;
+	}
+	return hash;
+}
+
+
+
+/**
+ * Locate the key for an attribute value in the index
+ *
+ * @param index     The index, NULL for an empty index
+ * @param attr      The attribute type and value to look for
+ * @return          The key listing all objects with that attribute value or NULL
+ */
+struct p11AttributeIndexKey_t *findAttributeIndexKey(struct p11AttributeIndex_t *index, CK_ATTRIBUTE_PTR attr)
+{
+	struct p11AttributeIndexKey_t *key;
+	CK_ULONG hash;
+
+	if ((index == NULL) || (attr->ulValueLen && (attr->pValue == NULL)))
+		return NULL;
+
+	hash = attributeHash(attr);
+
+	for (key = index->bucket[hash & (index->size - 1)]; key != NULL; key = key->next) {
+		if ((key->hash == hash) && (key->type == attr->type) && (key->valueLen == attr->ulValueLen) &&
+			!memcmp(key->value, attr->pValue, attr->ulValueLen))
+			return key;
+	}
+	return NULL;
+}
+
+
+
+static int growAttributeIndex(struct p11AttributeIndex_t **ppIndex)
+{
+	struct p11AttributeIndex_t *old = *ppIndex, *index;
+	struct p11AttributeIndexKey_t *key;
+	CK_ULONG size, i;
+
+	size = old ? old->size << 1 : MIN_ATTRIBUTE_INDEX_SIZE;
+
+	index = (struct p11AttributeIndex_t *)calloc(1, sizeof(struct p11AttributeIndex_t) + (size - 1) * sizeof(struct p11AttributeIndexKey_t *));
+	if (index == NULL)
+		return CKR_HOST_MEMORY;
+
+	index->size = size;
+
+	if (old != NULL) {
+		for (i = 0; i < old->size; i++) {
+			while ((key = old->bucket[i]) != NULL) {
+				old->bucket[i] = key->next;
+				key->next = index->bucket[key->hash & (size - 1)];
+				index->bucket[key->hash & (size - 1)] = key;
+			}
+		}
+		index->keys = old->keys;
+		free(old);
+	}
+
+	*ppIndex = index;
+	return CKR_OK;
+}
+
+
+
+static int addObjectToAttributeIndexKey(struct p11AttributeIndex_t **ppIndex, CK_ATTRIBUTE_PTR attr, struct p11Object_t *object)
+{
+	struct p11AttributeIndexKey_t *key;
+	struct p11Object_t **list;
+	CK_ULONG hash;
+	int rc;
+
+	key = findAttributeIndexKey(*ppIndex, attr);
+
+	if (key == NULL) {
+		if ((*ppIndex == NULL) || ((*ppIndex)->keys >= (*ppIndex)->size)) {
+			rc = growAttributeIndex(ppIndex);
+			if (rc != CKR_OK)
+				return rc;
+		}
+
+		key = (struct p11AttributeIndexKey_t *)calloc(1, sizeof(struct p11AttributeIndexKey_t) + attr->ulValueLen);
+		if (key == NULL)
+			return CKR_HOST_MEMORY;
+
+		hash = attributeHash(attr);
+		key->type = attr->type;
+		key->hash = hash;
+		key->valueLen = attr->ulValueLen;
+		if (attr->ulValueLen)
+			memcpy(key->value, attr->pValue, attr->ulValueLen);
+
+		key->next = (*ppIndex)->bucket[hash & ((*ppIndex)->size - 1)];
+		(*ppIndex)->bucket[hash & ((*ppIndex)->size - 1)] = key;
+		(*ppIndex)->keys++;
+	}
+
+	if (key->count == key->capacity) {
+		list = (struct p11Object_t **)realloc(key->object, (key->capacity ? key->capacity << 1 : 4) * sizeof(struct p11Object_t *));
+		if (list == NULL)
+			return CKR_HOST_MEMORY;
+		key->object = list;
+		key->capacity = key->capacity ? key->capacity << 1 : 4;
+	}
+
+	key->object[key->count++] = object;
+	return CKR_OK;
+}
+
+
+
+/**
+ * Add object to the index for the attributes applications typically search for
+ *
+ * Objects are listed under a value in the order they are added.
+ *
+ * @param ppIndex   Address of the pointer to the index, NULL for an empty index
+ * @param object    The object to add
+ * @return          CKR_OK or CKR_HOST_MEMORY
+ */
+int addObjectToAttributeIndex(struct p11AttributeIndex_t **ppIndex, struct p11Object_t *object)
+{
+	struct p11Attribute_t *attr;
+	int i, rc;
+
+	for (i = 0; i < (int)(sizeof(indexedAttributes) / sizeof(*indexedAttributes)); i++) {
+		if (findAttribute(object, indexedAttributes[i], &attr) < 0)
+			continue;
+
+		rc = addObjectToAttributeIndexKey(ppIndex, &attr->attrData, object);
+		if (rc != CKR_OK)
+			return rc;
+	}
+	return CKR_OK;
+}
+
+
+
+static int removeObjectFromAttributeIndexKey(struct p11AttributeIndex_t *index, struct p11AttributeIndexKey_t *key, struct p11Object_t *object)
+{
+	struct p11AttributeIndexKey_t **pKey;
+	CK_ULONG i;
+
+	for (i = 0; (i < key->count) && (key->object[i] != object); i++);
+
+	if (i == key->count)
+		return CK_FALSE;
+
+	key->count--;
+	memmove(&key->object[i], &key->object[i + 1], (key->count - i) * sizeof(struct p11Object_t *));
+
+	if (key->count == 0) {
+		pKey = &index->bucket[key->hash & (index->size - 1)];
+		while (*pKey != key)
+			pKey = &(*pKey)->next;
+		*pKey = key->next;
+		index->keys--;
+		free(key->object);
+		free(key);
+	}
+	return CK_TRUE;
+}
+
+
+
+/**
+ * Remove object from the attribute index
+ *
+ * The object is located under its current attribute values. If a value was changed since the object
+ * was added, all values of that attribute are searched.
+ *
+ * @param index     The index, NULL for an empty index
+ * @param object    The object to remove
+ */
+void removeObjectFromAttributeIndex(struct p11AttributeIndex_t *index, struct p11Object_t *object)
+{
+	struct p11AttributeIndexKey_t *key, *next;
+	struct p11Attribute_t *attr;
+	CK_ULONG j;
+	int i;
+
+	if (index == NULL)
+		return;
+
+	for (i = 0; i < (int)(sizeof(indexedAttributes) / sizeof(*indexedAttributes)); i++) {
+		if (findAttribute(object, indexedAttributes[i], &attr) >= 0) {
+			key = findAttributeIndexKey(index, &attr->attrData);
+			if (key && removeObjectFromAttributeIndexKey(index, key, object))
+				continue;
+		}
+
+		for (j = 0; j < index->size; j++) {
+			for (key = index->bucket[j]; key != NULL; key = next) {
+				next = key->next;
+				if ((key->type == indexedAttributes[i]) && removeObjectFromAttributeIndexKey(index, key, object))
+					break;
+			}
+			if (key != NULL)
+				break;
+		}
+	}
+}
+
+
+
+/**
+ * Release the attribute index
+ *
+ * @param ppIndex   Address of the pointer to the index, set to NULL
+ */
+void freeAttributeIndex(struct p11AttributeIndex_t **ppIndex)
+{
+	struct p11AttributeIndexKey_t *key;
+	CK_ULONG i;
+
+	if (*ppIndex == NULL)
+		return;
+
+	for (i = 0; i < (*ppIndex)->size; i++) {
+		while ((key = (*ppIndex)->bucket[i]) != NULL) {
+			(*ppIndex)->bucket[i] = key->next;
+			free(key->object);
+			free(key);
+		}
+	}
+
+	free(*ppIndex);
+	*ppIndex = NULL;
+}
+
+
+
 #ifdef DEBUG
 
 int dumpAttributeList(struct p11Object_t *pObject)
 {
-	CK_ATTRIBUTE_PTR attr;
-	struct p11Attribute_t *p11Attr;
+	CK_ULONG i;
 
 	debug("******** attribute list for object ********\n");
 
-	p11Attr = pObject->attrList;
-
-	while (p11Attr != NULL) {
-		attr = &p11Attr->attrData;
-		dumpAttribute(attr);
-		p11Attr = p11Attr->next;
+	for (i = 0; pObject->attributes && (i < pObject->attributes->count); i++) {
+		dumpAttribute(&pObject->attributes->attr[i].attrData);
 	}
 
 	debug("******** end attribute list ********\n");
@@ -948,19 +1970,18 @@ int createKeyObject(CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, struct p11Obje
  */
 int serializeObject(struct p11Object_t *pObject, unsigned char **pBuffer, unsigned int *bufLength)
 {
+	struct p11AttributeBlock_t *block = pObject->attributes;
 	struct p11Attribute_t *pAttribute;
 	unsigned char *buf;
 	unsigned int l, i;
+	CK_ULONG j;
 
 	l = 0;
 
-	pAttribute = pObject->attrList;
-
 	/* Determine the size of the object */
-	while (pAttribute) {
+	for (j = 0; block && (j < block->count); j++) {
 		l += sizeof(CK_ATTRIBUTE);
-		l += pAttribute->attrData.ulValueLen;
-		pAttribute = pAttribute->next;
+		l += block->attr[j].attrData.ulValueLen;
 	}
 
 	buf = (unsigned char *) malloc(l);
@@ -971,18 +1992,17 @@ int serializeObject(struct p11Object_t *pObject, unsigned char **pBuffer, unsign
 
 	memset(buf, 0x00, l);
 
-	pAttribute = pObject->attrList;
 	i = 0;
 
 	/* Fill the buffer */
-	while (pAttribute) {
+	for (j = 0; block && (j < block->count); j++) {
+		pAttribute = &block->attr[j];
+
 		memcpy(buf + i, &(pAttribute->attrData), sizeof(CK_ATTRIBUTE));
 		i += sizeof(CK_ATTRIBUTE);
 
 		memcpy(buf + i, pAttribute->attrData.pValue, pAttribute->attrData.ulValueLen);
 		i += pAttribute->attrData.ulValueLen;
-
-		pAttribute = pAttribute->next;
 	}
 
 	*pBuffer = buf;
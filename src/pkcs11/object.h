@@ -48,7 +48,65 @@ struct p11Attribute_t {
 
     CK_ATTRIBUTE attrData;          /**< The attribute data                   */
 
-    struct p11Attribute_t *next;    /**< Pointer to next attribute            */
+};
+
+
+
+/**
+ * Attributes of an object stored in a single allocation
+ *
+ * The attributes are sorted by type, so that they can be located with a binary search.
+ * The values follow the last attribute, with pValue pointing into the block. Values
+ * move when the block is reallocated, so pointers into the block must not be kept
+ * while attributes are added or enlarged.
+ */
+struct p11AttributeBlock_t {
+    CK_ULONG count;                     /**< Number of attributes                 */
+    CK_ULONG capacity;                  /**< Attributes that fit before values    */
+    size_t used;                        /**< Bytes used in the value area         */
+    size_t size;                        /**< Bytes available in the value area    */
+    struct p11Arena_t *arena;           /**< Arena owning the block or NULL       */
+    struct p11Attribute_t attr[1];      /**< Attributes sorted by type            */
+};
+
+
+
+/**
+ * Chunk of memory handed out in sequence and released as a whole
+ */
+struct p11ArenaChunk_t {
+    struct p11ArenaChunk_t *next;       /**< Next chunk of the arena              */
+    size_t size;                        /**< Bytes in this chunk                  */
+    size_t used;                        /**< Bytes handed out                     */
+};
+
+
+
+#define ARENA_CLASS_SIZE	64
+#define ARENA_CLASSES		64
+
+/**
+ * Memory for small blocks with the same lifetime as the owner of the arena
+ *
+ * Blocks are handed out in multiples of ARENA_CLASS_SIZE. Released blocks are kept in a list
+ * per size and handed out again, so that memory does not grow if blocks are repeatedly
+ * released and allocated.
+ */
+struct p11Arena_t {
+    struct p11ArenaChunk_t *chunk;      /**< Chunk in use, then full chunks       */
+    void *freeList[ARENA_CLASSES];      /**< Released blocks by size class        */
+    void *mutex;                        /**< Serialize allocation and release     */
+};
+
+
+
+/**
+ * Decoded key material cached with an object
+ */
+struct p11KeyCache_t {
+    void *key;                          /**< Key in the crypto library format     */
+    void (*freeKey)(void *key);         /**< Release the key                      */
+    struct p11KeyCache_t *next;         /**< Next retired entry                   */
 };
 
 
@@ -75,6 +133,8 @@ struct p11Object_t {
 
     struct p11Token_t *token;
 
+    volatile long refCount;         /**< References from the list and callers */
+
     CK_RV (*C_EncryptInit)  (struct p11Object_t *, CK_MECHANISM_PTR);
     CK_RV (*C_Encrypt)      (struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
     CK_RV (*C_EncryptUpdate)(struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
@@ -97,11 +157,49 @@ struct p11Object_t {
 
     int (*C_DeriveKey)  (struct p11Object_t *, CK_MECHANISM_PTR, CK_ATTRIBUTE_PTR, CK_ULONG, struct p11Object_t **);
 
-    struct p11Attribute_t *attrList;    /**< The list of attributes              */
+    struct p11AttributeBlock_t *attributes; /**< The attributes and their values */
+    struct p11KeyCache_t *keyCache; /**< Key decoded from the attributes     */
+    struct p11KeyCache_t *retiredKeys; /**< Decoded keys no longer current   */
     struct p11Object_t *next;       /**< Pointer to next object              */
 
 };
 
+/**
+ * Open addressing table locating objects by handle
+ *
+ * The table is rebuilt when it fills up. The replaced table is kept until the next rebuild, so
+ * that threads looking up a handle without holding the token mutex never access released memory.
+ */
+struct p11ObjectIndex_t {
+    struct p11ObjectIndex_t *retired;   /**< Table replaced by this table         */
+    CK_ULONG size;                      /**< Number of entries, a power of 2      */
+    CK_ULONG used;                      /**< Entries with objects or removed      */
+    struct p11Object_t *entry[1];       /**< The entries                          */
+};
+
+/**
+ * Objects sharing the same value for an indexed attribute
+ */
+struct p11AttributeIndexKey_t {
+    struct p11AttributeIndexKey_t *next;    /**< Next key in the same bucket          */
+    CK_ATTRIBUTE_TYPE type;                 /**< The attribute type                   */
+    CK_ULONG hash;                          /**< Hash over type and value             */
+    CK_ULONG count;                         /**< Number of objects with this value    */
+    CK_ULONG capacity;                      /**< Number of entries in object          */
+    struct p11Object_t **object;            /**< Objects in the order of addition     */
+    CK_ULONG valueLen;                      /**< Length of the value                  */
+    unsigned char value[1];                 /**< The attribute value                  */
+};
+
+/**
+ * Hash table locating objects by the value of CKA_CLASS, CKA_ID, CKA_LABEL or CKA_KEY_TYPE
+ */
+struct p11AttributeIndex_t {
+    CK_ULONG size;                          /**< Number of buckets, a power of 2      */
+    CK_ULONG keys;                          /**< Number of keys in all buckets        */
+    struct p11AttributeIndexKey_t *bucket[1]; /**< Keys chained by hash               */
+};
+
 // MANDATORY: Attribute must be provided by the caller
 // DEFAULT: Attribute shall be created with default attribute
 // OPTIONAL: Attribute may be missing
@@ -131,10 +229,31 @@ int findAttribute(struct p11Object_t *object, CK_ATTRIBUTE_TYPE type, struct p11
 int findAttributeInTemplate(CK_ATTRIBUTE_TYPE attributeType, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount);
 int removeAttribute(struct p11Object_t *object, CK_ATTRIBUTE_PTR attributeTemplate);
 int removeAllAttributes(struct p11Object_t *object);
+int reserveAttributes(struct p11Object_t *object, CK_ULONG count, size_t size);
+int setAttribute(struct p11Object_t *object, CK_ATTRIBUTE_PTR pTemplate);
+int copyAttributes(struct p11Object_t *dst, struct p11Object_t *src);
+int moveAttributesToArena(struct p11Object_t *object, struct p11Arena_t *arena);
+int createArena(struct p11Arena_t **arena);
+void *allocateFromArena(struct p11Arena_t *arena, size_t size);
+void releaseToArena(struct p11Arena_t *arena, void *p, size_t size);
+void freeArena(struct p11Arena_t **arena);
 void freeObject(struct p11Object_t *object);
+void releaseObject(struct p11Object_t *object);
+void *getCachedKey(struct p11Object_t *object);
+void *cacheKey(struct p11Object_t *object, void *key, void (*freeKey)(void *key));
+void invalidateKeyCache(struct p11Object_t *object);
 void addObjectToList(struct p11Object_t **ppObject, struct p11Object_t *object);
 int removeObjectFromList(struct p11Object_t **ppObject, CK_OBJECT_HANDLE handle);
 void removeAllObjectsFromList(struct p11Object_t **ppObject);
+int addObjectToIndex(struct p11ObjectIndex_t **ppIndex, struct p11Object_t *object);
+struct p11Object_t *findObjectInIndex(struct p11ObjectIndex_t *index, CK_OBJECT_HANDLE handle);
+void removeObjectFromIndex(struct p11ObjectIndex_t *index, CK_OBJECT_HANDLE handle);
+void freeObjectIndex(struct p11ObjectIndex_t **ppIndex);
+int isIndexedAttribute(CK_ATTRIBUTE_TYPE type);
+struct p11AttributeIndexKey_t *findAttributeIndexKey(struct p11AttributeIndex_t *index, CK_ATTRIBUTE_PTR attr);
+int addObjectToAttributeIndex(struct p11AttributeIndex_t **ppIndex, struct p11Object_t *object);
+void removeObjectFromAttributeIndex(struct p11AttributeIndex_t *index, struct p11Object_t *object);
+void freeAttributeIndex(struct p11AttributeIndex_t **ppIndex);
 int createObject(CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, struct p11Object_t *object);
 int createStorageObject(CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, struct p11Object_t *object);
 int createKeyObject(CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, struct p11Object_t *object);
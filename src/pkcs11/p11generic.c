@@ -33,12 +33,15 @@
 
 #include <string.h>
 
-#include <common/mutex.h>
+#include <common/atomic.h>
+#include <common/thread.h>
 
 #include <pkcs11/p11generic.h>
 #include <pkcs11/session.h>
 #include <pkcs11/slotpool.h>
 #include <pkcs11/strbpcpy.h>
+#include <pkcs11/verify-batch.h>
+#include <pkcs11/random-pool.h>
 
 #include <pkcs11/crypto.h>
 
@@ -112,6 +115,188 @@ CK_RV p11UnlockMutex(CK_VOID_PTR pMutex)
 
 
 
+/**
+ * Reader-writer lock for the objects of a token
+ *
+ * With operating system locking, readers and writers block on a condition variable. With
+ * mutexes provided by the application, readers only update a counter and never block each
+ * other. A writer holds the mutex, which stops new readers, and waits for active readers to
+ * leave. In both cases readers must not acquire the same lock recursively, as a waiting
+ * writer would then block the nested reader.
+ */
+struct p11RWLock_t {
+	int osLock;                         /**< Use rwlock rather than mutex      */
+	struct rw_lock rwlock;              /**< Lock of the operating system      */
+	CK_VOID_PTR mutex;                  /**< Held by the writer                */
+	volatile long readers;              /**< Number of active readers          */
+	volatile long writer;               /**< A writer holds or awaits the lock */
+};
+
+
+
+CK_RV p11CreateRWLock(CK_VOID_PTR_PTR ppLock)
+{
+	struct p11RWLock_t *lock;
+	CK_RV rv;
+
+	if (!initArgs.CreateMutex) {
+		return CKR_OK;
+	}
+
+	lock = (struct p11RWLock_t *)calloc(1, sizeof(struct p11RWLock_t));
+	if (lock == NULL)
+		return CKR_HOST_MEMORY;
+
+	if (initArgs.flags & CKF_OS_LOCKING_OK) {
+		if (rw_lock_init(&lock->rwlock) != 0) {
+			free(lock);
+			return CKR_GENERAL_ERROR;
+		}
+		lock->osLock = TRUE;
+	} else {
+		rv = p11CreateMutex(&lock->mutex);
+		if (rv != CKR_OK) {
+			free(lock);
+			return rv;
+		}
+	}
+
+	*ppLock = (CK_VOID_PTR)lock;
+	return CKR_OK;
+}
+
+
+
+CK_RV p11DestroyRWLock(CK_VOID_PTR pLock)
+{
+	struct p11RWLock_t *lock = (struct p11RWLock_t *)pLock;
+	CK_RV rv = CKR_OK;
+
+	if (lock == NULL) {
+		return CKR_OK;
+	}
+
+	if (lock->osLock)
+		rw_lock_destroy(&lock->rwlock);
+	else
+		rv = p11DestroyMutex(lock->mutex);
+	free(lock);
+	return rv;
+}
+
+
+
+CK_RV p11LockShared(CK_VOID_PTR pLock)
+{
+	struct p11RWLock_t *lock = (struct p11RWLock_t *)pLock;
+
+	if (lock == NULL) {
+		return CKR_OK;
+	}
+
+	if (lock->osLock) {
+		rw_lock_acquire_shared(&lock->rwlock);
+		return CKR_OK;
+	}
+
+	while (1) {
+		atomic_inc(&lock->readers);
+		if (!atomic_get(&lock->writer))
+			break;
+
+		// Step back and wait until the writer releases the mutex
+		atomic_dec(&lock->readers);
+		p11LockMutex(lock->mutex);
+		p11UnlockMutex(lock->mutex);
+	}
+	return CKR_OK;
+}
+
+
+
+CK_RV p11UnlockShared(CK_VOID_PTR pLock)
+{
+	struct p11RWLock_t *lock = (struct p11RWLock_t *)pLock;
+
+	if (lock == NULL) {
+		return CKR_OK;
+	}
+
+	if (lock->osLock)
+		rw_lock_release_shared(&lock->rwlock);
+	else
+		atomic_dec(&lock->readers);
+	return CKR_OK;
+}
+
+
+
+CK_RV p11LockExclusive(CK_VOID_PTR pLock)
+{
+	struct p11RWLock_t *lock = (struct p11RWLock_t *)pLock;
+	CK_RV rv;
+
+	if (lock == NULL) {
+		return CKR_OK;
+	}
+
+	if (lock->osLock) {
+		rw_lock_acquire_exclusive(&lock->rwlock);
+		return CKR_OK;
+	}
+
+	rv = p11LockMutex(lock->mutex);
+	if (rv != CKR_OK)
+		return rv;
+
+	atomic_inc(&lock->writer);
+
+	// Application mutexes offer no way to wait for the readers
+	while (atomic_get(&lock->readers)) {
+		thread_sleep(0);
+	}
+	return CKR_OK;
+}
+
+
+
+CK_RV p11UnlockExclusive(CK_VOID_PTR pLock)
+{
+	struct p11RWLock_t *lock = (struct p11RWLock_t *)pLock;
+
+	if (lock == NULL) {
+		return CKR_OK;
+	}
+
+	if (lock->osLock) {
+		rw_lock_release_exclusive(&lock->rwlock);
+		return CKR_OK;
+	}
+
+	atomic_dec(&lock->writer);
+	return p11UnlockMutex(lock->mutex);
+}
+
+
+
+/**
+ * Determine if the module may use background threads.
+ *
+ * This requires the application to allow the creation of threads and
+ * to use the module from multiple threads, i.e. to provide locking.
+ *
+ * @return TRUE if background threads may be created
+ */
+int p11CanCreateThreads()
+{
+	if (initArgs.flags & CKF_LIBRARY_CANT_CREATE_OS_THREADS) {
+		return FALSE;
+	}
+	return initArgs.LockMutex != NULL;
+}
+
+
+
 static CK_RV osCreateMutex(CK_VOID_PTR_PTR ppMutex)
 {
 	MUTEX *m = (MUTEX *)calloc(1, sizeof(*m));
@@ -349,6 +534,9 @@ CK_DECLARE_FUNCTION(CK_RV, C_Initialize)
 #ifdef ENABLE_LIBCRYPTO
 	cryptoInitialize();
 #endif
+
+	startRandomPool();
+
 	FUNC_RETURNS(CKR_OK);
 }
 
@@ -369,6 +557,8 @@ CK_DECLARE_FUNCTION(CK_RV, C_Finalize)
 	if (context != NULL) {
 		p11LockMutex(context->mutex);
 
+		stopVerifyWorkers();
+		stopRandomPool();
 		terminateSessionPool(&context->sessionPool);
 		terminateSlotPool(&context->slotPool);
 
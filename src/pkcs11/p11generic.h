@@ -96,6 +96,11 @@
 
 
 struct p11TokenDriver;
+struct ticket_lock;
+struct p11ObjectIndex_t;
+struct p11AttributeIndex_t;
+struct p11AttributeIndexKey_t;
+struct p11Arena_t;
 
 #define INT_CKU_NO_USER 0xFF
 
@@ -116,12 +121,19 @@ struct p11Token_t {
 
 	CK_ULONG numberOfTokenObjects;      /**< The number of public objects in this token     */
 	struct p11Object_t *tokenObjList;   /**< Pointer to first object in pool                */
+	struct p11ObjectIndex_t *tokenObjIndex; /**< Public objects by handle                   */
+	struct p11AttributeIndex_t *tokenObjAttrIndex; /**< Public objects by attribute value   */
 
 	CK_ULONG numberOfPrivateTokenObjects; /**< The number of private objects in this token  */
 	struct p11Object_t *tokenPrivObjList; /**< Pointer to the first object in pool          */
+	struct p11ObjectIndex_t *tokenPrivObjIndex; /**< Private objects by handle              */
+	struct p11AttributeIndex_t *tokenPrivObjAttrIndex; /**< Private objects by attribute value */
 
-	void *mutex;                        /**< Mutex used to synchronize internal updates     */
+	void *mutex;                        /**< Serialize token driver operations              */
+	void *objectLock;                   /**< Reader-writer lock for object lists and indexes */
+	struct p11Arena_t *arena;           /**< Memory for the attributes of token objects     */
 	struct p11TokenDriver *drv;         /**< Driver for this token                          */
+	struct p11Token_t *next;            /**< Next removed token awaiting release            */
 };
 
 
@@ -142,15 +154,30 @@ struct p11Slot_t {
 	char readername[MAX_READERNAME];  /**< The reader name for this slot       */
 	SCARDCONTEXT context;             /**< Card manager context for slot       */
 	SCARDHANDLE card;                 /**< Handle to card                      */
+	volatile long monitored;          /**< Reader is watched by slot monitor   */
+	volatile long generation;         /**< Incremented on each reader event    */
+	long validatedGeneration;         /**< Generation at last token check      */
+	int transaction;                  /**< PC/SC transaction is open           */
+	int transactionDepth;             /**< Nesting of slot transactions        */
+	unsigned long transactionExpires; /**< End of sticky transaction lease     */
+	volatile long discovering;        /**< Token discovery in progress         */
+	unsigned long discoveryStarted;   /**< Start of token discovery            */
 #endif
 	int maxCAPDU;                     /**< Maximum length of command APDU      */
 	int maxRAPDU;                     /**< Maximum length of response APDU     */
 	int noExtLengthReadAll;           /**< Prevent using Le='000000'           */
 	int supportsVirtualSlots;         /**< Allow a token to generate v-slotts  */
+	struct ticket_lock *queue;        /**< Serialize card access per reader    */
+	int isPool;                       /**< Slot aggregates other tokens        */
+	struct sc_hsm_emulator *emulator; /**< Card emulated in process            */
+	struct apdu_replay *replay;       /**< Card replayed from APDU trace       */
+	struct slot_statistics *statistics;/**< APDU counters and histograms       */
+	struct random_pool *randomPool;   /**< Card entropy buffered for the slot  */
 	struct p11Slot_t *primarySlot;    /**< Base slot if slot is virtual        */
 	struct p11Slot_t *virtualSlots[2];/**< Virtual slots using this as base    */
 	struct p11Token_t *token;         /**< Pointer to token in the slot        */
-	struct p11Token_t *removedToken;  /**< Removed but not freed token         */
+	struct p11Token_t *removedToken;  /**< Removed but not freed tokens        */
+	volatile long tokenUsers;         /**< References obtained for the token   */
 	struct p11Slot_t *next;           /**< Pointer to next available slot      */
 };
 
@@ -164,19 +191,52 @@ struct p11SlotPool_t {
 	CK_ULONG numberOfSlots;         /**< Number of slots in the pool         */
 	CK_SLOT_ID nextSlotID;          /**< The next assigned slot ID value     */
 	struct p11Slot_t *list;         /**< Pointer to first slot in pool       */
+	CK_VOID_PTR mutex;              /**< Serialize insertion of slots        */
+};
+
+
+
+#define SESSION_SHARDS          16          /**< Independently locked parts of the session table   */
+#define SESSION_INDEX_BITS      20          /**< Handle bits encoding the position in the table    */
+#define SESSION_INDEX_MASK      ((1UL << SESSION_INDEX_BITS) - 1)
+
+/**
+ * Entry in the session table. The generation is incremented whenever the entry is
+ * released, so that a stale handle does not address a session opened later on.
+ */
+struct p11SessionEntry_t {
+	struct p11Session_t *session;           /**< Session or NULL if entry is unused    */
+	CK_ULONG generation;                    /**< Upper bits of the session handle      */
+	CK_ULONG nextFree;                      /**< Next unused entry + 1, 0 for none     */
+};
+
+
+
+/**
+ * Part of the session table with it's own lock. Sessions are spread round-robin
+ * across shards, so that concurrent lookups rarely contend for the same mutex.
+ */
+struct p11SessionShard_t {
+	CK_VOID_PTR mutex;                      /**< Protect the entries of this shard     */
+	CK_ULONG numberOfSessions;              /**< Number of active sessions in shard    */
+	CK_ULONG used;                          /**< Entries used at least once            */
+	CK_ULONG size;                          /**< Entries allocated                     */
+	CK_ULONG freeList;                      /**< First released entry + 1, 0 for none  */
+	struct p11SessionEntry_t *entry;        /**< Entries addressed by session handle   */
 };
 
 
 
 /**
- * Internal structure to store information for session management and a list
+ * Internal structure to store information for session management and a table
  * of all active sessions.
  *
+ * The low SESSION_INDEX_BITS of a session handle select shard and entry, the
+ * remaining bits carry the generation of the entry.
  */
 struct p11SessionPool_t {
-	CK_ULONG numberOfSessions;              /**< Number of active sessions             */
-	CK_SESSION_HANDLE nextSessionHandle;    /**< Value of next assigned session handle */
-	struct p11Session_t *list;              /**< Pointer to first session in pool      */
+	volatile long nextShard;                /**< Shard for the next session            */
+	struct p11SessionShard_t shard[SESSION_SHARDS];
 };
 
 
@@ -215,6 +275,9 @@ struct p11TokenDriver {
 	int (*C_SetAttributeValue)(struct p11Slot_t *, struct p11Object_t *, CK_ATTRIBUTE_PTR, CK_ULONG);
 
 	int (*C_GenerateRandom)   (struct p11Slot_t *, CK_BYTE_PTR , CK_ULONG );
+
+	/**< Allow driver to defer loading objects until they can match a search template       */
+	int (*loadObjects)        (struct p11Token_t *, CK_ATTRIBUTE_PTR, CK_ULONG);
 };
 
 
@@ -242,10 +305,27 @@ struct p11Context_t {
 	void *mutex;                            /**< Global lock used to protect internals    */
 };
 
+/*
+ * Locks are acquired in the order
+ *
+ *   context->mutex -> slot queue -> token->mutex -> token->objectLock -> session->mutex
+ *
+ * A lock further right must never be held while acquiring a lock further left. The session
+ * mutex only protects the operation and search state of the session and is never held while
+ * calling into a token driver.
+ */
+
 CK_RV p11CreateMutex(CK_VOID_PTR_PTR ppMutex);
 CK_RV p11DestroyMutex(CK_VOID_PTR pMutex);
 CK_RV p11LockMutex(CK_VOID_PTR pMutex);
 CK_RV p11UnlockMutex(CK_VOID_PTR pMutex);
+CK_RV p11CreateRWLock(CK_VOID_PTR_PTR ppLock);
+CK_RV p11DestroyRWLock(CK_VOID_PTR pLock);
+CK_RV p11LockShared(CK_VOID_PTR pLock);
+CK_RV p11UnlockShared(CK_VOID_PTR pLock);
+CK_RV p11LockExclusive(CK_VOID_PTR pLock);
+CK_RV p11UnlockExclusive(CK_VOID_PTR pLock);
+int p11CanCreateThreads();
 
 #endif /* ___P11GENERIC_H_INC___ */
 
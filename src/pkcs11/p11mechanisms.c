@@ -31,6 +31,8 @@
  * @brief   Crypto mechanisms at the PKCS#11 interface
  */
 
+#include <string.h>
+
 #ifndef _WIN32
 #include <unistd.h>
 #endif
@@ -41,6 +43,8 @@
 #include <pkcs11/slotpool.h>
 #include <pkcs11/token.h>
 #include <pkcs11/crypto.h>
+#include <pkcs11/verify-batch.h>
+#include <pkcs11/random-pool.h>
 #include <common/debug.h>
 
 
@@ -48,6 +52,81 @@ extern struct p11Context_t *context;
 
 
 
+/**
+ * Process AES-CBC data for an operation chained on the host
+ *
+ * Whole blocks are passed to the token with the IV carried over from the previous call
+ * applied to the first block. A trailing partial block remains in the session until the
+ * next call. Input and output may overlap.
+ */
+static CK_RV cipherChainUpdate(struct p11Session_t *pSession, struct p11Object_t *pObject, CK_MECHANISM_TYPE mech, int encrypt, CK_BYTE_PTR pIn, CK_ULONG ulInLen, CK_BYTE_PTR pOut, CK_ULONG_PTR pulOutLen)
+{
+	CK_BYTE tail[16], next[16];
+	CK_ULONG have, len, tailLen, i;
+	CK_RV rv;
+
+	have = pSession->chainBlockLen;
+	len = (have + ulInLen) & ~(CK_ULONG)15;
+
+	if (pOut == NULL) {
+		*pulOutLen = len;
+		return CKR_OK;
+	}
+
+	if (len > *pulOutLen) {
+		*pulOutLen = len;
+		return CKR_BUFFER_TOO_SMALL;
+	}
+
+	if (len == 0) {
+		memcpy(pSession->chainBlock + have, pIn, ulInLen);
+		pSession->chainBlockLen += ulInLen;
+		*pulOutLen = 0;
+		return CKR_OK;
+	}
+
+	tailLen = have + ulInLen - len;
+	memcpy(tail, pIn + ulInLen - tailLen, tailLen);
+
+	memmove(pOut + have, pIn, len - have);
+	memcpy(pOut, pSession->chainBlock, have);
+
+	if (encrypt) {
+		for (i = 0; i < sizeof(pSession->chainIV); i++) {
+			pOut[i] ^= pSession->chainIV[i];
+		}
+
+		rv = pObject->C_Encrypt(pObject, mech, pOut, len, pOut, &len);
+
+		if (rv == CKR_OK) {
+			memcpy(pSession->chainIV, pOut + len - sizeof(pSession->chainIV), sizeof(pSession->chainIV));
+		}
+	} else {
+		memcpy(next, pOut + len - sizeof(next), sizeof(next));
+
+		rv = pObject->C_Decrypt(pObject, mech, pOut, len, pOut, &len);
+
+		if (rv == CKR_OK) {
+			for (i = 0; i < sizeof(pSession->chainIV); i++) {
+				pOut[i] ^= pSession->chainIV[i];
+			}
+			memcpy(pSession->chainIV, next, sizeof(pSession->chainIV));
+		}
+	}
+
+	if (rv != CKR_OK) {
+		return rv;
+	}
+
+	memcpy(pSession->chainBlock, tail, tailLen);
+	pSession->chainBlockLen = tailLen;
+	*pulOutLen = len;
+
+	return CKR_OK;
+}
+
+
+
 /*  C_EncryptInit initializes an encryption operation. */
 CK_DECLARE_FUNCTION(CK_RV, C_EncryptInit)(
 		CK_SESSION_HANDLE hSession,
@@ -91,18 +170,24 @@ CK_DECLARE_FUNCTION(CK_RV, C_EncryptInit)(
 	if (pObject->C_EncryptInit != NULL) {
 		rv = pObject->C_EncryptInit(pObject, pMechanism);
 		if (rv == CKR_DEVICE_ERROR) {
+			releaseObject(pObject);
 			rv = handleDeviceError(hSession);
 			FUNC_FAILS(rv, "Device error reported");
 		}
 	} else {
+		releaseObject(pObject);
 		FUNC_FAILS(CKR_FUNCTION_NOT_SUPPORTED, "Operation not supported");
 	}
 
 	if (rv == CKR_OK) {
-		pSession->activeObjectHandle = pObject->handle;
-		pSession->activeMechanism = pMechanism->mechanism;
+		setActiveOperation(pSession, pObject->handle, pMechanism->mechanism);
+
+		if ((pMechanism->mechanism == CKM_AES_CBC) && (pObject->C_EncryptUpdate == NULL)) {
+			setCipherChain(pSession, (pMechanism->ulParameterLen == 16) ? pMechanism->pParameter : NULL);
+		}
 	}
 
+	releaseObject(pObject);
 	FUNC_RETURNS(rv);
 }
 
@@ -121,6 +206,8 @@ CK_DECLARE_FUNCTION(CK_RV, C_Encrypt)(
 	struct p11Object_t *pObject;
 	struct p11Slot_t *pSlot;
 	struct p11Session_t *pSession;
+	CK_OBJECT_HANDLE hKey;
+	CK_MECHANISM_TYPE mech;
 
 	FUNC_CALLED();
 
@@ -146,7 +233,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_Encrypt)(
 		FUNC_RETURNS(rv);
 	}
 
-	if (pSession->activeObjectHandle == CK_INVALID_HANDLE) {
+	if (getActiveOperation(pSession, &hKey, &mech) != CKR_OK) {
 		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
 	}
 
@@ -156,22 +243,36 @@ CK_DECLARE_FUNCTION(CK_RV, C_Encrypt)(
 		FUNC_RETURNS(rv);
 	}
 
-	rv = findSlotKey(pSlot, pSession->activeObjectHandle, &pObject);
+	rv = findSlotKey(pSlot, hKey, &pObject);
 
 	if (rv != CKR_OK) {
 		FUNC_RETURNS(rv);
 	}
 
-	if (pObject->C_Encrypt != NULL) {
-		rv = pObject->C_Encrypt(pObject, pSession->activeMechanism, pData, ulDataLen, pEncryptedData, pulEncryptedDataLen);
+	if (pSession->cipherChain) {
+		if (ulDataLen & 15) {
+			endActiveOperation(pSession, FALSE);
+			releaseObject(pObject);
+			FUNC_FAILS(CKR_DATA_LEN_RANGE, "Data must be a multiple of the block size");
+		}
+
+		rv = cipherChainUpdate(pSession, pObject, mech, TRUE, pData, ulDataLen, pEncryptedData, pulEncryptedDataLen);
+
+		if ((pEncryptedData != NULL) && (rv != CKR_BUFFER_TOO_SMALL)) {
+			endActiveOperation(pSession, FALSE);
+		}
+	} else if (pObject->C_Encrypt != NULL) {
+		rv = pObject->C_Encrypt(pObject, mech, pData, ulDataLen, pEncryptedData, pulEncryptedDataLen);
 
 		if ((pEncryptedData != NULL) && (rv != CKR_BUFFER_TOO_SMALL)) {
-			pSession->activeObjectHandle = CK_INVALID_HANDLE;
+			endActiveOperation(pSession, FALSE);
 		}
 	} else {
+		releaseObject(pObject);
 		FUNC_FAILS(CKR_FUNCTION_NOT_SUPPORTED, "Operation not supported");
 	}
 
+	releaseObject(pObject);
 	FUNC_RETURNS(rv);
 }
 
@@ -191,6 +292,8 @@ CK_DECLARE_FUNCTION(CK_RV, C_EncryptUpdate)(
 	struct p11Object_t *pObject;
 	struct p11Slot_t *pSlot;
 	struct p11Session_t *pSession;
+	CK_OBJECT_HANDLE hKey;
+	CK_MECHANISM_TYPE mech;
 
 	FUNC_CALLED();
 
@@ -216,7 +319,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_EncryptUpdate)(
 		FUNC_RETURNS(rv);
 	}
 
-	if (pSession->activeObjectHandle == CK_INVALID_HANDLE) {
+	if (getActiveOperation(pSession, &hKey, &mech) != CKR_OK) {
 		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
 	}
 
@@ -226,22 +329,32 @@ CK_DECLARE_FUNCTION(CK_RV, C_EncryptUpdate)(
 		FUNC_RETURNS(rv);
 	}
 
-	rv = findSlotKey(pSlot, pSession->activeObjectHandle, &pObject);
+	rv = findSlotKey(pSlot, hKey, &pObject);
 
 	if (rv != CKR_OK) {
 		FUNC_RETURNS(rv);
 	}
 
-	if (pObject->C_EncryptUpdate != NULL) {
-		rv = pObject->C_EncryptUpdate(pObject, pSession->activeMechanism, pPart, ulPartLen, pEncryptedPart, pulEncryptedPartLen);
+	if (pSession->cipherChain) {
+		rv = cipherChainUpdate(pSession, pObject, mech, TRUE, pPart, ulPartLen, pEncryptedPart, pulEncryptedPartLen);
+		if (rv == CKR_DEVICE_ERROR) {
+			releaseObject(pObject);
+			rv = handleDeviceError(hSession);
+			FUNC_FAILS(rv, "Device error reported");
+		}
+	} else if (pObject->C_EncryptUpdate != NULL) {
+		rv = pObject->C_EncryptUpdate(pObject, mech, pPart, ulPartLen, pEncryptedPart, pulEncryptedPartLen);
 		if (rv == CKR_DEVICE_ERROR) {
+			releaseObject(pObject);
 			rv = handleDeviceError(hSession);
 			FUNC_FAILS(rv, "Device error reported");
 		}
 	} else {
+		releaseObject(pObject);
 		FUNC_FAILS(CKR_FUNCTION_NOT_SUPPORTED, "Operation not supported by token");
 	}
 
+	releaseObject(pObject);
 	FUNC_RETURNS(rv);
 }
 
@@ -258,6 +371,8 @@ CK_DECLARE_FUNCTION(CK_RV, C_EncryptFinal)(
 	struct p11Object_t *pObject;
 	struct p11Slot_t *pSlot;
 	struct p11Session_t *pSession;
+	CK_OBJECT_HANDLE hKey;
+	CK_MECHANISM_TYPE mech;
 
 	FUNC_CALLED();
 
@@ -279,7 +394,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_EncryptFinal)(
 		FUNC_RETURNS(rv);
 	}
 
-	if (pSession->activeObjectHandle == CK_INVALID_HANDLE) {
+	if (getActiveOperation(pSession, &hKey, &mech) != CKR_OK) {
 		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
 	}
 
@@ -289,27 +404,38 @@ CK_DECLARE_FUNCTION(CK_RV, C_EncryptFinal)(
 		FUNC_RETURNS(rv);
 	}
 
-	rv = findSlotKey(pSlot, pSession->activeObjectHandle, &pObject);
+	rv = findSlotKey(pSlot, hKey, &pObject);
 
 	if (rv != CKR_OK) {
 		FUNC_RETURNS(rv);
 	}
 
-	if (pObject->C_EncryptFinal != NULL) {
-		rv = pObject->C_EncryptFinal(pObject, pSession->activeMechanism, pLastEncryptedPart, pulLastEncryptedPartLen);
+	if (pSession->cipherChain) {
+		if (pSession->chainBlockLen) {
+			endActiveOperation(pSession, FALSE);
+			releaseObject(pObject);
+			FUNC_FAILS(CKR_DATA_LEN_RANGE, "Data must be a multiple of the block size");
+		}
+		*pulLastEncryptedPartLen = 0;
+		rv = CKR_OK;
+	} else if (pObject->C_EncryptFinal != NULL) {
+		rv = pObject->C_EncryptFinal(pObject, mech, pLastEncryptedPart, pulLastEncryptedPartLen);
 		if (rv == CKR_DEVICE_ERROR) {
+			releaseObject(pObject);
 			rv = handleDeviceError(hSession);
 			FUNC_FAILS(rv, "Device error reported");
 		}
 	} else {
+		releaseObject(pObject);
 		FUNC_FAILS(CKR_FUNCTION_NOT_SUPPORTED, "Operation not supported by token");
 	}
 
 	if (!rv) {
-		pSession->activeObjectHandle = CK_INVALID_HANDLE;
+		endActiveOperation(pSession, FALSE);
 		rv = CKR_OK;
 	}
 
+	releaseObject(pObject);
 	FUNC_RETURNS(rv);
 }
 
@@ -358,19 +484,25 @@ CK_DECLARE_FUNCTION(CK_RV, C_DecryptInit)(
 	if (pObject->C_DecryptInit != NULL) {
 		rv = pObject->C_DecryptInit(pObject, pMechanism);
 		if (rv == CKR_DEVICE_ERROR) {
+			releaseObject(pObject);
 			rv = handleDeviceError(hSession);
 			FUNC_FAILS(rv, "Device error reported");
 		}
 	} else {
+		releaseObject(pObject);
 		FUNC_FAILS(CKR_FUNCTION_NOT_SUPPORTED, "Operation not supported by token");
 	}
 
 	if (!rv) {
-		pSession->activeObjectHandle = pObject->handle;
-		pSession->activeMechanism = pMechanism->mechanism;
+		setActiveOperation(pSession, pObject->handle, pMechanism->mechanism);
 		rv = CKR_OK;
+
+		if ((pMechanism->mechanism == CKM_AES_CBC) && (pObject->C_DecryptUpdate == NULL)) {
+			setCipherChain(pSession, (pMechanism->ulParameterLen == 16) ? pMechanism->pParameter : NULL);
+		}
 	}
 
+	releaseObject(pObject);
 	FUNC_RETURNS(rv);
 }
 
@@ -389,6 +521,8 @@ CK_DECLARE_FUNCTION(CK_RV, C_Decrypt)(
 	struct p11Object_t *pObject;
 	struct p11Slot_t *pSlot;
 	struct p11Session_t *pSession;
+	CK_OBJECT_HANDLE hKey;
+	CK_MECHANISM_TYPE mech;
 
 	FUNC_CALLED();
 
@@ -414,7 +548,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_Decrypt)(
 		FUNC_RETURNS(rv);
 	}
 
-	if (pSession->activeObjectHandle == CK_INVALID_HANDLE) {
+	if (getActiveOperation(pSession, &hKey, &mech) != CKR_OK) {
 		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
 	}
 
@@ -424,26 +558,52 @@ CK_DECLARE_FUNCTION(CK_RV, C_Decrypt)(
 		FUNC_RETURNS(rv);
 	}
 
-	rv = findSlotKey(pSlot, pSession->activeObjectHandle, &pObject);
+	rv = findSlotKey(pSlot, hKey, &pObject);
 
 	if (rv != CKR_OK) {
 		FUNC_RETURNS(rv);
 	}
 
+	if (pSession->cipherChain) {
+		if (ulEncryptedDataLen & 15) {
+			endActiveOperation(pSession, FALSE);
+			releaseObject(pObject);
+			FUNC_FAILS(CKR_ENCRYPTED_DATA_LEN_RANGE, "Cryptogram must be a multiple of the block size");
+		}
+
+		rv = cipherChainUpdate(pSession, pObject, mech, FALSE, pEncryptedData, ulEncryptedDataLen, pData, pulDataLen);
+
+		if ((pData != NULL) && (rv != CKR_BUFFER_TOO_SMALL)) {
+			endActiveOperation(pSession, FALSE);
+		}
+
+		if (rv == CKR_DEVICE_ERROR) {
+			releaseObject(pObject);
+			rv = handleDeviceError(hSession);
+			FUNC_FAILS(rv, "Device error reported");
+		}
+
+		releaseObject(pObject);
+		FUNC_RETURNS(rv);
+	}
+
 	if (pData != NULL) {
-		pSession->activeObjectHandle = CK_INVALID_HANDLE;
+		endActiveOperation(pSession, FALSE);
 	}
 
 	if (pObject->C_Decrypt != NULL) {
-		rv = pObject->C_Decrypt(pObject, pSession->activeMechanism, pEncryptedData, ulEncryptedDataLen, pData, pulDataLen);
+		rv = pObject->C_Decrypt(pObject, mech, pEncryptedData, ulEncryptedDataLen, pData, pulDataLen);
 		if (rv == CKR_DEVICE_ERROR) {
+			releaseObject(pObject);
 			rv = handleDeviceError(hSession);
 			FUNC_FAILS(rv, "Device error reported");
 		}
 	} else {
+		releaseObject(pObject);
 		FUNC_FAILS(CKR_FUNCTION_NOT_SUPPORTED, "Operation not supported by token");
 	}
 
+	releaseObject(pObject);
 	FUNC_RETURNS(rv);
 }
 
@@ -463,6 +623,8 @@ CK_DECLARE_FUNCTION(CK_RV, C_DecryptUpdate)(
 	struct p11Object_t *pObject;
 	struct p11Slot_t *pSlot;
 	struct p11Session_t *pSession;
+	CK_OBJECT_HANDLE hKey;
+	CK_MECHANISM_TYPE mech;
 
 	FUNC_CALLED();
 
@@ -488,7 +650,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_DecryptUpdate)(
 		FUNC_RETURNS(rv);
 	}
 
-	if (pSession->activeObjectHandle == CK_INVALID_HANDLE) {
+	if (getActiveOperation(pSession, &hKey, &mech) != CKR_OK) {
 		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
 	}
 
@@ -498,22 +660,32 @@ CK_DECLARE_FUNCTION(CK_RV, C_DecryptUpdate)(
 		FUNC_RETURNS(rv);
 	}
 
-	rv = findSlotKey(pSlot, pSession->activeObjectHandle, &pObject);
+	rv = findSlotKey(pSlot, hKey, &pObject);
 
 	if (rv != CKR_OK) {
 		FUNC_RETURNS(rv);
 	}
 
-	if (pObject->C_DecryptUpdate != NULL) {
-		rv = pObject->C_DecryptUpdate(pObject, pSession->activeMechanism, pEncryptedPart, ulEncryptedPartLen, pPart, pulPartLen);
+	if (pSession->cipherChain) {
+		rv = cipherChainUpdate(pSession, pObject, mech, FALSE, pEncryptedPart, ulEncryptedPartLen, pPart, pulPartLen);
+		if (rv == CKR_DEVICE_ERROR) {
+			releaseObject(pObject);
+			rv = handleDeviceError(hSession);
+			FUNC_FAILS(rv, "Device error reported");
+		}
+	} else if (pObject->C_DecryptUpdate != NULL) {
+		rv = pObject->C_DecryptUpdate(pObject, mech, pEncryptedPart, ulEncryptedPartLen, pPart, pulPartLen);
 		if (rv == CKR_DEVICE_ERROR) {
+			releaseObject(pObject);
 			rv = handleDeviceError(hSession);
 			FUNC_FAILS(rv, "Device error reported");
 		}
 	} else {
+		releaseObject(pObject);
 		FUNC_FAILS(CKR_FUNCTION_NOT_SUPPORTED, "Operation not supported by token");
 	}
 
+	releaseObject(pObject);
 	FUNC_RETURNS(rv);
 }
 
@@ -530,6 +702,8 @@ CK_DECLARE_FUNCTION(CK_RV, C_DecryptFinal)(
 	struct p11Object_t *pObject;
 	struct p11Slot_t *pSlot;
 	struct p11Session_t *pSession;
+	CK_OBJECT_HANDLE hKey;
+	CK_MECHANISM_TYPE mech;
 
 	FUNC_CALLED();
 
@@ -550,7 +724,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_DecryptFinal)(
 		FUNC_RETURNS(rv);
 	}
 
-	if (pSession->activeObjectHandle == CK_INVALID_HANDLE) {
+	if (getActiveOperation(pSession, &hKey, &mech) != CKR_OK) {
 		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
 	}
 
@@ -560,27 +734,38 @@ CK_DECLARE_FUNCTION(CK_RV, C_DecryptFinal)(
 		FUNC_RETURNS(rv);
 	}
 
-	rv = findSlotKey(pSlot, pSession->activeObjectHandle, &pObject);
+	rv = findSlotKey(pSlot, hKey, &pObject);
 
 	if (rv != CKR_OK) {
 		FUNC_RETURNS(rv);
 	}
 
-	if (pObject->C_DecryptFinal != NULL) {
-		rv = pObject->C_DecryptFinal(pObject, pSession->activeMechanism, pLastPart, pulLastPartLen);
+	if (pSession->cipherChain) {
+		if (pSession->chainBlockLen) {
+			endActiveOperation(pSession, FALSE);
+			releaseObject(pObject);
+			FUNC_FAILS(CKR_ENCRYPTED_DATA_LEN_RANGE, "Cryptogram must be a multiple of the block size");
+		}
+		*pulLastPartLen = 0;
+		rv = CKR_OK;
+	} else if (pObject->C_DecryptFinal != NULL) {
+		rv = pObject->C_DecryptFinal(pObject, mech, pLastPart, pulLastPartLen);
 		if (rv == CKR_DEVICE_ERROR) {
+			releaseObject(pObject);
 			rv = handleDeviceError(hSession);
 			FUNC_FAILS(rv, "Device error reported");
 		}
 	} else {
+		releaseObject(pObject);
 		FUNC_FAILS(CKR_FUNCTION_NOT_SUPPORTED, "Operation not supported by token");
 	}
 
 	if (!rv) {
-		pSession->activeObjectHandle = CK_INVALID_HANDLE;
+		endActiveOperation(pSession, FALSE);
 		rv = CKR_OK;
 	}
 
+	releaseObject(pObject);
 	FUNC_RETURNS(rv);
 }
 
@@ -800,19 +985,21 @@ CK_DECLARE_FUNCTION(CK_RV, C_SignInit)(
 	if (pObject->C_SignInit != NULL) {
 		rv = pObject->C_SignInit(pObject, pMechanism);
 		if (rv == CKR_DEVICE_ERROR) {
+			releaseObject(pObject);
 			rv = handleDeviceError(hSession);
 			FUNC_FAILS(rv, "Device error reported");
 		}
 	} else {
+		releaseObject(pObject);
 		FUNC_FAILS(CKR_FUNCTION_NOT_SUPPORTED, "Operation not supported by token");
 	}
 
 	if (!rv) {
-		pSession->activeObjectHandle = pObject->handle;
-		pSession->activeMechanism = pMechanism->mechanism;
+		setActiveOperation(pSession, pObject->handle, pMechanism->mechanism);
 		rv = CKR_OK;
 	}
 
+	releaseObject(pObject);
 	FUNC_RETURNS(rv);
 }
 
@@ -831,6 +1018,8 @@ CK_DECLARE_FUNCTION(CK_RV, C_Sign)(
 	struct p11Object_t *pObject;
 	struct p11Slot_t *pSlot;
 	struct p11Session_t *pSession;
+	CK_OBJECT_HANDLE hKey;
+	CK_MECHANISM_TYPE mech;
 
 	FUNC_CALLED();
 
@@ -856,7 +1045,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_Sign)(
 		FUNC_RETURNS(rv);
 	}
 
-	if (pSession->activeObjectHandle == CK_INVALID_HANDLE) {
+	if (getActiveOperation(pSession, &hKey, &mech) != CKR_OK) {
 		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
 	}
 
@@ -866,32 +1055,93 @@ CK_DECLARE_FUNCTION(CK_RV, C_Sign)(
 		FUNC_RETURNS(rv);
 	}
 
-	rv = findSlotKey(pSlot, pSession->activeObjectHandle, &pObject);
+	rv = findSlotKey(pSlot, hKey, &pObject);
 
 	if (rv != CKR_OK) {
 		FUNC_RETURNS(rv);
 	}
 
 	if (pObject->C_Sign != NULL) {
-		rv = pObject->C_Sign(pObject, pSession->activeMechanism, pData, ulDataLen, pSignature, pulSignatureLen);
+		rv = pObject->C_Sign(pObject, mech, pData, ulDataLen, pSignature, pulSignatureLen);
 
 		if ((pSignature != NULL) && (rv != CKR_BUFFER_TOO_SMALL)) {
-			pSession->activeObjectHandle = CK_INVALID_HANDLE;
+			endActiveOperation(pSession, FALSE);
 		}
 
 		if (rv == CKR_DEVICE_ERROR) {
+			releaseObject(pObject);
 			rv = handleDeviceError(hSession);
 			FUNC_FAILS(rv, "Device error reported");
 		}
 	} else {
+		releaseObject(pObject);
 		FUNC_FAILS(CKR_FUNCTION_NOT_SUPPORTED, "Operation not supported by token");
 	}
 
+	releaseObject(pObject);
 	FUNC_RETURNS(rv);
 }
 
 
 
+/**
+ * Collect the data of a multi-part signature for tokens without C_SignUpdate
+ *
+ * If the mechanism hashes the input and the key can sign a hash with the matching raw
+ * mechanism, then the data is hashed on the host and only the hash is sent to the token.
+ * Otherwise the data is collected in the crypto buffer and signed in C_SignFinal.
+ */
+static CK_RV collectSignInput(struct p11Session_t *pSession, struct p11Object_t *pObject, CK_MECHANISM_TYPE mech, CK_BYTE_PTR pPart, CK_ULONG ulPartLen)
+{
+#ifdef ENABLE_LIBCRYPTO
+	CK_MECHANISM rawMech = { 0, NULL, 0 };
+	void *ctx;
+
+	if ((pSession->hashContext == NULL) && (pSession->cryptoBufferSize == 0) && (pObject->C_SignInit != NULL) &&
+		(cryptoSignHashInit(mech, &rawMech.mechanism, &ctx) == CKR_OK)) {
+		if ((pObject->C_SignInit(pObject, &rawMech) != CKR_OK) ||
+			(setHashContext(pSession, ctx, rawMech.mechanism) != CKR_OK)) {
+			cryptoSignHashFree(ctx);
+		}
+	}
+
+	if (pSession->hashContext != NULL) {
+		return cryptoSignHashUpdate(pSession->hashContext, pPart, ulPartLen);
+	}
+#endif
+
+	return appendToCryptoBuffer(pSession, pPart, ulPartLen);
+}
+
+
+
+/**
+ * Sign the data collected by collectSignInput()
+ */
+static CK_RV signCollectedInput(struct p11Session_t *pSession, struct p11Object_t *pObject, CK_MECHANISM_TYPE mech, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen)
+{
+#ifdef ENABLE_LIBCRYPTO
+	unsigned char hash[128];
+	CK_ULONG hashLen;
+	CK_RV rv;
+
+	if (pSession->hashContext != NULL) {
+		hashLen = sizeof(hash);
+		rv = cryptoSignHashFinal(pSession->hashContext, pSession->hashMechanism, hash, &hashLen);
+
+		if (rv == CKR_OK) {
+			rv = pObject->C_Sign(pObject, pSession->hashMechanism, hash, hashLen, pSignature, pulSignatureLen);
+		}
+
+		return rv;
+	}
+#endif
+
+	return pObject->C_Sign(pObject, mech, pSession->cryptoBuffer, pSession->cryptoBufferSize, pSignature, pulSignatureLen);
+}
+
+
+
 /*  C_SignUpdate continues a multiple-part signature operation,
     processing another data part. */
 CK_DECLARE_FUNCTION(CK_RV, C_SignUpdate)(
@@ -904,6 +1154,8 @@ CK_DECLARE_FUNCTION(CK_RV, C_SignUpdate)(
 	struct p11Object_t *pObject;
 	struct p11Slot_t *pSlot;
 	struct p11Session_t *pSession;
+	CK_OBJECT_HANDLE hKey;
+	CK_MECHANISM_TYPE mech;
 
 	FUNC_CALLED();
 
@@ -921,7 +1173,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_SignUpdate)(
 		FUNC_RETURNS(rv);
 	}
 
-	if (pSession->activeObjectHandle == CK_INVALID_HANDLE) {
+	if (getActiveOperation(pSession, &hKey, &mech) != CKR_OK) {
 		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
 	}
 
@@ -931,22 +1183,24 @@ CK_DECLARE_FUNCTION(CK_RV, C_SignUpdate)(
 		FUNC_RETURNS(rv);
 	}
 
-	rv = findSlotKey(pSlot, pSession->activeObjectHandle, &pObject);
+	rv = findSlotKey(pSlot, hKey, &pObject);
 
 	if (rv != CKR_OK) {
 		FUNC_RETURNS(rv);
 	}
 
 	if (pObject->C_SignUpdate != NULL) {
-		rv = pObject->C_SignUpdate(pObject, pSession->activeMechanism, pPart, ulPartLen);
+		rv = pObject->C_SignUpdate(pObject, mech, pPart, ulPartLen);
 		if (rv == CKR_DEVICE_ERROR) {
+			releaseObject(pObject);
 			rv = handleDeviceError(hSession);
 			FUNC_FAILS(rv, "Device error reported");
 		}
 	} else {
-		rv = appendToCryptoBuffer(pSession, pPart, ulPartLen);
+		rv = collectSignInput(pSession, pObject, mech, pPart, ulPartLen);
 	}
 
+	releaseObject(pObject);
 	FUNC_RETURNS(rv);
 }
 
@@ -963,6 +1217,8 @@ CK_DECLARE_FUNCTION(CK_RV, C_SignFinal)(
 	struct p11Object_t *pObject;
 	struct p11Slot_t *pSlot;
 	struct p11Session_t *pSession;
+	CK_OBJECT_HANDLE hKey;
+	CK_MECHANISM_TYPE mech;
 
 	FUNC_CALLED();
 
@@ -984,7 +1240,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_SignFinal)(
 		FUNC_RETURNS(rv);
 	}
 
-	if (pSession->activeObjectHandle == CK_INVALID_HANDLE) {
+	if (getActiveOperation(pSession, &hKey, &mech) != CKR_OK) {
 		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
 	}
 
@@ -994,42 +1250,44 @@ CK_DECLARE_FUNCTION(CK_RV, C_SignFinal)(
 		FUNC_RETURNS(rv);
 	}
 
-	rv = findSlotKey(pSlot, pSession->activeObjectHandle, &pObject);
+	rv = findSlotKey(pSlot, hKey, &pObject);
 
 	if (rv != CKR_OK) {
 		FUNC_RETURNS(rv);
 	}
 
 	if (pObject->C_SignFinal != NULL) {
-		rv = pObject->C_SignFinal(pObject, pSession->activeMechanism, pSignature, pulSignatureLen);
+		rv = pObject->C_SignFinal(pObject, mech, pSignature, pulSignatureLen);
 
 		if ((pSignature != NULL) && (rv != CKR_BUFFER_TOO_SMALL)) {
-			pSession->activeObjectHandle = CK_INVALID_HANDLE;
-			clearCryptoBuffer(pSession);
+			endActiveOperation(pSession, TRUE);
 		}
 
 		if (rv == CKR_DEVICE_ERROR) {
+			releaseObject(pObject);
 			rv = handleDeviceError(hSession);
 			FUNC_FAILS(rv, "Device error reported");
 		}
 	} else {
 		if (pObject->C_Sign != NULL) {
-			rv = pObject->C_Sign(pObject, pSession->activeMechanism, pSession->cryptoBuffer, pSession->cryptoBufferSize, pSignature, pulSignatureLen);
+			rv = signCollectedInput(pSession, pObject, mech, pSignature, pulSignatureLen);
 
 			if ((pSignature != NULL) && (rv != CKR_BUFFER_TOO_SMALL)) {
-				pSession->activeObjectHandle = CK_INVALID_HANDLE;
-				clearCryptoBuffer(pSession);
+				endActiveOperation(pSession, TRUE);
 			}
 
 			if (rv == CKR_DEVICE_ERROR) {
+				releaseObject(pObject);
 				rv = handleDeviceError(hSession);
 				FUNC_FAILS(rv, "Device error reported");
 			}
 		} else {
+			releaseObject(pObject);
 			FUNC_FAILS(CKR_FUNCTION_NOT_SUPPORTED, "Operation not supported by token");
 		}
 	}
 
+	releaseObject(pObject);
 	FUNC_RETURNS(rv);
 }
 
@@ -1121,14 +1379,15 @@ CK_DECLARE_FUNCTION(CK_RV, C_VerifyInit)(
 	if (pObject->C_VerifyInit != NULL) {
 		rv = pObject->C_VerifyInit(pObject, pMechanism);
 	} else {
+		releaseObject(pObject);
 		FUNC_FAILS(CKR_FUNCTION_NOT_SUPPORTED, "Operation not supported");
 	}
 
 	if (rv == CKR_OK) {
-		pSession->activeObjectHandle = pObject->handle;
-		pSession->activeMechanism = pMechanism->mechanism;
+		setActiveOperation(pSession, pObject->handle, pMechanism->mechanism);
 	}
 
+	releaseObject(pObject);
 	FUNC_RETURNS(rv);
 }
 
@@ -1148,6 +1407,8 @@ CK_DECLARE_FUNCTION(CK_RV, C_Verify)(
 	struct p11Object_t *pObject;
 	struct p11Slot_t *pSlot;
 	struct p11Session_t *pSession;
+	CK_OBJECT_HANDLE hKey;
+	CK_MECHANISM_TYPE mech;
 
 	FUNC_CALLED();
 
@@ -1169,7 +1430,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_Verify)(
 		FUNC_RETURNS(rv);
 	}
 
-	if (pSession->activeObjectHandle == CK_INVALID_HANDLE) {
+	if (getActiveOperation(pSession, &hKey, &mech) != CKR_OK) {
 		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
 	}
 
@@ -1179,17 +1440,19 @@ CK_DECLARE_FUNCTION(CK_RV, C_Verify)(
 		FUNC_RETURNS(rv);
 	}
 
-	if ((findSessionObject(pSession, pSession->activeObjectHandle, &pObject) < 0) && (findObject(pSlot->token, pSession->activeObjectHandle, &pObject, TRUE) < 0)) {
+	if ((findSessionObject(pSession, hKey, &pObject) < 0) && (findObject(pSlot->token, hKey, &pObject, TRUE) < 0)) {
 		FUNC_FAILS(CKR_KEY_HANDLE_INVALID, "Can not find key for handle");
 	}
 
 	if (pObject->C_Verify != NULL) {
-		rv = pObject->C_Verify(pObject, pSession->activeMechanism, pData, ulDataLen, pSignature, ulSignatureLen);
-		pSession->activeObjectHandle = CK_INVALID_HANDLE;
+		rv = pObject->C_Verify(pObject, mech, pData, ulDataLen, pSignature, ulSignatureLen);
+		endActiveOperation(pSession, FALSE);
 	} else {
+		releaseObject(pObject);
 		FUNC_FAILS(CKR_FUNCTION_NOT_SUPPORTED, "Operation not supported");
 	}
 
+	releaseObject(pObject);
 	FUNC_RETURNS(rv);
 }
 
@@ -1207,6 +1470,8 @@ CK_DECLARE_FUNCTION(CK_RV, C_VerifyUpdate)(
 	struct p11Object_t *pObject;
 	struct p11Slot_t *pSlot;
 	struct p11Session_t *pSession;
+	CK_OBJECT_HANDLE hKey;
+	CK_MECHANISM_TYPE mech;
 
 	FUNC_CALLED();
 
@@ -1224,7 +1489,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_VerifyUpdate)(
 		FUNC_RETURNS(rv);
 	}
 
-	if (pSession->activeObjectHandle == CK_INVALID_HANDLE) {
+	if (getActiveOperation(pSession, &hKey, &mech) != CKR_OK) {
 		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
 	}
 
@@ -1234,16 +1499,17 @@ CK_DECLARE_FUNCTION(CK_RV, C_VerifyUpdate)(
 		FUNC_RETURNS(rv);
 	}
 
-	if ((findSessionObject(pSession, pSession->activeObjectHandle, &pObject) < 0) && (findObject(pSlot->token, pSession->activeObjectHandle, &pObject, TRUE) < 0)) {
+	if ((findSessionObject(pSession, hKey, &pObject) < 0) && (findObject(pSlot->token, hKey, &pObject, TRUE) < 0)) {
 		FUNC_FAILS(CKR_KEY_HANDLE_INVALID, "Can not find key for handle");
 	}
 
 	if (pObject->C_VerifyUpdate != NULL) {
-		rv = pObject->C_VerifyUpdate(pObject, pSession->activeMechanism, pPart, ulPartLen);
+		rv = pObject->C_VerifyUpdate(pObject, mech, pPart, ulPartLen);
 	} else {
 		rv = appendToCryptoBuffer(pSession, pPart, ulPartLen);
 	}
 
+	releaseObject(pObject);
 	FUNC_RETURNS(rv);
 }
 
@@ -1261,6 +1527,8 @@ CK_DECLARE_FUNCTION(CK_RV, C_VerifyFinal)(
 	struct p11Object_t *pObject;
 	struct p11Slot_t *pSlot;
 	struct p11Session_t *pSession;
+	CK_OBJECT_HANDLE hKey;
+	CK_MECHANISM_TYPE mech;
 
 	FUNC_CALLED();
 
@@ -1278,7 +1546,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_VerifyFinal)(
 		FUNC_RETURNS(rv);
 	}
 
-	if (pSession->activeObjectHandle == CK_INVALID_HANDLE) {
+	if (getActiveOperation(pSession, &hKey, &mech) != CKR_OK) {
 		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
 	}
 
@@ -1288,26 +1556,26 @@ CK_DECLARE_FUNCTION(CK_RV, C_VerifyFinal)(
 		FUNC_RETURNS(rv);
 	}
 
-	if ((findSessionObject(pSession, pSession->activeObjectHandle, &pObject) < 0) && (findObject(pSlot->token, pSession->activeObjectHandle, &pObject, TRUE) < 0)) {
+	if ((findSessionObject(pSession, hKey, &pObject) < 0) && (findObject(pSlot->token, hKey, &pObject, TRUE) < 0)) {
 		FUNC_FAILS(CKR_KEY_HANDLE_INVALID, "Can not find key for handle");
 	}
 
 	if (pObject->C_VerifyFinal != NULL) {
-		rv = pObject->C_VerifyFinal(pObject, pSession->activeMechanism, pSignature, ulSignatureLen);
+		rv = pObject->C_VerifyFinal(pObject, mech, pSignature, ulSignatureLen);
 
-		pSession->activeObjectHandle = CK_INVALID_HANDLE;
-		clearCryptoBuffer(pSession);
+		endActiveOperation(pSession, TRUE);
 	} else {
 		if (pObject->C_Verify != NULL) {
-			rv = pObject->C_Verify(pObject, pSession->activeMechanism, pSession->cryptoBuffer, pSession->cryptoBufferSize, pSignature, ulSignatureLen);
+			rv = pObject->C_Verify(pObject, mech, pSession->cryptoBuffer, pSession->cryptoBufferSize, pSignature, ulSignatureLen);
 
-			pSession->activeObjectHandle = CK_INVALID_HANDLE;
-			clearCryptoBuffer(pSession);
+			endActiveOperation(pSession, TRUE);
 		} else {
+			releaseObject(pObject);
 			FUNC_FAILS(CKR_FUNCTION_NOT_SUPPORTED, "Operation not supported");
 		}
 	}
 
+	releaseObject(pObject);
 	FUNC_RETURNS(rv);
 }
 
@@ -1750,12 +2018,19 @@ CK_DECLARE_FUNCTION(CK_RV, C_DeriveKey)(
 
 	if (pObject->C_DeriveKey != NULL) {
 		rv = pObject->C_DeriveKey(pObject, pMechanism, pTemplate, ulAttributeCount, &derivedKey);
+		releaseObject(pObject);
 	} else {
+		releaseObject(pObject);
 		FUNC_FAILS(CKR_FUNCTION_NOT_SUPPORTED, "Operation not supported by token");
 	}
 
 	if (!derivedKey->tokenObj) {
-		addSessionObject(pSession, derivedKey);
+		rv = addSessionObject(pSession, derivedKey);
+
+		if (rv != CKR_OK) {
+			freeObject(derivedKey);
+			FUNC_FAILS(rv, "Could not add session object");
+		}
 	}
 
 	*phKey = derivedKey->handle;
@@ -1825,7 +2100,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_GenerateRandom)(
 		return rv;
 	}
 
-	rv = generateTokenRandom(slot, pRandomData, ulRandomLen);
+	rv = generatePooledRandom(slot, pRandomData, ulRandomLen);
 
 	if (rv == CKR_DEVICE_ERROR) {
 		rv = handleDeviceError(hSession);
@@ -1871,3 +2146,51 @@ CK_DECLARE_FUNCTION(CK_RV, C_CancelFunction)(
 
 	FUNC_RETURNS(CKR_FUNCTION_NOT_PARALLEL);
 }
+
+
+
+/*  SC_VerifyBatch verifies a list of signatures, each with its own key and mechanism,
+    using a pool of worker threads. The result for each signature is returned in pResults.
+    The active operation of the session is not affected. Vendor extension, not in the
+    function list. */
+CK_DECLARE_FUNCTION(CK_RV, SC_VerifyBatch)(
+		CK_SESSION_HANDLE hSession,
+		SC_VERIFY_ITEM *pItems,
+		CK_ULONG ulCount,
+		CK_RV *pResults
+)
+{
+	int rv;
+	struct p11Slot_t *pSlot;
+	struct p11Session_t *pSession;
+
+	FUNC_CALLED();
+
+	if (context == NULL) {
+		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
+	}
+
+	if (ulCount == 0) {
+		FUNC_RETURNS(CKR_OK);
+	}
+
+	if (!isValidPtr(pItems) || !isValidPtr(pResults)) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+	}
+
+	rv = findSessionByHandle(&context->sessionPool, hSession, &pSession);
+
+	if (rv != CKR_OK) {
+		FUNC_RETURNS(rv);
+	}
+
+	rv = findSlot(&context->slotPool, pSession->slotID, &pSlot);
+
+	if (rv != CKR_OK) {
+		FUNC_RETURNS(rv);
+	}
+
+	verifyBatch(pSession, pSlot->token, pItems, ulCount, pResults);
+
+	FUNC_RETURNS(CKR_OK);
+}
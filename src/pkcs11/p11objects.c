@@ -57,7 +57,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_CreateObject)(
 		CK_OBJECT_HANDLE_PTR phObject
 )
 {
-	int rv = 0;
+	int rv = 0, rc;
 	struct p11Object_t *pObject;
 	struct p11Session_t *session;
 	struct p11Slot_t *slot;
@@ -176,7 +176,12 @@ CK_DECLARE_FUNCTION(CK_RV, C_CreateObject)(
 		#endif
 			}
 
-			addSessionObject(session, pObject);
+			rc = addSessionObject(session, pObject);
+
+			if (rc != CKR_OK) {
+				freeObject(pObject);
+				FUNC_FAILS(rc, "Could not add session object");
+			}
 
 		} else {
 			FUNC_FAILS(CKR_TEMPLATE_INCONSISTENT, "Creating session objects not supported");
@@ -262,11 +267,13 @@ CK_DECLARE_FUNCTION(CK_RV, C_DestroyObject)(
 		rv = destroyObject(slot, pObject);
 
 		if (rv != CKR_OK) {
+			releaseObject(pObject);
 			FUNC_FAILS(rv, "Can't destroy object on token");
 		}
 
 		/* remove the object from the list */
 		removeTokenObject(slot->token, hObject, pObject->publicObj);
+		releaseObject(pObject);
 
 		rv = synchronizeToken(slot, slot->token);
 
@@ -275,6 +282,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_DestroyObject)(
 		}
 	} else {
 		removeSessionObject(session, hObject);
+		releaseObject(pObject);
 	}
 
 	FUNC_RETURNS(CKR_OK);
@@ -340,6 +348,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetObjectSize)(
 
 	serializeObject(pObject, &tmp, &size);
 	free(tmp);
+	releaseObject(pObject);
 
 	*pulSize = size;
 
@@ -356,7 +365,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetAttributeValue)(
 		CK_ULONG ulCount
 )
 {
-	int rv;
+	int rv, sessionObject;
 	CK_ULONG i;
 	struct p11Object_t *pObject;
 	struct p11Session_t *session;
@@ -387,6 +396,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetAttributeValue)(
 	}
 
 	rv = findSessionObject(session, hObject, &pObject);
+	sessionObject = rv >= 0;
 
 	if (rv < 0) {
 		rv = findObject(slot->token, hObject, &pObject, TRUE);
@@ -411,14 +421,15 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetAttributeValue)(
 
 	rv = CKR_OK;
 
-	for (i = 0; i < ulCount; i++) {
-		attribute = pObject->attrList;
-
-		while (attribute && (attribute->attrData.type != pTemplate[i].type)) {
-			attribute = attribute->next;
-		}
+	// Attribute values are replaced by C_SetAttributeValue while holding the lock
+	if (sessionObject) {
+		p11LockMutex(session->mutex);
+	} else {
+		p11LockShared(slot->token->objectLock);
+	}
 
-		if (!attribute) {
+	for (i = 0; i < ulCount; i++) {
+		if (findAttribute(pObject, pTemplate[i].type, &attribute) < 0) {
 			pTemplate[i].ulValueLen = (CK_LONG) -1;
 			rv = CKR_ATTRIBUTE_TYPE_INVALID;
 			continue;
@@ -444,6 +455,14 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetAttributeValue)(
 		}
 	}
 
+	if (sessionObject) {
+		p11UnlockMutex(session->mutex);
+	} else {
+		p11UnlockShared(slot->token->objectLock);
+	}
+
+	releaseObject(pObject);
+
 	FUNC_RETURNS(rv);
 }
 
@@ -459,11 +478,12 @@ CK_DECLARE_FUNCTION(CK_RV, C_SetAttributeValue)(
 {
 	int rv;
 	CK_ULONG i;
-	struct p11Object_t *pObject, *tmp;
+	struct p11Object_t *pObject;
 	struct p11Session_t *session;
 	struct p11Slot_t *slot;
 	struct p11Attribute_t *attribute;
 	struct p11Token_t *token;
+	int sessionObject;
 
 	FUNC_CALLED();
 
@@ -493,6 +513,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_SetAttributeValue)(
 #endif
 
 	rv = findSessionObject(session, hObject, &pObject);
+	sessionObject = rv >= 0;
 
 	/* only session objects can be modified without user authentication */
 
@@ -516,24 +537,21 @@ CK_DECLARE_FUNCTION(CK_RV, C_SetAttributeValue)(
 		rv = getValidatedToken(slot, &token);
 
 		if (rv != CKR_OK) {
+			releaseObject(pObject);
 			FUNC_FAILS(rv, "Could not get validated token");
 		}
 
 		rv = setTokenObjectAttributes(slot, pObject, pTemplate, ulCount);
 
 		if ((rv != CKR_OK) && (rv != CKR_FUNCTION_NOT_SUPPORTED)) {
+			releaseObject(pObject);
 			FUNC_FAILS(rv, "Could not update attribute on token");
 		}
 	}
 
 	for (i = 0; i < ulCount; i++) {
-		attribute = pObject->attrList;
-
-		while (attribute && (attribute->attrData.type != pTemplate[i].type)) {
-			attribute = attribute->next;
-		}
-
-		if (!attribute) {
+		if (findAttribute(pObject, pTemplate[i].type, &attribute) < 0) {
+			releaseObject(pObject);
 			FUNC_FAILS(CKR_TEMPLATE_INCOMPLETE, "Attribute not found");
 		}
 
@@ -541,44 +559,47 @@ CK_DECLARE_FUNCTION(CK_RV, C_SetAttributeValue)(
 		if (pTemplate[i].type == CKA_PRIVATE) {
 			/* changed from TRUE to FALSE */
 			if ((*(CK_BBOOL *)pTemplate[i].pValue == CK_FALSE) && (*(CK_BBOOL *)attribute->attrData.pValue == CK_TRUE)) {
+				releaseObject(pObject);
 				return CKR_TEMPLATE_INCONSISTENT;
 			}
 
 			/* changed from FALSE to TRUE */
 			if ((*(CK_BBOOL *)pTemplate[i].pValue == CK_TRUE) && (*(CK_BBOOL *)attribute->attrData.pValue == CK_FALSE)) {
-				memcpy(attribute->attrData.pValue, pTemplate[i].pValue, pTemplate[i].ulValueLen);
-
-				tmp = (struct p11Object_t *)calloc(1, sizeof(struct p11Object_t));
-				if (tmp == NULL) {
-					FUNC_FAILS(CKR_HOST_MEMORY,"Out of memory");
+				if (sessionObject) {
+					p11LockMutex(session->mutex);
+					rv = setAttribute(pObject, &pTemplate[i]);
+					p11UnlockMutex(session->mutex);
+				} else {
+					/* remove the public object from the token and keep it as private object */
+					destroyObject(slot, pObject);
+					rv = moveObjectToPrivate(slot->token, pObject, &pTemplate[i]);
 				}
 
-				memcpy(tmp, pObject, sizeof(*pObject));
-
-				tmp->next = NULL;
-				tmp->publicObj = FALSE;
-				tmp->dirtyFlag = 1;
-
-				/* remove the public object */
-				destroyObject(slot, pObject);
-				removeObjectLeavingAttributes(slot->token, pObject->handle, TRUE);
-
-				/* insert new private object */
-				addObject(slot->token, tmp, FALSE);
+				if (rv != CKR_OK) {
+					releaseObject(pObject);
+					FUNC_FAILS(rv, "Could not make object private");
+				}
 			}
 		} else {
-			if (pTemplate[i].ulValueLen > attribute->attrData.ulValueLen) {
-				free(attribute->attrData.pValue);
-				attribute->attrData.pValue = malloc(pTemplate[i].ulValueLen);
+			if (sessionObject) {
+				p11LockMutex(session->mutex);
+				rv = setAttribute(pObject, &pTemplate[i]);
+				p11UnlockMutex(session->mutex);
+			} else {
+				rv = setObjectAttribute(slot->token, pObject, &pTemplate[i]);
 			}
 
-			attribute->attrData.ulValueLen = pTemplate[i].ulValueLen;
-			memcpy(attribute->attrData.pValue, pTemplate[i].pValue, pTemplate[i].ulValueLen);
+			if (rv != CKR_OK) {
+				releaseObject(pObject);
+				FUNC_FAILS(rv, "Could not update attribute");
+			}
 
 			pObject->dirtyFlag = 1;
 		}
 	}
 
+	releaseObject(pObject);
+
 	rv = synchronizeToken(slot, slot->token);
 
 	if (rv != CKR_OK) {
@@ -590,6 +611,65 @@ CK_DECLARE_FUNCTION(CK_RV, C_SetAttributeValue)(
 
 
 
+/**
+ * Add the token objects matching the search template to the search list of the session
+ *
+ * The caller must hold the object lock of the token and the session mutex.
+ *
+ * @param session   The session performing the search
+ * @param token     The token whose objects shall be searched
+ * @param pTemplate The search template
+ * @param ulCount   The number of attributes in the search template
+ * @param privateObjects Include private objects
+ */
+static void searchTokenObjects(struct p11Session_t *session, struct p11Token_t *token, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, int privateObjects)
+{
+	struct p11AttributeIndexKey_t *keys[2];
+	struct p11Object_t *pObject;
+	CK_ULONG i;
+	int k;
+
+	/* token objects listed under the value of the most selective indexed attribute */
+	keys[1] = NULL;
+	if (selectIndexedObjects(token, pTemplate, ulCount, &keys[0], privateObjects ? &keys[1] : NULL) >= 0) {
+		reserveSearchList(session, (keys[0] ? keys[0]->count : 0) + (keys[1] ? keys[1]->count : 0));
+		for (k = 0; k < 2; k++) {
+			for (i = 0; keys[k] && (i < keys[k]->count); i++) {
+				if (isMatchingObject(keys[k]->object[i], pTemplate, ulCount)) {
+					addObjectToSearchList(session, keys[k]->object[i]);
+				}
+			}
+		}
+		return;
+	}
+
+	/* public token objects */
+	reserveSearchList(session, token->numberOfTokenObjects);
+	pObject = token->tokenObjList;
+
+	while (pObject != NULL) {
+		if (isMatchingObject(pObject, pTemplate, ulCount)) {
+			addObjectToSearchList(session, pObject);
+		}
+		pObject = pObject->next;
+	}
+
+	/* private token objects */
+	if (privateObjects) {
+		reserveSearchList(session, token->numberOfPrivateTokenObjects);
+		pObject = token->tokenPrivObjList;
+
+		while (pObject != NULL) {
+			if (isMatchingObject(pObject, pTemplate, ulCount)) {
+				addObjectToSearchList(session, pObject);
+			}
+			pObject = pObject->next;
+		}
+	}
+}
+
+
+
 /*  C_FindObjectsInit initializes a search for token and session objects
     that match a template. */
 CK_DECLARE_FUNCTION(CK_RV, C_FindObjectsInit)(
@@ -598,13 +678,14 @@ CK_DECLARE_FUNCTION(CK_RV, C_FindObjectsInit)(
 		CK_ULONG ulCount
 )
 {
-	int rv;
+	int rv, privateObjects;
 	struct p11Object_t *pObject;
 	struct p11Session_t *session;
 	struct p11Slot_t *slot;
+	struct p11Token_t *token;
 	CK_STATE state;
 #ifdef DEBUG
-	int i;
+	CK_ULONG i;
 #endif
 
 	FUNC_CALLED();
@@ -631,16 +712,27 @@ CK_DECLARE_FUNCTION(CK_RV, C_FindObjectsInit)(
 
 #ifdef DEBUG
 	debug("Search Filter:\n");
-	for (i = 0; i < (int)ulCount; i++) {
+	for (i = 0; i < ulCount; i++) {
 		dumpAttribute(&pTemplate[i]);
 	}
 #endif
 
-	if (session->searchObj.searchList != NULL) {
-		C_FindObjectsFinal(hSession);
+	token = slot->token;
+	privateObjects = FALSE;
+
+	if (token) {
+		loadDeferredObjects(token, pTemplate, ulCount);
+		state = getSessionState(session, token);
+		privateObjects = (state == CKS_RW_USER_FUNCTIONS) || (state == CKS_RO_USER_FUNCTIONS);
+		p11LockShared(token->objectLock);
 	}
 
+	p11LockMutex(session->mutex);
+
+	clearSearchList(session);
+
 	/* session objects */
+	reserveSearchList(session, session->numberOfSessionObjects);
 	pObject = session->sessionObjList;
 
 	while (pObject != NULL) {
@@ -650,32 +742,14 @@ CK_DECLARE_FUNCTION(CK_RV, C_FindObjectsInit)(
 		pObject = pObject->next;
 	}
 
-	if (!slot->token) {
-		FUNC_RETURNS(rv);
+	if (token) {
+		searchTokenObjects(session, token, pTemplate, ulCount, privateObjects);
 	}
 
-	/* public token objects */
-	pObject = slot->token->tokenObjList;
+	p11UnlockMutex(session->mutex);
 
-	while (pObject != NULL) {
-		if (isMatchingObject(pObject, pTemplate, ulCount)) {
-			addObjectToSearchList(session, pObject);
-		}
-		pObject = pObject->next;
-	}
-
-	/* private token objects */
-	state = getSessionState(session, slot->token);
-	if ((state == CKS_RW_USER_FUNCTIONS) ||
-		(state == CKS_RO_USER_FUNCTIONS)) {
-		pObject = slot->token->tokenPrivObjList;
-
-		while (pObject != NULL) {
-			if (isMatchingObject(pObject, pTemplate, ulCount)) {
-				addObjectToSearchList(session, pObject);
-			}
-			pObject = pObject->next;
-		}
+	if (token) {
+		p11UnlockShared(token->objectLock);
 	}
 
 	FUNC_RETURNS(CKR_OK);
@@ -693,8 +767,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_FindObjects)(
 {
 	int rv;
 	struct p11Session_t *session;
-	struct p11Object_t *pObject;
-	int i = 0, cnt;
+	CK_ULONG cnt;
 
 	FUNC_CALLED();
 
@@ -716,43 +789,30 @@ CK_DECLARE_FUNCTION(CK_RV, C_FindObjects)(
 		FUNC_RETURNS(rv);
 	}
 
-	if (session->searchObj.objectsCollected == session->searchObj.searchNumOfObjects) {
-		*pulObjectCount = 0;
-#ifdef DEBUG
-		debug("No objects in left in search list\n");
-#endif
-		FUNC_RETURNS(CKR_OK);
-	}
+	p11LockMutex(session->mutex);
 
-	pObject = session->searchObj.searchList;
-
-	i = session->searchObj.objectsCollected;
 #ifdef DEBUG
-	debug("objectsCollected=%d\n", i);
+	debug("objectsCollected=%lu\n", session->searchObj.objectsCollected);
 #endif
 
-	while (i > 0) {
-		pObject = pObject->next;
-		i--;
-	}
-
 	cnt = session->searchObj.searchNumOfObjects - session->searchObj.objectsCollected;
-	if (cnt > (int)ulMaxObjectCount) {
+	if (cnt > ulMaxObjectCount) {
 		cnt = ulMaxObjectCount;
 	}
 
-	for (i = cnt; i > 0; i--) {
-		*phObject = pObject->handle;
-		phObject++;
-		pObject = pObject->next;
+	if (cnt > 0) {
+		memcpy(phObject, session->searchObj.searchList + session->searchObj.objectsCollected, cnt * sizeof(CK_OBJECT_HANDLE));
 	}
 
+	session->searchObj.objectsCollected += cnt;
+
+	p11UnlockMutex(session->mutex);
+
 #ifdef DEBUG
-	debug("*pulObjectCount=%d\n", cnt);
+	debug("*pulObjectCount=%lu\n", cnt);
 #endif
 
 	*pulObjectCount = cnt;
-	session->searchObj.objectsCollected += cnt;
 
 	FUNC_RETURNS(CKR_OK);
 }
@@ -779,7 +839,9 @@ CK_DECLARE_FUNCTION(CK_RV, C_FindObjectsFinal)(
 		FUNC_RETURNS(rv);
 	}
 
+	p11LockMutex(session->mutex);
 	clearSearchList(session);
+	p11UnlockMutex(session->mutex);
 
 	FUNC_RETURNS(CKR_OK);
 }
@@ -115,7 +115,12 @@ CK_DECLARE_FUNCTION(CK_RV, C_OpenSession)(
 	session->flags = flags;
 	session->activeObjectHandle = CK_INVALID_HANDLE;
 
-	addSession(&context->sessionPool, session);
+	rv = addSession(&context->sessionPool, session);
+
+	if (rv != CKR_OK) {
+		free(session);
+		FUNC_FAILS(rv, "Session table exhausted");
+	}
 
 	*phSession = session->handle;               /* we got a valid handle by calling addSession() */
 
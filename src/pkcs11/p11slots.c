@@ -38,6 +38,7 @@
 #include <pkcs11/slotpool.h>
 #include <pkcs11/slot.h>
 #include <pkcs11/token.h>
+#include <pkcs11/slot-statistics.h>
 #include <common/debug.h>
 
 extern struct p11Context_t *context;
@@ -82,7 +83,8 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetSlotList)(
 		FUNC_RETURNS(rv);
 	}
 
-	slot = context->slotPool.list;
+	// Discovery threads may still add slots, so the list is walked under the pool mutex
+	slot = getNextSlot(&context->slotPool, NULL);
 	i = 0;
 
 	while (slot != NULL) {
@@ -93,7 +95,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetSlotList)(
 			i++;
 		}
 
-		slot = slot->next;
+		slot = getNextSlot(&context->slotPool, slot);
 	}
 
 	if (pSlotList) {
@@ -486,3 +488,37 @@ CK_DECLARE_FUNCTION(CK_RV, C_SetPIN)(
 
 	FUNC_RETURNS(rv);
 }
+
+
+
+/*  SC_GetAPDUStatistics obtains the counters and latency histogram for APDUs
+    exchanged with the card in a slot. Vendor extension, not in the function list. */
+CK_DECLARE_FUNCTION(CK_RV, SC_GetAPDUStatistics)(
+		CK_SLOT_ID slotID,
+		CK_ULONG ins,
+		SC_APDU_STATISTICS *stats
+)
+{
+	struct p11Slot_t *slot;
+	int rv;
+
+	FUNC_CALLED();
+
+	if (context == NULL) {
+		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
+	}
+
+	if (!isValidPtr(stats)) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+	}
+
+	rv = findSlot(&context->slotPool, slotID, &slot);
+
+	if (rv != CKR_OK) {
+		FUNC_RETURNS(rv);
+	}
+
+	rv = getSlotStatistics(slot, ins, stats);
+
+	FUNC_RETURNS(rv);
+}
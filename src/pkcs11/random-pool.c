@@ -0,0 +1,559 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2020, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    random-pool.c
+ * @author  Andreas Schwier
+ * @brief   Random data served from card entropy buffered in the background
+ *
+ * With PKCS11_RANDOM_POOL set to a number of bytes, C_GenerateRandom() serves requests from a
+ * buffer kept for each slot. A background thread refills the buffer from the card in blocks
+ * once it has dropped below half, whenever no other thread is using the reader or the buffer
+ * is empty. Requests that exceed the buffered entropy are passed to the card.
+ *
+ * With PKCS11_RANDOM_DRBG set to a number of seconds, random data is instead produced by a
+ * CTR_DRBG as defined in NIST SP 800-90A for each slot, which is seeded from the buffered card
+ * entropy and reseeded after the given interval. This requires libcrypto.
+ *
+ * A child process created with fork() inherits the buffer and the DRBG state of the parent. Both
+ * are discarded in the child, so that the child never repeats the parent's output. The mutexes
+ * are held across fork(), so that the child does not inherit them or the reader locked by the
+ * refill thread, which does not exist in the child and is restarted with the first request.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+#include <common/atomic.h>
+#include <common/thread.h>
+#include <common/memset_s.h>
+
+#include <pkcs11/p11generic.h>
+#include <pkcs11/slot.h>
+#include <pkcs11/token.h>
+#include <pkcs11/random-pool.h>
+
+#ifdef ENABLE_LIBCRYPTO
+#include <pkcs11/crypto.h>
+#endif
+
+#ifdef DEBUG
+#include <common/debug.h>
+#endif
+
+#define DEFAULT_POOL_SIZE		4096
+#define MAX_POOL_SIZE			(1024 * 1024)
+#define REFILL_BLOCK_SIZE		1024
+#define REFILL_POLL_INTERVAL	20
+#define DRBG_RESEED_REQUESTS	(1L << 20)
+
+
+
+/**
+ * Entropy buffered for a slot
+ */
+struct random_pool {
+	struct p11Slot_t *slot;             // Slot providing the entropy
+	CK_VOID_PTR mutex;                  // Protect buffer and DRBG state
+	unsigned char *buffer;              // Entropy obtained from the card
+	size_t avail;                       // Bytes available in buffer
+	void *drbg;                         // CTR_DRBG seeded from buffer or NULL
+	unsigned long reseedDue;            // Ticks at which the DRBG must be reseeded
+	long requests;                      // DRBG requests since last reseed
+	struct random_pool *next;           // Next pool in list
+};
+
+
+
+static struct {
+	size_t size;                        // Size of the buffer for each slot
+	int reseedInterval;                 // Seconds between DRBG reseeds, 0 without DRBG
+	CK_VOID_PTR mutex;                  // Protect list
+	CK_VOID_PTR refillMutex;            // Held by the refill thread while using the reader
+	struct random_pool *volatile list;  // Pools created so far
+	THREAD thread;                      // Refilling the pools
+	volatile long enabled;              // Random data is served from the pools
+	volatile long running;              // Refill thread is running
+#ifndef _WIN32
+	volatile long restart;              // Refill thread must be restarted in a forked child
+	int forkHandler;                    // Fork handlers are registered
+	int forkLocked;                     // Mutexes were locked before fork()
+#endif
+} pools;
+
+
+
+/**
+ * Return the pool for the slot, which is created on first use
+ *
+ * @return the pool or NULL if the token can not generate random data
+ */
+static struct random_pool *getRandomPool(struct p11Slot_t *slot)
+{
+	struct random_pool *pool;
+
+	pool = atomic_get_ptr(&slot->randomPool);
+	if (pool != NULL)
+		return pool;
+
+	if ((slot->token == NULL) || (slot->token->drv->C_GenerateRandom == NULL))
+		return NULL;
+
+	p11LockMutex(pools.mutex);
+
+	pool = atomic_get_ptr(&slot->randomPool);
+	if (pool == NULL) {
+		pool = (struct random_pool *)calloc(1, sizeof(struct random_pool));
+
+		if (pool != NULL) {
+			pool->buffer = (unsigned char *)malloc(pools.size);
+
+			if ((pool->buffer == NULL) || (p11CreateMutex(&pool->mutex) != CKR_OK)) {
+				free(pool->buffer);
+				free(pool);
+				pool = NULL;
+			} else {
+				pool->slot = slot;
+				pool->next = pools.list;
+				pools.list = pool;
+				// Publish only the fully initialized pool to the unlocked fast path
+				atomic_cas_ptr(&slot->randomPool, NULL, pool);
+			}
+		}
+	}
+
+	p11UnlockMutex(pools.mutex);
+
+	return pool;
+}
+
+
+
+/**
+ * Take entropy from the end of the buffer, which must hold at least len bytes
+ */
+static void takeEntropy(struct random_pool *pool, unsigned char *out, size_t len)
+{
+	pool->avail -= len;
+	memcpy(out, pool->buffer + pool->avail, len);
+	memset_s(pool->buffer + pool->avail, len, 0, len);
+}
+
+
+
+static int isSlotIdle(struct p11Slot_t *slot)
+{
+	if (slot->primarySlot)
+		slot = slot->primarySlot;
+
+	return (slot->queue == NULL) || (ticket_lock_pending(slot->queue) == 0);
+}
+
+
+
+/**
+ * Refill the buffer of the pool from the card, if it has dropped below half of its size
+ *
+ * Blocks are only requested while the reader is idle or the buffer is empty, so that
+ * refilling does not delay the commands of other threads. The token is referenced and
+ * revalidated while holding the reader, as it may be removed by another thread.
+ */
+static void refillPool(struct random_pool *pool)
+{
+	struct p11Token_t *token;
+	unsigned char block[REFILL_BLOCK_SIZE];
+	size_t avail, len;
+	int rc;
+
+	p11LockMutex(pool->mutex);
+	avail = pool->avail;
+	p11UnlockMutex(pool->mutex);
+
+	len = avail < pools.size / 2 ? pools.size - avail : 0;
+
+	while ((len > 0) && atomic_get(&pools.running)) {
+		if ((avail > 0) && !isSlotIdle(pool->slot))
+			break;
+
+		if (getTokenReference(pool->slot, &token) != CKR_OK)
+			break;
+
+		if (len > sizeof(block))
+			len = sizeof(block);
+
+		p11LockMutex(pools.refillMutex);
+		acquireSlot(pool->slot);
+
+		if ((pool->slot->token != token) || (token->drv->C_GenerateRandom == NULL)) {
+			rc = CKR_TOKEN_NOT_PRESENT;
+		} else {
+			rc = token->drv->C_GenerateRandom(pool->slot, block, (CK_ULONG)len);
+		}
+
+		releaseSlot(pool->slot);
+		p11UnlockMutex(pools.refillMutex);
+		releaseTokenReference(pool->slot);
+
+		if (rc != CKR_OK) {
+#ifdef DEBUG
+			debug("Refilling random pool for slot %lu failed with rc=%d\n", pool->slot->id, rc);
+#endif
+			break;
+		}
+
+		p11LockMutex(pool->mutex);
+		if (len > pools.size - pool->avail)
+			len = pools.size - pool->avail;
+		memcpy(pool->buffer + pool->avail, block, len);
+		pool->avail += len;
+		avail = pool->avail;
+		p11UnlockMutex(pool->mutex);
+
+		len = pools.size - avail;
+	}
+
+	memset_s(block, sizeof(block), 0, sizeof(block));
+}
+
+
+
+static void randomPoolRefiller(void *arg)
+{
+	struct random_pool *pool;
+
+	while (atomic_get(&pools.running)) {
+		thread_sleep(REFILL_POLL_INTERVAL);
+
+		p11LockMutex(pools.mutex);
+		pool = pools.list;
+		p11UnlockMutex(pools.mutex);
+
+		// Pools are only added to the head of the list and released after the thread terminated
+		for (; pool != NULL; pool = pool->next)
+			refillPool(pool);
+	}
+}
+
+
+
+#ifndef _WIN32
+/**
+ * Start the refill thread in a forked child, which only inherits the thread that called fork()
+ */
+static void restartRefiller()
+{
+	p11LockMutex(pools.mutex);
+
+	if (atomic_get(&pools.restart)) {
+		atomic_set(&pools.restart, 0);
+		atomic_set(&pools.running, 1);
+
+		if (thread_create(&pools.thread, randomPoolRefiller, NULL) != 0) {
+#ifdef DEBUG
+			debug("Could not restart random pool thread\n");
+#endif
+			atomic_set(&pools.running, 0);
+		}
+	}
+
+	p11UnlockMutex(pools.mutex);
+}
+
+
+
+/**
+ * Lock all mutexes before fork(), so that the refill thread neither holds them nor the reader
+ * while the process is copied
+ */
+static void prepareFork()
+{
+	struct random_pool *pool;
+
+	pools.forkLocked = atomic_get(&pools.enabled) != 0;
+	if (!pools.forkLocked)
+		return;
+
+	p11LockMutex(pools.refillMutex);
+	p11LockMutex(pools.mutex);
+
+	for (pool = pools.list; pool != NULL; pool = pool->next)
+		p11LockMutex(pool->mutex);
+}
+
+
+
+static void releaseFork()
+{
+	struct random_pool *pool;
+
+	if (!pools.forkLocked)
+		return;
+
+	for (pool = pools.list; pool != NULL; pool = pool->next)
+		p11UnlockMutex(pool->mutex);
+
+	p11UnlockMutex(pools.mutex);
+	p11UnlockMutex(pools.refillMutex);
+}
+
+
+
+/**
+ * Discard the buffered entropy and force a reseed of the DRBG in the child. The refill
+ * thread of the parent does not exist in the child, so it is restarted with the next request.
+ */
+static void childFork()
+{
+	struct random_pool *pool;
+
+	if (!pools.forkLocked)
+		return;
+
+	for (pool = pools.list; pool != NULL; pool = pool->next) {
+		memset_s(pool->buffer, pools.size, 0, pools.size);
+		pool->avail = 0;
+		pool->requests = DRBG_RESEED_REQUESTS;
+	}
+
+	if (atomic_get(&pools.running)) {
+		atomic_set(&pools.running, 0);
+		atomic_set(&pools.restart, 1);
+	}
+
+	releaseFork();
+}
+#endif
+
+
+
+#ifdef ENABLE_LIBCRYPTO
+/**
+ * Generate random data with the DRBG of the pool, which is (re)seeded with buffered entropy
+ * or, if the buffer holds not enough, with entropy read from the card
+ */
+static int generateDRBGRandom(struct random_pool *pool, CK_BYTE_PTR pRandomData, CK_ULONG ulRandomLen)
+{
+	unsigned char seed[CTR_DRBG_SEEDLEN];
+	int rv;
+
+	p11LockMutex(pool->mutex);
+
+	if ((pool->drbg == NULL) || ((long)(thread_ticks() - pool->reseedDue) >= 0) || (pool->requests >= DRBG_RESEED_REQUESTS)) {
+		if (pool->avail >= sizeof(seed)) {
+			takeEntropy(pool, seed, sizeof(seed));
+		} else {
+			p11UnlockMutex(pool->mutex);
+
+			rv = generateTokenRandom(pool->slot, seed, sizeof(seed));
+
+			if (rv != CKR_OK) {
+				return rv;
+			}
+
+			p11LockMutex(pool->mutex);
+		}
+
+		if (pool->drbg == NULL) {
+			rv = cryptoDRBGInstantiate(&pool->drbg, seed);
+		} else {
+			rv = cryptoDRBGReseed(pool->drbg, seed);
+		}
+
+		memset_s(seed, sizeof(seed), 0, sizeof(seed));
+
+		if (rv != CKR_OK) {
+			p11UnlockMutex(pool->mutex);
+			return rv;
+		}
+
+		pool->reseedDue = thread_ticks() + pools.reseedInterval * 1000UL;
+		pool->requests = 0;
+	}
+
+	rv = cryptoDRBGGenerate(pool->drbg, pRandomData, ulRandomLen);
+	pool->requests += (long)(ulRandomLen / CTR_DRBG_MAX_REQUEST) + 1;
+
+	p11UnlockMutex(pool->mutex);
+
+	return rv;
+}
+#endif
+
+
+
+/**
+ * Generate random data from the entropy buffered for the slot or with the token
+ *
+ * @param slot          The slot in which the token is inserted
+ * @param pRandomData   The buffer receiving random data
+ * @param ulRandomLen   The requested number of random bytes
+ * @return              CKR_OK or any other Cryptoki error code
+ */
+int generatePooledRandom(struct p11Slot_t *slot, CK_BYTE_PTR pRandomData, CK_ULONG ulRandomLen)
+{
+	struct random_pool *pool;
+
+	if (!atomic_get(&pools.enabled) || ((pool = getRandomPool(slot)) == NULL))
+		return generateTokenRandom(slot, pRandomData, ulRandomLen);
+
+#ifndef _WIN32
+	if (atomic_get(&pools.restart))
+		restartRefiller();
+#endif
+
+#ifdef ENABLE_LIBCRYPTO
+	if (pools.reseedInterval > 0)
+		return generateDRBGRandom(pool, pRandomData, ulRandomLen);
+#endif
+
+	p11LockMutex(pool->mutex);
+
+	if (pool->avail >= ulRandomLen) {
+		takeEntropy(pool, pRandomData, ulRandomLen);
+		p11UnlockMutex(pool->mutex);
+		return CKR_OK;
+	}
+
+	p11UnlockMutex(pool->mutex);
+
+	return generateTokenRandom(slot, pRandomData, ulRandomLen);
+}
+
+
+
+/**
+ * Enable the random pools and start the thread refilling them, if requested with
+ * PKCS11_RANDOM_POOL or PKCS11_RANDOM_DRBG
+ *
+ * Without background threads the DRBG is seeded directly from the card.
+ */
+void startRandomPool()
+{
+	char *po;
+	long size;
+
+	if (atomic_get(&pools.enabled))
+		return;
+
+	po = getenv("PKCS11_RANDOM_POOL");
+	size = po ? atol(po) : 0;
+
+	pools.reseedInterval = 0;
+#ifdef ENABLE_LIBCRYPTO
+	po = getenv("PKCS11_RANDOM_DRBG");
+	pools.reseedInterval = po ? atoi(po) : 0;
+
+	if ((pools.reseedInterval > 0) && (size <= 0))
+		size = DEFAULT_POOL_SIZE;
+#endif
+
+	if ((size <= 0) || (!p11CanCreateThreads() && (pools.reseedInterval <= 0)))
+		return;
+
+	if (size < REFILL_BLOCK_SIZE)
+		size = REFILL_BLOCK_SIZE;
+
+	if (size > MAX_POOL_SIZE)
+		size = MAX_POOL_SIZE;
+
+	pools.size = (size_t)size;
+	pools.list = NULL;
+
+	if (p11CreateMutex(&pools.mutex) != CKR_OK)
+		return;
+
+	if (p11CreateMutex(&pools.refillMutex) != CKR_OK) {
+		p11DestroyMutex(pools.mutex);
+		return;
+	}
+
+	atomic_set(&pools.enabled, 1);
+
+#ifndef _WIN32
+	// Handlers can not be removed and remain registered for the next C_Initialize()
+	if (!pools.forkHandler && (pthread_atfork(prepareFork, releaseFork, childFork) == 0))
+		pools.forkHandler = 1;
+#endif
+
+	if (!p11CanCreateThreads())
+		return;
+
+	atomic_set(&pools.running, 1);
+
+	if (thread_create(&pools.thread, randomPoolRefiller, NULL) != 0) {
+#ifdef DEBUG
+		debug("Could not start random pool thread\n");
+#endif
+		atomic_set(&pools.running, 0);
+	}
+}
+
+
+
+/**
+ * Stop the refill thread and release the pools
+ *
+ * Must be called before the slots are released
+ */
+void stopRandomPool()
+{
+	struct random_pool *pool;
+
+	if (!atomic_get(&pools.enabled))
+		return;
+
+#ifndef _WIN32
+	atomic_set(&pools.restart, 0);
+#endif
+
+	if (atomic_get(&pools.running)) {
+		atomic_set(&pools.running, 0);
+		thread_join(&pools.thread);
+	}
+
+	while (pools.list != NULL) {
+		pool = pools.list;
+		pools.list = pool->next;
+
+		pool->slot->randomPool = NULL;
+		memset_s(pool->buffer, pools.size, 0, pools.size);
+		free(pool->buffer);
+#ifdef ENABLE_LIBCRYPTO
+		cryptoDRBGFree(pool->drbg);
+#endif
+		p11DestroyMutex(pool->mutex);
+		free(pool);
+	}
+
+	p11DestroyMutex(pools.refillMutex);
+	p11DestroyMutex(pools.mutex);
+	atomic_set(&pools.enabled, 0);
+}
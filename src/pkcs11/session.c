@@ -38,8 +38,17 @@
 #include <pkcs11/session.h>
 #include <pkcs11/slotpool.h>
 
+#include <common/atomic.h>
+
+#ifdef ENABLE_LIBCRYPTO
+#include <pkcs11/crypto.h>
+#endif
+
 extern struct p11Context_t *context;
 
+#define MIN_SESSION_ENTRIES	16
+
+
 
 /**
  * Initialize the session-pool structure
@@ -48,10 +57,13 @@ extern struct p11Context_t *context;
  */
 void initSessionPool(struct p11SessionPool_t *pool)
 {
-	pool->list = NULL;
-	pool->nextSessionHandle = 1;     /* Set initial value of session handles to 1 */
-	                                 /* Valid handles have a non-zero value       */
-	pool->numberOfSessions = 0;
+	int i;
+
+	memset(pool, 0, sizeof(*pool));
+
+	for (i = 0; i < SESSION_SHARDS; i++) {
+		p11CreateMutex(&pool->shard[i].mutex);
+	}
 }
 
 
@@ -63,14 +75,60 @@ void initSessionPool(struct p11SessionPool_t *pool)
  */
 void terminateSessionPool(struct p11SessionPool_t *pool)
 {
-	while(pool->list) {
-		if (removeSession(pool, pool->list->handle) != CKR_OK)
-			return;
+	struct p11SessionShard_t *shard;
+	CK_ULONG pos;
+	int i;
+
+	for (i = 0; i < SESSION_SHARDS; i++) {
+		shard = &pool->shard[i];
+
+		for (pos = 0; pos < shard->used; pos++) {
+			if (shard->entry[pos].session) {
+				if (removeSession(pool, shard->entry[pos].session->handle) != CKR_OK)
+					return;
+			}
+		}
+
+		if (shard->entry) {
+			free(shard->entry);
+			shard->entry = NULL;
+		}
+		shard->used = 0;
+		shard->size = 0;
+		shard->freeList = 0;
+
+		p11DestroyMutex(shard->mutex);
+		shard->mutex = NULL;
 	}
 }
 
 
 
+/**
+ * Locate the shard and entry addressed by a session handle
+ *
+ * @param pool       Pointer to session-pool structure
+ * @param handle     The handle of the session
+ * @param pos        Position of the entry in the shard
+ *
+ * @return the shard or NULL if the handle can not be valid
+ */
+static struct p11SessionShard_t *getShardForHandle(struct p11SessionPool_t *pool, CK_SESSION_HANDLE handle, CK_ULONG *pos)
+{
+	CK_ULONG index;
+
+	index = handle & SESSION_INDEX_MASK;
+
+	if (index == 0)
+		return NULL;
+
+	index--;
+	*pos = index / SESSION_SHARDS;
+	return &pool->shard[index % SESSION_SHARDS];
+}
+
+
+
 /**
  * Add a session to the session-pool
  *
@@ -78,23 +136,65 @@ void terminateSessionPool(struct p11SessionPool_t *pool)
  *
  * @param pool       Pointer to session-pool structure
  * @param session    Pointer to session structure
+ *
+ * @return CKR_OK or CKR_HOST_MEMORY
  */
-void addSession(struct p11SessionPool_t *pool, struct p11Session_t *session)
+int addSession(struct p11SessionPool_t *pool, struct p11Session_t *session)
 {
-	struct p11Session_t **pSession;
+	struct p11SessionShard_t *shard;
+	struct p11SessionEntry_t *entry;
+	CK_ULONG pos, size;
+	int shardNo;
+
+	if (p11CreateMutex(&session->mutex) != CKR_OK)
+		return CKR_HOST_MEMORY;
+
+	shardNo = (int)((CK_ULONG)atomic_inc(&pool->nextShard) % SESSION_SHARDS);
+	shard = &pool->shard[shardNo];
 
-	session->next = NULL;
+	p11LockMutex(shard->mutex);
 
-	p11LockMutex(context->mutex);
-	pSession = &pool->list;
-	while(*pSession)
-		pSession = &(*pSession)->next;
+	if (shard->freeList) {
+		pos = shard->freeList - 1;
+		shard->freeList = shard->entry[pos].nextFree;
+	} else {
+		if (shard->used >= shard->size) {
+			size = shard->size ? shard->size << 1 : MIN_SESSION_ENTRIES;
+
+			if (size > SESSION_INDEX_MASK / SESSION_SHARDS)
+				size = SESSION_INDEX_MASK / SESSION_SHARDS;
 
-	*pSession = session;
-	p11UnlockMutex(context->mutex);
+			if (shard->used >= size) {
+				p11UnlockMutex(shard->mutex);
+				p11DestroyMutex(session->mutex);
+				return CKR_HOST_MEMORY;
+			}
 
-	session->handle = pool->nextSessionHandle++;
-	pool->numberOfSessions++;
+			entry = (struct p11SessionEntry_t *)realloc(shard->entry, size * sizeof(struct p11SessionEntry_t));
+
+			if (entry == NULL) {
+				p11UnlockMutex(shard->mutex);
+				p11DestroyMutex(session->mutex);
+				return CKR_HOST_MEMORY;
+			}
+
+			memset(entry + shard->size, 0, (size - shard->size) * sizeof(struct p11SessionEntry_t));
+			shard->entry = entry;
+			shard->size = size;
+		}
+		pos = shard->used++;
+	}
+
+	entry = &shard->entry[pos];
+	entry->session = session;
+	entry->nextFree = 0;
+
+	session->handle = (entry->generation << SESSION_INDEX_BITS) | (pos * SESSION_SHARDS + shardNo + 1);
+	shard->numberOfSessions++;
+
+	p11UnlockMutex(shard->mutex);
+
+	return CKR_OK;
 }
 
 
@@ -102,37 +202,46 @@ void addSession(struct p11SessionPool_t *pool, struct p11Session_t *session)
 /**
  * Find a session in the session pool by it's slot handle
  *
+ * Only the shard addressed by the handle is locked, so lookups for sessions
+ * in different shards do not contend.
+ *
  * @param pool       Pointer to session pool structure.
  * @param handle     The handle of the session.
  * @param session    Pointer to session structure.
  *                   If the session is found, this pointer holds the specific session structure - otherwise NULL.
  *
- * @return CKR_OK or CKR_SESSION_HANDLE_INVALID
+ * @return CKR_OK, CKR_DEVICE_REMOVED or CKR_SESSION_HANDLE_INVALID
  */
 int findSessionByHandle(struct p11SessionPool_t *pool, CK_SESSION_HANDLE handle, struct p11Session_t **session)
 {
-	struct p11Session_t *psession;
+	struct p11SessionShard_t *shard;
+	struct p11SessionEntry_t *entry;
+	CK_ULONG pos;
+	int rc;
 
-	p11LockMutex(context->mutex);
-	psession = pool->list;
 	*session = NULL;
 
-	while (psession != NULL) {
-		if (psession->handle == handle) {
-			*session = psession;
-			if (psession->isRemoved) {
-				p11UnlockMutex(context->mutex);
-				return CKR_DEVICE_REMOVED;
-			}
-			p11UnlockMutex(context->mutex);
-			return CKR_OK;
-		}
+	shard = getShardForHandle(pool, handle, &pos);
+
+	if (shard == NULL)
+		return CKR_SESSION_HANDLE_INVALID;
+
+	rc = CKR_SESSION_HANDLE_INVALID;
 
-		psession = psession->next;
+	p11LockMutex(shard->mutex);
+
+	if (pos < shard->used) {
+		entry = &shard->entry[pos];
+
+		if (entry->session && (entry->generation == (handle >> SESSION_INDEX_BITS))) {
+			*session = entry->session;
+			rc = entry->session->isRemoved ? CKR_DEVICE_REMOVED : CKR_OK;
+		}
 	}
-	p11UnlockMutex(context->mutex);
 
-	return CKR_SESSION_HANDLE_INVALID;
+	p11UnlockMutex(shard->mutex);
+
+	return rc;
 }
 
 
@@ -160,30 +269,43 @@ int findSessionByHandle(struct p11SessionPool_t *pool, CK_SESSION_HANDLE handle,
  */
 int findSessionBySlotID(struct p11SessionPool_t *pool, CK_SLOT_ID slotID, struct p11Session_t **session)
 {
-	struct p11Session_t *psession;
-	int pos;
-
-	p11LockMutex(context->mutex);
-	psession = pool->list;
-	pos = 0;
-
-	while (psession != NULL) {
-		if (psession->slotID == slotID) {
-			*session = psession;
-			p11UnlockMutex(context->mutex);
-			return pos;
-		}
+	struct p11SessionShard_t *shard;
+	CK_ULONG pos;
+	int i;
 
-		psession = psession->next;
-		pos++;
+	*session = NULL;
+
+	for (i = 0; i < SESSION_SHARDS; i++) {
+		shard = &pool->shard[i];
+
+		p11LockMutex(shard->mutex);
+		for (pos = 0; pos < shard->used; pos++) {
+			if (shard->entry[pos].session && (shard->entry[pos].session->slotID == slotID)) {
+				*session = shard->entry[pos].session;
+				p11UnlockMutex(shard->mutex);
+				return (int)(pos * SESSION_SHARDS + i);
+			}
+		}
+		p11UnlockMutex(shard->mutex);
 	}
 
-	p11UnlockMutex(context->mutex);
 	return -1;
 }
 
 
 
+static void freeHashContext(struct p11Session_t *session)
+{
+#ifdef ENABLE_LIBCRYPTO
+	if (session->hashContext) {
+		cryptoSignHashFree(session->hashContext);
+		session->hashContext = NULL;
+	}
+#endif
+}
+
+
+
 /**
  * Remove a session from the session-pool
  *
@@ -196,24 +318,35 @@ int removeSession(struct p11SessionPool_t *pool, CK_SESSION_HANDLE handle)
 {
 	int rc;
 	struct p11Session_t *session;
-	struct p11Session_t **pSession;
+	struct p11SessionShard_t *shard;
+	struct p11SessionEntry_t *entry;
 	struct p11Slot_t *slot;
+	CK_ULONG pos;
 
-	p11LockMutex(context->mutex);
-	pSession = &pool->list;
-	while (*pSession && (*pSession)->handle != handle) {
-		pSession = &((*pSession)->next);
-	}
+	shard = getShardForHandle(pool, handle, &pos);
 
-	session = *pSession;
+	if (shard == NULL)
+		return CKR_SESSION_HANDLE_INVALID;
+
+	p11LockMutex(shard->mutex);
+
+	entry = pos < shard->used ? &shard->entry[pos] : NULL;
 
-	if (!session) {
-		p11UnlockMutex(context->mutex);
+	if (!entry || !entry->session || (entry->generation != (handle >> SESSION_INDEX_BITS))) {
+		p11UnlockMutex(shard->mutex);
 		return CKR_SESSION_HANDLE_INVALID;
 	}
 
-	*pSession = session->next;
-	p11UnlockMutex(context->mutex);
+	session = entry->session;
+
+	/* Retire the handle before the entry is reused */
+	entry->session = NULL;
+	entry->generation = (entry->generation + 1) & (~0UL >> SESSION_INDEX_BITS);
+	entry->nextFree = shard->freeList;
+	shard->freeList = pos + 1;
+	shard->numberOfSessions--;
+
+	p11UnlockMutex(shard->mutex);
 
 	rc = findSlot(&context->slotPool, session->slotID, &slot);
 
@@ -223,12 +356,15 @@ int removeSession(struct p11SessionPool_t *pool, CK_SESSION_HANDLE handle)
 		}
 	}
 
-	clearSearchList(session);
+	if (session->searchObj.searchList) {
+		free(session->searchObj.searchList);
+	}
 
 	while(session->sessionObjList) {
 		if (removeSessionObject(session, session->sessionObjList->handle) != CKR_OK)
 			return CKR_GENERAL_ERROR;
 	}
+	freeObjectIndex(&session->sessionObjIndex);
 
 	if (session->cryptoBuffer) {
 		free(session->cryptoBuffer);
@@ -237,9 +373,10 @@ int removeSession(struct p11SessionPool_t *pool, CK_SESSION_HANDLE handle)
 		session->cryptoBufferSize = 0;
 	}
 
-	free(session);
+	freeHashContext(session);
 
-	pool->numberOfSessions--;
+	p11DestroyMutex(session->mutex);
+	free(session);
 
 	return CKR_OK;
 }
@@ -254,16 +391,29 @@ int removeSession(struct p11SessionPool_t *pool, CK_SESSION_HANDLE handle)
  */
 void closeSessionsForSlot(struct p11SessionPool_t *pool, CK_SLOT_ID slotID)
 {
-	struct p11Session_t *session;
-
-	session = pool->list;
+	struct p11SessionShard_t *shard;
+	CK_SESSION_HANDLE handle;
+	CK_ULONG pos;
+	int i;
+
+	for (i = 0; i < SESSION_SHARDS; i++) {
+		shard = &pool->shard[i];
+
+		for (pos = 0; ; pos++) {
+			p11LockMutex(shard->mutex);
+			if (pos >= shard->used) {
+				p11UnlockMutex(shard->mutex);
+				break;
+			}
+			handle = 0;
+			if (shard->entry[pos].session && (shard->entry[pos].session->slotID == slotID)) {
+				handle = shard->entry[pos].session->handle;
+			}
+			p11UnlockMutex(shard->mutex);
 
-	while (session != NULL) {
-		if (session->slotID == slotID) {
-			removeSession(pool, session->handle);
-			session = pool->list;
-		} else {
-			session = session->next;
+			if (handle) {
+				removeSession(pool, handle);
+			}
 		}
 	}
 }
@@ -274,20 +424,28 @@ void closeSessionsForSlot(struct p11SessionPool_t *pool, CK_SLOT_ID slotID)
  * Mark all sessions closing for a slot. This will make the session unusable but will not yet
  * remove them from memory.
  *
+ * The flag is set while holding the shard lock, so that any lookup completing afterwards
+ * reports CKR_DEVICE_REMOVED.
+ *
  * @param pool       Pointer to session-pool structure
  * @param slotID     The slot ID
  */
 void tokenRemovedForSessionsOnSlot(struct p11SessionPool_t *pool, CK_SLOT_ID slotID)
 {
-	struct p11Session_t *session;
+	struct p11SessionShard_t *shard;
+	CK_ULONG pos;
+	int i;
 
-	session = pool->list;
+	for (i = 0; i < SESSION_SHARDS; i++) {
+		shard = &pool->shard[i];
 
-	while (session != NULL) {
-		if (session->slotID == slotID) {
-			session->isRemoved = 1;
+		p11LockMutex(shard->mutex);
+		for (pos = 0; pos < shard->used; pos++) {
+			if (shard->entry[pos].session && (shard->entry[pos].session->slotID == slotID)) {
+				shard->entry[pos].session->isRemoved = 1;
+			}
 		}
-		session = session->next;
+		p11UnlockMutex(shard->mutex);
 	}
 }
 
@@ -325,11 +483,19 @@ CK_STATE getSessionState(struct p11Session_t *session, struct p11Token_t *token)
 /**
  * Add an object to the list of session objects
  *
+ * The object is only linked into the list if it could be added to the index. If not, the object
+ * remains owned by the caller.
+ *
  * @param session    the session
  * @param object     the object to add
+ * @return           CKR_OK or CKR_HOST_MEMORY
  */
-void addSessionObject(struct p11Session_t *session, struct p11Object_t *object)
+int addSessionObject(struct p11Session_t *session, struct p11Object_t *object)
 {
+	int rc;
+
+	p11LockMutex(session->mutex);
+
 	if (session->freeSessionObjNumber == 0) {
 		session->freeSessionObjNumber = 0xA000;
 	}
@@ -337,35 +503,35 @@ void addSessionObject(struct p11Session_t *session, struct p11Object_t *object)
 	object->handle = session->freeSessionObjNumber++;
 	object->dirtyFlag = 0;
 
-	addObjectToList(&session->sessionObjList, object);
+	rc = addObjectToIndex(&session->sessionObjIndex, object);
+
+	if (rc == CKR_OK) {
+		object->refCount = 1;
+		addObjectToList(&session->sessionObjList, object);
+		session->numberOfSessionObjects++;
+	}
+
+	p11UnlockMutex(session->mutex);
 
-	session->numberOfSessionObjects++;
+	return rc;
 }
 
 
 
 /**
  * Find a session object by it's handle
+ *
+ * The reference must be released with releaseObject().
  */
 int findSessionObject(struct p11Session_t *session, CK_OBJECT_HANDLE handle, struct p11Object_t **object)
 {
-	struct p11Object_t *obj;
-	int pos = 0;            /* remember the current position in the list */
-
-	obj = session->sessionObjList;
-	*object = NULL;
-
-	while (obj != NULL) {
-		if (obj->handle == handle) {
-			*object = obj;
-			return pos;
-		}
+	p11LockMutex(session->mutex);
+	*object = findObjectInIndex(session->sessionObjIndex, handle);
+	if (*object != NULL)
+		atomic_inc(&(*object)->refCount);
+	p11UnlockMutex(session->mutex);
 
-		obj = obj->next;
-		pos++;
-	}
-
-	return -1;
+	return *object ? 0 : -1;
 }
 
 
@@ -377,51 +543,66 @@ int removeSessionObject(struct p11Session_t *session, CK_OBJECT_HANDLE handle)
 {
 	int rc;
 
+	p11LockMutex(session->mutex);
+
+	removeObjectFromIndex(session->sessionObjIndex, handle);
 	rc = removeObjectFromList(&session->sessionObjList, handle);
 
-	if (rc != CKR_OK)
-		return rc;
+	if (rc == CKR_OK)
+		session->numberOfSessionObjects--;
 
-	session->numberOfSessionObjects--;
+	p11UnlockMutex(session->mutex);
 
-	return CKR_OK;
+	return rc;
 }
 
 
 
 /**
- * Add an object to the search list by make a shallow copy of the object
+ * Make room for additional handles in the search list
+ *
+ * The caller must hold the session mutex while accessing the search list.
+ *
+ * @param session   The session
+ * @param count     The number of handles to be added
+ * @return          CKR_OK or CKR_HOST_MEMORY
  */
-int addObjectToSearchList(struct p11Session_t *session, struct p11Object_t *object)
+int reserveSearchList(struct p11Session_t *session, CK_ULONG count)
 {
-	struct p11Object_t *obj;
-	struct p11Object_t *tmp;
+	struct p11ObjectSearch_t *search = &session->searchObj;
+	CK_OBJECT_HANDLE_PTR list;
+
+	if (search->searchNumOfObjects + count <= search->searchListSize) {
+		return CKR_OK;
+	}
 
-	tmp = (struct p11Object_t *)calloc(1, sizeof(struct p11Object_t));
+	list = (CK_OBJECT_HANDLE_PTR)realloc(search->searchList, (search->searchNumOfObjects + count) * sizeof(CK_OBJECT_HANDLE));
 
-	if (tmp == NULL) {
-		return -1;
+	if (list == NULL) {
+		return CKR_HOST_MEMORY;
 	}
 
-	*tmp = *object;
+	search->searchList = list;
+	search->searchListSize = search->searchNumOfObjects + count;
+	return CKR_OK;
+}
 
-	if (session->searchObj.searchList == NULL) {
-		session->searchObj.searchList = tmp;
-		tmp->next = NULL;
-		session->searchObj.searchNumOfObjects = 1;
-		session->searchObj.objectsCollected = 0;
-	} else {
-		obj = session->searchObj.searchList;
 
-		while (obj->next != NULL) {
-			obj = obj->next;
-		}
 
-		obj->next = tmp;
-		session->searchObj.searchNumOfObjects++;
-		tmp->next = NULL;
+/**
+ * Add the handle of an object to the search list
+ */
+int addObjectToSearchList(struct p11Session_t *session, struct p11Object_t *object)
+{
+	struct p11ObjectSearch_t *search = &session->searchObj;
+
+	if (search->searchNumOfObjects == search->searchListSize) {
+		if (reserveSearchList(session, search->searchListSize ? search->searchListSize : 16) != CKR_OK) {
+			return CKR_HOST_MEMORY;
+		}
 	}
 
+	search->searchList[search->searchNumOfObjects++] = object->handle;
 	return CKR_OK;
 }
 
@@ -429,24 +610,13 @@ int addObjectToSearchList(struct p11Session_t *session, struct p11Object_t *obje
 
 /**
  * Clear the search results list
+ *
+ * The memory for the handles is kept for the next search in the session.
  */
 void clearSearchList(struct p11Session_t *session)
 {
-	struct p11Object_t *pObject, *pTempObject;
-
-	pObject = session->searchObj.searchList;
-
-	// Objects on the search list are not a deep copy of the actual object
-	// thats why we don't use removeAllObjectsFromList() here
-	while (pObject) {
-		pTempObject = pObject->next;
-		free(pObject);
-		pObject = pTempObject;
-	}
-
 	session->searchObj.searchNumOfObjects = 0;
 	session->searchObj.objectsCollected = 0;
-	session->searchObj.searchList = NULL;
 }
 
 
@@ -461,6 +631,8 @@ void clearSearchList(struct p11Session_t *session)
  */
 int appendToCryptoBuffer(struct p11Session_t *session, CK_BYTE_PTR data, CK_ULONG length)
 {
+	p11LockMutex(session->mutex);
+
 	if (session->cryptoBufferMax < session->cryptoBufferSize + length) {
 		if (session->cryptoBufferMax == 0) {
 			session->cryptoBufferMax = 256;
@@ -472,6 +644,7 @@ int appendToCryptoBuffer(struct p11Session_t *session, CK_BYTE_PTR data, CK_ULON
 		session->cryptoBuffer = (CK_BYTE_PTR)realloc(session->cryptoBuffer, session->cryptoBufferMax);
 		if (session->cryptoBuffer == NULL) {
 			session->cryptoBufferMax = 0;
+			p11UnlockMutex(session->mutex);
 			return CKR_HOST_MEMORY;
 		}
 	}
@@ -479,6 +652,8 @@ int appendToCryptoBuffer(struct p11Session_t *session, CK_BYTE_PTR data, CK_ULON
 	memcpy(session->cryptoBuffer + session->cryptoBufferSize, data, length);
 	session->cryptoBufferSize += length;
 
+	p11UnlockMutex(session->mutex);
+
 	return CKR_OK;
 }
 
@@ -491,8 +666,129 @@ int appendToCryptoBuffer(struct p11Session_t *session, CK_BYTE_PTR data, CK_ULON
  */
 void clearCryptoBuffer(struct p11Session_t *session)
 {
+	p11LockMutex(session->mutex);
 	if (session->cryptoBuffer) {
 		memset(session->cryptoBuffer, 0, session->cryptoBufferMax);
 		session->cryptoBufferSize = 0;
 	}
+	p11UnlockMutex(session->mutex);
+}
+
+
+
+/**
+ * Hash the data of a multi-part signature on the host instead of collecting it
+ *
+ * The context is only installed, if no data has been collected in the crypto buffer
+ * and no other context is installed. The session takes ownership of the context and
+ * releases it when the operation ends.
+ *
+ * @param session   the session
+ * @param ctx       the hash context
+ * @param mechanism the mechanism signing the hash
+ * @return CKR_OK or CKR_OPERATION_ACTIVE if data has already been collected
+ */
+int setHashContext(struct p11Session_t *session, CK_VOID_PTR ctx, CK_MECHANISM_TYPE mechanism)
+{
+	p11LockMutex(session->mutex);
+	if (session->hashContext || session->cryptoBufferSize) {
+		p11UnlockMutex(session->mutex);
+		return CKR_OPERATION_ACTIVE;
+	}
+	session->hashContext = ctx;
+	session->hashMechanism = mechanism;
+	p11UnlockMutex(session->mutex);
+
+	return CKR_OK;
+}
+
+
+
+/**
+ * Chain the blocks of the AES-CBC operation initialized in the session on the host
+ *
+ * The token processes each call with a zero IV, so the caller applies the IV to the
+ * first block and keeps partial blocks until the next update.
+ *
+ * @param session   the session
+ * @param iv        the initial vector of 16 bytes or NULL for a zero IV
+ */
+void setCipherChain(struct p11Session_t *session, CK_BYTE_PTR iv)
+{
+	p11LockMutex(session->mutex);
+	session->cipherChain = TRUE;
+	if (iv) {
+		memcpy(session->chainIV, iv, sizeof(session->chainIV));
+	} else {
+		memset(session->chainIV, 0, sizeof(session->chainIV));
+	}
+	session->chainBlockLen = 0;
+	p11UnlockMutex(session->mutex);
+}
+
+
+
+/**
+ * Record the key and mechanism of the operation initialized in the session
+ *
+ * @param session   the session
+ * @param handle    the handle of the key object
+ * @param mechanism the mechanism of the operation
+ */
+void setActiveOperation(struct p11Session_t *session, CK_OBJECT_HANDLE handle, CK_MECHANISM_TYPE mechanism)
+{
+	p11LockMutex(session->mutex);
+	session->activeObjectHandle = handle;
+	session->activeMechanism = mechanism;
+	session->cipherChain = FALSE;
+	freeHashContext(session);
+	p11UnlockMutex(session->mutex);
+}
+
+
+
+/**
+ * Obtain the key and mechanism of the operation active in the session
+ *
+ * Both values are read together, so that an operation initialized concurrently in the
+ * same session never yields the key of one and the mechanism of another operation.
+ *
+ * @param session   the session
+ * @param handle    the variable receiving the handle of the key object
+ * @param mechanism the variable receiving the mechanism of the operation
+ * @return CKR_OK or CKR_OPERATION_NOT_INITIALIZED
+ */
+int getActiveOperation(struct p11Session_t *session, CK_OBJECT_HANDLE *handle, CK_MECHANISM_TYPE *mechanism)
+{
+	p11LockMutex(session->mutex);
+	*handle = session->activeObjectHandle;
+	*mechanism = session->activeMechanism;
+	p11UnlockMutex(session->mutex);
+
+	return *handle == CK_INVALID_HANDLE ? CKR_OPERATION_NOT_INITIALIZED : CKR_OK;
+}
+
+
+
+/**
+ * Terminate the operation active in the session
+ *
+ * @param session     the session
+ * @param clearBuffer clear data collected for tokens without update() function
+ */
+void endActiveOperation(struct p11Session_t *session, int clearBuffer)
+{
+	p11LockMutex(session->mutex);
+	session->activeObjectHandle = CK_INVALID_HANDLE;
+	if (clearBuffer && session->cryptoBuffer) {
+		memset(session->cryptoBuffer, 0, session->cryptoBufferMax);
+		session->cryptoBufferSize = 0;
+	}
+	if (session->cipherChain) {
+		memset(session->chainBlock, 0, sizeof(session->chainBlock));
+		session->chainBlockLen = 0;
+		session->cipherChain = FALSE;
+	}
+	freeHashContext(session);
+	p11UnlockMutex(session->mutex);
 }
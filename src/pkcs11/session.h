@@ -40,9 +40,10 @@
 
 
 struct p11ObjectSearch_t {
-	int searchNumOfObjects;
-	int objectsCollected;
-	struct p11Object_t *searchList;
+	CK_ULONG searchNumOfObjects;        /**< Number of handles in searchList                    */
+	CK_ULONG objectsCollected;          /**< Handles already returned by C_FindObjects          */
+	CK_ULONG searchListSize;            /**< Number of handles allocated, kept between searches */
+	CK_OBJECT_HANDLE_PTR searchList;    /**< Handles of the matching objects                    */
 };
 
 
@@ -57,19 +58,25 @@ struct p11Session_t {
 	CK_FLAGS flags;                     /**< The flags of this session                          */
 	CK_SESSION_HANDLE handle;           /**< The handle of the session                          */
 	int isRemoved;                      /**< The token has been removed                         */
+	CK_VOID_PTR mutex;                  /**< Protect operation, search and session object state */
 	int activeObjectHandle;             /**< The handle of the active object, -1 if no object   */
 	CK_MECHANISM_TYPE activeMechanism;  /**< The currently active mechanism                     */
 	CK_BYTE_PTR cryptoBuffer;           /**< Buffer storing intermediate results                */
 	CK_ULONG cryptoBufferSize;          /**< Current content of crypto buffer                   */
 	CK_ULONG cryptoBufferMax;           /**< Current size of crypto buffer                      */
+	CK_VOID_PTR hashContext;            /**< Host side hash of data signed in multiple parts    */
+	CK_MECHANISM_TYPE hashMechanism;    /**< The mechanism signing the hash                     */
+	int cipherChain;                    /**< AES-CBC blocks are chained by the host             */
+	CK_BYTE chainIV[16];                /**< Last cipher text block, the IV of the next block   */
+	CK_BYTE chainBlock[16];             /**< Partial block not yet processed                    */
+	CK_ULONG chainBlockLen;             /**< Number of bytes in chainBlock                      */
 
 	struct p11ObjectSearch_t searchObj; /**< Store the result of a search operation             */
 
 	int numberOfSessionObjects;
 	CK_LONG freeSessionObjNumber;
 	struct p11Object_t *sessionObjList; /**< Pointer to first object in pool                    */
-
-	struct p11Session_t *next;          /**< Pointer to next active session                     */
+	struct p11ObjectIndex_t *sessionObjIndex; /**< Session objects by handle                    */
 };
 
 
@@ -78,19 +85,25 @@ struct p11Session_t {
 
 void initSessionPool(struct p11SessionPool_t *pool);
 void terminateSessionPool(struct p11SessionPool_t *pool);
-void addSession(struct p11SessionPool_t *pool, struct p11Session_t *session);
+int addSession(struct p11SessionPool_t *pool, struct p11Session_t *session);
 int findSessionByHandle(struct p11SessionPool_t *pool, CK_SESSION_HANDLE handle, struct p11Session_t **session);
 int findSessionBySlotID(struct p11SessionPool_t *pool, CK_SLOT_ID slotID, struct p11Session_t **session);
 int removeSession(struct p11SessionPool_t *pool, CK_SESSION_HANDLE handle);
 void closeSessionsForSlot(struct p11SessionPool_t *pool, CK_SLOT_ID slotID);
 void tokenRemovedForSessionsOnSlot(struct p11SessionPool_t *pool, CK_SLOT_ID slotID);
 CK_STATE getSessionState(struct p11Session_t *session, struct p11Token_t *token);
-void addSessionObject(struct p11Session_t *session, struct p11Object_t *object);
+int addSessionObject(struct p11Session_t *session, struct p11Object_t *object);
 int findSessionObject(struct p11Session_t *session, CK_OBJECT_HANDLE handle, struct p11Object_t **object);
 int removeSessionObject(struct p11Session_t *session, CK_OBJECT_HANDLE handle);
+int reserveSearchList(struct p11Session_t *session, CK_ULONG count);
 int addObjectToSearchList(struct p11Session_t *session, struct p11Object_t *object);
 void clearSearchList(struct p11Session_t *session);
 int appendToCryptoBuffer(struct p11Session_t *session, CK_BYTE_PTR data, CK_ULONG length);
 void clearCryptoBuffer(struct p11Session_t *session);
+int setHashContext(struct p11Session_t *session, CK_VOID_PTR ctx, CK_MECHANISM_TYPE mechanism);
+void setCipherChain(struct p11Session_t *session, CK_BYTE_PTR iv);
+void setActiveOperation(struct p11Session_t *session, CK_OBJECT_HANDLE handle, CK_MECHANISM_TYPE mechanism);
+int getActiveOperation(struct p11Session_t *session, CK_OBJECT_HANDLE *handle, CK_MECHANISM_TYPE *mechanism);
+void endActiveOperation(struct p11Session_t *session, int clearBuffer);
 
 #endif /* ___SESSION_H_INC___ */
@@ -322,7 +322,7 @@ int updateCTAPISlots(struct p11SlotPool_t *pool)
 
 	FUNC_CALLED();
 
-	slot = pool->list;
+	slot = getNextSlot(pool, NULL);
 	while (slot) {
 		if (slot->closed) {
 			ctn = slot->ctn;
@@ -336,7 +336,7 @@ int updateCTAPISlots(struct p11SlotPool_t *pool)
 				slot->closed = FALSE;
 			}
 		}
-		slot = slot->next;
+		slot = getNextSlot(pool, slot);
 	}
 
 	while (numberOfReaders < MAX_READERS) {
@@ -0,0 +1,1726 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2020, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    slot-emulator.c
+ * @author  Andreas Schwier
+ * @brief   Slot with a SmartCard-HSM emulated in process
+ *
+ * Emulated slots allow load tests of the module and the applications using it without
+ * hardware. The emulator implements the subset of the SmartCard-HSM command set used by
+ * the token driver, performs the cryptographic operations with libcrypto and delays each
+ * response according to a latency profile measured with real devices.
+ *
+ * The slots are enabled with PKCS11_EMULATED_SLOTS and appear next to the PC/SC or CT-API
+ * slots. Commands are serialized by the slot queue like for a reader, so that the emulator
+ * state is never accessed concurrently.
+ *
+ * The emulator uses a fixed PIN and keeps keys in memory, so it is only built if configured
+ * with --enable-emulator.
+ */
+
+#ifdef ENABLE_EMULATOR
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/bn.h>
+#include <openssl/cmac.h>
+#include <openssl/rsa.h>
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
+#include <openssl/evp.h>
+#include <openssl/objects.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+
+#include <common/asn1.h>
+#include <common/cvc.h>
+#include <common/pkcs15.h>
+#include <common/thread.h>
+
+#include <pkcs11/slot.h>
+#include <pkcs11/slotpool.h>
+#include <pkcs11/token.h>
+#include <pkcs11/strbpcpy.h>
+#include <pkcs11/token-sc-hsm.h>
+#include <pkcs11/slot-emulator.h>
+
+#ifdef DEBUG
+#include <common/debug.h>
+#endif
+
+#define EMULATOR_PIN		"648219"
+#define EMULATOR_PIN_RETRIES	3
+#define EMULATOR_SO_PIN_RETRIES	15
+
+
+
+static unsigned char atrHSM[] = { 0x3B,0xFE,0x18,0x00,0x00,0x81,0x31,0xFE,0x45,0x80,0x31,0x81,0x54,0x48,0x53,0x4D,0x31,0x73,0x80,0x21,0x40,0x81,0x07,0xFA };
+static unsigned char aid[] = { 0xE8,0x2B,0x06,0x01,0x04,0x01,0x81,0xC3,0x1F,0x02,0x01 };
+static unsigned char fcp[] = { 0x62,0x05,0x85,0x03,0x01,0x03,0x05 };
+static unsigned char defaultSOPIN[] = { 0x35,0x37,0x36,0x32,0x31,0x38,0x38,0x30 };
+
+static struct bytestring_s algorithmRSA = { (unsigned char *)"\x04\x00\x7F\x00\x07\x02\x02\x02\x01\x02", 10 };
+static struct bytestring_s algorithmEC = { (unsigned char *)"\x04\x00\x7F\x00\x07\x02\x02\x02\x02\x03", 10 };
+static struct bytestring_s secp256r1 = { (unsigned char *)"\x2A\x86\x48\xCE\x3D\x03\x01\x07", 8 };
+
+
+
+/**
+ * Time in microseconds a SmartCard-HSM needs to process a command
+ *
+ * Key operations are given for RSA-2048 and EC P-256 and are scaled with the key size.
+ */
+struct latencyProfile {
+	char *name;
+	long select;
+	long verify;
+	long enumerate;
+	long read;
+	long update;
+	long erase;
+	long challenge;
+	long rsaSign;
+	long ecSign;
+	long rsaGenerate;
+	long ecGenerate;
+	long other;
+	long perByte;                       /**< Transfer time per command or response byte */
+};
+
+static struct latencyProfile latencyProfiles[] = {
+	{ "none",               0,     0,     0,     0,     0,     0,     0,      0,     0,       0,      0,     0,  0 },
+	{ "usb",             3000, 30000,  8000, 10000, 30000, 20000,  5000, 160000, 70000, 4000000, 150000,  5000, 30 },
+	{ "contactless",     8000, 40000, 15000, 20000, 45000, 30000, 10000, 190000, 90000, 4500000, 200000, 10000, 80 },
+	{ NULL }
+};
+
+
+
+struct emulatedFile {
+	unsigned short fid;                 /**< File identifier                     */
+	unsigned char *data;                /**< Content of elementary file          */
+	int len;                            /**< Length of content                   */
+	RSA *rsa;                           /**< RSA key, if the file is a key       */
+	EC_KEY *ec;                         /**< EC key, if the file is a key        */
+	unsigned char *aes;                 /**< AES key, if the file is a key       */
+	int keysize;                        /**< Key size in bits                    */
+};
+
+
+
+struct sc_hsm_emulator {
+	int selected;                       /**< Applet is selected                  */
+	int verified;                       /**< User PIN was verified               */
+	char pin[17];                       /**< Current user PIN                    */
+	int pinRetries;                     /**< Remaining user PIN retries          */
+	unsigned char sopin[8];             /**< Current SO-PIN                      */
+	int soRetries;                      /**< Remaining SO-PIN retries            */
+	char chr[16];                       /**< Holder reference of device key      */
+	struct latencyProfile *latency;     /**< Simulated processing time           */
+	int numberOfFiles;
+	struct emulatedFile file[MAX_FILES];
+};
+
+
+
+struct emulatedAPDU {
+	unsigned char cla;
+	unsigned char ins;
+	unsigned char p1;
+	unsigned char p2;
+	unsigned char *data;                /**< Command data                        */
+	int nc;                             /**< Length of command data              */
+	int ne;                             /**< Expected response length or -1      */
+	unsigned char *rdata;               /**< Response data                       */
+	int rlen;                           /**< Length of response data             */
+	int rsize;                          /**< Size of the response buffer         */
+	long delay;                         /**< Simulated processing time in us     */
+};
+
+
+
+/**
+ * Determine the latency profile from PKCS11_EMULATED_LATENCY
+ */
+static struct latencyProfile *getLatencyProfile()
+{
+	struct latencyProfile *p;
+	char *po;
+
+	po = getenv("PKCS11_EMULATED_LATENCY");
+	if (po == NULL)
+		po = "usb";
+
+	for (p = latencyProfiles; p->name != NULL; p++) {
+		if (!strcmp(p->name, po))
+			return p;
+	}
+
+#ifdef DEBUG
+	debug("Unknown latency profile '%s', using none\n", po);
+#endif
+	return latencyProfiles;
+}
+
+
+
+/**
+ * Scale the time for a key operation with the size of the key
+ *
+ * RSA operations grow with the cube of the modulus length, EC operations
+ * with the square of the field size.
+ */
+static long scaleKeyOperation(long base, struct emulatedFile *key)
+{
+	double f;
+
+	if (key->rsa != NULL) {
+		f = key->keysize / 2048.0;
+		return (long)(base * f * f * f);
+	}
+
+	f = key->keysize / 256.0;
+	return (long)(base * f * f);
+}
+
+
+
+static struct emulatedFile *findFile(struct sc_hsm_emulator *emu, unsigned short fid)
+{
+	int i;
+
+	for (i = 0; i < emu->numberOfFiles; i++) {
+		if (emu->file[i].fid == fid)
+			return &emu->file[i];
+	}
+	return NULL;
+}
+
+
+
+static struct emulatedFile *createFile(struct sc_hsm_emulator *emu, unsigned short fid)
+{
+	struct emulatedFile *file;
+
+	file = findFile(emu, fid);
+	if (file != NULL)
+		return file;
+
+	if (emu->numberOfFiles >= MAX_FILES)
+		return NULL;
+
+	file = &emu->file[emu->numberOfFiles++];
+	memset(file, 0, sizeof(*file));
+	file->fid = fid;
+	return file;
+}
+
+
+
+static void freeFile(struct emulatedFile *file)
+{
+	if (file->data != NULL) {
+		memset(file->data, 0, file->len);
+		free(file->data);
+	}
+
+	if (file->rsa != NULL)
+		RSA_free(file->rsa);
+
+	if (file->ec != NULL)
+		EC_KEY_free(file->ec);
+
+	if (file->aes != NULL) {
+		memset(file->aes, 0, file->keysize >> 3);
+		free(file->aes);
+	}
+
+	memset(file, 0, sizeof(*file));
+}
+
+
+
+static void deleteFile(struct sc_hsm_emulator *emu, struct emulatedFile *file)
+{
+	int i;
+
+	i = (int)(file - emu->file);
+	freeFile(file);
+	emu->numberOfFiles--;
+	memmove(file, file + 1, (emu->numberOfFiles - i) * sizeof(*file));
+}
+
+
+
+static int writeFile(struct sc_hsm_emulator *emu, unsigned short fid, int offset, unsigned char *data, int len)
+{
+	struct emulatedFile *file;
+	unsigned char *p;
+
+	file = createFile(emu, fid);
+	if (file == NULL)
+		return -1;
+
+	if (offset + len > file->len) {
+		p = realloc(file->data, offset + len);
+		if (p == NULL)
+			return -1;
+		memset(p + file->len, 0, offset + len - file->len);
+		file->data = p;
+		file->len = offset + len;
+	}
+
+	memcpy(file->data + offset, data, len);
+	return 0;
+}
+
+
+
+/**
+ * Decode the command APDU in short or extended format
+ */
+static int decodeCommandAPDU(unsigned char *capdu, size_t capdu_len, struct emulatedAPDU *apdu)
+{
+	int len = (int)capdu_len;
+
+	if (len < 4)
+		return -1;
+
+	apdu->cla = capdu[0];
+	apdu->ins = capdu[1];
+	apdu->p1 = capdu[2];
+	apdu->p2 = capdu[3];
+	apdu->data = capdu + 5;
+	apdu->nc = 0;
+	apdu->ne = -1;
+
+	if (len == 4)
+		return 0;
+
+	if (len == 5) {
+		apdu->ne = capdu[4] ? capdu[4] : 256;
+		return 0;
+	}
+
+	if (capdu[4] != 0) {
+		apdu->nc = capdu[4];
+		if (len == 5 + apdu->nc)
+			return 0;
+		if (len == 6 + apdu->nc) {
+			apdu->ne = capdu[len - 1] ? capdu[len - 1] : 256;
+			return 0;
+		}
+		return -1;
+	}
+
+	if (len == 7) {
+		apdu->ne = (capdu[5] << 8) | capdu[6];
+		if (apdu->ne == 0)
+			apdu->ne = 65536;
+		return 0;
+	}
+
+	apdu->nc = (capdu[5] << 8) | capdu[6];
+	apdu->data = capdu + 7;
+
+	if (len == 7 + apdu->nc)
+		return 0;
+
+	if (len == 9 + apdu->nc) {
+		apdu->ne = (capdu[len - 2] << 8) | capdu[len - 1];
+		if (apdu->ne == 0)
+			apdu->ne = 65536;
+		return 0;
+	}
+	return -1;
+}
+
+
+
+static unsigned short setResponse(struct emulatedAPDU *apdu, unsigned char *data, int len)
+{
+	if (len > apdu->rsize)
+		return 0x6F00;
+
+	memcpy(apdu->rdata, data, len);
+	apdu->rlen = len;
+	return 0x9000;
+}
+
+
+
+/**
+ * Sign the data as required for CV certificates and requests, i.e. with PKCS#1 V1.5
+ * and SHA-256 for RSA or ECDSA and SHA-256 with plain encoded signature for EC
+ */
+static int signCVC(RSA *rsa, EC_KEY *ec, unsigned char *data, int len, unsigned char *sig, int *siglen)
+{
+	unsigned char hash[SHA256_DIGEST_LENGTH];
+	const BIGNUM *r, *s;
+	unsigned int slen;
+	ECDSA_SIG *esig;
+	int flen;
+
+	SHA256(data, len, hash);
+
+	if (rsa != NULL) {
+		if (RSA_size(rsa) > *siglen)
+			return -1;
+		if (!RSA_sign(NID_sha256, hash, sizeof(hash), sig, &slen, rsa))
+			return -1;
+		*siglen = (int)slen;
+		return 0;
+	}
+
+	flen = (EC_GROUP_get_degree(EC_KEY_get0_group(ec)) + 7) >> 3;
+	if (flen * 2 > *siglen)
+		return -1;
+
+	esig = ECDSA_do_sign(hash, sizeof(hash), ec);
+	if (esig == NULL)
+		return -1;
+
+	ECDSA_SIG_get0(esig, &r, &s);
+	BN_bn2binpad(r, sig, flen);
+	BN_bn2binpad(s, sig + flen, flen);
+	ECDSA_SIG_free(esig);
+
+	*siglen = flen * 2;
+	return 0;
+}
+
+
+
+/**
+ * Encode the public key of a key pair in the format used in CV certificates
+ *
+ * @param bb the buffer to append the 7F49 object to
+ * @param key the key pair
+ * @param dp the domain parameter for EC keys
+ * @param oid the algorithm identifier
+ */
+static int encodePublicKey(bytebuffer bb, struct emulatedFile *key, struct ec_curve *dp, bytestring oid)
+{
+	unsigned char scr[1024];
+	const BIGNUM *n, *e;
+	size_t ofs, len;
+
+	ofs = bbGetLength(bb);
+	asn1Append(bb, 0x06, oid);
+
+	if (key->rsa != NULL) {
+		RSA_get0_key(key->rsa, &n, &e, NULL);
+		len = BN_bn2bin(n, scr);
+		asn1AppendBytes(bb, 0x81, scr, len);
+		len = BN_bn2bin(e, scr);
+		asn1AppendBytes(bb, 0x82, scr, len);
+	} else {
+		len = EC_POINT_point2oct(EC_KEY_get0_group(key->ec), EC_KEY_get0_public_key(key->ec),
+				POINT_CONVERSION_UNCOMPRESSED, scr, sizeof(scr), NULL);
+		if (len == 0)
+			return -1;
+
+		asn1Append(bb, 0x81, &dp->prime);
+		asn1Append(bb, 0x82, &dp->coefficientA);
+		asn1Append(bb, 0x83, &dp->coefficientB);
+		asn1Append(bb, 0x84, &dp->basePointG);
+		asn1Append(bb, 0x85, &dp->order);
+		asn1AppendBytes(bb, 0x86, scr, len);
+		asn1Append(bb, 0x87, &dp->coFactor);
+	}
+
+	return asn1EncapBuffer(0x7F49, bb, ofs);
+}
+
+
+
+/**
+ * Create an EC key for the domain parameter, preferring the optimized implementation
+ * of named curves known to libcrypto
+ */
+static EC_KEY *generateECKey(struct ec_curve *dp)
+{
+	struct cvc cvc;
+	bytestring oid;
+	unsigned char scr[32];
+	const unsigned char *po;
+	ASN1_OBJECT *obj;
+	BIGNUM *p, *a, *b, *order, *cofactor;
+	EC_GROUP *group = NULL;
+	EC_POINT *g = NULL;
+	EC_KEY *ec = NULL;
+	int nid = NID_undef;
+
+	memset(&cvc, 0, sizeof(cvc));
+	cvc.primeOrModulus = dp->prime;
+
+	if (!cvcDetermineCurveOID(&cvc, &oid) && (oid->len + 2 <= sizeof(scr))) {
+		scr[0] = 0x06;
+		scr[1] = (unsigned char)oid->len;
+		memcpy(scr + 2, oid->val, oid->len);
+		po = scr;
+		obj = d2i_ASN1_OBJECT(NULL, &po, (long)oid->len + 2);
+		if (obj != NULL) {
+			nid = OBJ_obj2nid(obj);
+			ASN1_OBJECT_free(obj);
+		}
+	}
+
+	if (nid != NID_undef)
+		group = EC_GROUP_new_by_curve_name(nid);
+
+	if (group == NULL) {
+		p = BN_bin2bn(dp->prime.val, (int)dp->prime.len, NULL);
+		a = BN_bin2bn(dp->coefficientA.val, (int)dp->coefficientA.len, NULL);
+		b = BN_bin2bn(dp->coefficientB.val, (int)dp->coefficientB.len, NULL);
+		order = BN_bin2bn(dp->order.val, (int)dp->order.len, NULL);
+		cofactor = BN_bin2bn(dp->coFactor.val, (int)dp->coFactor.len, NULL);
+
+		if (p && a && b && order && cofactor)
+			group = EC_GROUP_new_curve_GFp(p, a, b, NULL);
+
+		if (group != NULL) {
+			g = EC_POINT_new(group);
+			if ((g == NULL) ||
+				!EC_POINT_oct2point(group, g, dp->basePointG.val, dp->basePointG.len, NULL) ||
+				!EC_GROUP_set_generator(group, g, order, cofactor)) {
+				EC_GROUP_free(group);
+				group = NULL;
+			}
+			EC_POINT_free(g);
+		}
+
+		BN_free(p);
+		BN_free(a);
+		BN_free(b);
+		BN_free(order);
+		BN_free(cofactor);
+	}
+
+	if (group == NULL)
+		return NULL;
+
+	ec = EC_KEY_new();
+	if ((ec == NULL) || !EC_KEY_set_group(ec, group) || !EC_KEY_generate_key(ec)) {
+		EC_KEY_free(ec);
+		ec = NULL;
+	}
+
+	EC_GROUP_free(group);
+	return ec;
+}
+
+
+
+/**
+ * Generate a key pair as defined by the GENERATE ASYMMETRIC KEY PAIR command data
+ * and store the authenticated request in the EE certificate file
+ *
+ * @param emu the emulator
+ * @param id the key identifier
+ * @param gakp the command data
+ * @param gakplen the length of the command data
+ * @param request the buffer receiving the authenticated request
+ * @return the length of the request or -1 if the command data is invalid
+ */
+static int generateKeyPair(struct sc_hsm_emulator *emu, int id, unsigned char *gakp, int gakplen, bytebuffer request)
+{
+	struct emulatedFile *key, *devaut, tmp;
+	struct ec_curve dp;
+	struct bytestring_s oid, car, chr, outercar;
+	unsigned char *po, *val, *pk, *pval, sig[512];
+	BIGNUM *e;
+	int len, tag, vlen, pklen, ptag, plen, keysize, siglen;
+
+	if (asn1Validate(gakp, gakplen))
+		return -1;
+
+	memset(&dp, 0, sizeof(dp));
+	memset(&oid, 0, sizeof(oid));
+	memset(&car, 0, sizeof(car));
+	memset(&chr, 0, sizeof(chr));
+	keysize = 0;
+	e = NULL;
+
+	po = gakp;
+	len = gakplen;
+	while (asn1Next(&po, &len, &tag, &vlen, &val)) {
+		switch(tag) {
+		case 0x42:
+			car.val = val;
+			car.len = vlen;
+			break;
+		case 0x5F20:
+			chr.val = val;
+			chr.len = vlen;
+			break;
+		case 0x7F49:
+			pk = val;
+			pklen = vlen;
+			while (asn1Next(&pk, &pklen, &ptag, &plen, &pval)) {
+				switch(ptag) {
+				case 0x06: oid.val = pval; oid.len = plen; break;
+				case 0x81: dp.prime.val = pval; dp.prime.len = plen; break;
+				case 0x82: dp.coefficientA.val = pval; dp.coefficientA.len = plen; break;
+				case 0x83: dp.coefficientB.val = pval; dp.coefficientB.len = plen; break;
+				case 0x84: dp.basePointG.val = pval; dp.basePointG.len = plen; break;
+				case 0x85: dp.order.val = pval; dp.order.len = plen; break;
+				case 0x87: dp.coFactor.val = pval; dp.coFactor.len = plen; break;
+				case 0x02: asn1DecodeInteger(pval, plen, &keysize); break;
+				}
+			}
+			break;
+		}
+	}
+
+	if ((oid.val == NULL) || (chr.val == NULL))
+		return -1;
+
+	memset(&tmp, 0, sizeof(tmp));
+
+	if (dp.prime.val != NULL) {
+		if (!dp.coefficientB.val || !dp.basePointG.val || !dp.order.val || !dp.coFactor.val)
+			return -1;
+
+		tmp.ec = generateECKey(&dp);
+		if (tmp.ec == NULL)
+			return -1;
+		tmp.keysize = (int)(dp.prime.len << 3);
+	} else {
+		if ((keysize < 1024) || (keysize > 4096) || (keysize & 7))
+			return -1;
+
+		tmp.rsa = RSA_new();
+		if (dp.coefficientA.val != NULL)
+			e = BN_bin2bn(dp.coefficientA.val, (int)dp.coefficientA.len, NULL);
+		else
+			e = BN_bin2bn((unsigned char *)"\x01\x00\x01", 3, NULL);
+
+		if ((tmp.rsa == NULL) || (e == NULL) || !RSA_generate_key_ex(tmp.rsa, keysize, e, NULL)) {
+			BN_free(e);
+			freeFile(&tmp);
+			return -1;
+		}
+		BN_free(e);
+		tmp.keysize = keysize;
+	}
+
+	// Encode the self-signed request, authenticated with the device key
+	bbClear(request);
+	asn1AppendBytes(request, 0x5F29, (unsigned char *)"\x00", 1);
+	if (car.val != NULL)
+		asn1Append(request, 0x42, &car);
+	encodePublicKey(request, &tmp, &dp, &oid);
+	asn1Append(request, 0x5F20, &chr);
+	asn1EncapBuffer(0x7F4E, request, 0);
+
+	siglen = sizeof(sig);
+	if (bbHasFailed(request) || signCVC(tmp.rsa, tmp.ec, request->val, (int)request->len, sig, &siglen)) {
+		freeFile(&tmp);
+		return -1;
+	}
+	asn1AppendBytes(request, 0x5F37, sig, siglen);
+	asn1EncapBuffer(0x7F21, request, 0);
+
+	devaut = findFile(emu, (KEY_PREFIX << 8) | 0);
+	outercar.val = (unsigned char *)emu->chr;
+	outercar.len = strlen(emu->chr);
+	asn1Append(request, 0x42, &outercar);
+
+	siglen = sizeof(sig);
+	if (bbHasFailed(request) || signCVC(NULL, devaut->ec, request->val, (int)request->len, sig, &siglen)) {
+		freeFile(&tmp);
+		return -1;
+	}
+	asn1AppendBytes(request, 0x5F37, sig, siglen);
+	asn1EncapBuffer(0x67, request, 0);
+
+	if (bbHasFailed(request)) {
+		freeFile(&tmp);
+		return -1;
+	}
+
+	key = findFile(emu, (KEY_PREFIX << 8) | id);
+	if (key != NULL)
+		deleteFile(emu, key);
+
+	key = createFile(emu, (KEY_PREFIX << 8) | id);
+	if (key == NULL) {
+		freeFile(&tmp);
+		return -1;
+	}
+	key->rsa = tmp.rsa;
+	key->ec = tmp.ec;
+	key->keysize = tmp.keysize;
+
+	key = findFile(emu, (EE_CERTIFICATE_PREFIX << 8) | id);
+	if (key != NULL)
+		deleteFile(emu, key);
+
+	if (writeFile(emu, (EE_CERTIFICATE_PREFIX << 8) | id, 0, request->val, (int)request->len) < 0)
+		return -1;
+
+	return (int)request->len;
+}
+
+
+
+static unsigned short emuSelect(struct sc_hsm_emulator *emu, struct emulatedAPDU *apdu)
+{
+	apdu->delay = emu->latency->select;
+
+	if ((apdu->p1 != 0x04) || (apdu->nc != sizeof(aid)) || memcmp(apdu->data, aid, sizeof(aid)))
+		return 0x6A82;
+
+	emu->selected = 1;
+	emu->verified = 0;
+
+	return setResponse(apdu, fcp, sizeof(fcp));
+}
+
+
+
+static unsigned short emuVerify(struct sc_hsm_emulator *emu, struct emulatedAPDU *apdu)
+{
+	apdu->delay = emu->latency->verify;
+
+	if (apdu->p2 == 0x88) {
+		if (apdu->nc > 0)
+			return 0x6A80;
+
+		return emu->soRetries ? 0x63C0 | emu->soRetries : 0x6983;
+	}
+
+	if (apdu->p2 != 0x81)
+		return 0x6A88;
+
+	if (apdu->nc == 0) {
+		if (emu->verified)
+			return 0x9000;
+
+		return emu->pinRetries ? 0x63C0 | emu->pinRetries : 0x6983;
+	}
+
+	if (emu->pinRetries == 0)
+		return 0x6983;
+
+	if ((apdu->nc < 6) || (apdu->nc > 16))
+		return 0x6A80;
+
+	if ((apdu->nc != (int)strlen(emu->pin)) || memcmp(apdu->data, emu->pin, apdu->nc)) {
+		emu->verified = 0;
+		emu->pinRetries--;
+		return emu->pinRetries ? 0x63C0 | emu->pinRetries : 0x6983;
+	}
+
+	emu->verified = 1;
+	emu->pinRetries = EMULATOR_PIN_RETRIES;
+	return 0x9000;
+}
+
+
+
+static unsigned short emuChangeReferenceData(struct sc_hsm_emulator *emu, struct emulatedAPDU *apdu)
+{
+	int len;
+
+	apdu->delay = emu->latency->update;
+
+	if (apdu->p2 == 0x88) {
+		if (apdu->nc != 16)
+			return 0x6A80;
+
+		if (emu->soRetries == 0)
+			return 0x6983;
+
+		if (memcmp(apdu->data, emu->sopin, sizeof(emu->sopin))) {
+			emu->soRetries--;
+			return emu->soRetries ? 0x63C0 | emu->soRetries : 0x6983;
+		}
+
+		memcpy(emu->sopin, apdu->data + 8, sizeof(emu->sopin));
+		emu->soRetries = EMULATOR_SO_PIN_RETRIES;
+		return 0x9000;
+	}
+
+	if (apdu->p2 != 0x81)
+		return 0x6A88;
+
+	if (emu->pinRetries == 0)
+		return 0x6983;
+
+	len = (int)strlen(emu->pin);
+	if ((apdu->nc < len + 6) || (apdu->nc > len + 16))
+		return 0x6A80;
+
+	if (memcmp(apdu->data, emu->pin, len)) {
+		emu->verified = 0;
+		emu->pinRetries--;
+		return emu->pinRetries ? 0x63C0 | emu->pinRetries : 0x6983;
+	}
+
+	memcpy(emu->pin, apdu->data + len, apdu->nc - len);
+	emu->pin[apdu->nc - len] = 0;
+	emu->pinRetries = EMULATOR_PIN_RETRIES;
+	emu->verified = 1;
+	return 0x9000;
+}
+
+
+
+static unsigned short emuResetRetryCounter(struct sc_hsm_emulator *emu, struct emulatedAPDU *apdu)
+{
+	int len;
+
+	apdu->delay = emu->latency->update;
+
+	if (apdu->p2 != 0x81)
+		return 0x6A88;
+
+	if ((apdu->p1 != 0x00) && (apdu->p1 != 0x01))
+		return 0x6A86;
+
+	if (apdu->nc < 8)
+		return 0x6A80;
+
+	len = apdu->nc - 8;
+	if ((apdu->p1 == 0x00) && ((len < 6) || (len > 16)))
+		return 0x6A80;
+
+	if (emu->soRetries == 0)
+		return 0x6983;
+
+	if (memcmp(apdu->data, emu->sopin, sizeof(emu->sopin))) {
+		emu->soRetries--;
+		return emu->soRetries ? 0x63C0 | emu->soRetries : 0x6983;
+	}
+	emu->soRetries = EMULATOR_SO_PIN_RETRIES;
+
+	if (apdu->p1 == 0x00) {
+		memcpy(emu->pin, apdu->data + 8, len);
+		emu->pin[len] = 0;
+	}
+
+	emu->pinRetries = EMULATOR_PIN_RETRIES;
+	return 0x9000;
+}
+
+
+
+static unsigned short emuEnumerate(struct sc_hsm_emulator *emu, struct emulatedAPDU *apdu)
+{
+	int i;
+
+	apdu->delay = emu->latency->enumerate;
+
+	if (emu->numberOfFiles * 2 > apdu->rsize)
+		return 0x6F00;
+
+	for (i = 0; i < emu->numberOfFiles; i++) {
+		apdu->rdata[i << 1] = emu->file[i].fid >> 8;
+		apdu->rdata[(i << 1) + 1] = emu->file[i].fid & 0xFF;
+	}
+	apdu->rlen = emu->numberOfFiles * 2;
+
+	return 0x9000;
+}
+
+
+
+static unsigned short emuReadBinary(struct sc_hsm_emulator *emu, struct emulatedAPDU *apdu)
+{
+	struct emulatedFile *file;
+	int offset, len;
+
+	apdu->delay = emu->latency->read;
+
+	if ((apdu->nc != 4) || (apdu->data[0] != 0x54) || (apdu->data[1] != 0x02))
+		return 0x6A80;
+
+	offset = (apdu->data[2] << 8) | apdu->data[3];
+
+	file = findFile(emu, (apdu->p1 << 8) | apdu->p2);
+	if (file == NULL)
+		return 0x6A82;
+
+	if ((file->rsa != NULL) || (file->ec != NULL) || (file->aes != NULL))
+		return 0x6982;
+
+	if (offset > file->len)
+		return 0x6B00;
+
+	len = file->len - offset;
+	if (len > apdu->ne)
+		len = apdu->ne < 0 ? 0 : apdu->ne;
+
+	if (len > apdu->rsize)
+		len = apdu->rsize;
+
+	memcpy(apdu->rdata, file->data + offset, len);
+	apdu->rlen = len;
+
+	return len < apdu->ne ? 0x6282 : 0x9000;
+}
+
+
+
+static unsigned short emuUpdateBinary(struct sc_hsm_emulator *emu, struct emulatedAPDU *apdu)
+{
+	unsigned char *po, *val;
+	int len, tag, vlen, offset;
+	unsigned short fid;
+
+	apdu->delay = emu->latency->update;
+
+	if (!emu->verified)
+		return 0x6982;
+
+	fid = (apdu->p1 << 8) | apdu->p2;
+	if (apdu->p1 == KEY_PREFIX)
+		return 0x6982;
+
+	if (asn1Validate(apdu->data, apdu->nc))
+		return 0x6A80;
+
+	po = apdu->data;
+	len = apdu->nc;
+	if (!asn1Next(&po, &len, &tag, &vlen, &val) || (tag != 0x54) || (vlen != 2))
+		return 0x6A80;
+
+	offset = (val[0] << 8) | val[1];
+
+	if (!asn1Next(&po, &len, &tag, &vlen, &val) || (tag != 0x53))
+		return 0x6A80;
+
+	if ((offset + vlen > 0x7FFF) || (writeFile(emu, fid, offset, val, vlen) < 0))
+		return 0x6A84;
+
+	return 0x9000;
+}
+
+
+
+static unsigned short emuDeleteFile(struct sc_hsm_emulator *emu, struct emulatedAPDU *apdu)
+{
+	struct emulatedFile *file;
+	unsigned short fid;
+
+	apdu->delay = emu->latency->erase;
+
+	if (!emu->verified)
+		return 0x6982;
+
+	if ((apdu->p1 != 0x02) || (apdu->nc != 2))
+		return 0x6A86;
+
+	fid = (apdu->data[0] << 8) | apdu->data[1];
+	if (fid == ((KEY_PREFIX << 8) | 0))
+		return 0x6982;
+
+	file = findFile(emu, fid);
+	if (file == NULL)
+		return 0x6A82;
+
+	deleteFile(emu, file);
+	return 0x9000;
+}
+
+
+
+static unsigned short emuGetChallenge(struct sc_hsm_emulator *emu, struct emulatedAPDU *apdu)
+{
+	int len;
+
+	len = apdu->ne < 0 ? 0 : apdu->ne;
+	if (len > apdu->rsize)
+		return 0x6700;
+
+	apdu->delay = emu->latency->challenge;
+
+	if (len > 0 && !RAND_bytes(apdu->rdata, len))
+		return 0x6F00;
+
+	apdu->rlen = len;
+	return 0x9000;
+}
+
+
+
+static unsigned short emuGenerateKeyPair(struct sc_hsm_emulator *emu, struct emulatedAPDU *apdu)
+{
+	struct emulatedFile *key;
+	unsigned char buff[2048];
+	struct bytebuffer_s bb = { buff, 0, sizeof(buff) };
+	int rc;
+
+	apdu->delay = emu->latency->ecGenerate;
+
+	if (!emu->verified)
+		return 0x6982;
+
+	if ((apdu->p1 == 0) || (apdu->p2 != 0x00))
+		return 0x6A86;
+
+	rc = generateKeyPair(emu, apdu->p1, apdu->data, apdu->nc, &bb);
+	if (rc < 0)
+		return 0x6A80;
+
+	key = findFile(emu, (KEY_PREFIX << 8) | apdu->p1);
+	if (key->rsa != NULL)
+		apdu->delay = scaleKeyOperation(emu->latency->rsaGenerate, key);
+	else
+		apdu->delay = scaleKeyOperation(emu->latency->ecGenerate, key);
+
+	// The request is also stored in the EE certificate file, from where the token driver reads it
+	if (rc > apdu->rsize)
+		return 0x9000;
+
+	return setResponse(apdu, buff, rc);
+}
+
+
+
+static unsigned short signRSA(struct emulatedFile *key, struct emulatedAPDU *apdu)
+{
+	unsigned char hash[SHA256_DIGEST_LENGTH], em[512];
+	const EVP_MD *md;
+	unsigned int slen;
+	int rc, size;
+
+	size = RSA_size(key->rsa);
+	if (size > apdu->rsize)
+		return 0x6F00;
+
+	md = NULL;
+	rc = -1;
+
+	switch(apdu->p2) {
+	case ALGO_RSA_RAW:
+		if (apdu->nc != size)
+			return 0x6A80;
+		rc = RSA_private_encrypt(apdu->nc, apdu->data, apdu->rdata, key->rsa, RSA_NO_PADDING);
+		break;
+	case ALGO_RSA_PKCS1:
+		rc = RSA_private_encrypt(apdu->nc, apdu->data, apdu->rdata, key->rsa, RSA_PKCS1_PADDING);
+		break;
+	case ALGO_RSA_PKCS1_SHA1:
+		SHA1(apdu->data, apdu->nc, hash);
+		rc = RSA_sign(NID_sha1, hash, SHA_DIGEST_LENGTH, apdu->rdata, &slen, key->rsa) ? (int)slen : -1;
+		break;
+	case ALGO_RSA_PKCS1_SHA256:
+		SHA256(apdu->data, apdu->nc, hash);
+		rc = RSA_sign(NID_sha256, hash, SHA256_DIGEST_LENGTH, apdu->rdata, &slen, key->rsa) ? (int)slen : -1;
+		break;
+	case ALGO_RSA_PSS:
+		if ((apdu->nc != SHA_DIGEST_LENGTH) && (apdu->nc != SHA256_DIGEST_LENGTH))
+			return 0x6A80;
+		md = apdu->nc == SHA_DIGEST_LENGTH ? EVP_sha1() : EVP_sha256();
+		memcpy(hash, apdu->data, apdu->nc);
+		break;
+	case ALGO_RSA_PSS_SHA1:
+		md = EVP_sha1();
+		SHA1(apdu->data, apdu->nc, hash);
+		break;
+	case ALGO_RSA_PSS_SHA256:
+		md = EVP_sha256();
+		SHA256(apdu->data, apdu->nc, hash);
+		break;
+	default:
+		return 0x6A81;
+	}
+
+	if (md != NULL) {
+		if ((size > sizeof(em)) || !RSA_padding_add_PKCS1_PSS(key->rsa, em, hash, md, -1))
+			return 0x6A80;
+		rc = RSA_private_encrypt(size, em, apdu->rdata, key->rsa, RSA_NO_PADDING);
+		memset(em, 0, sizeof(em));
+	}
+
+	if (rc < 0)
+		return 0x6A80;
+
+	apdu->rlen = rc;
+	return 0x9000;
+}
+
+
+
+static unsigned short signEC(struct emulatedFile *key, struct emulatedAPDU *apdu)
+{
+	unsigned char hash[SHA256_DIGEST_LENGTH], *data, *po;
+	ECDSA_SIG *sig;
+	int len;
+
+	data = hash;
+
+	switch(apdu->p2) {
+	case ALGO_EC_RAW:
+		data = apdu->data;
+		len = apdu->nc;
+		break;
+	case ALGO_EC_SHA1:
+		SHA1(apdu->data, apdu->nc, hash);
+		len = SHA_DIGEST_LENGTH;
+		break;
+	case ALGO_EC_SHA224:
+		SHA224(apdu->data, apdu->nc, hash);
+		len = SHA224_DIGEST_LENGTH;
+		break;
+	case ALGO_EC_SHA256:
+		SHA256(apdu->data, apdu->nc, hash);
+		len = SHA256_DIGEST_LENGTH;
+		break;
+	default:
+		return 0x6A81;
+	}
+
+	sig = ECDSA_do_sign(data, len, key->ec);
+	if (sig == NULL)
+		return 0x6A80;
+
+	len = i2d_ECDSA_SIG(sig, NULL);
+	if (len > apdu->rsize) {
+		ECDSA_SIG_free(sig);
+		return 0x6F00;
+	}
+
+	po = apdu->rdata;
+	apdu->rlen = i2d_ECDSA_SIG(sig, &po);
+	ECDSA_SIG_free(sig);
+
+	return 0x9000;
+}
+
+
+
+static unsigned short emuSign(struct sc_hsm_emulator *emu, struct emulatedAPDU *apdu)
+{
+	struct emulatedFile *key;
+
+	apdu->delay = emu->latency->other;
+
+	if (!emu->verified)
+		return 0x6982;
+
+	key = findFile(emu, (KEY_PREFIX << 8) | apdu->p1);
+	if ((apdu->p1 == 0) || (key == NULL))
+		return 0x6A88;
+
+	if (key->rsa != NULL) {
+		apdu->delay = scaleKeyOperation(emu->latency->rsaSign, key);
+		return signRSA(key, apdu);
+	}
+
+	if (key->ec == NULL)
+		return 0x6A81;
+
+	apdu->delay = scaleKeyOperation(emu->latency->ecSign, key);
+	return signEC(key, apdu);
+}
+
+
+
+static unsigned short emuDecipher(struct sc_hsm_emulator *emu, struct emulatedAPDU *apdu)
+{
+	struct emulatedFile *key;
+	int rc;
+
+	apdu->delay = emu->latency->other;
+
+	if (!emu->verified)
+		return 0x6982;
+
+	key = findFile(emu, (KEY_PREFIX << 8) | apdu->p1);
+	if ((apdu->p1 == 0) || (key == NULL))
+		return 0x6A88;
+
+	if ((key->rsa == NULL) || (apdu->p2 != ALGO_RSA_DECRYPT))
+		return 0x6A81;
+
+	apdu->delay = scaleKeyOperation(emu->latency->rsaSign, key);
+
+	if (apdu->nc != RSA_size(key->rsa))
+		return 0x6A80;
+
+	if (apdu->nc > apdu->rsize)
+		return 0x6F00;
+
+	rc = RSA_private_decrypt(apdu->nc, apdu->data, apdu->rdata, key->rsa, RSA_NO_PADDING);
+	if (rc < 0)
+		return 0x6A80;
+
+	apdu->rlen = rc;
+	return 0x9000;
+}
+
+
+
+static unsigned short signCMAC(struct emulatedFile *key, const EVP_CIPHER *cipher, struct emulatedAPDU *apdu)
+{
+	CMAC_CTX *ctx;
+	size_t len;
+	int rc;
+
+	if (apdu->rsize < 16)
+		return 0x6F00;
+
+	ctx = CMAC_CTX_new();
+	if (ctx == NULL)
+		return 0x6F00;
+
+	rc = CMAC_Init(ctx, key->aes, key->keysize >> 3, cipher, NULL) &&
+		CMAC_Update(ctx, apdu->data, apdu->nc) &&
+		CMAC_Final(ctx, apdu->rdata, &len);
+
+	CMAC_CTX_free(ctx);
+
+	if (!rc)
+		return 0x6F00;
+
+	apdu->rlen = (int)len;
+	return 0x9000;
+}
+
+
+
+static unsigned short emuCipher(struct sc_hsm_emulator *emu, struct emulatedAPDU *apdu)
+{
+	struct emulatedFile *key;
+	const EVP_CIPHER *cipher;
+	EVP_CIPHER_CTX *ctx;
+	unsigned char iv[16];
+	int rc, len;
+
+	apdu->delay = emu->latency->other;
+
+	if (!emu->verified)
+		return 0x6982;
+
+	key = findFile(emu, (KEY_PREFIX << 8) | apdu->p1);
+	if ((apdu->p1 == 0) || (key == NULL))
+		return 0x6A88;
+
+	if ((key->aes == NULL) || ((apdu->p2 != ALGO_AES_CBC_ENCRYPT) && (apdu->p2 != ALGO_AES_CBC_DECRYPT) && (apdu->p2 != ALGO_AES_CMAC)))
+		return 0x6A81;
+
+	switch(key->keysize) {
+	case 128: cipher = EVP_aes_128_cbc(); break;
+	case 192: cipher = EVP_aes_192_cbc(); break;
+	default: cipher = EVP_aes_256_cbc(); break;
+	}
+
+	if (apdu->p2 == ALGO_AES_CMAC)
+		return signCMAC(key, cipher, apdu);
+
+	if ((apdu->nc == 0) || (apdu->nc & 15))
+		return 0x6A80;
+
+	if (apdu->nc > apdu->rsize)
+		return 0x6F00;
+
+	// Every command starts with a zero IV
+	memset(iv, 0, sizeof(iv));
+
+	ctx = EVP_CIPHER_CTX_new();
+	if (ctx == NULL)
+		return 0x6F00;
+
+	rc = EVP_CipherInit_ex(ctx, cipher, NULL, key->aes, iv, apdu->p2 == ALGO_AES_CBC_ENCRYPT) &&
+		EVP_CIPHER_CTX_set_padding(ctx, 0) &&
+		EVP_CipherUpdate(ctx, apdu->rdata, &len, apdu->data, apdu->nc);
+
+	EVP_CIPHER_CTX_free(ctx);
+
+	if (!rc)
+		return 0x6F00;
+
+	apdu->rlen = len;
+	return 0x9000;
+}
+
+
+
+static unsigned short processAPDU(struct sc_hsm_emulator *emu, struct emulatedAPDU *apdu)
+{
+	if (apdu->ins == 0xA4)
+		return emuSelect(emu, apdu);
+
+	apdu->delay = emu->latency->other;
+
+	// A card in which the applet is not selected does not know the SmartCard-HSM commands
+	if (!emu->selected)
+		return 0x6D00;
+
+	switch(apdu->ins) {
+	case 0x20:
+		return emuVerify(emu, apdu);
+	case 0x24:
+		return emuChangeReferenceData(emu, apdu);
+	case 0x2C:
+		return emuResetRetryCounter(emu, apdu);
+	case 0x46:
+		return emuGenerateKeyPair(emu, apdu);
+	case 0x58:
+		return emuEnumerate(emu, apdu);
+	case 0x62:
+		return emuDecipher(emu, apdu);
+	case 0x68:
+		return emuSign(emu, apdu);
+	case 0x78:
+		return emuCipher(emu, apdu);
+	case 0x84:
+		return emuGetChallenge(emu, apdu);
+	case 0xB1:
+		return emuReadBinary(emu, apdu);
+	case 0xD7:
+		return emuUpdateBinary(emu, apdu);
+	case 0xE4:
+		return emuDeleteFile(emu, apdu);
+	}
+	return 0x6D00;
+}
+
+
+
+/**
+ * Process the command APDU with the emulated SmartCard-HSM in the slot
+ *
+ * The response is returned after the time a real device would need for the command,
+ * as defined by the latency profile selected with PKCS11_EMULATED_LATENCY.
+ *
+ * @param slot the slot with the emulator
+ * @param capdu the command APDU
+ * @param capdu_len the length of the command APDU
+ * @param rapdu the buffer receiving the response APDU, which may be the same as capdu
+ * @param rapdu_len the size of the buffer
+ * @return the length of the response APDU or a negative value in case of an error
+ */
+int transmitAPDUviaEmulator(struct p11Slot_t *slot,
+	unsigned char *capdu, size_t capdu_len,
+	unsigned char *rapdu, size_t rapdu_len)
+{
+	struct sc_hsm_emulator *emu = slot->emulator;
+	struct emulatedAPDU apdu;
+	unsigned char cmd[MAX_CAPDU];
+	unsigned short SW1SW2;
+	unsigned long start, elapsed;
+
+	FUNC_CALLED();
+
+	if ((emu == NULL) || (rapdu_len < 2) || (capdu_len > sizeof(cmd)))
+		FUNC_FAILS(-1, "Invalid argument");
+
+	start = thread_ticks();
+
+	// The response is usually written to the buffer containing the command
+	memcpy(cmd, capdu, capdu_len);
+	memset(&apdu, 0, sizeof(apdu));
+	apdu.rdata = rapdu;
+	apdu.rsize = (int)rapdu_len - 2;
+
+	if (decodeCommandAPDU(cmd, capdu_len, &apdu) < 0) {
+		SW1SW2 = 0x6700;
+	} else {
+		SW1SW2 = processAPDU(emu, &apdu);
+	}
+
+	if ((SW1SW2 != 0x9000) && (SW1SW2 != 0x6282))
+		apdu.rlen = 0;
+
+	rapdu[apdu.rlen] = SW1SW2 >> 8;
+	rapdu[apdu.rlen + 1] = SW1SW2 & 0xFF;
+
+	memset(cmd, 0, sizeof(cmd));
+
+	apdu.delay += (long)(capdu_len + apdu.rlen + 2) * emu->latency->perByte;
+	elapsed = (thread_ticks() - start) * 1000;
+
+	if (apdu.delay > (long)elapsed)
+		thread_sleep((int)((apdu.delay - elapsed + 500) / 1000));
+
+	FUNC_RETURNS(apdu.rlen + 2);
+}
+
+
+
+static void closeEmulator(struct sc_hsm_emulator *emu)
+{
+	int i;
+
+	for (i = 0; i < emu->numberOfFiles; i++)
+		freeFile(&emu->file[i]);
+
+	memset(emu, 0, sizeof(*emu));
+	free(emu);
+}
+
+
+
+/**
+ * Write the private or secret key description for a pre-provisioned key
+ */
+static int writeKeyDescription(struct sc_hsm_emulator *emu, int id, struct emulatedFile *key, char *label)
+{
+	struct p15PrivateKeyDescription p15;
+	struct p15SecretKeyDescription p15s;
+	unsigned char buff[256], keyid;
+	struct bytebuffer_s bb = { buff, 0, sizeof(buff) };
+
+	memset(&p15, 0, sizeof(p15));
+	keyid = (unsigned char)id;
+
+	if (key->aes != NULL) {
+		memset(&p15s, 0, sizeof(p15s));
+		p15s.keytype = P15_KEYTYPE_AES;
+		p15s.coa.label = label;
+		p15s.id.val = &keyid;
+		p15s.id.len = 1;
+		p15s.usage = P15_ENCIPHER | P15_DECIPHER;
+		p15s.keysize = key->keysize;
+		p15s.keyReference = id;
+
+		if (encodeSecretKeyDescription(&bb, &p15s) < 0)
+			return -1;
+
+		return writeFile(emu, (PRKD_PREFIX << 8) | id, 0, bb.val, (int)bb.len);
+	}
+
+	p15.keytype = key->rsa != NULL ? P15_KEYTYPE_RSA : P15_KEYTYPE_ECC;
+	p15.coa.label = label;
+	p15.id.val = &keyid;
+	p15.id.len = 1;
+	p15.usage = key->rsa != NULL ? P15_SIGN | P15_DECIPHER : P15_SIGN | P15_DERIVE;
+	p15.keysize = key->keysize;
+	p15.keyReference = id;
+
+	if (encodePrivateKeyDescription(&bb, &p15) < 0)
+		return -1;
+
+	return writeFile(emu, (PRKD_PREFIX << 8) | id, 0, bb.val, (int)bb.len);
+}
+
+
+
+/**
+ * Generate the keys listed in PKCS11_EMULATED_KEYS
+ *
+ * The list contains entries like rsa2048:2, ec256:1 or aes256:1, each denoting the key type and size
+ * and the number of keys to generate. Keys are labeled with the key type and size and a
+ * sequence number, e.g. rsa2048-1.
+ */
+static void provisionKeys(struct sc_hsm_emulator *emu)
+{
+	unsigned char gakp[512], req[2048], scr[2];
+	struct bytebuffer_s bb = { gakp, 0, sizeof(gakp) };
+	struct bytebuffer_s request = { req, 0, sizeof(req) };
+	struct bytestring_s oid, chr;
+	struct ec_curve *curve;
+	struct emulatedFile *key;
+	char *keys, *p, spec[16], label[32];
+	int id, size, count, i, ofs;
+
+	keys = getenv("PKCS11_EMULATED_KEYS");
+	if (keys == NULL)
+		keys = "rsa2048:1,ec256:1,aes128:1";
+
+	chr.val = (unsigned char *)"UTDUMMY00001";
+	chr.len = 12;
+	id = 1;
+
+	for (p = keys; *p; p += strcspn(p, ",")) {
+		if (*p == ',')
+			p++;
+
+		count = 1;
+		if ((sscanf(p, "%15[a-z]%d:%d", spec, &size, &count) < 2) || (count < 1))
+			continue;
+
+		if (!strcmp(spec, "aes")) {
+			if ((size != 128) && (size != 192) && (size != 256))
+				continue;
+
+			for (i = 1; (i <= count) && (id <= 255); i++, id++) {
+				key = createFile(emu, (KEY_PREFIX << 8) | id);
+				if (key == NULL)
+					break;
+
+				key->aes = malloc(size >> 3);
+				key->keysize = size;
+				if ((key->aes == NULL) || (RAND_bytes(key->aes, size >> 3) != 1)) {
+					deleteFile(emu, key);
+					break;
+				}
+
+				sprintf(label, "%s%d-%d", spec, size, i);
+				writeKeyDescription(emu, id, key, label);
+			}
+			continue;
+		}
+
+		bbClear(&bb);
+		asn1AppendBytes(&bb, 0x5F29, (unsigned char *)"\x00", 1);
+		ofs = (int)bbGetLength(&bb);
+
+		if (!strcmp(spec, "rsa")) {
+			asn1Append(&bb, 0x06, &algorithmRSA);
+			asn1AppendBytes(&bb, 0x82, (unsigned char *)"\x01\x00\x01", 3);
+			scr[0] = (unsigned char)(size >> 8);
+			scr[1] = (unsigned char)(size & 0xFF);
+			asn1AppendBytes(&bb, 0x02, scr, 2);
+		} else if (!strcmp(spec, "ec")) {
+			switch(size) {
+			case 192: oid.val = (unsigned char *)"\x2A\x86\x48\xCE\x3D\x03\x01\x01"; oid.len = 8; break;
+			case 256: oid = secp256r1; break;
+			case 384: oid.val = (unsigned char *)"\x2B\x81\x04\x00\x22"; oid.len = 5; break;
+			case 521: oid.val = (unsigned char *)"\x2B\x81\x04\x00\x23"; oid.len = 5; break;
+			default: oid.len = 0; break;
+			}
+			curve = oid.len ? cvcGetCurveForOID(&oid) : NULL;
+			if (curve == NULL)
+				continue;
+
+			asn1Append(&bb, 0x06, &algorithmEC);
+			asn1Append(&bb, 0x81, &curve->prime);
+			asn1Append(&bb, 0x82, &curve->coefficientA);
+			asn1Append(&bb, 0x83, &curve->coefficientB);
+			asn1Append(&bb, 0x84, &curve->basePointG);
+			asn1Append(&bb, 0x85, &curve->order);
+			asn1Append(&bb, 0x87, &curve->coFactor);
+		} else {
+			continue;
+		}
+
+		asn1EncapBuffer(0x7F49, &bb, ofs);
+		asn1Append(&bb, 0x5F20, &chr);
+
+		for (i = 1; (i <= count) && (id <= 255); i++, id++) {
+			if (generateKeyPair(emu, id, bb.val, (int)bb.len, &request) < 0) {
+#ifdef DEBUG
+				debug("Could not generate %s%d key\n", spec, size);
+#endif
+				break;
+			}
+
+			sprintf(label, "%s%d-%d", spec, size, i);
+			writeKeyDescription(emu, id, findFile(emu, (KEY_PREFIX << 8) | id), label);
+		}
+	}
+}
+
+
+
+/**
+ * Create the device authentication key and certificate, the CIAInfo with the token label
+ * and the keys to be pre-provisioned
+ */
+static struct sc_hsm_emulator *newEmulator(int index)
+{
+	struct sc_hsm_emulator *emu;
+	struct emulatedFile *devaut;
+	struct ec_curve *curve;
+	unsigned char buff[1024], sig[128];
+	struct bytebuffer_s bb = { buff, 0, sizeof(buff) };
+	struct bytestring_s car, chr;
+	char label[32];
+	int siglen;
+
+	emu = calloc(1, sizeof(struct sc_hsm_emulator));
+	if (emu == NULL)
+		return NULL;
+
+	emu->latency = getLatencyProfile();
+	strcpy(emu->pin, EMULATOR_PIN);
+	emu->pinRetries = EMULATOR_PIN_RETRIES;
+	memcpy(emu->sopin, defaultSOPIN, sizeof(emu->sopin));
+	emu->soRetries = EMULATOR_SO_PIN_RETRIES;
+	sprintf(emu->chr, "UTEMU%05d00001", index);
+
+	curve = cvcGetCurveForOID(&secp256r1);
+	devaut = createFile(emu, (KEY_PREFIX << 8) | 0);
+	devaut->ec = generateECKey(curve);
+	devaut->keysize = 256;
+
+	if (devaut->ec == NULL) {
+		closeEmulator(emu);
+		return NULL;
+	}
+
+	car.val = (unsigned char *)"UTEMUCA00001";
+	car.len = 12;
+	chr.val = (unsigned char *)emu->chr;
+	chr.len = strlen(emu->chr);
+
+	asn1AppendBytes(&bb, 0x5F29, (unsigned char *)"\x00", 1);
+	asn1Append(&bb, 0x42, &car);
+	encodePublicKey(&bb, devaut, curve, &algorithmEC);
+	asn1Append(&bb, 0x5F20, &chr);
+	asn1EncapBuffer(0x7F4E, &bb, 0);
+
+	siglen = sizeof(sig);
+	if (bbHasFailed(&bb) || signCVC(NULL, devaut->ec, bb.val, (int)bb.len, sig, &siglen)) {
+		closeEmulator(emu);
+		return NULL;
+	}
+	asn1AppendBytes(&bb, 0x5F37, sig, siglen);
+	asn1EncapBuffer(0x7F21, &bb, 0);
+	writeFile(emu, 0x2F02, 0, bb.val, (int)bb.len);
+
+	sprintf(label, "SmartCard-HSM Emulator %d", index);
+	bbClear(&bb);
+	asn1AppendBytes(&bb, 0x02, (unsigned char *)"\x00", 1);
+	asn1AppendBytes(&bb, 0x80, (unsigned char *)label, strlen(label));
+	asn1EncapBuffer(0x30, &bb, 0);
+	writeFile(emu, 0x2F03, 0, bb.val, (int)bb.len);
+
+	provisionKeys(emu);
+
+	return emu;
+}
+
+
+
+/**
+ * Add the number of slots with an emulated SmartCard-HSM defined in PKCS11_EMULATED_SLOTS
+ *
+ * Slots are only added once, subsequent calls return the number of emulated slots.
+ *
+ * @param pool the slot pool
+ * @return the number of emulated slots in the pool
+ */
+int addEmulatedSlots(struct p11SlotPool_t *pool)
+{
+	struct p11Slot_t *slot;
+	char *po, scr[64];
+	int cnt, i;
+
+	FUNC_CALLED();
+
+	po = getenv("PKCS11_EMULATED_SLOTS");
+	if (po == NULL)
+		FUNC_RETURNS(0);
+
+	cnt = atoi(po);
+	if (cnt > MAX_EMULATED_SLOTS)
+		cnt = MAX_EMULATED_SLOTS;
+
+	for (slot = getNextSlot(pool, NULL); slot != NULL; slot = getNextSlot(pool, slot)) {
+		if (slot->emulator != NULL)
+			FUNC_RETURNS(cnt);
+	}
+
+	for (i = 1; i <= cnt; i++) {
+		slot = (struct p11Slot_t *) calloc(1, sizeof(struct p11Slot_t));
+
+		if (slot == NULL) {
+			FUNC_FAILS(i - 1, "Out of memory");
+		}
+
+		slot->emulator = newEmulator(i);
+
+		if (slot->emulator == NULL) {
+			free(slot);
+			FUNC_FAILS(i - 1, "Could not create emulator");
+		}
+
+		sprintf(scr, "SmartCard-HSM Emulator %d", i);
+		strbpcpy(slot->info.slotDescription, scr, sizeof(slot->info.slotDescription));
+		strbpcpy(slot->info.manufacturerID, "CardContact", sizeof(slot->info.manufacturerID));
+
+		slot->info.firmwareVersion.major = VERSION_MAJOR;
+		slot->info.firmwareVersion.minor = VERSION_MINOR;
+
+		slot->info.flags = CKF_REMOVABLE_DEVICE;
+
+		slot->maxRAPDU = MAX_RAPDU;
+		slot->maxCAPDU = MAX_CAPDU;
+
+		addSlot(pool, slot);
+
+#ifdef DEBUG
+		debug("Added emulated slot (%lu, %s)\n", slot->id, scr);
+#endif
+	}
+
+	FUNC_RETURNS(cnt);
+}
+
+
+
+/**
+ * Detect the token in the emulated slot
+ *
+ * The emulated card is inserted when the slot is created and never removed.
+ *
+ * @param slot the slot with the emulator
+ * @param token pointer to pointer updated with the token
+ * @return CKR_OK or any other Cryptoki error code
+ */
+int getEmulatedToken(struct p11Slot_t *slot, struct p11Token_t **token)
+{
+	struct p11Token_t *ptoken;
+	int rc;
+
+	FUNC_CALLED();
+
+	if (slot->token == NULL) {
+		beginSlotTransaction(slot);
+		rc = newToken(slot, atrHSM, sizeof(atrHSM), &ptoken);
+		endSlotTransaction(slot);
+
+		if (rc != CKR_OK) {
+			FUNC_FAILS(rc, "newToken() failed");
+		}
+	}
+
+	*token = slot->token;
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * Release the emulator in the slot
+ *
+ * @param slot the slot with the emulator
+ * @return CKR_OK
+ */
+int closeEmulatedSlot(struct p11Slot_t *slot)
+{
+	FUNC_CALLED();
+
+	if (slot->emulator != NULL) {
+		closeEmulator(slot->emulator);
+		slot->emulator = NULL;
+	}
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+#endif
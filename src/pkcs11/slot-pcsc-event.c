@@ -36,6 +36,9 @@
 #include <pkcs11/slot-pcsc.h>
 #include <pkcs11/crc32.h>
 
+#include <common/thread.h>
+#include <common/atomic.h>
+
 #ifdef DEBUG
 #include <common/debug.h>
 #endif
@@ -60,6 +63,39 @@ static SCARDCONTEXT globalContext = -1;
 static SCARDCONTEXT globalBlockingContext = -1;
 static int slotCounter = 0;
 
+#define MONITOR_TIMEOUT		1000
+
+static struct {
+	int enabled;                        // 0 not yet determined, -1 disabled, 1 enabled
+	volatile long running;
+	volatile long rebuild;
+	SCARDCONTEXT context;
+	THREAD thread;
+	MUTEX mutex;                        // Protects the list of watched slots
+	struct p11Slot_t **slots;
+	int numberOfSlots;
+	int maxSlots;
+} monitor;
+
+#define MAX_DISCOVERY_THREADS	16
+#define DISCOVERY_POLL		10
+
+/**
+ * Tokens in a group of readers found by the same call to updatePCSCSlots(),
+ * which are discovered in parallel by a bounded number of threads
+ */
+struct discoveryBatch {
+	struct discoveryBatch *next;
+	struct p11Slot_t **slots;
+	int numberOfSlots;
+	volatile long nextSlot;             // Index of next slot to be taken by a thread
+	volatile long finished;             // Number of threads that completed
+	int numberOfThreads;
+	THREAD thread[MAX_DISCOVERY_THREADS];
+};
+
+static struct discoveryBatch *discoveryBatches = NULL;
+
 
 
 /**
@@ -111,6 +147,577 @@ static int matchFilter(char *value, char *filter)
 
 
 
+
+/**
+ * Invalidate the presence information for a slot watched by the slot monitor.
+ *
+ * The generation is incremented after the monitored flag is cleared, so that
+ * a concurrent isPCSCSlotUnchanged() will never report an outdated state.
+ */
+static void invalidateMonitoredSlot(struct p11Slot_t *slot, int watched)
+{
+	if (!watched)
+		atomic_set(&slot->monitored, 0);
+	atomic_inc(&slot->generation);
+	if (watched)
+		atomic_set(&slot->monitored, 1);
+}
+
+
+
+/**
+ * End the sticky transaction of a slot once the lease has expired
+ *
+ * @param slot the watched slot
+ * @param force wait for the slot and end the transaction regardless of the lease
+ */
+static void expireTransaction(struct p11Slot_t *slot, int force)
+{
+	if (!slot->queue) {
+		return;
+	}
+
+	if (force) {
+		ticket_lock_acquire(slot->queue);
+	} else if (ticket_lock_tryacquire(slot->queue) != 0) {
+		// The slot is in use and the lease is renewed when the slot is released
+		return;
+	}
+
+	if (slot->transaction && (force || ((long)(thread_ticks() - slot->transactionExpires) >= 0))) {
+		endPCSCTransaction(slot, TRUE);
+	}
+
+	ticket_lock_release(slot->queue);
+}
+
+
+
+/**
+ * End all sticky transactions with an expired lease
+ */
+static void expireTransactions()
+{
+	int i;
+
+	mutex_lock(&monitor.mutex);
+	for (i = 0; i < monitor.numberOfSlots; i++) {
+		if (monitor.slots[i]->transaction) {
+			expireTransaction(monitor.slots[i], FALSE);
+		}
+	}
+	mutex_unlock(&monitor.mutex);
+}
+
+
+
+/**
+ * Remove a slot from the list of slots watched by the monitor
+ */
+static void unwatchSlot(struct p11Slot_t *slot)
+{
+	int i;
+
+	mutex_lock(&monitor.mutex);
+	for (i = 0; i < monitor.numberOfSlots; i++) {
+		if (monitor.slots[i] == slot) {
+			monitor.numberOfSlots--;
+			monitor.slots[i] = monitor.slots[monitor.numberOfSlots];
+			break;
+		}
+	}
+	mutex_unlock(&monitor.mutex);
+
+	invalidateMonitoredSlot(slot, FALSE);
+
+	// Without the monitor, nobody would end the transaction after the lease
+	if (slot->transaction) {
+		expireTransaction(slot, TRUE);
+	}
+}
+
+
+
+/**
+ * Background thread tracking card insertion and removal for all watched readers.
+ *
+ * Each reader event increments the generation of the associated slot. The first
+ * result obtained for a reader marks the slot as monitored.
+ *
+ * If a transaction lease is configured, then the monitor wakes up at least once per
+ * lease to end expired transactions.
+ */
+static void slotMonitor(void *arg)
+{
+	SCARD_READERSTATE *rs = NULL;
+	struct p11Slot_t *slot;
+	DWORD readers, i, timeout;
+	LONG rc;
+
+	timeout = MONITOR_TIMEOUT;
+	if ((getPCSCTransactionLease() > 0) && (getPCSCTransactionLease() < MONITOR_TIMEOUT)) {
+		timeout = getPCSCTransactionLease();
+	}
+
+	while (atomic_get(&monitor.running)) {
+		mutex_lock(&monitor.mutex);
+
+		atomic_set(&monitor.rebuild, 0);
+		readers = monitor.numberOfSlots;
+#ifndef __APPLE__
+		readers++;
+#endif
+		free(rs);
+		rs = (SCARD_READERSTATE *)calloc(sizeof(SCARD_READERSTATE), readers + 1);
+
+		for (i = 0; rs && (i < (DWORD)monitor.numberOfSlots); i++) {
+			rs[i].szReader = monitor.slots[i]->readername;
+			rs[i].pvUserData = monitor.slots[i];
+			rs[i].dwCurrentState = SCARD_STATE_UNAWARE;
+		}
+
+#ifndef __APPLE__
+		if (rs) {
+			rs[i].szReader = "\\\\?PnP?\\Notification";
+			rs[i].dwCurrentState = SCARD_STATE_UNAWARE;
+		}
+#endif
+
+		mutex_unlock(&monitor.mutex);
+
+		if ((rs == NULL) || (readers == 0)) {
+			thread_sleep(MONITOR_TIMEOUT);
+			continue;
+		}
+
+		rc = SCardGetStatusChange(monitor.context, 0, rs, readers);
+
+		if (rc != SCARD_S_SUCCESS) {
+#ifdef DEBUG
+			debug("Slot monitor SCardGetStatusChange: %s\n", pcsc_error_to_string(rc));
+#endif
+			thread_sleep(MONITOR_TIMEOUT);
+			continue;
+		}
+
+		// The state of all readers is now known, so the slots can use the cached state
+		for (i = 0; i < readers; i++) {
+			rs[i].dwCurrentState = rs[i].dwEventState;
+			slot = (struct p11Slot_t *)rs[i].pvUserData;
+			if (slot) {
+				if (rs[i].dwEventState & (SCARD_STATE_UNKNOWN | SCARD_STATE_UNAVAILABLE)) {
+					unwatchSlot(slot);
+					atomic_set(&monitor.rebuild, 1);
+				} else {
+					invalidateMonitoredSlot(slot, TRUE);
+				}
+			}
+		}
+
+		while (atomic_get(&monitor.running) && !atomic_get(&monitor.rebuild)) {
+			rc = SCardGetStatusChange(monitor.context, timeout, rs, readers);
+
+			if (getPCSCTransactionLease() > 0) {
+				expireTransactions();
+			}
+
+			if ((rc == SCARD_E_TIMEOUT) || (rc == SCARD_E_CANCELLED)) {
+				continue;
+			}
+
+			if (rc != SCARD_S_SUCCESS) {
+#ifdef DEBUG
+				debug("Slot monitor SCardGetStatusChange: %s\n", pcsc_error_to_string(rc));
+#endif
+				// Don't trust any cached state until the list of readers is rebuild
+				for (i = 0; i < readers; i++) {
+					if (rs[i].pvUserData) {
+						invalidateMonitoredSlot((struct p11Slot_t *)rs[i].pvUserData, FALSE);
+					}
+				}
+				thread_sleep(MONITOR_TIMEOUT);
+				break;
+			}
+
+			for (i = 0; i < readers; i++) {
+				if (!(rs[i].dwEventState & SCARD_STATE_CHANGED)) {
+					continue;
+				}
+#ifdef DEBUG
+				debug("Slot monitor event for %08lx %08lx %s\n", rs[i].dwCurrentState, rs[i].dwEventState, rs[i].szReader);
+#endif
+				rs[i].dwCurrentState = rs[i].dwEventState;
+				slot = (struct p11Slot_t *)rs[i].pvUserData;
+
+				if (slot == NULL) {
+					continue;
+				}
+
+				if (rs[i].dwEventState & (SCARD_STATE_UNKNOWN | SCARD_STATE_UNAVAILABLE)) {
+					// Reader was detached, updatePCSCSlots() will watch the slot again once reattached
+					unwatchSlot(slot);
+					atomic_set(&monitor.rebuild, 1);
+				} else {
+					invalidateMonitoredSlot(slot, TRUE);
+				}
+			}
+		}
+	}
+
+	free(rs);
+}
+
+
+
+/**
+ * Add a slot to the list of slots watched by the background slot monitor.
+ *
+ * The monitor is started with the first slot, if the application allows
+ * the creation of threads and the monitor is not disabled with
+ * PKCS11_SLOT_MONITOR=0.
+ *
+ * @param slot the slot for a newly found or reattached reader
+ */
+static void watchSlot(struct p11Slot_t *slot)
+{
+	struct p11Slot_t **slots;
+	char *po;
+	LONG rc;
+	int i;
+
+	FUNC_CALLED();
+
+	if (monitor.enabled == 0) {
+		po = getenv("PKCS11_SLOT_MONITOR");
+		monitor.enabled = (p11CanCreateThreads() && (!po || (*po != '0'))) ? 1 : -1;
+#ifdef DEBUG
+		debug("Slot monitor is %s\n", monitor.enabled == 1 ? "enabled" : "disabled");
+#endif
+	}
+
+	if (monitor.enabled != 1) {
+		return;
+	}
+
+	if (!atomic_get(&monitor.running)) {
+		rc = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &monitor.context);
+
+#ifdef DEBUG
+		debug("SCardEstablishContext: %s\n", pcsc_error_to_string(rc));
+#endif
+
+		if (rc != SCARD_S_SUCCESS) {
+			monitor.enabled = -1;
+			return;
+		}
+
+		if (mutex_init(&monitor.mutex) != 0) {
+			SCardReleaseContext(monitor.context);
+			monitor.enabled = -1;
+			return;
+		}
+
+		atomic_set(&monitor.running, 1);
+
+		if (thread_create(&monitor.thread, slotMonitor, NULL) != 0) {
+#ifdef DEBUG
+			debug("Could not start slot monitor thread\n");
+#endif
+			atomic_set(&monitor.running, 0);
+			mutex_destroy(&monitor.mutex);
+			SCardReleaseContext(monitor.context);
+			monitor.enabled = -1;
+			return;
+		}
+	}
+
+	mutex_lock(&monitor.mutex);
+
+	for (i = 0; i < monitor.numberOfSlots; i++) {
+		if (monitor.slots[i] == slot) {
+			mutex_unlock(&monitor.mutex);
+			return;
+		}
+	}
+
+	if (monitor.numberOfSlots == monitor.maxSlots) {
+		slots = (struct p11Slot_t **)realloc(monitor.slots, (monitor.maxSlots + 8) * sizeof(*slots));
+		if (slots == NULL) {
+			mutex_unlock(&monitor.mutex);
+			return;
+		}
+		monitor.slots = slots;
+		monitor.maxSlots += 8;
+	}
+
+	monitor.slots[monitor.numberOfSlots++] = slot;
+
+	mutex_unlock(&monitor.mutex);
+
+	// Wake up the monitor to include the new reader. If the cancel is lost, the
+	// reader is included after the next timeout.
+	atomic_set(&monitor.rebuild, 1);
+	SCardCancel(monitor.context);
+}
+
+
+
+/**
+ * Stop the background slot monitor
+ *
+ * Must be called before the slots are released
+ */
+void stopPCSCSlotMonitor()
+{
+	FUNC_CALLED();
+
+	if (atomic_get(&monitor.running)) {
+		atomic_set(&monitor.running, 0);
+		SCardCancel(monitor.context);
+		thread_join(&monitor.thread);
+
+		SCardReleaseContext(monitor.context);
+		mutex_destroy(&monitor.mutex);
+	}
+
+	free(monitor.slots);
+	monitor.slots = NULL;
+	monitor.numberOfSlots = 0;
+	monitor.maxSlots = 0;
+	monitor.enabled = 0;
+}
+
+
+
+/**
+ * Check if the state of the reader is unchanged since the last validation of the token.
+ *
+ * This is the fast path that does not require a call to the PC/SC resource manager
+ * and can be used without holding the global lock.
+ *
+ * @param slot the primary slot
+ * @return TRUE if the token in the slot is known to be still present
+ */
+int isPCSCSlotUnchanged(struct p11Slot_t *slot)
+{
+	if (!atomic_get(&slot->monitored) || slot->closed || !slot->token) {
+		return FALSE;
+	}
+
+	return atomic_get(&slot->generation) == slot->validatedGeneration;
+}
+
+
+/**
+ * Get the maximum number of threads discovering tokens in parallel
+ *
+ * Defined by PKCS11_DISCOVERY_THREADS, with 1 discovering all tokens in the calling thread.
+ */
+static int getDiscoveryThreads()
+{
+	char *po;
+	int threads;
+
+	po = getenv("PKCS11_DISCOVERY_THREADS");
+	threads = po ? atoi(po) : 4;
+
+	if (threads < 1)
+		threads = 1;
+
+	if (threads > MAX_DISCOVERY_THREADS)
+		threads = MAX_DISCOVERY_THREADS;
+
+	return threads;
+}
+
+
+
+/**
+ * Get the time in milliseconds a caller waits for a token discovery to complete
+ *
+ * Defined by PKCS11_DISCOVERY_TIMEOUT, with 0 waiting until discovery completes.
+ */
+static int getDiscoveryTimeout()
+{
+	static int timeout = -1;
+	char *po;
+
+	if (timeout < 0) {
+		po = getenv("PKCS11_DISCOVERY_TIMEOUT");
+		timeout = po ? atoi(po) : 0;
+		if (timeout < 0)
+			timeout = 0;
+	}
+	return timeout;
+}
+
+
+
+/**
+ * Connect to the card in a new reader and create the token
+ *
+ * The slot is held for the duration, so that no other thread can use the reader.
+ */
+static void discoverToken(struct p11Slot_t *slot)
+{
+	acquireSlot(slot);
+	checkForNewPCSCToken(slot);
+	releaseSlot(slot);
+
+	atomic_set(&slot->discovering, 0);
+}
+
+
+
+static void discoveryThread(void *arg)
+{
+	struct discoveryBatch *batch = (struct discoveryBatch *)arg;
+	long i;
+
+	while ((i = atomic_inc(&batch->nextSlot) - 1) < batch->numberOfSlots) {
+		discoverToken(batch->slots[i]);
+	}
+
+	atomic_inc(&batch->finished);
+}
+
+
+
+/**
+ * Release batches whose threads completed
+ *
+ * @param wait wait for all threads to complete
+ */
+static void reapDiscoveryBatches(int wait)
+{
+	struct discoveryBatch **pbatch, *batch;
+	int i;
+
+	pbatch = &discoveryBatches;
+	while (*pbatch) {
+		batch = *pbatch;
+
+		if (!wait && (atomic_get(&batch->finished) < batch->numberOfThreads)) {
+			pbatch = &batch->next;
+			continue;
+		}
+
+		for (i = 0; i < batch->numberOfThreads; i++) {
+			thread_join(&batch->thread[i]);
+		}
+
+		*pbatch = batch->next;
+		free(batch->slots);
+		free(batch);
+	}
+}
+
+
+
+/**
+ * Discover the tokens in new readers
+ *
+ * Connecting to the card and loading the token takes a while, so tokens are discovered
+ * in parallel if more than one reader was found. The batch takes ownership of the slot list.
+ *
+ * @param slots the list of new slots
+ * @param cnt the number of slots in the list
+ */
+static void startDiscovery(struct p11Slot_t **slots, int cnt)
+{
+	struct discoveryBatch *batch;
+	int i, threads;
+
+	threads = getDiscoveryThreads();
+	if (threads > cnt)
+		threads = cnt;
+
+	batch = NULL;
+	if ((threads > 1) && p11CanCreateThreads()) {
+		batch = (struct discoveryBatch *)calloc(1, sizeof(struct discoveryBatch));
+	}
+
+	if (batch == NULL) {
+		for (i = 0; i < cnt; i++) {
+			checkForNewPCSCToken(slots[i]);
+		}
+		free(slots);
+		return;
+	}
+
+#ifdef DEBUG
+	debug("Discovering %d tokens using %d threads\n", cnt, threads);
+#endif
+
+	batch->slots = slots;
+	batch->numberOfSlots = cnt;
+
+	for (i = 0; i < cnt; i++) {
+		slots[i]->discoveryStarted = thread_ticks();
+		atomic_set(&slots[i]->discovering, 1);
+	}
+
+	for (i = 0; i < threads; i++) {
+		if (thread_create(&batch->thread[i], discoveryThread, batch) != 0)
+			break;
+		batch->numberOfThreads++;
+	}
+
+	if (batch->numberOfThreads == 0) {
+		discoveryThread(batch);		// Fall back to discovery in the calling thread
+	}
+
+	batch->next = discoveryBatches;
+	discoveryBatches = batch;
+}
+
+
+
+/**
+ * Wait until the discovery of the token in a new reader completed
+ *
+ * If PKCS11_DISCOVERY_TIMEOUT is set, then a caller waits at most the given number of
+ * milliseconds after the discovery started. A token still being discovered is reported
+ * absent, so that C_GetSlotList() can return the tokens found so far.
+ *
+ * @param slot the primary slot
+ * @return CKR_OK or CKR_TOKEN_NOT_PRESENT if the discovery did not complete in time
+ */
+int waitForPCSCDiscovery(struct p11Slot_t *slot)
+{
+	int timeout;
+
+	if (!atomic_get(&slot->discovering))
+		return CKR_OK;
+
+	timeout = getDiscoveryTimeout();
+
+	while (atomic_get(&slot->discovering)) {
+		if ((timeout > 0) && (thread_ticks() - slot->discoveryStarted >= (unsigned long)timeout)) {
+			FUNC_FAILS(CKR_TOKEN_NOT_PRESENT, "Token discovery not yet completed");
+		}
+		thread_sleep(DISCOVERY_POLL);
+	}
+
+	return CKR_OK;
+}
+
+
+
+/**
+ * Wait for all threads discovering tokens
+ *
+ * Must be called before the slots are released
+ */
+void stopPCSCDiscovery()
+{
+	FUNC_CALLED();
+
+	reapDiscoveryBatches(TRUE);
+}
+
+
+
 /**
  * Check for new readers and add to slot pool.
  *
@@ -120,16 +727,18 @@ static int matchFilter(char *value, char *filter)
  */
 int updatePCSCSlots(struct p11SlotPool_t *pool)
 {
-	struct p11Slot_t *slot,*vslot;
+	struct p11Slot_t *slot,*vslot,**newslots,**tmp;
 	LPTSTR readers = NULL;
 	char *filter, *prealloc;
 	DWORD cch = 0;
 	LPTSTR p;
 	LONG rc;
-	int match,vslotcnt,i;
+	int match,vslotcnt,i,newcnt;
 
 	FUNC_CALLED();
 
+	reapDiscoveryBatches(FALSE);
+
 	/*
 	 * Create a context if not already done
 	 */
@@ -183,6 +792,9 @@ int updatePCSCSlots(struct p11SlotPool_t *pool)
 	}
 #endif
 
+	newslots = NULL;
+	newcnt = 0;
+
 	/* Determine the total number of readers */
 	p = readers;
 	while (*p != '\0') {
@@ -191,14 +803,14 @@ int updatePCSCSlots(struct p11SlotPool_t *pool)
 #endif
 
 		/* Check if we already have a slot for the reader */
-		slot = pool->list;
+		slot = getNextSlot(pool, NULL);
 		match = FALSE;
 		while (slot) {
 			if (strncmp(slot->readername, p, strlen(p)) == 0) {
 				match = TRUE;
 				break;
 			}
-			slot = slot->next;
+			slot = getNextSlot(pool, slot);
 		}
 
 		/* Skip the reader as we already have a slot for it */
@@ -207,6 +819,7 @@ int updatePCSCSlots(struct p11SlotPool_t *pool)
 			if (slot->closed)
 				slot->eventOccured = TRUE;
 			slot->closed = FALSE;
+			watchSlot(slot);
 			continue;
 		}
 
@@ -216,11 +829,15 @@ int updatePCSCSlots(struct p11SlotPool_t *pool)
 		}
 
 		slot = (struct p11Slot_t *) calloc(1, sizeof(struct p11Slot_t));
+		tmp = (struct p11Slot_t **) realloc(newslots, (newcnt + 1) * sizeof(*newslots));
 
-		if (slot == NULL) {
+		if ((slot == NULL) || (tmp == NULL)) {
+			free(slot);
+			free(tmp ? tmp : newslots);
 			free(readers);
 			FUNC_FAILS(CKR_HOST_MEMORY, "Out of memory");
 		}
+		newslots = tmp;
 
 		/* If a reader filter is defined, then slot ids for that reader are
 		 * derived from the reader name using a CRC32 value. If the token
@@ -240,6 +857,7 @@ int updatePCSCSlots(struct p11SlotPool_t *pool)
 
 		if (rc != SCARD_S_SUCCESS) {
 			free(slot);
+			free(newslots);
 			free(readers);
 			FUNC_FAILS(CKR_DEVICE_ERROR, "Could not establish context to PC/SC manager");
 		}
@@ -324,13 +942,21 @@ int updatePCSCSlots(struct p11SlotPool_t *pool)
 			}
 		}
 
-		checkForNewPCSCToken(slot);
+		watchSlot(slot);
+
+		newslots[newcnt++] = slot;
 
 		p += strlen(p) + 1;
 	}
 
 	free(readers);
 
+	if (newcnt > 0) {
+		startDiscovery(newslots, newcnt);
+	} else {
+		free(newslots);
+	}
+
 	FUNC_RETURNS(CKR_OK);
 }
 
@@ -364,12 +990,12 @@ int waitForPCSCEvent(struct p11SlotPool_t *pool, int timeout)
 		}
 	}
 
-	slot = pool->list;
+	slot = getNextSlot(pool, NULL);
 	readers = 0;
 	while (slot) {
-		if ((slot->primarySlot == NULL) && !slot->closed)
+		if ((slot->primarySlot == NULL) && !slot->isPool && !slot->emulator && !slot->replay && !slot->closed)
 			readers++;
-		slot = slot->next;
+		slot = getNextSlot(pool, slot);
 	}
 
 #ifndef __APPLE__
@@ -378,15 +1004,15 @@ int waitForPCSCEvent(struct p11SlotPool_t *pool, int timeout)
 
 	rs = (SCARD_READERSTATE *)calloc(sizeof(SCARD_READERSTATE), readers);
 
-	slot = pool->list;
+	slot = getNextSlot(pool, NULL);
 	i = 0;
 	while (slot) {
-		if ((slot->primarySlot == NULL) && !slot->closed) {
+		if ((slot->primarySlot == NULL) && !slot->isPool && !slot->emulator && !slot->replay && !slot->closed) {
 			rs[i].szReader = slot->readername;
 			rs[i].pvUserData = slot;
 			i++;
 		}
-		slot = slot->next;
+		slot = getNextSlot(pool, slot);
 	}
 
 #ifndef __APPLE__
@@ -484,6 +1110,7 @@ int closePCSCSlot(struct p11Slot_t *slot)
 	}
 
 	rc = SCardDisconnect(slot->card, SCARD_UNPOWER_CARD);
+	slot->transaction = FALSE;
 
 #ifdef DEBUG
 	debug("SCardDisconnect (%i, %s): %s\n", slot->id, slot->readername, pcsc_error_to_string(rc));
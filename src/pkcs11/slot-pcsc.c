@@ -47,6 +47,12 @@
 #include <pkcs11/slot-pcsc.h>
 #include <pkcs11/strbpcpy.h>
 
+#include <common/atomic.h>
+#ifndef MINIDRIVER
+#include <common/thread.h>
+#include <pkcs11/slot-statistics.h>
+#endif
+
 #ifdef DEBUG
 #include <common/debug.h>
 #endif
@@ -303,6 +309,9 @@ int transmitAPDUviaPCSC(struct p11Slot_t *slot,
 #endif
 
 	if (rc != SCARD_S_SUCCESS) {
+#ifndef MINIDRIVER
+		countPCSCError(slot);
+#endif
 		FUNC_FAILS(-1, "SCardTransmit failed");
 	}
 
@@ -363,6 +372,9 @@ int transmitVerifyPinAPDUviaPCSC(struct p11Slot_t *slot,
 #endif
 
 	if (rc != SCARD_S_SUCCESS) {
+#ifndef MINIDRIVER
+		countPCSCError(slot);
+#endif
 		FUNC_FAILS(-1, "SCardControl failed");
 	}
 
@@ -468,6 +480,8 @@ int checkForNewPCSCToken(struct p11Slot_t *slot)
 		FUNC_FAILS(CKR_DEVICE_ERROR, pcsc_error_to_string(rv));
 	}
 
+	slot->transaction = FALSE;
+
 	if (!slot->hasFeatureVerifyPINDirect) {
 		checkPCSCPinPad(slot);
 	}
@@ -482,7 +496,11 @@ int checkForNewPCSCToken(struct p11Slot_t *slot)
 		FUNC_FAILS(CKR_DEVICE_ERROR, pcsc_error_to_string(rc));
 	}
 
-	rc = newToken(slot, atr, atrlen, &ptoken);
+	// Token detection reads many files, which shall not be interleaved with other processes
+	rc = beginSlotTransaction(slot);
+	if (rc == CKR_OK)
+		rc = newToken(slot, atr, atrlen, &ptoken);
+	endSlotTransaction(slot);
 
 	if (rc != CKR_OK) {
 		FUNC_FAILS(rc, "newToken() failed");
@@ -545,6 +563,7 @@ static int checkForRemovedPCSCToken(struct p11Slot_t *slot)
 		}
 
 		rc = SCardDisconnect(slot->card, SCARD_UNPOWER_CARD);
+		slot->transaction = FALSE;
 
 #ifdef DEBUG
 		debug("SCardDisconnect (%i, %s): %s\n", slot->id, slot->readername, pcsc_error_to_string(rc));
@@ -568,15 +587,23 @@ static int checkForRemovedPCSCToken(struct p11Slot_t *slot)
 int getPCSCToken(struct p11Slot_t *slot, struct p11Token_t **token)
 {
 	int rc;
+	long generation;
 
 	FUNC_CALLED();
 
+	// Events signaled after this point will trigger another check
+	generation = atomic_get(&slot->generation);
+
 	if (slot->token) {
 		rc = checkForRemovedPCSCToken(slot);
 	} else {
 		rc = checkForNewPCSCToken(slot);
 	}
 
+	if (rc == CKR_OK) {
+		slot->validatedGeneration = generation;
+	}
+
 	*token = slot->token;
 	FUNC_RETURNS(rc);
 }
@@ -596,8 +623,12 @@ int lockPCSCSlot(struct p11Slot_t *slot)
 	debug("SCardReconnect (%i, %s): %s\n", slot->id, slot->readername, pcsc_error_to_string(rv));
 #endif
 
-	if (rv != SCARD_S_SUCCESS)
+	if (rv != SCARD_S_SUCCESS) {
+#ifndef MINIDRIVER
+		countPCSCError(slot);
+#endif
 		FUNC_FAILS(CKR_DEVICE_ERROR, "Could not reconnect to card");
+	}
 
 	FUNC_RETURNS(CKR_OK);
 }
@@ -617,9 +648,126 @@ int unlockPCSCSlot(struct p11Slot_t *slot)
 	debug("SCardReconnect (%i, %s): %s\n", slot->id, slot->readername, pcsc_error_to_string(rv));
 #endif
 
-	if (rv != SCARD_S_SUCCESS)
+	if (rv != SCARD_S_SUCCESS) {
+#ifndef MINIDRIVER
+		countPCSCError(slot);
+#endif
 		FUNC_FAILS(CKR_DEVICE_ERROR, "Could not reconnect to card");
+	}
 
 	FUNC_RETURNS(CKR_OK);
 }
+
+
+
+/**
+ * Return the time in milliseconds a transaction is kept open after the last operation
+ *
+ * The sticky transaction is enabled with PKCS11_TRANSACTION_LEASE and requires the slot monitor,
+ * which ends transactions whose lease expired.
+ *
+ * @return the lease in milliseconds or 0 if disabled
+ */
+int getPCSCTransactionLease()
+{
+	static int lease = -1;
+	char *po;
+
+	if (lease == -1) {
+		po = getenv("PKCS11_TRANSACTION_LEASE");
+		lease = po ? atoi(po) : 0;
+		if (lease < 0)
+			lease = 0;
+#ifdef DEBUG
+		debug("Transaction lease is %d ms\n", lease);
+#endif
+	}
+	return lease;
+}
+
+
+
+/**
+ * Begin a PC/SC transaction, unless a sticky transaction is still open
+ *
+ * Must be called by the thread that acquired the slot.
+ *
+ * @param slot the primary slot
+ * @return CKR_OK or CKR_DEVICE_ERROR
+ */
+int beginPCSCTransaction(struct p11Slot_t *slot)
+{
+	LONG rv;
+
+	FUNC_CALLED();
+
+	if (slot->transaction) {
+		FUNC_RETURNS(CKR_OK);
+	}
+
+	if (!slot->card) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "No card handle");
+	}
+
+	rv = SCardBeginTransaction(slot->card);
+
+#ifdef DEBUG
+	debug("SCardBeginTransaction (%i, %s): %s\n", slot->id, slot->readername, pcsc_error_to_string(rv));
+#endif
+
+	if (rv != SCARD_S_SUCCESS) {
+#ifndef MINIDRIVER
+		countPCSCError(slot);
+#endif
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Could not begin transaction");
+	}
+
+	slot->transaction = TRUE;
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * End the PC/SC transaction
+ *
+ * If a transaction lease is configured and the reader is watched by the slot monitor,
+ * then the transaction remains open until the lease expires.
+ *
+ * Must be called by the thread that acquired the slot.
+ *
+ * @param slot the primary slot
+ * @param force end the transaction regardless of the lease
+ */
+void endPCSCTransaction(struct p11Slot_t *slot, int force)
+{
+	LONG rv;
+
+	FUNC_CALLED();
+
+	if (!slot->transaction) {
+		return;
+	}
+
+#ifndef MINIDRIVER
+	if (!force && (getPCSCTransactionLease() > 0) && atomic_get(&slot->monitored)) {
+		slot->transactionExpires = thread_ticks() + getPCSCTransactionLease();
+		return;
+	}
+#endif
+
+	rv = SCardEndTransaction(slot->card, SCARD_LEAVE_CARD);
+
+#ifdef DEBUG
+	debug("SCardEndTransaction (%i, %s): %s\n", slot->id, slot->readername, pcsc_error_to_string(rv));
+#endif
+
+#ifndef MINIDRIVER
+	if (rv != SCARD_S_SUCCESS)
+		countPCSCError(slot);
+#endif
+
+	slot->transaction = FALSE;
+}
 #endif /* CTAPI */
@@ -121,9 +121,16 @@ void checkPCSCPinPad(struct p11Slot_t *slot);
 int checkForNewPCSCToken(struct p11Slot_t *slot);
 int lockPCSCSlot(struct p11Slot_t *slot);
 int unlockPCSCSlot(struct p11Slot_t *slot);
+int getPCSCTransactionLease();
+int beginPCSCTransaction(struct p11Slot_t *slot);
+void endPCSCTransaction(struct p11Slot_t *slot, int force);
 int updatePCSCSlots(struct p11SlotPool_t *pool);
 int waitForPCSCEvent(struct p11SlotPool_t *pool, int timeout);
 int closePCSCSlot(struct p11Slot_t *slot);
+int isPCSCSlotUnchanged(struct p11Slot_t *slot);
+void stopPCSCSlotMonitor();
+int waitForPCSCDiscovery(struct p11Slot_t *slot);
+void stopPCSCDiscovery();
 
 #endif
 
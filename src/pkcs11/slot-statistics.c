@@ -0,0 +1,459 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2020, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    slot-statistics.c
+ * @author  Andreas Schwier
+ * @brief   Counters and latency histograms for APDUs exchanged with a card
+ *
+ * Each APDU sent to a card is counted with the number of bytes, the time the card needed to
+ * respond and the time the command waited for the reader, in total and for the instruction
+ * byte of the command. Counters are updated with atomic operations and the structures for a
+ * slot and an instruction are allocated on first use, so counting needs no lock.
+ *
+ * The counters are obtained with the vendor function SC_GetAPDUStatistics() or written to the
+ * file named in PKCS11_STATISTICS_FILE every PKCS11_STATISTICS_INTERVAL seconds.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <common/atomic.h>
+#include <common/thread.h>
+
+#include <pkcs11/p11generic.h>
+#include <pkcs11/slotpool.h>
+#include <pkcs11/slot-statistics.h>
+
+#ifdef DEBUG
+#include <common/debug.h>
+#endif
+
+#define DEFAULT_DUMP_INTERVAL	60
+
+
+
+/**
+ * Counters for the APDUs of a slot or of a single instruction
+ */
+struct apdu_counters {
+	volatile long long count;
+	volatile long long failed;
+	volatile long long bytesSent;
+	volatile long long bytesReceived;
+	volatile long long cardTime;
+	volatile long long queueTime;
+	volatile long long histogram[SC_STATS_BUCKETS];
+};
+
+
+
+/**
+ * Counters of a slot
+ */
+struct slot_statistics {
+	volatile long long pcscErrors;      /**< Failed PC/SC calls                   */
+	struct apdu_counters total;         /**< Counters for all instructions        */
+	struct apdu_counters *ins[256];     /**< Counters by instruction byte         */
+};
+
+
+
+static struct {
+	struct p11SlotPool_t *pool;
+	char file[FILENAME_MAX];
+	int interval;
+	THREAD thread;
+	volatile long running;
+} dump;
+
+
+
+/**
+ * Determine the histogram bucket for a time in microseconds
+ */
+static int getBucket(unsigned long long us)
+{
+	int m, i;
+
+	if (us < 8)
+		return (int)us;
+
+	m = 3;
+	while ((m < 40) && ((us >> (m + 1)) != 0))
+		m++;
+
+	i = ((m - 2) << 3) + (int)((us >> (m - 3)) & 7);
+
+	return i < SC_STATS_BUCKETS ? i : SC_STATS_BUCKETS - 1;
+}
+
+
+
+static struct slot_statistics *getStatistics(struct p11Slot_t *slot)
+{
+	struct slot_statistics *stats;
+
+	stats = atomic_get_ptr(&slot->statistics);
+
+	if (stats == NULL) {
+		stats = (struct slot_statistics *)calloc(1, sizeof(struct slot_statistics));
+		if (stats == NULL)
+			return NULL;
+
+		// Another thread may have allocated the counters in the meantime
+		if (!atomic_cas_ptr(&slot->statistics, NULL, stats)) {
+			free(stats);
+			stats = atomic_get_ptr(&slot->statistics);
+		}
+	}
+	return stats;
+}
+
+
+
+static struct apdu_counters *getCounters(struct slot_statistics *stats, unsigned char ins)
+{
+	struct apdu_counters *counters;
+
+	counters = atomic_get_ptr(&stats->ins[ins]);
+
+	if (counters == NULL) {
+		counters = (struct apdu_counters *)calloc(1, sizeof(struct apdu_counters));
+		if (counters == NULL)
+			return NULL;
+
+		if (!atomic_cas_ptr(&stats->ins[ins], NULL, counters)) {
+			free(counters);
+			counters = atomic_get_ptr(&stats->ins[ins]);
+		}
+	}
+	return counters;
+}
+
+
+
+static void addCounters(struct apdu_counters *counters, size_t capdu_len, int rapdu_len,
+		unsigned long long queueTime, unsigned long long cardTime, int bucket)
+{
+	atomic_add64(&counters->count, 1);
+	if (rapdu_len < 0)
+		atomic_add64(&counters->failed, 1);
+	else
+		atomic_add64(&counters->bytesReceived, rapdu_len);
+	atomic_add64(&counters->bytesSent, capdu_len);
+	atomic_add64(&counters->queueTime, queueTime);
+	atomic_add64(&counters->cardTime, cardTime);
+	atomic_add64(&counters->histogram[bucket], 1);
+}
+
+
+
+/**
+ * Count an APDU exchanged with the card in a slot
+ *
+ * @param slot the slot
+ * @param ins the instruction byte of the command
+ * @param capdu_len the length of the command APDU
+ * @param rapdu_len the length of the response APDU or a negative value if the transmission failed
+ * @param queued the time the command was queued for the reader
+ * @param started the time the command was sent to the card
+ * @param finished the time the response was received
+ */
+void countAPDU(struct p11Slot_t *slot, unsigned char ins, size_t capdu_len, int rapdu_len,
+	unsigned long long queued, unsigned long long started, unsigned long long finished)
+{
+	struct slot_statistics *stats;
+	struct apdu_counters *counters;
+	unsigned long long cardTime;
+	int bucket;
+
+	if (slot->primarySlot)
+		slot = slot->primarySlot;
+
+	stats = getStatistics(slot);
+	if (stats == NULL)
+		return;
+
+	cardTime = finished - started;
+	bucket = getBucket(cardTime);
+
+	addCounters(&stats->total, capdu_len, rapdu_len, started - queued, cardTime, bucket);
+
+	counters = getCounters(stats, ins);
+	if (counters != NULL)
+		addCounters(counters, capdu_len, rapdu_len, started - queued, cardTime, bucket);
+}
+
+
+
+/**
+ * Count a failed call to the PC/SC resource manager for the card in a slot
+ *
+ * @param slot the slot
+ */
+void countPCSCError(struct p11Slot_t *slot)
+{
+	struct slot_statistics *stats;
+
+	if (slot->primarySlot)
+		slot = slot->primarySlot;
+
+	stats = getStatistics(slot);
+	if (stats != NULL)
+		atomic_add64(&stats->pcscErrors, 1);
+}
+
+
+
+/**
+ * Obtain a snapshot of the counters of a slot
+ *
+ * @param slot the slot
+ * @param ins the instruction byte or SC_STATS_ALL_INS for the counters of all instructions
+ * @param out the structure receiving the counters
+ * @return CKR_OK or CKR_ARGUMENTS_BAD
+ */
+int getSlotStatistics(struct p11Slot_t *slot, CK_ULONG ins, SC_APDU_STATISTICS *out)
+{
+	struct slot_statistics *stats;
+	struct apdu_counters *counters;
+	int i;
+
+	if (ins > SC_STATS_ALL_INS)
+		return CKR_ARGUMENTS_BAD;
+
+	if (slot->primarySlot)
+		slot = slot->primarySlot;
+
+	memset(out, 0, sizeof(SC_APDU_STATISTICS));
+
+	stats = atomic_get_ptr(&slot->statistics);
+	if (stats == NULL)
+		return CKR_OK;
+
+	if (ins == SC_STATS_ALL_INS) {
+		counters = &stats->total;
+		out->pcscErrors = atomic_get64(&stats->pcscErrors);
+	} else {
+		counters = atomic_get_ptr(&stats->ins[ins]);
+		if (counters == NULL)
+			return CKR_OK;
+	}
+
+	out->count = atomic_get64(&counters->count);
+	out->failed = atomic_get64(&counters->failed);
+	out->bytesSent = atomic_get64(&counters->bytesSent);
+	out->bytesReceived = atomic_get64(&counters->bytesReceived);
+	out->cardTime = atomic_get64(&counters->cardTime);
+	out->queueTime = atomic_get64(&counters->queueTime);
+
+	for (i = 0; i < SC_STATS_BUCKETS; i++)
+		out->histogram[i] = atomic_get64(&counters->histogram[i]);
+
+	return CKR_OK;
+}
+
+
+
+/**
+ * Release the counters of a slot
+ *
+ * @param slot the slot
+ */
+void freeSlotStatistics(struct p11Slot_t *slot)
+{
+	int i;
+
+	if (slot->statistics == NULL)
+		return;
+
+	for (i = 0; i < 256; i++)
+		free(slot->statistics->ins[i]);
+
+	free(slot->statistics);
+	slot->statistics = NULL;
+}
+
+
+
+/**
+ * Return the upper bound of the time in which the given fraction of APDUs completed
+ */
+static unsigned long long getPercentile(SC_APDU_STATISTICS *stats, double fraction)
+{
+	unsigned long long sum, limit;
+	int i;
+
+	limit = (unsigned long long)(stats->count * fraction);
+	sum = 0;
+
+	for (i = 0; i < SC_STATS_BUCKETS - 1; i++) {
+		sum += stats->histogram[i];
+		if ((sum > limit) || (sum == stats->count))
+			return SC_STATS_BUCKET_START(i + 1) - 1;
+	}
+	return SC_STATS_BUCKET_START(SC_STATS_BUCKETS - 1);
+}
+
+
+
+static void writeCounters(FILE *fp, unsigned long slotID, char *ins, SC_APDU_STATISTICS *stats)
+{
+	if (stats->count == 0)
+		return;
+
+	fprintf(fp, "%lu %s %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu\n",
+			slotID, ins, stats->count, stats->failed, stats->bytesSent, stats->bytesReceived,
+			stats->queueTime / stats->count, stats->cardTime / stats->count,
+			getPercentile(stats, 0.5), getPercentile(stats, 0.9), getPercentile(stats, 0.99),
+			getPercentile(stats, 1.0));
+}
+
+
+
+/**
+ * Write the counters of all slots to the statistics file
+ */
+static void writeStatistics()
+{
+	SC_APDU_STATISTICS stats;
+	struct p11Slot_t *slot;
+	char scr[3];
+	FILE *fp;
+	int i, len;
+
+	fp = fopen(dump.file, "w");
+
+	if (fp == NULL) {
+#ifdef DEBUG
+		debug("Could not write statistics to %s\n", dump.file);
+#endif
+		return;
+	}
+
+	fprintf(fp, "# slot ins count failed bytes-sent bytes-received queue-mean card-mean card-p50 card-p90 card-p99 card-max\n");
+	fprintf(fp, "# Times in microseconds\n");
+
+	p11LockMutex(dump.pool->mutex);
+
+	for (slot = dump.pool->list; slot != NULL; slot = slot->next) {
+		if (slot->statistics == NULL)
+			continue;
+
+		len = sizeof(slot->info.slotDescription);
+		while ((len > 0) && (slot->info.slotDescription[len - 1] == ' '))
+			len--;
+
+		getSlotStatistics(slot, SC_STATS_ALL_INS, &stats);
+		fprintf(fp, "# slot %lu %.*s, %llu PC/SC errors\n", slot->id, len, slot->info.slotDescription, stats.pcscErrors);
+		writeCounters(fp, slot->id, "all", &stats);
+
+		for (i = 0; i < 256; i++) {
+			getSlotStatistics(slot, i, &stats);
+			sprintf(scr, "%02X", i);
+			writeCounters(fp, slot->id, scr, &stats);
+		}
+	}
+
+	p11UnlockMutex(dump.pool->mutex);
+
+	fclose(fp);
+}
+
+
+
+static void statisticsDumper(void *arg)
+{
+	unsigned long next;
+
+	next = thread_ticks() + dump.interval * 1000;
+
+	while (atomic_get(&dump.running)) {
+		thread_sleep(100);
+
+		if ((long)(thread_ticks() - next) >= 0) {
+			writeStatistics();
+			next += dump.interval * 1000;
+		}
+	}
+}
+
+
+
+/**
+ * Start the thread writing the counters to the file named in PKCS11_STATISTICS_FILE
+ *
+ * @param pool the slot pool
+ */
+void startStatisticsDump(struct p11SlotPool_t *pool)
+{
+	char *po;
+
+	po = getenv("PKCS11_STATISTICS_FILE");
+	if ((po == NULL) || (*po == 0) || (strlen(po) >= sizeof(dump.file)))
+		return;
+
+	if (!p11CanCreateThreads() || atomic_get(&dump.running))
+		return;
+
+	strcpy(dump.file, po);
+	dump.pool = pool;
+
+	po = getenv("PKCS11_STATISTICS_INTERVAL");
+	dump.interval = po ? atoi(po) : DEFAULT_DUMP_INTERVAL;
+	if (dump.interval < 1)
+		dump.interval = 1;
+
+	atomic_set(&dump.running, 1);
+
+	if (thread_create(&dump.thread, statisticsDumper, NULL) != 0) {
+#ifdef DEBUG
+		debug("Could not start statistics thread\n");
+#endif
+		atomic_set(&dump.running, 0);
+	}
+}
+
+
+
+/**
+ * Stop the statistics thread and write the final counters
+ *
+ * Must be called before the slots are released
+ */
+void stopStatisticsDump()
+{
+	if (!atomic_get(&dump.running))
+		return;
+
+	atomic_set(&dump.running, 0);
+	thread_join(&dump.thread);
+
+	writeStatistics();
+}
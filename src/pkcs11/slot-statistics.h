@@ -0,0 +1,88 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2020, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    slot-statistics.h
+ * @author  Andreas Schwier
+ * @brief   Counters and latency histograms for APDUs exchanged with a card
+ */
+
+#ifndef ___SLOT_STATISTICS_H_INC___
+#define ___SLOT_STATISTICS_H_INC___
+
+#include <pkcs11/cryptoki.h>
+
+/**
+ * Value for ins in SC_GetAPDUStatistics() to obtain the sum over all instructions
+ */
+#define SC_STATS_ALL_INS		0x100
+
+/**
+ * The histogram has 8 exact buckets for 0 to 7 microseconds followed by 8 buckets for each
+ * power of two, which limits the error to 12.5%. Times longer than 2^32 microseconds are
+ * counted in the last bucket.
+ */
+#define SC_STATS_BUCKETS		240
+
+/**
+ * Shortest time in microseconds counted in bucket i
+ */
+#define SC_STATS_BUCKET_START(i)	((i) < 8 ? (unsigned long long)(i) : (unsigned long long)(8 + ((i) & 7)) << (((i) >> 3) - 1))
+
+/**
+ * APDU statistics for a slot, returned by SC_GetAPDUStatistics()
+ *
+ * Times are measured in microseconds. The card time is the time from sending the command to receiving
+ * the response, the queue time is the time waiting for other threads and processes using the reader.
+ */
+typedef struct SC_APDU_STATISTICS {
+	unsigned long long count;                       /**< Number of APDUs transmitted          */
+	unsigned long long failed;                      /**< Number of failed transmissions       */
+	unsigned long long bytesSent;                   /**< Sum of command APDU lengths          */
+	unsigned long long bytesReceived;               /**< Sum of response APDU lengths         */
+	unsigned long long cardTime;                    /**< Sum of card times                    */
+	unsigned long long queueTime;                   /**< Sum of queue times                   */
+	unsigned long long pcscErrors;                  /**< Failed PC/SC calls, all INS only     */
+	unsigned long long histogram[SC_STATS_BUCKETS]; /**< Number of APDUs by card time         */
+} SC_APDU_STATISTICS;
+
+typedef CK_RV (*SC_GetAPDUStatistics_t)(CK_SLOT_ID slotID, CK_ULONG ins, SC_APDU_STATISTICS *stats);
+
+CK_DECLARE_FUNCTION(CK_RV, SC_GetAPDUStatistics)(CK_SLOT_ID slotID, CK_ULONG ins, SC_APDU_STATISTICS *stats);
+
+struct p11Slot_t;
+struct p11SlotPool_t;
+
+void countAPDU(struct p11Slot_t *slot, unsigned char ins, size_t capdu_len, int rapdu_len,
+	unsigned long long queued, unsigned long long started, unsigned long long finished);
+void countPCSCError(struct p11Slot_t *slot);
+int getSlotStatistics(struct p11Slot_t *slot, CK_ULONG ins, SC_APDU_STATISTICS *stats);
+void freeSlotStatistics(struct p11Slot_t *slot);
+void startStatisticsDump(struct p11SlotPool_t *pool);
+void stopStatisticsDump();
+
+#endif /* ___SLOT_STATISTICS_H_INC___ */
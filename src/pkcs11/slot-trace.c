@@ -0,0 +1,739 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2020, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    slot-trace.c
+ * @author  Andreas Schwier
+ * @brief   Recording of APDU traces and slots replaying a recorded trace
+ *
+ * With PKCS11_APDU_TRACE set to a file name, all command and response APDUs exchanged with
+ * a card are written to a binary trace together with the slot, the time the command was
+ * sent and the time the card needed to respond. PIN values are not recorded and the data
+ * returned by DECIPHER, DERIVE and the AES operations is replaced by zeros, keeping the length
+ * and status word. The file is created with access for the owner only and must not exist.
+ *
+ * The trace starts with the 8 byte magic TRACE_MAGIC and a 4 byte version, followed by
+ * records with a 25 byte header and two variable length data fields. All numbers are
+ * encoded MSB first.
+ *
+ *   1 byte  type (TRACE_READER or TRACE_APDU)
+ *   4 byte  slot id
+ *   8 byte  time in microseconds since the trace was opened
+ *   4 byte  duration in microseconds
+ *   4 byte  length of first data field (slot description or C-APDU)
+ *   4 byte  length of second data field (ATR or R-APDU, empty if the transmission failed)
+ *
+ * With PKCS11_APDU_REPLAY set to a trace file, a slot is created for each recorded slot,
+ * which answers commands with the recorded responses. Responses are delayed by the recorded
+ * duration, unless PKCS11_APDU_REPLAY_TIMING is set to fast.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <common/memset_s.h>
+#include <common/thread.h>
+
+#include <pkcs11/slot.h>
+#include <pkcs11/slotpool.h>
+#include <pkcs11/token.h>
+#include <pkcs11/strbpcpy.h>
+#include <pkcs11/slot-trace.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef DEBUG
+#include <common/debug.h>
+#endif
+
+#define TRACE_HEADER_LEN	25
+#define MAX_TRACE_DATA		65536
+#define MAX_TRACE_ATR		40
+
+extern struct p11Context_t *context;
+
+
+
+/**
+ * A command and the response recorded in the trace
+ */
+struct apdu_exchange {
+	unsigned long duration;             /**< Time the card needed in microseconds */
+	unsigned char *capdu;               /**< Command APDU                         */
+	size_t capdu_len;                   /**< Length of command APDU               */
+	unsigned char *rapdu;               /**< Response APDU                        */
+	size_t rapdu_len;                   /**< Length of response, 0 for failure    */
+};
+
+
+
+/**
+ * The recorded card in a replayed slot
+ */
+struct apdu_replay {
+	unsigned long slotID;               /**< Slot id in the trace                 */
+	char description[65];               /**< Slot description in the trace        */
+	unsigned char atr[MAX_TRACE_ATR];   /**< ATR of the recorded card             */
+	size_t atrlen;                      /**< Length of ATR                        */
+	int originalTiming;                 /**< Delay responses by recorded duration */
+	int numberOfExchanges;              /**< Number of recorded exchanges         */
+	int sizeOfExchanges;                /**< Allocated entries in exchange        */
+	int next;                           /**< Next exchange expected               */
+	unsigned long mismatches;           /**< Commands not found verbatim          */
+	struct apdu_exchange *exchange;     /**< Recorded exchanges in order          */
+};
+
+
+
+static FILE *traceFile = NULL;
+static void *traceMutex = NULL;
+static unsigned long long traceStart = 0;
+
+
+
+static void putUInt(unsigned char *p, unsigned long long v, int len)
+{
+	while (len > 0) {
+		len--;
+		p[len] = (unsigned char)(v & 0xFF);
+		v >>= 8;
+	}
+}
+
+
+
+static unsigned long long getUInt(unsigned char *p, int len)
+{
+	unsigned long long v = 0;
+
+	while (len > 0) {
+		v = (v << 8) | *p++;
+		len--;
+	}
+	return v;
+}
+
+
+
+/**
+ * Commands transporting PIN values are only recorded with header and length
+ */
+static int isSensitiveCommand(unsigned char *capdu, size_t capdu_len)
+{
+	if (capdu_len <= 4)
+		return FALSE;
+
+	return (capdu[1] == 0x20) || (capdu[1] == 0x24) || (capdu[1] == 0x2C);
+}
+
+
+
+/**
+ * Responses with plaintext or key material are only recorded with length and status word
+ *
+ * This covers DECIPHER, DERIVE and the AES operations
+ */
+static int isSensitiveResponse(unsigned char *capdu, size_t capdu_len)
+{
+	if (capdu_len < 4)
+		return FALSE;
+
+	return (capdu[1] == 0x62) || (capdu[1] == 0x76) || (capdu[1] == 0x78);
+}
+
+
+
+static void sleepMicroseconds(unsigned long us)
+{
+#ifdef _WIN32
+	Sleep((us + 500) / 1000);
+#else
+	struct timespec ts;
+
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = (us % 1000000) * 1000;
+	nanosleep(&ts, NULL);
+#endif
+}
+
+
+
+/**
+ * Open the trace file named in PKCS11_APDU_TRACE
+ *
+ * The sequence %p in the name is replaced by the process id, so that each process of
+ * a server writes its own trace.
+ */
+void openAPDUTrace()
+{
+	unsigned char header[12];
+	char name[FILENAME_MAX], *po, *pp;
+#ifndef _WIN32
+	int fd;
+#endif
+
+	if (traceFile != NULL)
+		return;
+
+	po = getenv("PKCS11_APDU_TRACE");
+	if ((po == NULL) || (*po == 0))
+		return;
+
+	pp = strstr(po, "%p");
+	if (pp != NULL) {
+		if (strlen(po) + 16 >= sizeof(name))
+			return;
+#ifdef _WIN32
+		sprintf(name, "%.*s%d%s", (int)(pp - po), po, _getpid(), pp + 2);
+#else
+		sprintf(name, "%.*s%d%s", (int)(pp - po), po, (int)getpid(), pp + 2);
+#endif
+	} else {
+		if (strlen(po) >= sizeof(name))
+			return;
+		strcpy(name, po);
+	}
+
+#ifdef _WIN32
+	traceFile = fopen(name, "wb");
+#else
+	// Do not follow a link or reuse a file prepared by someone else
+	fd = open(name, O_WRONLY | O_CREAT | O_EXCL, 0600);
+	traceFile = fd < 0 ? NULL : fdopen(fd, "wb");
+	if ((traceFile == NULL) && (fd >= 0))
+		close(fd);
+#endif
+
+	if (traceFile == NULL) {
+#ifdef DEBUG
+		debug("Could not create APDU trace %s\n", name);
+#endif
+		return;
+	}
+
+	memcpy(header, TRACE_MAGIC, 8);
+	putUInt(header + 8, TRACE_VERSION, 4);
+
+	if (fwrite(header, 1, sizeof(header), traceFile) != sizeof(header)) {
+		fclose(traceFile);
+		traceFile = NULL;
+		return;
+	}
+
+	p11CreateMutex(&traceMutex);
+	traceStart = thread_micros();
+
+#ifdef DEBUG
+	debug("Recording APDU trace to %s\n", name);
+#endif
+}
+
+
+
+/**
+ * Close the trace file
+ */
+void closeAPDUTrace()
+{
+	if (traceFile == NULL)
+		return;
+
+	fclose(traceFile);
+	traceFile = NULL;
+
+	p11DestroyMutex(traceMutex);
+	traceMutex = NULL;
+}
+
+
+
+/**
+ * Return TRUE if APDUs are recorded
+ */
+int isAPDUTraceActive()
+{
+	return traceFile != NULL;
+}
+
+
+
+static void writeTraceRecord(int type, unsigned long slotID, unsigned long long time, unsigned long duration,
+		unsigned char *data1, size_t len1, unsigned char *data2, size_t len2)
+{
+	unsigned char header[TRACE_HEADER_LEN];
+
+	header[0] = (unsigned char)type;
+	putUInt(header + 1, slotID, 4);
+	putUInt(header + 5, time - traceStart, 8);
+	putUInt(header + 13, duration, 4);
+	putUInt(header + 17, len1, 4);
+	putUInt(header + 21, len2, 4);
+
+	p11LockMutex(traceMutex);
+
+	if (traceFile != NULL) {
+		fwrite(header, 1, sizeof(header), traceFile);
+		if (len1)
+			fwrite(data1, 1, len1, traceFile);
+		if (len2)
+			fwrite(data2, 1, len2, traceFile);
+		fflush(traceFile);
+	}
+
+	p11UnlockMutex(traceMutex);
+}
+
+
+
+/**
+ * Record the description of the slot and the ATR of a card found in the slot
+ *
+ * @param slot the slot in which a card was found
+ * @param atr the ATR of the card
+ * @param atrlen the length of the ATR
+ */
+void traceReader(struct p11Slot_t *slot, unsigned char *atr, size_t atrlen)
+{
+	size_t len;
+
+	if (traceFile == NULL)
+		return;
+
+	len = sizeof(slot->info.slotDescription);
+	while ((len > 0) && (slot->info.slotDescription[len - 1] == ' '))
+		len--;
+
+	writeTraceRecord(TRACE_READER, slot->id, thread_micros(), 0,
+			slot->info.slotDescription, len, atr, atrlen);
+}
+
+
+
+/**
+ * Record a command and the response received from the card
+ *
+ * @param slot the slot to which the command was sent
+ * @param started the time the command was sent
+ * @param finished the time the response was received
+ * @param capdu the command APDU
+ * @param capdu_len the length of the command APDU
+ * @param rapdu the response APDU
+ * @param rapdu_len the length of the response APDU or a negative value if the transmission failed
+ */
+void traceAPDU(struct p11Slot_t *slot, unsigned long long started, unsigned long long finished,
+	unsigned char *capdu, size_t capdu_len,
+	unsigned char *rapdu, int rapdu_len)
+{
+	unsigned char masked[MAX_CAPDU], maskedResponse[MAX_RAPDU];
+
+	if (traceFile == NULL)
+		return;
+
+	if (rapdu_len < 0)
+		rapdu_len = 0;
+
+	if (isSensitiveCommand(capdu, capdu_len) && (capdu_len <= sizeof(masked))) {
+		memcpy(masked, capdu, 4);
+		memset(masked + 4, 0, capdu_len - 4);
+		capdu = masked;
+	}
+
+	if (isSensitiveResponse(capdu, capdu_len) && (rapdu_len > 2) && (rapdu_len <= sizeof(maskedResponse))) {
+		memset(maskedResponse, 0, rapdu_len - 2);
+		memcpy(maskedResponse + rapdu_len - 2, rapdu + rapdu_len - 2, 2);
+		rapdu = maskedResponse;
+	}
+
+	writeTraceRecord(TRACE_APDU, slot->id, started, (unsigned long)(finished - started),
+			capdu, capdu_len, rapdu, rapdu_len);
+}
+
+
+
+static void freeReplay(struct apdu_replay *replay)
+{
+	int i;
+
+	for (i = 0; i < replay->numberOfExchanges; i++) {
+		free(replay->exchange[i].capdu);
+		free(replay->exchange[i].rapdu);
+	}
+	free(replay->exchange);
+	free(replay);
+}
+
+
+
+static struct apdu_replay *findReplay(struct apdu_replay **replay, int cnt, unsigned long slotID)
+{
+	int i;
+
+	for (i = 0; i < cnt; i++) {
+		if (replay[i]->slotID == slotID)
+			return replay[i];
+	}
+	return NULL;
+}
+
+
+
+static int addExchange(struct apdu_replay *replay, unsigned long duration,
+		unsigned char *capdu, size_t capdu_len, unsigned char *rapdu, size_t rapdu_len)
+{
+	struct apdu_exchange *ex;
+	int size;
+
+	if (replay->numberOfExchanges == replay->sizeOfExchanges) {
+		size = replay->sizeOfExchanges ? replay->sizeOfExchanges * 2 : 256;
+		ex = (struct apdu_exchange *)realloc(replay->exchange, size * sizeof(struct apdu_exchange));
+		if (ex == NULL)
+			return -1;
+		replay->exchange = ex;
+		replay->sizeOfExchanges = size;
+	}
+
+	ex = &replay->exchange[replay->numberOfExchanges];
+	ex->duration = duration;
+	ex->capdu = capdu;
+	ex->capdu_len = capdu_len;
+	ex->rapdu = rapdu;
+	ex->rapdu_len = rapdu_len;
+	replay->numberOfExchanges++;
+	return 0;
+}
+
+
+
+static unsigned char *readTraceData(FILE *fp, size_t len)
+{
+	unsigned char *p;
+
+	p = (unsigned char *)malloc(len ? len : 1);
+	if (p == NULL)
+		return NULL;
+
+	if (len && (fread(p, 1, len, fp) != len)) {
+		free(p);
+		return NULL;
+	}
+	return p;
+}
+
+
+
+/**
+ * Load the slots recorded in a trace file
+ *
+ * @param name the trace file
+ * @param replay the array receiving a replay structure for each recorded slot
+ * @param cnt the number of recorded slots
+ * @return CKR_OK or CKR_GENERAL_ERROR if the file can not be read
+ */
+static int loadTrace(char *name, struct apdu_replay **replay, int *cnt)
+{
+	unsigned char header[TRACE_HEADER_LEN], *data1, *data2;
+	struct apdu_replay *r;
+	unsigned long slotID, duration;
+	size_t len1, len2;
+	FILE *fp;
+	int type;
+
+	FUNC_CALLED();
+
+	*cnt = 0;
+
+	fp = fopen(name, "rb");
+
+	if (fp == NULL)
+		FUNC_FAILS(CKR_GENERAL_ERROR, "Could not open trace");
+
+	if ((fread(header, 1, 12, fp) != 12) || memcmp(header, TRACE_MAGIC, 8) || (getUInt(header + 8, 4) != TRACE_VERSION)) {
+		fclose(fp);
+		FUNC_FAILS(CKR_GENERAL_ERROR, "Not an APDU trace");
+	}
+
+	while (fread(header, 1, sizeof(header), fp) == sizeof(header)) {
+		type = header[0];
+		slotID = (unsigned long)getUInt(header + 1, 4);
+		duration = (unsigned long)getUInt(header + 13, 4);
+		len1 = (size_t)getUInt(header + 17, 4);
+		len2 = (size_t)getUInt(header + 21, 4);
+
+		if ((len1 > MAX_TRACE_DATA) || (len2 > MAX_TRACE_DATA))
+			break;
+
+		data1 = readTraceData(fp, len1);
+		data2 = readTraceData(fp, len2);
+
+		if ((data1 == NULL) || (data2 == NULL)) {
+			free(data1);
+			free(data2);
+			break;
+		}
+
+		r = findReplay(replay, *cnt, slotID);
+
+		if ((type == TRACE_READER) && (r == NULL) && (*cnt < MAX_REPLAYED_SLOTS) && (len2 <= MAX_TRACE_ATR)) {
+			r = (struct apdu_replay *)calloc(1, sizeof(struct apdu_replay));
+			if (r != NULL) {
+				r->slotID = slotID;
+				if (len1 >= sizeof(r->description))
+					len1 = sizeof(r->description) - 1;
+				memcpy(r->description, data1, len1);
+				memcpy(r->atr, data2, len2);
+				r->atrlen = len2;
+				replay[(*cnt)++] = r;
+			}
+		}
+
+		if ((type == TRACE_APDU) && (r != NULL) && (len1 >= 4)) {
+			if (addExchange(r, duration, data1, len1, data2, len2) == 0)
+				continue;
+		}
+
+		free(data1);
+		free(data2);
+	}
+
+	fclose(fp);
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * Add a slot for each slot recorded in the trace file named in PKCS11_APDU_REPLAY
+ *
+ * Slots are only added once, subsequent calls return the number of replayed slots.
+ *
+ * @param pool the slot pool
+ * @return the number of replayed slots in the pool
+ */
+int addReplayedSlots(struct p11SlotPool_t *pool)
+{
+	struct apdu_replay *replay[MAX_REPLAYED_SLOTS];
+	struct p11Slot_t *slot;
+	char *po;
+	int cnt, i, j, fast;
+
+	FUNC_CALLED();
+
+	po = getenv("PKCS11_APDU_REPLAY");
+	if ((po == NULL) || (*po == 0))
+		FUNC_RETURNS(0);
+
+	cnt = 0;
+	for (slot = getNextSlot(pool, NULL); slot != NULL; slot = getNextSlot(pool, slot)) {
+		if (slot->replay != NULL)
+			cnt++;
+	}
+
+	if (cnt > 0)
+		FUNC_RETURNS(cnt);
+
+	if (loadTrace(po, replay, &cnt) != CKR_OK)
+		FUNC_RETURNS(0);
+
+	po = getenv("PKCS11_APDU_REPLAY_TIMING");
+	fast = (po != NULL) && !strcmp(po, "fast");
+
+	for (i = 0; i < cnt; i++) {
+		slot = (struct p11Slot_t *) calloc(1, sizeof(struct p11Slot_t));
+
+		if (slot == NULL) {
+			for (j = i; j < cnt; j++)
+				freeReplay(replay[j]);
+			FUNC_FAILS(i, "Out of memory");
+		}
+
+		replay[i]->originalTiming = !fast;
+		slot->replay = replay[i];
+
+		strbpcpy(slot->info.slotDescription, replay[i]->description, sizeof(slot->info.slotDescription));
+		strbpcpy(slot->info.manufacturerID, "CardContact", sizeof(slot->info.manufacturerID));
+
+		slot->info.firmwareVersion.major = VERSION_MAJOR;
+		slot->info.firmwareVersion.minor = VERSION_MINOR;
+
+		slot->info.flags = CKF_REMOVABLE_DEVICE;
+
+		slot->maxRAPDU = MAX_RAPDU;
+		slot->maxCAPDU = MAX_CAPDU;
+
+		addSlot(pool, slot);
+
+#ifdef DEBUG
+		debug("Added replayed slot (%lu, %s) with %d APDUs\n", slot->id, replay[i]->description, replay[i]->numberOfExchanges);
+#endif
+	}
+
+	FUNC_RETURNS(cnt);
+}
+
+
+
+static int matchesExchange(struct apdu_exchange *ex, unsigned char *capdu, size_t capdu_len, int exact)
+{
+	if (ex->capdu_len != capdu_len)
+		return FALSE;
+
+	if (exact && !isSensitiveCommand(capdu, capdu_len))
+		return !memcmp(ex->capdu, capdu, capdu_len);
+
+	return !memcmp(ex->capdu, capdu, 4);
+}
+
+
+
+/**
+ * Locate the recorded exchange for a command
+ *
+ * The search starts after the last exchange replayed and wraps around at the end of the trace,
+ * so that a recorded workload can be replayed repeatedly. If the command was not recorded
+ * verbatim, which happens for signatures over data that is different in each run, then the
+ * next command with the same header and length is used.
+ */
+static int findExchange(struct apdu_replay *replay, unsigned char *capdu, size_t capdu_len)
+{
+	int exact, i, j;
+
+	for (exact = TRUE; exact >= FALSE; exact--) {
+		for (i = 0; i < replay->numberOfExchanges; i++) {
+			j = (replay->next + i) % replay->numberOfExchanges;
+			if (matchesExchange(&replay->exchange[j], capdu, capdu_len, exact)) {
+				if (!exact)
+					replay->mismatches++;
+				return j;
+			}
+		}
+	}
+	return -1;
+}
+
+
+
+/**
+ * Answer a command with the response recorded in the trace
+ *
+ * @param slot the replayed slot
+ * @param capdu the command APDU
+ * @param capdu_len the length of the command APDU
+ * @param rapdu the buffer receiving the response, may be the same as capdu
+ * @param rapdu_len the size of the response buffer
+ * @return the length of the response or -1 if the command is not in the trace
+ */
+int transmitAPDUviaReplay(struct p11Slot_t *slot,
+	unsigned char *capdu, size_t capdu_len,
+	unsigned char *rapdu, size_t rapdu_len)
+{
+	struct apdu_replay *replay = slot->replay;
+	struct apdu_exchange *ex;
+	int i;
+
+	FUNC_CALLED();
+
+	i = findExchange(replay, capdu, capdu_len);
+
+	if (i < 0)
+		FUNC_FAILS(-1, "Command not found in trace");
+
+	ex = &replay->exchange[i];
+	replay->next = (i + 1) % replay->numberOfExchanges;
+
+	if (replay->originalTiming)
+		sleepMicroseconds(ex->duration);
+
+	if (ex->rapdu_len == 0)
+		FUNC_FAILS(-1, "Transmission failed in trace");
+
+	if (ex->rapdu_len > rapdu_len)
+		FUNC_FAILS(-1, "Recorded response exceeds buffer");
+
+	memcpy(rapdu, ex->rapdu, ex->rapdu_len);
+
+	FUNC_RETURNS((int)ex->rapdu_len);
+}
+
+
+
+/**
+ * Detect the token in the replayed slot
+ *
+ * The recorded card is inserted when the slot is created and never removed.
+ *
+ * @param slot the replayed slot
+ * @param token pointer to pointer updated with the token
+ * @return CKR_OK or any other Cryptoki error code
+ */
+int getReplayedToken(struct p11Slot_t *slot, struct p11Token_t **token)
+{
+	struct p11Token_t *ptoken;
+	int rc;
+
+	FUNC_CALLED();
+
+	if (slot->token == NULL) {
+		beginSlotTransaction(slot);
+		rc = newToken(slot, slot->replay->atr, slot->replay->atrlen, &ptoken);
+		endSlotTransaction(slot);
+
+		if (rc != CKR_OK) {
+			FUNC_FAILS(rc, "newToken() failed");
+		}
+	}
+
+	*token = slot->token;
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * Release the recorded exchanges of the slot
+ *
+ * @param slot the replayed slot
+ * @return CKR_OK
+ */
+int closeReplayedSlot(struct p11Slot_t *slot)
+{
+	FUNC_CALLED();
+
+	if (slot->replay != NULL) {
+#ifdef DEBUG
+		debug("Replayed slot %lu had %lu commands not found verbatim\n", slot->id, slot->replay->mismatches);
+#endif
+		freeReplay(slot->replay);
+		slot->replay = NULL;
+	}
+
+	FUNC_RETURNS(CKR_OK);
+}
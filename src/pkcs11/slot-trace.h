@@ -0,0 +1,63 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2020, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    slot-trace.h
+ * @author  Andreas Schwier
+ * @brief   Recording of APDU traces and slots replaying a recorded trace
+ */
+
+#ifndef ___SLOT_TRACE_H_INC___
+#define ___SLOT_TRACE_H_INC___
+
+#include <pkcs11/cryptoki.h>
+#include <pkcs11/p11generic.h>
+
+#define TRACE_MAGIC		"SCHTRACE"
+#define TRACE_VERSION		1
+
+#define TRACE_READER		1
+#define TRACE_APDU		2
+
+#define MAX_REPLAYED_SLOTS	16
+
+void openAPDUTrace();
+void closeAPDUTrace();
+int isAPDUTraceActive();
+void traceReader(struct p11Slot_t *slot, unsigned char *atr, size_t atrlen);
+void traceAPDU(struct p11Slot_t *slot, unsigned long long started, unsigned long long finished,
+	unsigned char *capdu, size_t capdu_len,
+	unsigned char *rapdu, int rapdu_len);
+
+int addReplayedSlots(struct p11SlotPool_t *pool);
+int transmitAPDUviaReplay(struct p11Slot_t *slot,
+	unsigned char *capdu, size_t capdu_len,
+	unsigned char *rapdu, size_t rapdu_len);
+int getReplayedToken(struct p11Slot_t *slot, struct p11Token_t **token);
+int closeReplayedSlot(struct p11Slot_t *slot);
+
+#endif /* ___SLOT_TRACE_H_INC___ */
@@ -34,12 +34,15 @@
 #include <string.h>
 
 #include <common/memset_s.h>
+#include <common/thread.h>
+#include <common/atomic.h>
 
 #include <pkcs11/p11generic.h>
 #include <pkcs11/slot.h>
 #include <pkcs11/token.h>
 #include <pkcs11/slotpool.h>
 #include <pkcs11/session.h>
+#include <pkcs11/token-pool.h>
 
 #ifdef DEBUG
 #include <common/debug.h>
@@ -51,6 +54,15 @@
 #include "slot-pcsc.h"
 #endif
 
+#if defined(ENABLE_EMULATOR) && !defined(MINIDRIVER)
+#include "slot-emulator.h"
+#endif
+
+#ifndef MINIDRIVER
+#include "slot-trace.h"
+#include "slot-statistics.h"
+#endif
+
 #ifndef _WIN32
 #include <unistd.h>
 #endif
@@ -61,6 +73,26 @@ extern struct p11Context_t *context;
 
 
 
+/**
+ * Release the tokens removed from the slot
+ *
+ * Must only be called if no thread holds a reference obtained with getTokenReference()
+ *
+ * @param slot       Pointer to slot structure.
+ */
+void freeRemovedTokens(struct p11Slot_t *slot)
+{
+	struct p11Token_t *token;
+
+	while (slot->removedToken) {
+		token = slot->removedToken;
+		slot->removedToken = token->next;
+		freeToken(token);
+	}
+}
+
+
+
 /**
  * addToken adds a token to the specified slot.
  *
@@ -86,14 +118,13 @@ int addToken(struct p11Slot_t *slot, struct p11Token_t *token)
 		return CKR_FUNCTION_FAILED;
 	}
 
-	if (slot->removedToken) {
-		freeToken(slot->removedToken);
-		slot->removedToken = NULL;
+	if (slot->removedToken && !atomic_get(&slot->tokenUsers)) {
+		freeRemovedTokens(slot);
 	}
 
 	slot->token = token;                     /* Add token to slot                */
 	slot->info.flags |= CKF_TOKEN_PRESENT;   /* indicate the presence of a token */
-	if (slot->primarySlot != NULL)
+	if ((slot->primarySlot != NULL) || slot->isPool)
 		slot->eventOccured = TRUE;
 
 	return CKR_OK;
@@ -136,20 +167,21 @@ int removeToken(struct p11Slot_t *slot)
 		}
 	}
 
-	if (slot->removedToken) {
+	if (slot->removedToken && !atomic_get(&slot->tokenUsers)) {
 #ifndef MINIDRIVER
 		closeSessionsForSlot(&context->sessionPool, slot->id);
 #endif
-		freeToken(slot->removedToken);
-		slot->removedToken = NULL;
+		freeRemovedTokens(slot);
 	}
 
 	// A removed token and associated sessions are not immediately released from memory
-	// to give running threads a change to complete token operations.
+	// to give running threads a change to complete token operations. Tokens still
+	// referenced with getTokenReference() are kept until the last reference is returned.
+	slot->token->next = slot->removedToken;
 	slot->removedToken = slot->token;
 	slot->token = NULL;
 	slot->info.flags &= ~CKF_TOKEN_PRESENT;
-	if (slot->primarySlot != NULL)
+	if ((slot->primarySlot != NULL) || slot->isPool)
 		slot->eventOccured = TRUE;
 
 #ifndef MINIDRIVER
@@ -236,6 +268,20 @@ int encodeCommandAPDU(
 
 
 
+/**
+ * Check if transactions are kept open for a lease after the last operation
+ */
+static int isTransactionLeased()
+{
+#if !defined(MINIDRIVER) && !defined(CTAPI)
+	return getPCSCTransactionLease() > 0;
+#else
+	return FALSE;
+#endif
+}
+
+
+
 /*
  *  Process an ISO 7816 APDU with the underlying terminal hardware.
  *
@@ -257,8 +303,13 @@ int transmitAPDU(struct p11Slot_t *slot,
 		int OutLen, unsigned char *OutData,
 		int InLen, unsigned char *InData, int InSize, unsigned short *SW1SW2)
 {
-	int rc;
+	int rc, leased;
 	unsigned char apdu[MAX_CAPDU];
+#ifndef MINIDRIVER
+	unsigned char capdu[MAX_CAPDU];
+	unsigned long long queued, started, finished;
+	int tracing, clen;
+#endif
 #ifdef DEBUG
 	char scr[MAX_CAPDU + 128];
 	char *po;
@@ -306,6 +357,40 @@ int transmitAPDU(struct p11Slot_t *slot,
 		FUNC_FAILS(rc, "Encoding APDU failed");
 	}
 
+#ifndef MINIDRIVER
+	queued = thread_micros();
+#endif
+
+	// A single APDU only opens a transaction if the lease saves the arbitration for the next APDU
+	// The APDU is sent without transaction if it can not be started
+	leased = isTransactionLeased();
+	if (leased)
+		beginSlotTransaction(slot);
+	else
+		acquireSlot(slot);
+
+#ifndef MINIDRIVER
+	// The response overwrites the command in apdu, so the trace needs a copy
+	clen = rc;
+	tracing = isAPDUTraceActive();
+	if (tracing)
+		memcpy(capdu, apdu, clen);
+
+	started = thread_micros();
+
+	if (slot->replay)
+		rc = transmitAPDUviaReplay(slot,
+			apdu, rc,
+			apdu, sizeof(apdu));
+	else
+#endif
+#if defined(ENABLE_EMULATOR) && !defined(MINIDRIVER)
+	if (slot->emulator)
+		rc = transmitAPDUviaEmulator(slot,
+			apdu, rc,
+			apdu, sizeof(apdu));
+	else
+#endif
 #ifdef CTAPI
 	rc = transmitAPDUviaCTAPI(slot, 0,
 			apdu, rc,
@@ -316,6 +401,24 @@ int transmitAPDU(struct p11Slot_t *slot,
 			apdu, sizeof(apdu));
 #endif
 
+#ifndef MINIDRIVER
+	finished = thread_micros();
+#endif
+
+	if (leased)
+		endSlotTransaction(slot);
+	else
+		releaseSlot(slot);
+
+#ifndef MINIDRIVER
+	countAPDU(slot, INS, clen, rc, queued, started, finished);
+
+	if (tracing) {
+		traceAPDU(slot, started, finished, capdu, clen, apdu, rc);
+		memset_s(capdu, sizeof(capdu), 0, sizeof(capdu));
+	}
+#endif
+
 	if (rc >= 2) {
 		*SW1SW2 = (apdu[rc - 2] << 8) | apdu[rc - 1];
 		rc -= 2;
@@ -362,6 +465,11 @@ int transmitVerifyPinAPDU(struct p11Slot_t *slot,
 {
 	int rc;
 	unsigned char apdu[MAX_CAPDU];
+#if !defined(MINIDRIVER) && !defined(CTAPI)
+	unsigned char capdu[MAX_CAPDU];
+	unsigned long long started;
+	int tracing, clen;
+#endif
 #ifdef DEBUG
 	char scr[MAX_CAPDU + 128];
 #endif
@@ -389,11 +497,29 @@ int transmitVerifyPinAPDU(struct p11Slot_t *slot,
 	rc = -1;
 
 #else
+	acquireSlot(slot);
+
+#ifndef MINIDRIVER
+	tracing = isAPDUTraceActive();
+	if (tracing) {
+		clen = rc;
+		memcpy(capdu, apdu, clen);
+		started = thread_micros();
+	}
+#endif
+
 	rc = transmitVerifyPinAPDUviaPCSC(slot,
 			pinformat, minpinsize, maxpinsize,
 			pinblockstring, pinlengthformat,
 			apdu, rc,
 			apdu, sizeof(apdu));
+
+	releaseSlot(slot);
+
+#ifndef MINIDRIVER
+	if (tracing)
+		traceAPDU(slot, started, thread_micros(), capdu, clen, apdu, rc);
+#endif
 #endif
 
 	if (rc >= 2) {
@@ -484,6 +610,44 @@ int getToken(struct p11Slot_t *slot, struct p11Token_t **token)
 
 
 
+/**
+ * Obtain the token in the slot for use without holding the global lock
+ *
+ * The token is not released from memory before the reference is returned with
+ * releaseTokenReference(), even if it is removed from the slot in the meantime.
+ *
+ * @param slot       Pointer to slot structure.
+ * @param token      Pointer to pointer updated with the token
+ * @return           CKR_OK or CKR_TOKEN_NOT_PRESENT
+ */
+int getTokenReference(struct p11Slot_t *slot, struct p11Token_t **token)
+{
+	// Announce the reference before reading the token, so that removeToken() keeps it
+	atomic_inc(&slot->tokenUsers);
+
+	*token = slot->token;
+
+	if (*token == NULL) {
+		atomic_dec(&slot->tokenUsers);
+		return CKR_TOKEN_NOT_PRESENT;
+	}
+	return CKR_OK;
+}
+
+
+
+/**
+ * Return a reference obtained with getTokenReference()
+ *
+ * @param slot       Pointer to slot structure.
+ */
+void releaseTokenReference(struct p11Slot_t *slot)
+{
+	atomic_dec(&slot->tokenUsers);
+}
+
+
+
 int getValidatedToken(struct p11Slot_t *slot, struct p11Token_t **token)
 {
 	int rc;
@@ -491,12 +655,59 @@ int getValidatedToken(struct p11Slot_t *slot, struct p11Token_t **token)
 
 	FUNC_CALLED();
 
+#ifndef MINIDRIVER
+	// The pooled slot aggregates the tokens found in other slots
+	if (slot->isPool)
+		return getPoolToken(slot, token);
+#endif
+
 	// Checking for new or removed token is always performed on the
 	// primary slot
 	pslot = slot;
 	if (pslot->primarySlot)
 		pslot = pslot->primarySlot;
 
+#ifndef MINIDRIVER
+	// The replayed card is never removed, so the token needs to be detected only once
+	if (pslot->replay) {
+		if (pslot->token == NULL) {
+			p11LockMutex(context->mutex);
+			rc = getReplayedToken(pslot, token);
+			p11UnlockMutex(context->mutex);
+
+			if (rc != CKR_OK)
+				return rc;
+		}
+		return getToken(slot, token);
+	}
+#endif
+
+#if defined(ENABLE_EMULATOR) && !defined(MINIDRIVER)
+	// The emulated card is never removed, so the token needs to be detected only once
+	if (pslot->emulator) {
+		if (pslot->token == NULL) {
+			p11LockMutex(context->mutex);
+			rc = getEmulatedToken(pslot, token);
+			p11UnlockMutex(context->mutex);
+
+			if (rc != CKR_OK)
+				return rc;
+		}
+		return getToken(slot, token);
+	}
+#endif
+
+#if !defined(MINIDRIVER) && !defined(CTAPI)
+	// The token in a new reader may still be discovered by another thread
+	rc = waitForPCSCDiscovery(pslot);
+	if (rc != CKR_OK)
+		return rc;
+
+	// The slot monitor reported no change for the reader since the last check
+	if (isPCSCSlotUnchanged(pslot))
+		return getToken(slot, token);
+#endif
+
 #ifndef MINIDRIVER
 	p11LockMutex(context->mutex);
 #endif
@@ -586,6 +797,10 @@ int lockSlot(struct p11Slot_t *slot)
 	if (pslot->primarySlot)
 		pslot = pslot->primarySlot;
 
+	// Other processes can not access an emulated or replayed card
+	if (pslot->emulator || pslot->replay)
+		return 0;
+
 #ifdef CTAPI
 	rc = 0;
 #else
@@ -608,6 +823,9 @@ int unlockSlot(struct p11Slot_t *slot)
 	if (pslot->primarySlot)
 		pslot = pslot->primarySlot;
 
+	if (pslot->emulator || pslot->replay)
+		return 0;
+
 #ifdef CTAPI
 	rc = 0;
 #else
@@ -618,6 +836,140 @@ int unlockSlot(struct p11Slot_t *slot)
 
 
 
+/**
+ * Create the queue used to serialize access to the card in a reader
+ *
+ * Only primary slots have a queue, virtual slots use the queue of the primary slot.
+ */
+int createSlotQueue(struct p11Slot_t *slot)
+{
+#ifndef MINIDRIVER
+	if (slot->primarySlot || slot->queue)
+		return CKR_OK;
+
+	slot->queue = (struct ticket_lock *)calloc(1, sizeof(struct ticket_lock));
+
+	if (slot->queue == NULL)
+		return CKR_HOST_MEMORY;
+
+	if (ticket_lock_init(slot->queue) != 0) {
+		free(slot->queue);
+		slot->queue = NULL;
+		return CKR_CANT_LOCK;
+	}
+#endif
+	return CKR_OK;
+}
+
+
+
+void destroySlotQueue(struct p11Slot_t *slot)
+{
+#ifndef MINIDRIVER
+	if (slot->primarySlot || !slot->queue)
+		return;
+
+	ticket_lock_destroy(slot->queue);
+	free(slot->queue);
+	slot->queue = NULL;
+#endif
+}
+
+
+
+/**
+ * Acquire the card in the reader for the calling thread.
+ *
+ * Threads are served in the order of arrival, so that all threads using a reader
+ * get a fair share, while threads using different readers run in parallel.
+ *
+ * The call can be nested, so that a token driver can wrap a sequence of APDUs that
+ * must not be interleaved with APDUs from other threads, e.g. MANAGE SE followed
+ * by PSO or a chained WRITE BINARY.
+ */
+void acquireSlot(struct p11Slot_t *slot)
+{
+#ifndef MINIDRIVER
+	if (slot->primarySlot)
+		slot = slot->primarySlot;
+
+	if (slot->queue)
+		ticket_lock_acquire(slot->queue);
+#endif
+}
+
+
+
+/**
+ * Release the card in the reader acquired with acquireSlot()
+ */
+void releaseSlot(struct p11Slot_t *slot)
+{
+#ifndef MINIDRIVER
+	if (slot->primarySlot)
+		slot = slot->primarySlot;
+
+	if (slot->queue)
+		ticket_lock_release(slot->queue);
+#endif
+}
+
+
+
+/**
+ * Begin a sequence of APDUs that must not be interleaved with APDUs from other threads or processes
+ *
+ * The slot is acquired for the calling thread and for PC/SC readers a transaction is started with
+ * the resource manager, so that other processes can not change the selected application or
+ * security environment and pcscd arbitrates access only once for the sequence.
+ *
+ * Calls can be nested and must be paired with endSlotTransaction(), even if an error is returned.
+ *
+ * @return CKR_OK or CKR_DEVICE_ERROR if the PC/SC transaction could not be started
+ */
+int beginSlotTransaction(struct p11Slot_t *slot)
+{
+	int rc = CKR_OK;
+
+#ifndef MINIDRIVER
+	if (slot->primarySlot)
+		slot = slot->primarySlot;
+
+	acquireSlot(slot);
+
+#ifndef CTAPI
+	if (slot->queue && !slot->isPool && !slot->emulator && !slot->replay) {
+		// A nested call retries the transaction if the outer call failed to start it
+		slot->transactionDepth++;
+		rc = beginPCSCTransaction(slot);
+	}
+#endif
+#endif
+	return rc;
+}
+
+
+
+/**
+ * End the sequence of APDUs started with beginSlotTransaction()
+ */
+void endSlotTransaction(struct p11Slot_t *slot)
+{
+#ifndef MINIDRIVER
+	if (slot->primarySlot)
+		slot = slot->primarySlot;
+
+#ifndef CTAPI
+	if (slot->queue && !slot->isPool && !slot->emulator && !slot->replay && (--slot->transactionDepth == 0))
+		endPCSCTransaction(slot, FALSE);
+#endif
+
+	releaseSlot(slot);
+#endif
+}
+
+
+
 int findSlotObject(struct p11Slot_t *slot, CK_OBJECT_HANDLE handle, struct p11Object_t **object, int publicObject)
 {
 	int rc;
@@ -657,9 +1009,19 @@ int closeSlot(struct p11Slot_t *slot)
 
 	FUNC_CALLED();
 
-	if (slot->primarySlot)
+	if (slot->primarySlot || slot->isPool)
 		FUNC_RETURNS(CKR_OK);
 
+#ifndef MINIDRIVER
+	if (slot->replay)
+		FUNC_RETURNS(closeReplayedSlot(slot));
+#endif
+
+#if defined(ENABLE_EMULATOR) && !defined(MINIDRIVER)
+	if (slot->emulator)
+		FUNC_RETURNS(closeEmulatedSlot(slot));
+#endif
+
 #ifndef MINIDRIVER
 #ifdef CTAPI
 	rc = closeCTAPISlot(slot);
@@ -39,6 +39,7 @@
 
 int addToken(struct p11Slot_t *slot, struct p11Token_t *token);
 int removeToken(struct p11Slot_t *slot);
+void freeRemovedTokens(struct p11Slot_t *slot);
 int encodeCommandAPDU(
 		unsigned char CLA, unsigned char INS, unsigned char P1, unsigned char P2,
 		size_t Nc, unsigned char *OutData, int Ne,
@@ -54,12 +55,20 @@ int transmitVerifyPinAPDU(struct p11Slot_t *slot,
 		unsigned char pinformat, unsigned char minpinsize, unsigned char maxpinsize,
 		unsigned char pinblockstring, unsigned char pinlengthformat);
 int getToken(struct p11Slot_t *slot, struct p11Token_t **token);
+int getTokenReference(struct p11Slot_t *slot, struct p11Token_t **token);
+void releaseTokenReference(struct p11Slot_t *slot);
 int getValidatedToken(struct p11Slot_t *slot, struct p11Token_t **token);
 int handleDeviceError(CK_SESSION_HANDLE hSession);
 int findSlotObject(struct p11Slot_t *slot, CK_OBJECT_HANDLE handle, struct p11Object_t **object, int publicObject);
 int findSlotKey(struct p11Slot_t *slot, CK_OBJECT_HANDLE handle, struct p11Object_t **object);
 int lockSlot(struct p11Slot_t *slot);
 int unlockSlot(struct p11Slot_t *slot);
+int createSlotQueue(struct p11Slot_t *slot);
+void destroySlotQueue(struct p11Slot_t *slot);
+void acquireSlot(struct p11Slot_t *slot);
+void releaseSlot(struct p11Slot_t *slot);
+int beginSlotTransaction(struct p11Slot_t *slot);
+void endSlotTransaction(struct p11Slot_t *slot);
 int updateSlots(struct p11SlotPool_t *pool);
 int closeSlot(struct p11Slot_t *slot);
 int addToken(struct p11Slot_t *slot, struct p11Token_t *token);
@@ -40,6 +40,9 @@
 #include <pkcs11/slot.h>
 #include <pkcs11/token.h>
 #include <pkcs11/session.h>
+#include <pkcs11/token-pool.h>
+#include <pkcs11/slot-trace.h>
+#include <pkcs11/slot-statistics.h>
 #include <common/debug.h>
 
 #ifdef CTAPI
@@ -48,6 +51,10 @@
 #include "slot-pcsc.h"
 #endif
 
+#ifdef ENABLE_EMULATOR
+#include "slot-emulator.h"
+#endif
+
 extern struct p11Context_t *context;
 
 
@@ -98,6 +105,11 @@ int initSlotPool(struct p11SlotPool_t *pool)
 	pool->numberOfSlots = 0;
 	pool->nextSlotID = 1;
 
+	p11CreateMutex(&pool->mutex);
+
+	openAPDUTrace();
+	startStatisticsDump(pool);
+
 	FUNC_RETURNS(CKR_OK);
 }
 
@@ -109,6 +121,13 @@ int terminateSlotPool(struct p11SlotPool_t *pool)
 
 	FUNC_CALLED();
 
+#ifndef CTAPI
+	stopPCSCDiscovery();
+	stopPCSCSlotMonitor();
+#endif
+
+	stopStatisticsDump();
+
 	pSlot = pool->list;
 
 	/* clear the slot pool */
@@ -120,17 +139,23 @@ int terminateSlotPool(struct p11SlotPool_t *pool)
 
 		if (pSlot->removedToken) {
 			closeSessionsForSlot(&context->sessionPool, pSlot->id);
-			freeToken(pSlot->removedToken);
-			pSlot->removedToken = NULL;
+			freeRemovedTokens(pSlot);
 		}
 
 		closeSlot(pSlot);
+		destroySlotQueue(pSlot);
+		freeSlotStatistics(pSlot);
 
 		pFreeSlot = pSlot;
 		pSlot = pSlot->next;
 		free(pFreeSlot);
 	}
 
+	p11DestroyMutex(pool->mutex);
+	pool->mutex = NULL;
+
+	closeAPDUTrace();
+
 	FUNC_RETURNS(CKR_OK);
 }
 
@@ -157,21 +182,29 @@ int addSlot(struct p11SlotPool_t *pool, struct p11Slot_t *slot)
 
 	FUNC_CALLED();
 
+	// Without a queue, access to the card is not serialized
+	createSlotQueue(slot);
+
+	// Virtual slots may be added by threads discovering tokens in parallel
+	p11LockMutex(pool->mutex);
+
 	ppSlot = &pool->list;
 	while (*ppSlot && (memcmp(slot->info.slotDescription, (*ppSlot)->info.slotDescription, sizeof(slot->info.slotDescription)) >= 0))
 		ppSlot = &(*ppSlot)->next;
 
-	slot->next = *ppSlot;
-	*ppSlot = slot;
-
-	pool->numberOfSlots++;
-
 	/* Slot id might have been set during slot creation */
 	if (slot->id == 0) {
 		slot->id = pool->nextSlotID;
 		pool->nextSlotID += 4;
 	}
 
+	slot->next = *ppSlot;
+	*ppSlot = slot;
+
+	pool->numberOfSlots++;
+
+	p11UnlockMutex(pool->mutex);
+
 	FUNC_RETURNS(CKR_OK);
 }
 
@@ -205,23 +238,52 @@ int findSlot(struct p11SlotPool_t *pool, CK_SLOT_ID slotID, struct p11Slot_t **s
 
 	FUNC_CALLED();
 
+	p11LockMutex(pool->mutex);
+
 	pslot = pool->list;
 	*slot = NULL;
 
 	while (pslot != NULL) {
 		if (pslot->id == slotID) {
 			*slot = pslot;
+			p11UnlockMutex(pool->mutex);
 			FUNC_RETURNS(CKR_OK);
 		}
 
 		pslot = pslot->next;
 	}
 
+	p11UnlockMutex(pool->mutex);
+
 	FUNC_RETURNS(CKR_SLOT_ID_INVALID);
 }
 
 
 
+/**
+ * Return the slot following the given slot in the slot-pool.
+ *
+ * Slots are added by discovery threads while the list is walked, so the link is read with
+ * the pool mutex held. Slots are only removed in terminateSlotPool(), so the returned slot
+ * remains valid after the mutex is released and may be used to continue the walk.
+ *
+ * @param pool       Pointer to slot-pool structure.
+ * @param slot       The current slot or NULL to return the first slot.
+ * @return           The next slot or NULL at the end of the list
+ */
+struct p11Slot_t *getNextSlot(struct p11SlotPool_t *pool, struct p11Slot_t *slot)
+{
+	struct p11Slot_t *next;
+
+	p11LockMutex(pool->mutex);
+	next = slot == NULL ? pool->list : slot->next;
+	p11UnlockMutex(pool->mutex);
+
+	return next;
+}
+
+
+
 /**
  * Update the slot list, adding newly attached readers
  *
@@ -240,6 +302,19 @@ int updateSlots(struct p11SlotPool_t *pool)
 	rc = updatePCSCSlots(pool);
 #endif
 
+#ifdef ENABLE_EMULATOR
+	// Emulated slots must be usable without a PC/SC manager or CT-API driver
+	if ((addEmulatedSlots(pool) > 0) && (rc == CKR_DEVICE_ERROR))
+		rc = CKR_OK;
+#endif
+
+	// Replayed slots reproduce a recorded trace on a host without the recorded devices
+	if ((addReplayedSlots(pool) > 0) && (rc == CKR_DEVICE_ERROR))
+		rc = CKR_OK;
+
+	if (rc == CKR_OK)
+		rc = addPoolSlot(pool);
+
 	FUNC_RETURNS(rc);
 }
 
@@ -256,17 +331,14 @@ int nextSlotEvent(struct p11SlotPool_t *pool, struct p11Slot_t **pslot)
 {
 	struct p11Slot_t *slot;
 
-	slot = pool->list;
 	*pslot = NULL;
 
-	while (slot != NULL) {
+	for (slot = getNextSlot(pool, NULL); slot != NULL; slot = getNextSlot(pool, slot)) {
 		if (slot->eventOccured) {
 			slot->eventOccured = FALSE;
 			*pslot = slot;
 			FUNC_RETURNS(CKR_OK);
 		}
-
-		slot = slot->next;
 	}
 
 	FUNC_RETURNS(CKR_NO_EVENT);
@@ -42,6 +42,7 @@ int initSlotPool(struct p11SlotPool_t *pool);
 int terminateSlotPool(struct p11SlotPool_t *pool);
 int addSlot(struct p11SlotPool_t *pool, struct p11Slot_t *slot);
 int findSlot(struct p11SlotPool_t *pool, CK_SLOT_ID slotID, struct p11Slot_t **slot);
+struct p11Slot_t *getNextSlot(struct p11SlotPool_t *pool, struct p11Slot_t *slot);
 int removeSlot(struct p11SlotPool_t *pool, CK_SLOT_ID slotID);
 int nextSlotEvent(struct p11SlotPool_t *pool, struct p11Slot_t **pslot);
 int waitForSlotEvent(struct p11SlotPool_t *pool);
@@ -0,0 +1,909 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2020, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    token-pool.c
+ * @author  Andreas Schwier
+ * @brief   Pooled slot dispatching key operations to a group of SmartCard-HSMs
+ *
+ * The pooled slot aggregates all SmartCard-HSMs that hold copies of the same keys,
+ * e.g. imported under a shared DKEK. Private key operations are dispatched to the
+ * member with the shortest queue, so that throughput scales with the number of devices.
+ * If a member fails or is removed, the operation is retried on the next member.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <common/thread.h>
+#include <common/atomic.h>
+
+#include <pkcs11/slot.h>
+#include <pkcs11/slotpool.h>
+#include <pkcs11/token.h>
+#include <pkcs11/object.h>
+#include <pkcs11/strbpcpy.h>
+#include <pkcs11/token-pool.h>
+
+#ifdef DEBUG
+#include <common/debug.h>
+#endif
+
+extern struct p11Context_t *context;
+
+extern struct p11TokenDriver *getSmartCardHSMTokenDriver();
+
+static struct p11TokenDriver *getPoolTokenDriver();
+
+
+
+static struct token_pool *getPrivateData(struct p11Token_t *token)
+{
+	return (struct token_pool *)(token + 1);
+}
+
+
+
+/**
+ * Check if the token can become a member of the pool
+ *
+ * If PKCS11_POOLED_SLOT is set to a value other than 1, then only tokens with
+ * a matching label join the pool.
+ *
+ * @param token     The token found in a reader
+ * @return          TRUE if the token is a pool member
+ */
+static int isPoolCandidate(struct p11Token_t *token)
+{
+	CK_UTF8CHAR label[sizeof(token->info.label)];
+	char *po;
+
+	if (token->drv != getSmartCardHSMTokenDriver())
+		return FALSE;
+
+	po = getenv("PKCS11_POOLED_SLOT");
+	if (po && strcmp(po, "1")) {
+		strbpcpy(label, po, sizeof(label));
+		if (memcmp(label, token->info.label, sizeof(label)))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+
+
+/**
+ * Return the public key value for the key with the given CKA_ID
+ *
+ * @param token     The token to search
+ * @param id        The CKA_ID attribute
+ * @return          The CKA_MODULUS or CKA_EC_POINT attribute or NULL if not found
+ */
+static struct p11Attribute_t *getPublicKeyValue(struct p11Token_t *token, CK_ATTRIBUTE_PTR id)
+{
+	struct p11Object_t *puk;
+	struct p11Attribute_t *attr;
+
+	if (findMatchingTokenObjectById(token, CKO_PUBLIC_KEY, id->pValue, (int)id->ulValueLen, &puk) != CKR_OK)
+		return NULL;
+
+	if ((findAttribute(puk, CKA_MODULUS, &attr) < 0) && (findAttribute(puk, CKA_EC_POINT, &attr) < 0))
+		return NULL;
+
+	return attr;
+}
+
+
+
+/**
+ * Check that the key with CKA_ID in both tokens is the same key
+ *
+ * The CKA_ID alone is not sufficient, as unrelated keys may share the same identifier.
+ * If one of the tokens has no public key object for the key, then the key is not used.
+ */
+static int isSameKey(struct p11Token_t *token, struct p11Token_t *member, CK_ATTRIBUTE_PTR id)
+{
+	struct p11Attribute_t *a, *b;
+
+	a = getPublicKeyValue(token, id);
+	b = getPublicKeyValue(member, id);
+
+	if (!a || !b)
+		return FALSE;
+
+	return (a->attrData.ulValueLen == b->attrData.ulValueLen) &&
+			!memcmp(a->attrData.pValue, b->attrData.pValue, a->attrData.ulValueLen);
+}
+
+
+
+/**
+ * Locate the private key on a member token that corresponds to the key object in the pool
+ *
+ * @param pObject   The key object in the pooled slot
+ * @param member    The member token
+ * @param key       The variable receiving the key object of the member, which must be
+ *                  released with releaseObject()
+ * @return          CKR_OK or CKR_KEY_HANDLE_INVALID
+ */
+static int findMemberKey(struct p11Object_t *pObject, struct p11Token_t *member, struct p11Object_t **key)
+{
+	struct p11Attribute_t *id;
+
+	if (findAttribute(pObject, CKA_ID, &id) < 0)
+		return CKR_KEY_HANDLE_INVALID;
+
+	if (findMatchingTokenObjectById(member, CKO_PRIVATE_KEY, id->attrData.pValue, (int)id->attrData.ulValueLen, key) != CKR_OK)
+		return CKR_KEY_HANDLE_INVALID;
+
+	if (!isSameKey(pObject->token, member, &id->attrData))
+		return CKR_KEY_HANDLE_INVALID;
+
+	// Keep the key alive while the member token resynchronizes its objects
+	if (referenceObject(member, *key) < 0)
+		return CKR_KEY_HANDLE_INVALID;
+
+	return CKR_OK;
+}
+
+
+
+static int poolInit(struct p11Object_t *pObject, CK_MECHANISM_PTR mech, int decrypt)
+{
+	struct token_pool *pool;
+	struct p11Token_t *member;
+	struct p11Object_t *key;
+	int rv, i;
+
+	FUNC_CALLED();
+
+	pool = getPrivateData(pObject->token);
+	rv = CKR_DEVICE_REMOVED;
+
+	p11LockMutex(pObject->token->mutex);
+
+	for (i = 0; i < pool->numberOfMembers; i++) {
+		if (pool->excluded[i] || (getTokenReference(pool->member[i], &member) != CKR_OK))
+			continue;
+
+		if (findMemberKey(pObject, member, &key) != CKR_OK) {
+			releaseTokenReference(pool->member[i]);
+			continue;
+		}
+
+		// The member drivers only validate the mechanism, so any member will do
+		if (decrypt)
+			rv = key->C_DecryptInit ? key->C_DecryptInit(key, mech) : CKR_FUNCTION_NOT_SUPPORTED;
+		else
+			rv = key->C_SignInit ? key->C_SignInit(key, mech) : CKR_FUNCTION_NOT_SUPPORTED;
+
+		releaseObject(key);
+		releaseTokenReference(pool->member[i]);
+		break;
+	}
+
+	p11UnlockMutex(pObject->token->mutex);
+
+	FUNC_RETURNS(rv);
+}
+
+
+
+struct poolCandidate {
+	struct p11Slot_t *slot;
+	struct p11Token_t *token;
+	int load;
+};
+
+
+
+/**
+ * Dispatch a private key operation to the least busy member holding the key
+ *
+ * Members are ordered by the number of threads holding or waiting for the reader. Members
+ * with the same load are selected in turn. Members that failed the last login are skipped. If the operation fails with a device error, then
+ * the token status of the member is updated and the operation is repeated on the next member.
+ *
+ * A reference is held on each candidate token, so that a member removed during the operation
+ * remains in memory. The key is located again before each attempt, as the objects of a member
+ * may change once the pool lock is released.
+ */
+static int poolDispatch(struct p11Object_t *pObject, int decrypt, CK_MECHANISM_TYPE mech, CK_BYTE_PTR pIn, CK_ULONG ulInLen, CK_BYTE_PTR pOut, CK_ULONG_PTR pulOutLen)
+{
+	struct token_pool *pool;
+	struct poolCandidate found[MAX_POOL_MEMBERS], cand[MAX_POOL_MEMBERS], c;
+	struct p11Token_t *member;
+	struct p11Object_t *key;
+	int rv, cnt, rot, i, j;
+
+	FUNC_CALLED();
+
+	pool = getPrivateData(pObject->token);
+	rv = CKR_DEVICE_REMOVED;
+	cnt = 0;
+
+	p11LockMutex(pObject->token->mutex);
+
+	for (i = 0; i < pool->numberOfMembers; i++) {
+		if (pool->excluded[i]) {
+			rv = CKR_USER_NOT_LOGGED_IN;
+			continue;
+		}
+
+		if (getTokenReference(pool->member[i], &member) != CKR_OK)
+			continue;
+
+		if (findMemberKey(pObject, member, &key) != CKR_OK) {
+			releaseTokenReference(pool->member[i]);
+			continue;
+		}
+
+		if ((decrypt && !key->C_Decrypt) || (!decrypt && !key->C_Sign)) {
+			releaseObject(key);
+			releaseTokenReference(pool->member[i]);
+			continue;
+		}
+
+		releaseObject(key);
+
+		if (member->user != CKU_USER) {
+			releaseTokenReference(pool->member[i]);
+			rv = CKR_USER_NOT_LOGGED_IN;
+			continue;
+		}
+
+		found[cnt].slot = pool->member[i];
+		found[cnt].token = member;
+		cnt++;
+	}
+
+	p11UnlockMutex(pObject->token->mutex);
+
+	if (cnt == 0) {
+		FUNC_FAILS(rv, "No pool member available for key");
+	}
+
+	// Rotate the start position and sort by load. Insertion sort is stable, so members
+	// with the same load remain in rotated order
+	rot = (int)((unsigned long)atomic_inc(&pool->rotation) % cnt);
+	for (i = 0; i < cnt; i++) {
+		c = found[(i + rot) % cnt];
+		c.load = c.slot->queue ? ticket_lock_pending(c.slot->queue) : 0;
+
+		for (j = i; (j > 0) && (cand[j - 1].load > c.load); j--) {
+			cand[j] = cand[j - 1];
+		}
+		cand[j] = c;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		if (findMemberKey(pObject, cand[i].token, &key) != CKR_OK)
+			continue;
+
+		if ((decrypt && !key->C_Decrypt) || (!decrypt && !key->C_Sign)) {
+			releaseObject(key);
+			continue;
+		}
+
+#ifdef DEBUG
+		debug("Dispatching to slot %lu with load %d\n", cand[i].slot->id, cand[i].load);
+#endif
+		if (decrypt)
+			rv = key->C_Decrypt(key, mech, pIn, ulInLen, pOut, pulOutLen);
+		else
+			rv = key->C_Sign(key, mech, pIn, ulInLen, pOut, pulOutLen);
+
+		releaseObject(key);
+
+		if ((rv != CKR_DEVICE_ERROR) && (rv != CKR_DEVICE_REMOVED) && (rv != CKR_TOKEN_NOT_PRESENT))
+			break;
+
+		// Update the token status of the failed member before moving on to the next
+		getValidatedToken(cand[i].slot, &member);
+	}
+
+	for (i = 0; i < cnt; i++) {
+		releaseTokenReference(cand[i].slot);
+	}
+
+	FUNC_RETURNS(rv);
+}
+
+
+
+static int pool_C_SignInit(struct p11Object_t *pObject, CK_MECHANISM_PTR mech)
+{
+	return poolInit(pObject, mech, FALSE);
+}
+
+
+
+static int pool_C_Sign(struct p11Object_t *pObject, CK_MECHANISM_TYPE mech, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen)
+{
+	return poolDispatch(pObject, FALSE, mech, pData, ulDataLen, pSignature, pulSignatureLen);
+}
+
+
+
+static int pool_C_DecryptInit(struct p11Object_t *pObject, CK_MECHANISM_PTR mech)
+{
+	return poolInit(pObject, mech, TRUE);
+}
+
+
+
+static int pool_C_Decrypt(struct p11Object_t *pObject, CK_MECHANISM_TYPE mech, CK_BYTE_PTR pEncryptedData, CK_ULONG ulEncryptedDataLen, CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen)
+{
+	return poolDispatch(pObject, TRUE, mech, pEncryptedData, ulEncryptedDataLen, pData, pulDataLen);
+}
+
+
+
+/**
+ * Create a copy of a member object for the pooled slot
+ *
+ * @param src       The object of the member token
+ * @param pObject   The variable receiving the copy
+ * @return          CKR_OK or any other Cryptoki error code
+ */
+static int cloneObject(struct p11Object_t *src, struct p11Object_t **pObject)
+{
+	struct p11Object_t *obj;
+	int rc;
+
+	obj = (struct p11Object_t *)calloc(1, sizeof(struct p11Object_t));
+
+	if (obj == NULL)
+		return CKR_HOST_MEMORY;
+
+	*obj = *src;
+	obj->handle = 0;
+	obj->token = NULL;
+	obj->next = NULL;
+	obj->keyCache = NULL;
+	obj->retiredKeys = NULL;
+
+	rc = copyAttributes(obj, src);
+	if (rc != CKR_OK) {
+		free(obj);
+		return rc;
+	}
+
+	*pObject = obj;
+	return CKR_OK;
+}
+
+
+
+/**
+ * Add keys and certificates of a member token not yet present in the pool
+ *
+ * Objects are matched by class and CKA_ID. Private keys of the pool dispatch to the members.
+ */
+static int addMemberObjects(struct p11Token_t *token, struct p11Token_t *member, struct p11Object_t *list, int publicObject)
+{
+	struct p11Object_t *obj, *clone, *existing;
+	struct p11Attribute_t *class, *id;
+	CK_OBJECT_CLASS cl;
+	int rc;
+
+	FUNC_CALLED();
+
+	for (obj = list; obj != NULL; obj = obj->next) {
+		if ((findAttribute(obj, CKA_CLASS, &class) < 0) || (findAttribute(obj, CKA_ID, &id) < 0))
+			continue;
+
+		cl = *(CK_OBJECT_CLASS *)class->attrData.pValue;
+
+		if ((cl != CKO_PRIVATE_KEY) && (cl != CKO_PUBLIC_KEY) && (cl != CKO_CERTIFICATE))
+			continue;
+
+		if (findMatchingTokenObjectById(token, cl, id->attrData.pValue, (int)id->attrData.ulValueLen, &existing) == CKR_OK)
+			continue;
+
+		// A key not confirmed by a matching public key is not pooled
+		if ((cl == CKO_PRIVATE_KEY) && !isSameKey(token, member, &id->attrData))
+			continue;
+
+		rc = cloneObject(obj, &clone);
+		if (rc != CKR_OK) {
+			FUNC_FAILS(rc, "Could not copy member object");
+		}
+
+		if (cl == CKO_PRIVATE_KEY) {
+			clone->C_SignInit = pool_C_SignInit;
+			clone->C_Sign = pool_C_Sign;
+			clone->C_DecryptInit = pool_C_DecryptInit;
+			clone->C_Decrypt = pool_C_Decrypt;
+			clone->C_DeriveKey = NULL;
+		}
+
+		addObject(token, clone, publicObject);
+	}
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * Check that a member token provides the key or certificate of the pool
+ *
+ * A key or certificate replaced on the member under the same CKA_ID is not provided.
+ */
+static int isProvidedByMember(struct p11Token_t *token, struct p11Token_t *member, struct p11Object_t *obj, CK_OBJECT_CLASS cl, CK_ATTRIBUTE_PTR id)
+{
+	struct p11Object_t *mobj;
+	struct p11Attribute_t *a, *b;
+
+	if (findMatchingTokenObjectById(member, cl, id->pValue, (int)id->ulValueLen, &mobj) != CKR_OK)
+		return FALSE;
+
+	if (cl == CKO_PRIVATE_KEY)
+		return isSameKey(token, member, id);
+
+	if (cl == CKO_PUBLIC_KEY) {
+		if ((findAttribute(obj, CKA_MODULUS, &a) < 0) && (findAttribute(obj, CKA_EC_POINT, &a) < 0))
+			return FALSE;
+		b = getPublicKeyValue(member, id);
+	} else {
+		if ((findAttribute(obj, CKA_VALUE, &a) < 0) || (findAttribute(mobj, CKA_VALUE, &b) < 0))
+			return FALSE;
+	}
+
+	return (b != NULL) && (a->attrData.ulValueLen == b->attrData.ulValueLen) &&
+			!memcmp(a->attrData.pValue, b->attrData.pValue, a->attrData.ulValueLen);
+}
+
+
+
+/**
+ * Remove keys and certificates of the pool that no member provides anymore
+ *
+ * Public objects must be checked first, so that private keys are removed with a replaced public key.
+ */
+static void removeStaleObjects(struct p11Token_t *token, int cnt, struct p11Token_t **memberToken, int publicObject)
+{
+	struct p11Object_t *obj;
+	struct p11Attribute_t *class, *id;
+	int i;
+
+	obj = publicObject ? token->tokenObjList : token->tokenPrivObjList;
+	while (obj != NULL) {
+		if ((findAttribute(obj, CKA_CLASS, &class) < 0) || (findAttribute(obj, CKA_ID, &id) < 0)) {
+			obj = obj->next;
+			continue;
+		}
+
+		for (i = 0; i < cnt; i++) {
+			if (isProvidedByMember(token, memberToken[i], obj, *(CK_OBJECT_CLASS *)class->attrData.pValue, &id->attrData))
+				break;
+		}
+
+		if (i < cnt) {
+			obj = obj->next;
+			continue;
+		}
+
+#ifdef DEBUG
+		debug("Removing object %lu no longer provided by a pool member\n", obj->handle);
+#endif
+		removeTokenObject(token, obj->handle, publicObject);
+		obj = publicObject ? token->tokenObjList : token->tokenPrivObjList;
+	}
+}
+
+
+
+/**
+ * Determine the state of the member objects, which changes with every object added or removed
+ */
+static void getMemberObjectState(struct p11Token_t *member, CK_ULONG *handles, CK_ULONG *objects)
+{
+	p11LockShared(member->objectLock);
+	*handles = member->freeObjectNumber;
+	*objects = member->numberOfTokenObjects + member->numberOfPrivateTokenObjects;
+	p11UnlockShared(member->objectLock);
+}
+
+
+
+static int newPoolToken(struct p11Slot_t *slot)
+{
+	struct p11Token_t *ptoken;
+	int rc;
+
+	FUNC_CALLED();
+
+	rc = allocateToken(&ptoken, sizeof(struct token_pool));
+	if (rc != CKR_OK)
+		FUNC_RETURNS(rc);
+
+	ptoken->slot = slot;
+	ptoken->freeObjectNumber = 1;
+	strbpcpy(ptoken->info.label, "SmartCard-HSM Pool", sizeof(ptoken->info.label));
+	strbpcpy(ptoken->info.manufacturerID, "CardContact (www.cardcontact.de)", sizeof(ptoken->info.manufacturerID));
+	strbpcpy(ptoken->info.model, "SmartCard-HSM", sizeof(ptoken->info.model));
+	strbpcpy(ptoken->info.serialNumber, "Pool", sizeof(ptoken->info.serialNumber));
+	ptoken->info.ulFreePrivateMemory = CK_UNAVAILABLE_INFORMATION;
+	ptoken->info.ulFreePublicMemory = CK_UNAVAILABLE_INFORMATION;
+	ptoken->info.ulMinPinLen = 6;
+	ptoken->info.ulMaxPinLen = 16;
+	ptoken->info.ulTotalPrivateMemory = CK_UNAVAILABLE_INFORMATION;
+	ptoken->info.ulTotalPublicMemory = CK_UNAVAILABLE_INFORMATION;
+	ptoken->info.ulMaxSessionCount = CK_EFFECTIVELY_INFINITE;
+	ptoken->info.ulMaxRwSessionCount = CK_EFFECTIVELY_INFINITE;
+	ptoken->info.ulSessionCount = CK_UNAVAILABLE_INFORMATION;
+	ptoken->info.flags = CKF_LOGIN_REQUIRED | CKF_USER_PIN_INITIALIZED | CKF_TOKEN_INITIALIZED | CKF_WRITE_PROTECTED;
+
+	ptoken->user = INT_CKU_NO_USER;
+	ptoken->drv = getPoolTokenDriver();
+
+	rc = addToken(slot, ptoken);
+	if (rc != CKR_OK) {
+		freeToken(ptoken);
+		FUNC_FAILS(rc, "addToken() failed");
+	}
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * Update the pool after the set of member tokens or the objects of a member changed
+ *
+ * Keys and certificates no longer provided by any member are removed and new ones are added.
+ * All other objects keep their handles while the pool token is present. The pool token is
+ * removed once the last member is gone.
+ */
+static int updatePool(struct p11Slot_t *slot, int cnt, struct p11Slot_t **member, struct p11Token_t **memberToken)
+{
+	struct token_pool *pool;
+	unsigned char excluded[MAX_POOL_MEMBERS];
+	CK_ULONG handles[MAX_POOL_MEMBERS], objects[MAX_POOL_MEMBERS];
+	int rc, i, j, changed;
+
+	FUNC_CALLED();
+
+	if (cnt == 0) {
+		if (slot->token)
+			removeToken(slot);
+		FUNC_RETURNS(CKR_TOKEN_NOT_PRESENT);
+	}
+
+	if (!slot->token) {
+		rc = newPoolToken(slot);
+		if (rc != CKR_OK)
+			FUNC_RETURNS(rc);
+	}
+
+	pool = getPrivateData(slot->token);
+
+	changed = (pool->numberOfMembers != cnt) || memcmp(pool->memberToken, memberToken, cnt * sizeof(*memberToken));
+
+	for (i = 0; i < cnt; i++) {
+		loadDeferredObjects(memberToken[i], NULL, 0);
+		getMemberObjectState(memberToken[i], &handles[i], &objects[i]);
+
+		if ((handles[i] != pool->memberHandles[i]) || (objects[i] != pool->memberObjects[i]))
+			changed = TRUE;
+	}
+
+	if (!changed)
+		FUNC_RETURNS(CKR_OK);
+
+#ifdef DEBUG
+	debug("Pool now has %d members\n", cnt);
+#endif
+
+	p11LockMutex(slot->token->mutex);
+
+	// Members remaining in the pool keep the result of the last login
+	for (i = 0; i < cnt; i++) {
+		excluded[i] = 0;
+		for (j = 0; j < pool->numberOfMembers; j++) {
+			if (pool->memberToken[j] == memberToken[i])
+				excluded[i] = pool->excluded[j];
+		}
+	}
+
+	memcpy(pool->member, member, cnt * sizeof(*member));
+	memcpy(pool->memberToken, memberToken, cnt * sizeof(*memberToken));
+	memcpy(pool->excluded, excluded, cnt);
+	memcpy(pool->memberHandles, handles, cnt * sizeof(*handles));
+	memcpy(pool->memberObjects, objects, cnt * sizeof(*objects));
+	pool->numberOfMembers = cnt;
+	p11UnlockMutex(slot->token->mutex);
+
+	removeStaleObjects(slot->token, cnt, memberToken, TRUE);
+	removeStaleObjects(slot->token, cnt, memberToken, FALSE);
+
+	rc = CKR_OK;
+	for (i = 0; (i < cnt) && (rc == CKR_OK); i++) {
+		// Public objects first, so that key identity can be checked against the public key
+		rc = addMemberObjects(slot->token, memberToken[i], memberToken[i]->tokenObjList, TRUE);
+
+		if (rc == CKR_OK)
+			rc = addMemberObjects(slot->token, memberToken[i], memberToken[i]->tokenPrivObjList, FALSE);
+	}
+
+	FUNC_RETURNS(rc);
+}
+
+
+
+/**
+ * Determine the members of the pool and return the pool token
+ *
+ * @param slot      The pooled slot
+ * @param token     Pointer to pointer updated with the pool token
+ * @return          CKR_OK, CKR_TOKEN_NOT_PRESENT or any other Cryptoki error code
+ */
+int getPoolToken(struct p11Slot_t *slot, struct p11Token_t **token)
+{
+	struct p11Slot_t *member[MAX_POOL_MEMBERS], *mslot;
+	struct p11Token_t *memberToken[MAX_POOL_MEMBERS], *mtoken;
+	int rc, cnt;
+
+	FUNC_CALLED();
+
+	// Validate the member slots first, which acquires the global lock on its own
+	cnt = 0;
+	for (mslot = getNextSlot(&context->slotPool, NULL); (mslot != NULL) && (cnt < MAX_POOL_MEMBERS); mslot = getNextSlot(&context->slotPool, mslot)) {
+		if (mslot->isPool || mslot->primarySlot)
+			continue;
+
+		if ((getValidatedToken(mslot, &mtoken) != CKR_OK) || !isPoolCandidate(mtoken))
+			continue;
+
+		member[cnt] = mslot;
+		memberToken[cnt] = mtoken;
+		cnt++;
+	}
+
+	p11LockMutex(context->mutex);
+
+	rc = updatePool(slot, cnt, member, memberToken);
+
+	p11UnlockMutex(context->mutex);
+
+	if (rc != CKR_OK)
+		FUNC_RETURNS(rc);
+
+	FUNC_RETURNS(getToken(slot, token));
+}
+
+
+
+/**
+ * Log into all members of the pool
+ *
+ * The login stops at the first member rejecting the PIN, so that a wrong PIN or a PIN not
+ * changed on all members decrements the retry counter of only one device. Members that
+ * accepted the PIN are logged out again. Members failing the login for other reasons are
+ * excluded from dispatch until the next login.
+ */
+static int pool_login(struct p11Slot_t *slot, int userType, CK_UTF8CHAR_PTR pin, CK_ULONG pinlen)
+{
+	struct token_pool *pool;
+	struct p11Slot_t *member[MAX_POOL_MEMBERS];
+	struct p11Token_t *mtoken;
+	unsigned char excluded[MAX_POOL_MEMBERS];
+	int rc, rv, cnt, i, j;
+
+	FUNC_CALLED();
+
+	if (userType != CKU_USER) {
+		FUNC_FAILS(CKR_USER_TYPE_INVALID, "Only the user can log into the pooled slot");
+	}
+
+	pool = getPrivateData(slot->token);
+	rv = CKR_DEVICE_REMOVED;
+
+	p11LockMutex(slot->token->mutex);
+	cnt = pool->numberOfMembers;
+	memcpy(member, pool->member, cnt * sizeof(*member));
+	p11UnlockMutex(slot->token->mutex);
+
+	memset(excluded, 1, sizeof(excluded));
+
+	for (i = 0; i < cnt; i++) {
+		if (getToken(member[i], &mtoken) != CKR_OK)
+			continue;
+
+		rc = logIn(member[i], CKU_USER, pin, pinlen);
+
+		if ((rc == CKR_PIN_INCORRECT) || (rc == CKR_PIN_LOCKED) || (rc == CKR_PIN_LEN_RANGE)) {
+			for (j = 0; j < i; j++) {
+				if (!excluded[j] && (getToken(member[j], &mtoken) == CKR_OK))
+					logOut(member[j]);
+			}
+			memset(excluded, 1, sizeof(excluded));
+			rv = rc;
+			break;
+		}
+
+		if (rc == CKR_OK) {
+			excluded[i] = 0;
+			rv = CKR_OK;
+		} else {
+#ifdef DEBUG
+			debug("Login to pool member in slot %lu failed with rc=%d\n", member[i]->id, rc);
+#endif
+			if (rv != CKR_OK)
+				rv = rc;
+		}
+	}
+
+	p11LockMutex(slot->token->mutex);
+	for (i = 0; i < pool->numberOfMembers; i++) {
+		pool->excluded[i] = 1;
+		for (j = 0; j < cnt; j++) {
+			if (pool->member[i] == member[j])
+				pool->excluded[i] = excluded[j];
+		}
+	}
+	p11UnlockMutex(slot->token->mutex);
+
+	if (rv != CKR_OK) {
+		FUNC_FAILS(rv, "Login to pool failed");
+	}
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+static int pool_logout(struct p11Slot_t *slot)
+{
+	struct token_pool *pool;
+	struct p11Token_t *member;
+	int i;
+
+	FUNC_CALLED();
+
+	pool = getPrivateData(slot->token);
+
+	for (i = 0; i < pool->numberOfMembers; i++) {
+		if ((getToken(pool->member[i], &member) == CKR_OK) && (member->user != INT_CKU_NO_USER))
+			logOut(pool->member[i]);
+	}
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+static int pool_C_GetMechanismList(CK_MECHANISM_TYPE_PTR pMechanismList, CK_ULONG_PTR pulCount)
+{
+	return getSmartCardHSMTokenDriver()->C_GetMechanismList(pMechanismList, pulCount);
+}
+
+
+
+static int pool_C_GetMechanismInfo(CK_MECHANISM_TYPE type, CK_MECHANISM_INFO_PTR pInfo)
+{
+	return getSmartCardHSMTokenDriver()->C_GetMechanismInfo(type, pInfo);
+}
+
+
+
+/**
+ * Create the pooled slot if enabled with PKCS11_POOLED_SLOT
+ *
+ * @param pool      Pointer to slot-pool structure
+ * @return          CKR_OK or any other Cryptoki error code
+ */
+int addPoolSlot(struct p11SlotPool_t *pool)
+{
+	struct p11Slot_t *slot;
+	char *po;
+
+	FUNC_CALLED();
+
+	po = getenv("PKCS11_POOLED_SLOT");
+	if (!po || (*po == '0'))
+		FUNC_RETURNS(CKR_OK);
+
+	for (slot = getNextSlot(pool, NULL); slot != NULL; slot = getNextSlot(pool, slot)) {
+		if (slot->isPool)
+			FUNC_RETURNS(CKR_OK);
+	}
+
+	slot = (struct p11Slot_t *) calloc(1, sizeof(struct p11Slot_t));
+
+	if (slot == NULL) {
+		FUNC_FAILS(CKR_HOST_MEMORY, "Out of memory");
+	}
+
+	slot->isPool = TRUE;
+
+	strbpcpy(slot->info.slotDescription, "SmartCard-HSM Pool", sizeof(slot->info.slotDescription));
+	strbpcpy(slot->info.manufacturerID, "CardContact", sizeof(slot->info.manufacturerID));
+
+	slot->info.firmwareVersion.major = VERSION_MAJOR;
+	slot->info.firmwareVersion.minor = VERSION_MINOR;
+
+	slot->info.flags = CKF_REMOVABLE_DEVICE;
+
+	slot->maxRAPDU = MAX_RAPDU;
+	slot->maxCAPDU = MAX_CAPDU;
+
+	addSlot(pool, slot);
+
+#ifdef DEBUG
+	debug("Added pooled slot (%lu)\n", slot->id);
+#endif
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+static struct p11TokenDriver *getPoolTokenDriver()
+{
+	static struct p11TokenDriver pool_token = {
+		"SmartCard-HSM Pool",
+		1,
+		0,
+		0,
+		0,
+		NULL,
+		NULL,
+		NULL,
+		pool_C_GetMechanismList,
+		pool_C_GetMechanismInfo,
+		pool_login,
+		pool_logout,
+		NULL,
+		NULL,
+
+		pool_C_DecryptInit,		// int (*C_DecryptInit)  (struct p11Object_t *, CK_MECHANISM_PTR);
+		pool_C_Decrypt,			// int (*C_Decrypt)      (struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
+		NULL,				// int (*C_DecryptUpdate)(struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
+		NULL,				// int (*C_DecryptFinal) (struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG_PTR);
+
+		pool_C_SignInit,		// int (*C_SignInit)     (struct p11Object_t *, CK_MECHANISM_PTR);
+		pool_C_Sign,			// int (*C_Sign)         (struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
+		NULL,				// int (*C_SignUpdate)   (struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG);
+		NULL,				// int (*C_SignFinal)    (struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG_PTR);
+
+		NULL,				// int (*C_GenerateKey)      (struct p11Slot_t *, CK_MECHANISM_PTR, CK_ATTRIBUTE_PTR, CK_ULONG, struct p11Object_t **);
+		NULL,				// int (*C_GenerateKeyPair)  (struct p11Slot_t *, CK_MECHANISM_PTR, CK_ATTRIBUTE_PTR, CK_ULONG, CK_ATTRIBUTE_PTR, CK_ULONG, struct p11Object_t **, struct p11Object_t **);
+		NULL,				// int (*C_CreateObject)     (struct p11Slot_t *, CK_ATTRIBUTE_PTR, CK_ULONG ulCount, struct p11Object_t **);
+		NULL,				// int (*destroyObject)       (struct p11Slot_t *, struct p11Object_t *);
+		NULL,				// int (*C_SetAttributeValue)(struct p11Slot_t *, struct p11Object_t *, CK_ATTRIBUTE_PTR, CK_ULONG);
+		NULL,				// int (*C_GenerateRandom)   (struct p11Slot_t *, CK_BYTE_PTR , CK_ULONG );
+
+		NULL				// int (*loadObjects)        (struct p11Token_t *, CK_ATTRIBUTE_PTR, CK_ULONG);
+	};
+
+	return &pool_token;
+}
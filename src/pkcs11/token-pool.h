@@ -0,0 +1,55 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2020, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    token-pool.h
+ * @author  Andreas Schwier
+ * @brief   Pooled slot dispatching key operations to a group of SmartCard-HSMs
+ */
+
+#ifndef ___TOKEN_POOL_H_INC___
+#define ___TOKEN_POOL_H_INC___
+
+#include <pkcs11/cryptoki.h>
+#include <pkcs11/p11generic.h>
+
+#define MAX_POOL_MEMBERS	16
+
+struct token_pool {
+	int numberOfMembers;                                /**< Number of member slots                */
+	struct p11Slot_t *member[MAX_POOL_MEMBERS];         /**< Slots contributing to the pool        */
+	struct p11Token_t *memberToken[MAX_POOL_MEMBERS];   /**< Token in member slot at last update   */
+	unsigned char excluded[MAX_POOL_MEMBERS];           /**< Member failed the last login          */
+	CK_ULONG memberHandles[MAX_POOL_MEMBERS];           /**< Next object handle of member at last update */
+	CK_ULONG memberObjects[MAX_POOL_MEMBERS];           /**< Number of member objects at last update */
+	volatile long rotation;                             /**< Spread requests among idle members    */
+};
+
+int addPoolSlot(struct p11SlotPool_t *pool);
+int getPoolToken(struct p11Slot_t *slot, struct p11Token_t **token);
+
+#endif /* ___TOKEN_POOL_H_INC___ */
@@ -51,6 +51,11 @@
 #include <pkcs11/strbpcpy.h>
 #include <pkcs11/crypto.h>
 
+#ifndef MINIDRIVER
+#include <pkcs11/efcache.h>
+#include <common/thread.h>
+#endif
+
 
 
 static unsigned char aid[] = { 0xE8,0x2B,0x06,0x01,0x04,0x01,0x81,0xC3,0x1F,0x02,0x01 };
@@ -212,6 +217,12 @@ static int readEF(struct p11Slot_t *slot, unsigned short fid, unsigned char *con
 	blk = 65536;
 	rlen = 0;
 
+	// Read all blocks without interleaving APDUs from other threads or processes
+	if (beginSlotTransaction(slot) != CKR_OK) {
+		endSlotTransaction(slot);
+		FUNC_FAILS(-1, "Could not begin transaction");
+	}
+
 	if (slot->noExtLengthReadAll) {
 		blk = slot->maxRAPDU - 2;
 		if (blk > len) {
@@ -227,16 +238,19 @@ static int readEF(struct p11Slot_t *slot, unsigned short fid, unsigned char *con
 				blk, content, (int)len, &SW1SW2);
 
 		if (rc < 0) {
+			endSlotTransaction(slot);
 			FUNC_FAILS(rc, "transmitAPDU failed");
 		}
 
 		if ((SW1SW2 != 0x9000) && (SW1SW2 != 0x6282)) {
+			endSlotTransaction(slot);
 			FUNC_FAILS(-1, "Read EF failed");
 		}
 
 		rlen += rc;
 
 		if ((rc == 0) || (blk == 65536) || (SW1SW2 == 0x6282)) {
+			endSlotTransaction(slot);
 			FUNC_RETURNS(rlen);
 		}
 
@@ -248,11 +262,87 @@ static int readEF(struct p11Slot_t *slot, unsigned short fid, unsigned char *con
 		}
 	} while ((rc > 0) && (len > 0));
 
+	endSlotTransaction(slot);
 	FUNC_RETURNS(rlen);
 }
 
 
 
+/**
+ * Track files created or deleted by this module in the file list, so that the next
+ * synchronization only picks up changes made by other processes
+ */
+static void updateFileList(struct p11Token_t *token, unsigned short fid, int present)
+{
+	struct token_sc_hsm *sc;
+	int i;
+
+	if (token == NULL)
+		return;
+
+	sc = getPrivateData(token);
+
+	acquireSlot(token->slot);
+
+	for (i = 0; i < sc->filelistLen; i += 2) {
+		if ((sc->filelist[i] == (fid >> 8)) && (sc->filelist[i + 1] == (fid & 0xFF)))
+			break;
+	}
+
+	if (present && (i >= sc->filelistLen) && (sc->filelistLen < sizeof(sc->filelist))) {
+		sc->filelist[sc->filelistLen++] = fid >> 8;
+		sc->filelist[sc->filelistLen++] = fid & 0xFF;
+	} else if (!present && (i < sc->filelistLen)) {
+		sc->filelistLen -= 2;
+		memmove(sc->filelist + i, sc->filelist + i + 2, sc->filelistLen - i);
+	}
+
+	releaseSlot(token->slot);
+}
+
+
+
+/**
+ * Remove the persistent file cache before a file on the token is changed
+ */
+static void invalidateEFCache(struct p11Slot_t *slot)
+{
+#ifndef MINIDRIVER
+	if (slot->token != NULL)
+		removeEFCache(slot->token->info.serialNumber, sizeof(slot->token->info.serialNumber));
+#endif
+}
+
+
+
+/**
+ * Read file from the persistent file cache, if active while loading objects, or from the token
+ */
+static int readCachedEF(struct p11Token_t *token, unsigned short fid, unsigned char *content, size_t len)
+{
+#ifndef MINIDRIVER
+	struct token_sc_hsm *sc = getPrivateData(token);
+	int rc;
+
+	if (sc->cache != NULL) {
+		rc = getCachedEF(sc->cache, fid, content, len);
+		if (rc != EF_CACHE_MISS)
+			return rc;
+	}
+
+	rc = readEF(token->slot, fid, content, len);
+
+	if (sc->cache != NULL)
+		putCachedEF(sc->cache, fid, content, rc);
+
+	return rc;
+#else
+	return readEF(token->slot, fid, content, len);
+#endif
+}
+
+
+
 static int writeEF(struct p11Slot_t *slot, unsigned short fid, unsigned char *content, size_t len)
 {
 	int rc, blen, ofs;
@@ -271,6 +361,14 @@ static int writeEF(struct p11Slot_t *slot, unsigned short fid, unsigned char *co
 	ofs = 0;
 	rc = CKR_OK;
 
+	invalidateEFCache(slot);
+
+	// Write all blocks without interleaving APDUs from other threads or processes
+	if (beginSlotTransaction(slot) != CKR_OK) {
+		endSlotTransaction(slot);
+		FUNC_FAILS(-1, "Could not begin transaction");
+	}
+
 	while (len > 0) {
 		blen = (int)(len > maxblk ? maxblk : len);
 
@@ -294,14 +392,19 @@ static int writeEF(struct p11Slot_t *slot, unsigned short fid, unsigned char *co
 				0, NULL, 0, &SW1SW2);
 
 		if (rc < 0) {
+			endSlotTransaction(slot);
 			FUNC_FAILS(rc, "transmitAPDU failed");
 		}
 
 		if (SW1SW2 != 0x9000) {
+			endSlotTransaction(slot);
 			FUNC_FAILS(-1, "Write EF failed");
 		}
 	}
 
+	updateFileList(slot->token, fid, TRUE);
+
+	endSlotTransaction(slot);
 	FUNC_RETURNS(rc);
 }
 
@@ -317,6 +420,8 @@ static int deleteEF(struct p11Slot_t *slot, unsigned short fid)
 	scr[0] = fid >> 8;
 	scr[1] = fid & 0xFF;
 
+	invalidateEFCache(slot);
+
 	rc = transmitAPDU(slot, 0x00, 0xE4, 0x02, 0x00,
 			2, scr,
 			0, NULL, 0, &SW1SW2);
@@ -329,6 +434,8 @@ static int deleteEF(struct p11Slot_t *slot, unsigned short fid)
 		FUNC_FAILS(-1, "Delete EF failed");
 	}
 
+	updateFileList(slot->token, fid, FALSE);
+
 	FUNC_RETURNS(CKR_OK);
 }
 
@@ -663,11 +770,93 @@ static int sc_hsm_C_DecryptInit(struct p11Object_t *pObject, CK_MECHANISM_PTR me
 
 
 
+/**
+ * Encrypt or decrypt with AES-CBC, splitting the data into chunks that fit into a single APDU
+ *
+ * The device starts every APDU with a zero IV, so the last cipher text block of a chunk is
+ * carried over as IV into the first block of the next chunk. Input and output may overlap.
+ *
+ * @param pObject   the secret key
+ * @param algo      ALGO_AES_CBC_ENCRYPT or ALGO_AES_CBC_DECRYPT
+ * @param in        the input, a multiple of the block size
+ * @param len       the length of the input
+ * @param out       the buffer receiving the output, at least len bytes
+ * @param SW1SW2    the status word returned by the device for the last chunk
+ * @return          the number of bytes processed or -1 if the device returned less than expected
+ */
+static int transmitAESCBC(struct p11Object_t *pObject, int algo, unsigned char *in, size_t len, unsigned char *out, unsigned short *SW1SW2)
+{
+	struct p11Slot_t *slot = pObject->token->slot;
+	unsigned char buff[MAX_CAPDU], iv[16], next[16];
+	size_t maxblk, blen, i;
+	int rc, total;
+
+	maxblk = pObject->token->drv->maxCAPDU;	// Limit defined by token
+	if (maxblk > slot->maxCAPDU) {
+		maxblk = slot->maxCAPDU;			// Limit defined by slot
+	}
+
+	maxblk -= 9;			// Header, extended Lc and Le
+	if (maxblk + 2 > slot->maxRAPDU) {
+		maxblk = slot->maxRAPDU - 2;
+	}
+	maxblk &= ~(size_t)15;	// Whole blocks only
+
+	memset(iv, 0, sizeof(iv));
+	*SW1SW2 = 0x9000;
+	total = 0;
+
+	while (len > 0) {
+		blen = len > maxblk ? maxblk : len;
+
+		memcpy(buff, in, blen);
+		if (algo == ALGO_AES_CBC_ENCRYPT) {
+			for (i = 0; i < sizeof(iv); i++) {
+				buff[i] ^= iv[i];
+			}
+		} else {
+			memcpy(next, in + blen - sizeof(next), sizeof(next));
+		}
+
+		rc = transmitAPDU(slot, 0x80, 0x78, (unsigned char)pObject->tokenid, (unsigned char)algo,
+				(int)blen, buff,
+				0, out, (int)blen, SW1SW2);
+
+		if ((rc < 0) || (*SW1SW2 != 0x9000)) {
+			memset(buff, 0, sizeof(buff));
+			return rc;
+		}
+
+		if (rc != (int)blen) {
+			memset(buff, 0, sizeof(buff));
+			return -1;
+		}
+
+		if (algo == ALGO_AES_CBC_ENCRYPT) {
+			memcpy(iv, out + blen - sizeof(iv), sizeof(iv));
+		} else {
+			for (i = 0; i < sizeof(iv); i++) {
+				out[i] ^= iv[i];
+			}
+			memcpy(iv, next, sizeof(iv));
+		}
+
+		in += blen;
+		out += blen;
+		len -= blen;
+		total += (int)blen;
+	}
+
+	memset(buff, 0, sizeof(buff));
+	return total;
+}
+
+
+
 static CK_RV sc_hsm_C_Encrypt(struct p11Object_t *pObject, CK_MECHANISM_TYPE mech, CK_BYTE_PTR pData, CK_ULONG pulDataLen, CK_BYTE_PTR pEncryptedData, CK_ULONG_PTR ulEncryptedDataLen)
 {
 	int rc, algo;
 	unsigned short SW1SW2;
-	unsigned char scr[2048];
 
 	FUNC_CALLED();
 
@@ -681,9 +870,16 @@ static CK_RV sc_hsm_C_Encrypt(struct p11Object_t *pObject, CK_MECHANISM_TYPE mec
 		FUNC_FAILS(CKR_MECHANISM_INVALID, "Mechanism not supported");
 	}
 
-	rc = transmitAPDU(pObject->token->slot, 0x80, 0x78, (unsigned char)pObject->tokenid, (unsigned char)algo,
-			pulDataLen, pData,
-			0, scr, sizeof(scr), &SW1SW2);
+	if (pulDataLen & 15) {
+		FUNC_FAILS(CKR_DATA_LEN_RANGE, "Data must be a multiple of the block size");
+	}
+
+	if (pulDataLen > *ulEncryptedDataLen) {
+		*ulEncryptedDataLen = pulDataLen;
+		FUNC_FAILS(CKR_BUFFER_TOO_SMALL, "supplied buffer too small");
+	}
+
+	rc = transmitAESCBC(pObject, algo, pData, pulDataLen, pEncryptedData, &SW1SW2);
 
 	if (rc < 0) {
 		FUNC_FAILS(CKR_DEVICE_ERROR, "transmitAPDU failed");
@@ -706,12 +902,7 @@ static CK_RV sc_hsm_C_Encrypt(struct p11Object_t *pObject, CK_MECHANISM_TYPE mec
 		break;
 	}
 
-	if (rc > (int)*ulEncryptedDataLen) {
-		*ulEncryptedDataLen = rc;
-		FUNC_FAILS(CKR_BUFFER_TOO_SMALL, "supplied buffer too small");
-	}
 	*ulEncryptedDataLen = rc;
-	memcpy(pEncryptedData, scr, rc);
 
 	FUNC_RETURNS(CKR_OK);
 }
@@ -752,7 +943,7 @@ static int stripPKCS15Padding(unsigned char *scr, int len, CK_BYTE_PTR pData, CK
 
 static int sc_hsm_C_Decrypt(struct p11Object_t *pObject, CK_MECHANISM_TYPE mech, CK_BYTE_PTR pEncryptedData, CK_ULONG ulEncryptedDataLen, CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen)
 {
-	int rc, algo, ins;
+	int rc, algo;
 	unsigned short SW1SW2;
 	unsigned char scr[2048];
 
@@ -773,15 +964,22 @@ static int sc_hsm_C_Decrypt(struct p11Object_t *pObject, CK_MECHANISM_TYPE mech,
 	}
 
 	if (mech == CKM_AES_CBC) {
-		ins = 0x78;
+		if (ulEncryptedDataLen & 15) {
+			FUNC_FAILS(CKR_ENCRYPTED_DATA_LEN_RANGE, "Cryptogram must be a multiple of the block size");
+		}
+
+		if (ulEncryptedDataLen > *pulDataLen) {
+			*pulDataLen = ulEncryptedDataLen;
+			FUNC_FAILS(CKR_BUFFER_TOO_SMALL, "supplied buffer too small");
+		}
+
+		rc = transmitAESCBC(pObject, algo, pEncryptedData, ulEncryptedDataLen, pData, &SW1SW2);
 	} else {
-		ins = 0x62;
+		rc = transmitAPDU(pObject->token->slot, 0x80, 0x62, (unsigned char)pObject->tokenid, (unsigned char)algo,
+				ulEncryptedDataLen, pEncryptedData,
+				0, scr, sizeof(scr), &SW1SW2);
 	}
 
-	rc = transmitAPDU(pObject->token->slot, 0x80, ins, (unsigned char)pObject->tokenid, (unsigned char)algo,
-			ulEncryptedDataLen, pEncryptedData,
-			0, scr, sizeof(scr), &SW1SW2);
-
 	if (rc < 0) {
 		FUNC_FAILS(CKR_DEVICE_ERROR, "transmitAPDU failed");
 	}
@@ -806,8 +1004,9 @@ static int sc_hsm_C_Decrypt(struct p11Object_t *pObject, CK_MECHANISM_TYPE mech,
 		break;
 	}
 
-	if ((mech == CKM_RSA_X_509)
-			|| (mech == CKM_AES_CBC)) {
+	if (mech == CKM_AES_CBC) {
+		*pulDataLen = rc;
+	} else if (mech == CKM_RSA_X_509) {
 		if (rc > (int)*pulDataLen) {
 			*pulDataLen = rc;
 			FUNC_FAILS(CKR_BUFFER_TOO_SMALL, "supplied buffer too small");
@@ -1196,7 +1395,7 @@ static int addEECertificateAndKeyObjects(struct p11Token_t *token, unsigned char
 
 	FUNC_CALLED();
 
-	rc = readEF(token->slot, (PRKD_PREFIX << 8) | id, prkd, sizeof(prkd));
+	rc = readCachedEF(token, (PRKD_PREFIX << 8) | id, prkd, sizeof(prkd));
 
 	if (rc < 0) {
 		FUNC_FAILS(CKR_DEVICE_ERROR, "Error reading private key description");
@@ -1227,7 +1426,7 @@ static int addEECertificateAndKeyObjects(struct p11Token_t *token, unsigned char
 			FUNC_FAILS(CKR_DEVICE_ERROR, "Error decoding private key description");
 		}
 
-		rc = readEF(token->slot, (EE_CERTIFICATE_PREFIX << 8) | id, certValue, sizeof(certValue));
+		rc = readCachedEF(token, (EE_CERTIFICATE_PREFIX << 8) | id, certValue, sizeof(certValue));
 
 		if (rc > 0) {
 			certLen = rc;
@@ -1328,8 +1527,13 @@ static int addEECertificateAndKeyObjects(struct p11Token_t *token, unsigned char
 
 	p11prikey->tokenid = (int)id;
 
+	if (p11pubkey != NULL)
+		p11pubkey->tokenid = (int)id;
+
 	addObject(token, p11prikey, FALSE);
 
+	updateFileList(token, (KEY_PREFIX << 8) | id, TRUE);
+
 	if (priKey != NULL)
 		*priKey = p11prikey;
 
@@ -1355,7 +1559,7 @@ static int addCACertificateObject(struct p11Token_t *token, unsigned char id)
 
 	FUNC_CALLED();
 
-	rc = readEF(token->slot, (CD_PREFIX << 8) | id, cd, sizeof(cd));
+	rc = readCachedEF(token, (CD_PREFIX << 8) | id, cd, sizeof(cd));
 
 	if (rc < 0) {
 		FUNC_FAILS(CKR_DEVICE_ERROR, "Error reading certificate description");
@@ -1368,7 +1572,7 @@ static int addCACertificateObject(struct p11Token_t *token, unsigned char id)
 	}
 
 	fid = (CA_CERTIFICATE_PREFIX << 8) | id;
-	rc = readEF(token->slot, fid, certValue, sizeof(certValue));
+	rc = readCachedEF(token, fid, certValue, sizeof(certValue));
 
 	if (rc < 0) {
 		FUNC_FAILS(CKR_DEVICE_ERROR, "Error reading certificate");
@@ -2052,6 +2256,9 @@ static int sc_hsm_C_GenerateKeyPair(
 	if (SW1SW2 != 0x9000)
 		FUNC_FAILS(CKR_DEVICE_ERROR, "Signature operation failed");
 
+	// The device stores the request in the EE certificate file
+	updateFileList(slot->token, (EE_CERTIFICATE_PREFIX << 8) | id, TRUE);
+
 	createPrivateKeyDescription(slot,pMechanism, pPrivateKeyTemplate, ulPrivateKeyAttributeCount, id, keysize);
 
 	rc = addEECertificateAndKeyObjects(slot->token, id, &priKey, &pubKey, NULL);
@@ -2266,43 +2473,398 @@ static int sc_hsm_destroyObject(struct p11Slot_t *slot, struct p11Object_t *pObj
 
 
 
-static int sc_hsm_loadObjects(struct p11Token_t *token)
+/**
+ * Read and decode the files for an entry in the file list and add the resulting objects to the token
+ */
+static void loadObject(struct p11Token_t *token, int prefix, int id)
+{
+	int rc;
+
+	switch(prefix) {
+	case KEY_PREFIX:
+		rc = addEECertificateAndKeyObjects(token, id, NULL, NULL, NULL);
+		if (rc != CKR_OK) {
+#ifdef DEBUG
+			debug("addEECertificateAndKeyObjects failed with rc=%d\n", rc);
+#endif
+		}
+		break;
+	case CA_CERTIFICATE_PREFIX:
+		rc = addCACertificateObject(token, id);
+		if (rc != CKR_OK) {
+#ifdef DEBUG
+			debug("addCACertificateAndKeyObjects failed with rc=%d\n", rc);
+#endif
+		}
+		break;
+	}
+}
+
+
+
+/**
+ * Determine from the search template, if deferred keys or CA certificates can match
+ */
+static void getDeferredObjectFilter(CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, int *keys, int *cacerts)
+{
+	CK_ULONG i;
+
+	*keys = TRUE;
+	*cacerts = TRUE;
+
+	for (i = 0; i < ulCount; i++) {
+		if ((pTemplate[i].type == CKA_TOKEN) && (pTemplate[i].ulValueLen == sizeof(CK_BBOOL))) {
+			if (*(CK_BBOOL *)pTemplate[i].pValue == CK_FALSE) {
+				*keys = FALSE;
+				*cacerts = FALSE;
+			}
+		}
+		if ((pTemplate[i].type == CKA_CLASS) && (pTemplate[i].ulValueLen == sizeof(CK_OBJECT_CLASS))) {
+			switch(*(CK_OBJECT_CLASS *)pTemplate[i].pValue) {
+			case CKO_CERTIFICATE:
+				break;
+			case CKO_PRIVATE_KEY:
+			case CKO_PUBLIC_KEY:
+			case CKO_SECRET_KEY:
+				*cacerts = FALSE;
+				break;
+			default:
+				*keys = FALSE;
+				*cacerts = FALSE;
+				break;
+			}
+		}
+	}
+}
+
+
+
+#ifndef MINIDRIVER
+/**
+ * Get the interval in milliseconds after which a search compares the file list with the token
+ */
+static int getSyncInterval()
+{
+	static int interval = -1;
+	char *po;
+
+	if (interval < 0) {
+		po = getenv("PKCS11_SYNC_INTERVAL");
+		interval = po ? atoi(po) : 0;
+		if (interval < 0)
+			interval = 0;
+#ifdef DEBUG
+		debug("Object synchronization interval is %d ms\n", interval);
+#endif
+	}
+	return interval;
+}
+
+
+
+static int isSyncDue(struct token_sc_hsm *sc)
+{
+	int interval = getSyncInterval();
+
+	return (interval > 0) && (thread_ticks() - sc->lastSync >= (unsigned long)interval);
+}
+
+
+
+static int getFileIndex(unsigned char *filelist, int listlen, int prefix, int id)
+{
+	int i;
+
+	for (i = 0; i < listlen; i += 2) {
+		if ((filelist[i] == prefix) && (filelist[i + 1] == id))
+			return i;
+	}
+	return -1;
+}
+
+
+
+static int isFileListed(unsigned char *filelist, int listlen, int prefix, int id)
+{
+	return getFileIndex(filelist, listlen, prefix, id) >= 0;
+}
+
+
+
+/**
+ * Mark the key or CA certificate using the file
+ */
+static void markObjectForFile(int prefix, int id, unsigned char *keys, unsigned char *cacerts)
+{
+	switch(prefix) {
+	case KEY_PREFIX:
+	case PRKD_PREFIX:
+	case EE_CERTIFICATE_PREFIX:
+		keys[id] = 1;
+		break;
+	case CA_CERTIFICATE_PREFIX:
+	case CD_PREFIX:
+		cacerts[id] = 1;
+		break;
+	}
+}
+
+
+
+/**
+ * Mark keys and CA certificates with files in list a that are not contained in list b
+ */
+static void markChangedObjects(unsigned char *a, int alen, unsigned char *b, int blen, unsigned char *keys, unsigned char *cacerts)
+{
+	int i;
+
+	for (i = 0; i < alen; i += 2) {
+		if (!isFileListed(b, blen, a[i], a[i + 1]))
+			markObjectForFile(a[i], a[i + 1], keys, cacerts);
+	}
+}
+
+
+
+/**
+ * Mark keys and CA certificates with files that changed their position in the list
+ *
+ * The SmartCard-HSM enumerates files in the order of creation, so a file deleted and created
+ * again under the same identifier by another process moves behind the files of the same type
+ * that were created before, even if the list contains the same files. Positions are only compared
+ * among files with the same prefix, as this module adds files of different types to the old list
+ * in a different order than the device creates them.
+ */
+static void markMovedObjects(unsigned char *oldlist, int oldlen, unsigned char *newlist, int newlen, unsigned char *keys, unsigned char *cacerts)
+{
+	int last[256];
+	int i, ofs;
+
+	for (i = 0; i < 256; i++)
+		last[i] = -1;
+
+	for (i = 0; i < newlen; i += 2) {
+		ofs = getFileIndex(oldlist, oldlen, newlist[i], newlist[i + 1]);
+
+		if (ofs < 0)
+			continue;
+
+		if (ofs < last[newlist[i]]) {
+			markObjectForFile(newlist[i], newlist[i + 1], keys, cacerts);
+		} else {
+			last[newlist[i]] = ofs;
+		}
+	}
+}
+
+
+
+/**
+ * Unload the objects for a key or CA certificate and register it for deferred loading if still on the token
+ */
+static void reloadObject(struct p11Token_t *token, int prefix, int id)
 {
+	struct token_sc_hsm *sc = getPrivateData(token);
+	struct p11Object_t *obj;
+	int i, tokenid, publicObject;
+
+	for (i = 0; i < sc->pendingLen; i += 2) {
+		if ((sc->pending[i] == prefix) && (sc->pending[i + 1] == id)) {
+			sc->pendingLen -= 2;
+			memmove(sc->pending + i, sc->pending + i + 2, sc->pendingLen - i);
+			break;
+		}
+	}
+
+	tokenid = prefix == KEY_PREFIX ? id : (prefix << 8) | id;
+
+	for (publicObject = 0; publicObject < 2; publicObject++) {
+		obj = publicObject ? token->tokenObjList : token->tokenPrivObjList;
+		while (obj != NULL) {
+			if (obj->tokenid == tokenid) {
+				removeTokenObject(token, obj->handle, publicObject);
+				obj = publicObject ? token->tokenObjList : token->tokenPrivObjList;
+			} else {
+				obj = obj->next;
+			}
+		}
+	}
+
+	if (isFileListed(sc->filelist, sc->filelistLen, prefix, id)) {
+		sc->pending[sc->pendingLen++] = prefix;
+		sc->pending[sc->pendingLen++] = id;
+	}
+}
+
+
+
+/**
+ * Compare the file list on the token with the file list at the last synchronization
+ *
+ * Keys and CA certificates with files added, removed or replaced by other processes are unloaded
+ * and registered for deferred loading. All other objects remain unchanged and keep their handles.
+ * Files are only read again when the objects are loaded. The persistent file cache is validated
+ * against the file list, so it is not used for the files of replaced keys and certificates.
+ */
+static void syncObjects(struct p11Token_t *token)
+{
+	struct token_sc_hsm *sc = getPrivateData(token);
 	unsigned char filelist[MAX_FILES * 2];
-	struct p11Slot_t *slot = token->slot;
-	int rc,listlen,i,id,prefix;
+	unsigned char keys[256], cacerts[256];
+	int rc, listlen, id;
 
 	FUNC_CALLED();
 
-	rc = enumerateObjects(slot, filelist, sizeof(filelist));
+	sc->lastSync = thread_ticks();
+
+	rc = enumerateObjects(token->slot, filelist, sizeof(filelist));
 	if (rc < 0) {
-		FUNC_FAILS(rc, "enumerateObjects failed");
+#ifdef DEBUG
+		debug("enumerateObjects failed with rc=%d\n", rc);
+#endif
+		return;
 	}
 
 	listlen = rc;
-	for (i = 0; i < listlen; i += 2) {
-		prefix = filelist[i];
-		id = filelist[i + 1];
 
-		switch(prefix) {
-		case KEY_PREFIX:
-			if (id != 0) {				// Skip Device Authentication Key
-				rc = addEECertificateAndKeyObjects(token, id, NULL, NULL, NULL);
-				if (rc != CKR_OK) {
+	if ((listlen == sc->filelistLen) && !memcmp(filelist, sc->filelist, listlen)) {
+		return;
+	}
+
+	memset(keys, 0, sizeof(keys));
+	memset(cacerts, 0, sizeof(cacerts));
+	markChangedObjects(sc->filelist, sc->filelistLen, filelist, listlen, keys, cacerts);
+	markChangedObjects(filelist, listlen, sc->filelist, sc->filelistLen, keys, cacerts);
+	markMovedObjects(sc->filelist, sc->filelistLen, filelist, listlen, keys, cacerts);
+
+	memcpy(sc->filelist, filelist, listlen);
+	sc->filelistLen = listlen;
+
+	for (id = 1; id < 256; id++) {		// Skip Device Authentication Key
+		if (keys[id]) {
 #ifdef DEBUG
-					debug("addEECertificateAndKeyObjects failed with rc=%d\n", rc);
+			debug("Key %d changed\n", id);
 #endif
-				}
-			}
-			break;
-		case CA_CERTIFICATE_PREFIX:
-			rc = addCACertificateObject(token, id);
-			if (rc != CKR_OK) {
+			reloadObject(token, KEY_PREFIX, id);
+		}
+	}
+
+	for (id = 0; id < 256; id++) {
+		if (cacerts[id]) {
 #ifdef DEBUG
-				debug("addCACertificateAndKeyObjects failed with rc=%d\n", rc);
+			debug("CA certificate %d changed\n", id);
 #endif
-			}
-			break;
+			reloadObject(token, CA_CERTIFICATE_PREFIX, id);
+		}
+	}
+}
+#endif
+
+
+
+/**
+ * Load objects deferred at token insertion which can match the search template
+ *
+ * Only the file list is enumerated when the token is inserted. Key descriptions and certificates
+ * are read and decoded on the first search or enumeration of token objects that may include them.
+ *
+ * If PKCS11_SYNC_INTERVAL is set, then a search also applies changes made to the token by
+ * other processes, at most once in the given number of milliseconds.
+ *
+ * @param token     The token
+ * @param pTemplate The search template or NULL to load all deferred objects
+ * @param ulCount   The number of attributes in the search template
+ * @return          CKR_OK or any other Cryptoki error code
+ */
+static int sc_hsm_loadDeferredObjects(struct p11Token_t *token, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount)
+{
+	struct token_sc_hsm *sc = getPrivateData(token);
+	int rc, i, j, keys, cacerts, prefix, id, sync;
+
+	sync = FALSE;
+#ifndef MINIDRIVER
+	sync = isSyncDue(sc);
+#endif
+
+	if (!sync && (sc->pendingLen == 0))
+		return CKR_OK;
+
+	FUNC_CALLED();
+
+	getDeferredObjectFilter(pTemplate, ulCount, &keys, &cacerts);
+
+	if (!sync && !keys && !cacerts)
+		FUNC_RETURNS(CKR_OK);
+
+	// Serialize with other threads loading objects from this token. Objects remain
+	// pending and are loaded with the next search if the transaction fails.
+	rc = beginSlotTransaction(token->slot);
+	if (rc != CKR_OK) {
+		endSlotTransaction(token->slot);
+		FUNC_FAILS(rc, "Could not begin transaction");
+	}
+
+#ifndef MINIDRIVER
+	if (sync && isSyncDue(sc))
+		syncObjects(token);
+
+	openEFCache(token->info.serialNumber, sizeof(token->info.serialNumber), sc->filelist, sc->filelistLen, &sc->cache);
+#endif
+
+	for (i = 0, j = 0; i < sc->pendingLen; i += 2) {
+		prefix = sc->pending[i];
+		id = sc->pending[i + 1];
+
+		if (((prefix == KEY_PREFIX) && keys) || ((prefix == CA_CERTIFICATE_PREFIX) && cacerts)) {
+			loadObject(token, prefix, id);
+		} else {
+			sc->pending[j++] = prefix;
+			sc->pending[j++] = id;
+		}
+	}
+	sc->pendingLen = j;
+
+#ifndef MINIDRIVER
+	closeEFCache(sc->cache);
+	sc->cache = NULL;
+#endif
+
+	endSlotTransaction(token->slot);
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * Enumerate the files on the token and register keys and CA certificates for deferred loading
+ */
+static int sc_hsm_loadObjects(struct p11Token_t *token)
+{
+	struct token_sc_hsm *sc = getPrivateData(token);
+	int rc,i,id,prefix;
+
+	FUNC_CALLED();
+
+	rc = enumerateObjects(token->slot, sc->filelist, sizeof(sc->filelist));
+	if (rc < 0) {
+		FUNC_FAILS(rc, "enumerateObjects failed");
+	}
+
+	sc->filelistLen = rc;
+	sc->pendingLen = 0;
+#ifndef MINIDRIVER
+	sc->lastSync = thread_ticks();
+#endif
+
+	for (i = 0; i < sc->filelistLen; i += 2) {
+		prefix = sc->filelist[i];
+		id = sc->filelist[i + 1];
+
+		if (((prefix == KEY_PREFIX) && (id != 0)) ||		// Skip Device Authentication Key
+			(prefix == CA_CERTIFICATE_PREFIX)) {
+			sc->pending[sc->pendingLen++] = prefix;
+			sc->pending[sc->pendingLen++] = id;
 		}
 	}
 
@@ -2939,7 +3501,9 @@ struct p11TokenDriver *getSmartCardHSMTokenDriver()
 		sc_hsm_C_CreateObject,		// int (*C_CreateObject)     (struct p11Slot_t *, CK_ATTRIBUTE_PTR, CK_ULONG ulCount, struct p11Object_t **);
 		sc_hsm_destroyObject,		// int (*destroyObject)       (struct p11Slot_t *, struct p11Object_t *);
 		sc_hsm_C_SetAttributeValue,	// int (*C_SetAttributeValue)(struct p11Slot_t *, struct p11Object_t *, CK_ATTRIBUTE_PTR, CK_ULONG);
-		sc_hsm_C_GenerateRandom		// int (*C_GenerateRandom)   (struct p11Slot_t *, CK_BYTE_PTR , CK_ULONG );
+		sc_hsm_C_GenerateRandom,	// int (*C_GenerateRandom)   (struct p11Slot_t *, CK_BYTE_PTR , CK_ULONG );
+
+		sc_hsm_loadDeferredObjects	// int (*loadObjects)        (struct p11Token_t *, CK_ATTRIBUTE_PTR, CK_ULONG);
 	};
 
 	return &sc_hsm_token;
@@ -78,6 +78,12 @@
 
 struct token_sc_hsm {
 	unsigned char sopin[8];
+	struct ef_cache *cache;		/* Persistent file cache, only while loading objects */
+	unsigned char filelist[MAX_FILES * 2];	/* File list enumerated from the token */
+	int filelistLen;
+	unsigned char pending[MAX_FILES * 2];	/* Keys and CA certificates not yet loaded */
+	int pendingLen;
+	unsigned long lastSync;		/* Time of last comparison of the file list with the token */
 };
 
 struct p11TokenDriver *sc_hsm_getDriver();
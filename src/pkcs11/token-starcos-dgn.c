@@ -256,11 +256,17 @@ static int esign_C_Sign(struct p11Object_t *pObject, CK_MECHANISM_TYPE mech, CK_
 	}
 
 	slot = pObject->token->slot;
-	starcosLock(pObject->token);
+	rc = starcosLock(pObject->token);
 	if (!slot->token) {
+		starcosUnlock(pObject->token);
 		FUNC_RETURNS(CKR_DEVICE_REMOVED);
 	}
 
+	if (rc != CKR_OK) {
+		starcosUnlock(pObject->token);
+		FUNC_FAILS(rc, "Could not begin transaction");
+	}
+
 	rc = starcosSelectApplication(pObject->token);
 	if (rc < 0) {
 		starcosUnlock(pObject->token);
@@ -103,9 +103,23 @@ struct starcosPrivateData *starcosGetPrivateData(struct p11Token_t *token)
 
 
 
-void starcosLock(struct p11Token_t *token)
+/**
+ * Lock the token and begin a transaction for the card
+ *
+ * Must be paired with starcosUnlock(), even if an error is returned.
+ *
+ * @return CKR_OK or CKR_DEVICE_ERROR if the transaction could not be started
+ */
+int starcosLock(struct p11Token_t *token)
 {
+	int rc;
+
+	// Tokens in virtual slots share the card with the token in the primary slot. The
+	// transaction keeps other processes from changing the selected application.
+	// The slot is acquired first, as logIn() already holds it when calling the driver
+	rc = beginSlotTransaction(token->slot);
 	p11LockMutex(token->mutex);
+	return rc;
 }
 
 
@@ -113,6 +127,7 @@ void starcosLock(struct p11Token_t *token)
 void starcosUnlock(struct p11Token_t *token)
 {
 	p11UnlockMutex(token->mutex);
+	endSlotTransaction(token->slot);
 }
 
 
@@ -728,11 +743,17 @@ static int starcos_C_Sign(struct p11Object_t *pObject, CK_MECHANISM_TYPE mech, C
 	}
 
 	slot = pObject->token->slot;
-	starcosLock(pObject->token);
+	rc = starcosLock(pObject->token);
 	if (!slot->token) {
+		starcosUnlock(pObject->token);
 		FUNC_RETURNS(CKR_DEVICE_REMOVED);
 	}
 
+	if (rc != CKR_OK) {
+		starcosUnlock(pObject->token);
+		FUNC_FAILS(rc, "Could not begin transaction");
+	}
+
 	rc = starcosSelectApplication(pObject->token);
 	if (rc < 0) {
 		starcosUnlock(pObject->token);
@@ -847,11 +868,17 @@ static int starcos_C_Decrypt(struct p11Object_t *pObject, CK_MECHANISM_TYPE mech
 	}
 
 	slot = pObject->token->slot;
-	starcosLock(pObject->token);
+	rc = starcosLock(pObject->token);
 	if (!slot->token) {
+		starcosUnlock(pObject->token);
 		FUNC_RETURNS(CKR_DEVICE_REMOVED);
 	}
 
+	if (rc != CKR_OK) {
+		starcosUnlock(pObject->token);
+		FUNC_FAILS(rc, "Could not begin transaction");
+	}
+
 	rc = starcosSelectApplication(pObject->token);
 	if (rc < 0) {
 		starcosUnlock(pObject->token);
@@ -1132,11 +1159,16 @@ static int login(struct p11Slot_t *slot, int userType, CK_UTF8CHAR_PTR pin, CK_U
 
 	FUNC_CALLED();
 
-	starcosLock(slot->token);
+	rc = starcosLock(slot->token);
 	if (!slot->token) {
 		FUNC_RETURNS(CKR_DEVICE_REMOVED);
 	}
 
+	if (rc != CKR_OK) {
+		starcosUnlock(slot->token);
+		FUNC_FAILS(rc, "Could not begin transaction");
+	}
+
 	rc = starcosSelectApplication(slot->token);
 	if (rc < 0) {
 		starcosUnlock(slot->token);
@@ -1230,11 +1262,16 @@ static int initpin(struct p11Slot_t *slot, CK_UTF8CHAR_PTR pin, CK_ULONG pinlen)
 		}
 	}
 
-	starcosLock(slot->token);
+	rc = starcosLock(slot->token);
 	if (!slot->token) {
 		FUNC_RETURNS(CKR_DEVICE_REMOVED);
 	}
 
+	if (rc != CKR_OK) {
+		starcosUnlock(slot->token);
+		FUNC_FAILS(rc, "Could not begin transaction");
+	}
+
 	rc = starcosSelectApplication(slot->token);
 	if (rc < 0) {
 		starcosUnlock(slot->token);
@@ -1322,11 +1359,16 @@ static int setpin(struct p11Slot_t *slot, CK_UTF8CHAR_PTR oldpin, CK_ULONG oldpi
 		FUNC_FAILS(rc, "Could not encode NewPIN");
 	}
 
-	starcosLock(slot->token);
+	rc = starcosLock(slot->token);
 	if (!slot->token) {
 		FUNC_RETURNS(CKR_DEVICE_REMOVED);
 	}
 
+	if (rc != CKR_OK) {
+		starcosUnlock(slot->token);
+		FUNC_FAILS(rc, "Could not begin transaction");
+	}
+
 	rc = starcosSelectApplication(slot->token);
 	if (rc < 0) {
 		starcosUnlock(slot->token);
@@ -1635,7 +1677,9 @@ struct p11TokenDriver *getStarcosTokenDriver()
 
 		NULL,				// int (*destroyObject)       (struct p11Slot_t *, struct p11Object_t *);
 		NULL,				// int (*C_SetAttributeValue)(struct p11Slot_t *, struct p11Object_t *, CK_ATTRIBUTE_PTR, CK_ULONG);
-		starcos_C_GenerateRandom	// int (*C_GenerateRandom)   (struct p11Slot_t *, CK_BYTE_PTR , CK_ULONG );
+		starcos_C_GenerateRandom,	// int (*C_GenerateRandom)   (struct p11Slot_t *, CK_BYTE_PTR , CK_ULONG );
+
+		NULL				// int (*loadObjects)        (struct p11Token_t *, CK_ATTRIBUTE_PTR, CK_ULONG);
 	};
 
 
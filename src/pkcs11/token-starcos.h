@@ -64,7 +64,7 @@ struct starcosPrivateData {
 };
 
 struct starcosPrivateData *starcosGetPrivateData(struct p11Token_t *token);
-void starcosLock(struct p11Token_t *token);
+int starcosLock(struct p11Token_t *token);
 void starcosUnlock(struct p11Token_t *token);
 int starcosSwitchApplication(struct p11Token_t *token, struct starcosApplication *application);
 int starcosSelectApplication(struct p11Token_t *token);
@@ -40,11 +40,18 @@
 #include <pkcs11/strbpcpy.h>
 
 #include <pkcs11/token.h>
+#include <pkcs11/slot.h>
 #include <pkcs11/object.h>
 #include <pkcs11/dataobject.h>
 
 #include <pkcs11/token-sc-hsm.h>
 
+#ifndef MINIDRIVER
+#include <pkcs11/slot-trace.h>
+#endif
+
+#include <common/atomic.h>
+
 #ifdef DEBUG
 #include <common/debug.h>
 #endif
@@ -111,31 +118,47 @@ int getMechanismInfo(struct p11Token_t *token, CK_MECHANISM_TYPE type, CK_MECHAN
  * @param object    The object
  * @param publicObject true to add as public object, false to add as private object
  *
- * @return          0 or -1 if error
+ * @return          CKR_OK or CKR_HOST_MEMORY if the object can not be located by handle
  */
 int addObject(struct p11Token_t *token, struct p11Object_t *object, int publicObject)
 {
+	int rc, rca;
+
 	object->token = token;
 
-	p11LockMutex(token->mutex);
+	// The object is not yet visible to other threads, so the attributes are moved without the object lock
+	moveAttributesToArena(object, token->arena);
+
+	p11LockExclusive(token->objectLock);
 
 	if (!object->handle) {
 		object->handle = token->freeObjectNumber++;
 	}
 
+	// The list holds the first reference, which is released when the object is removed
+	object->refCount = 1;
+
 	if (publicObject) {
 		addObjectToList(&token->tokenObjList, object);
+		rc = addObjectToIndex(&token->tokenObjIndex, object);
+		rca = addObjectToAttributeIndex(&token->tokenObjAttrIndex, object);
 		token->numberOfTokenObjects++;
 	} else {
 		addObjectToList(&token->tokenPrivObjList, object);
+		rc = addObjectToIndex(&token->tokenPrivObjIndex, object);
+		rca = addObjectToAttributeIndex(&token->tokenPrivObjAttrIndex, object);
 		token->numberOfPrivateTokenObjects++;
 	}
 
-	p11UnlockMutex(token->mutex);
+	if (rc == CKR_OK) {
+		rc = rca;
+	}
+
+	p11UnlockExclusive(token->objectLock);
 
 	object->dirtyFlag = 1;
 
-	return CKR_OK;
+	return rc;
 }
 
 
@@ -143,32 +166,70 @@ int addObject(struct p11Token_t *token, struct p11Object_t *object, int publicOb
 /**
  * Find public or private object in list of token objects
  *
+ * The object remains valid if removed from the token by another thread until the reference
+ * is released with releaseObject().
+ *
  * @param token     The token whose object shall be searched
  * @param handle    The objects handle
+ * @return          0 if found or -1 if not
  */
 int findObject(struct p11Token_t *token, CK_OBJECT_HANDLE handle, struct p11Object_t **object, int publicObject)
 {
-	struct p11Object_t *obj;
-	int pos = 0;            /* remember the current position in the list */
-
 	if (!publicObject && (token->user != CKU_USER)) {
+		*object = NULL;
 		return -1;
 	}
 
-	obj = publicObject == TRUE ? token->tokenObjList : token->tokenPrivObjList;
-	*object = NULL;
+	p11LockShared(token->objectLock);
+	*object = findObjectInIndex(publicObject == TRUE ? token->tokenObjIndex : token->tokenPrivObjIndex, handle);
+	if (*object != NULL)
+		atomic_inc(&(*object)->refCount);
+	p11UnlockShared(token->objectLock);
 
-	while (obj != NULL) {
-		if (obj->handle == handle) {
-			*object = obj;
-			return pos;
-		}
+	return *object ? 0 : -1;
+}
 
-		obj = obj->next;
-		pos++;
-	}
 
-	return -1;
+
+/**
+ * Obtain a reference to an object located by other means than the handle
+ *
+ * @param token     The token containing the object
+ * @param object    The object, which must be released with releaseObject()
+ * @return          0 or -1 if the object was removed from the token
+ */
+int referenceObject(struct p11Token_t *token, struct p11Object_t *object)
+{
+	struct p11Object_t *found;
+
+	p11LockShared(token->objectLock);
+	found = findObjectInIndex(token->tokenPrivObjIndex, object->handle);
+	if (found != object)
+		found = findObjectInIndex(token->tokenObjIndex, object->handle);
+	if (found == object)
+		atomic_inc(&object->refCount);
+	p11UnlockShared(token->objectLock);
+
+	return found == object ? 0 : -1;
+}
+
+
+
+/**
+ * Load objects the token driver deferred until first use
+ *
+ * @param token     The token whose objects shall be loaded
+ * @param pTemplate The search template or NULL to load all objects
+ * @param ulCount   The number of attributes in the search template
+ *
+ * @return          CKR_OK or any other Cryptoki error code
+ */
+int loadDeferredObjects(struct p11Token_t *token, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount)
+{
+	if (token->drv->loadObjects == NULL) {
+		return CKR_OK;
+	}
+	return token->drv->loadObjects(token, pTemplate, ulCount);
 }
 
 
@@ -183,7 +244,28 @@ int findObject(struct p11Token_t *token, CK_OBJECT_HANDLE handle, struct p11Obje
  */
 int findMatchingTokenObject(struct p11Token_t *token, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, struct p11Object_t **pObject)
 {
+	struct p11AttributeIndexKey_t *keys[2];
 	struct p11Object_t *p;
+	CK_ULONG i;
+	int k;
+
+	loadDeferredObjects(token, pTemplate, ulCount);
+
+	p11LockShared(token->objectLock);
+
+	if (selectIndexedObjects(token, pTemplate, ulCount, &keys[0], &keys[1]) >= 0) {
+		for (k = 0; k < 2; k++) {
+			for (i = 0; keys[k] && (i < keys[k]->count); i++) {
+				if (isMatchingObject(keys[k]->object[i], pTemplate, ulCount)) {
+					*pObject = keys[k]->object[i];
+					p11UnlockShared(token->objectLock);
+					return CKR_OK;
+				}
+			}
+		}
+		p11UnlockShared(token->objectLock);
+		return CKR_ARGUMENTS_BAD;
+	}
 
 	/* public token objects */
 	p = token->tokenObjList;
@@ -191,6 +273,7 @@ int findMatchingTokenObject(struct p11Token_t *token, CK_ATTRIBUTE_PTR pTemplate
 	while (p != NULL) {
 		if (isMatchingObject(p, pTemplate, ulCount)) {
 			*pObject = p;
+			p11UnlockShared(token->objectLock);
 			return CKR_OK;
 		}
 		p = p->next;
@@ -202,16 +285,69 @@ int findMatchingTokenObject(struct p11Token_t *token, CK_ATTRIBUTE_PTR pTemplate
 	while (p != NULL) {
 		if (isMatchingObject(p, pTemplate, ulCount)) {
 			*pObject = p;
+			p11UnlockShared(token->objectLock);
 			return CKR_OK;
 		}
 		p = p->next;
 	}
 
+	p11UnlockShared(token->objectLock);
+
 	return CKR_ARGUMENTS_BAD;
 }
 
 
 
+/**
+ * Select the token objects to be matched against a search template
+ *
+ * Of the attributes in the template that are indexed, the one listing the fewest objects is chosen.
+ * The caller must hold the object lock of the token while accessing the selected objects.
+ *
+ * @param token      The token whose objects shall be searched
+ * @param pTemplate  The search template
+ * @param ulCount    The number of attributes in the search template
+ * @param publicKey  Variable receiving the public objects having the selected value or NULL
+ * @param privateKey Variable receiving the private objects having the selected value or NULL.
+ *                   Pass NULL to not consider private objects
+ * @return           The position of the selected attribute in the template or -1 if no attribute is indexed
+ */
+int selectIndexedObjects(struct p11Token_t *token, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount,
+		struct p11AttributeIndexKey_t **publicKey, struct p11AttributeIndexKey_t **privateKey)
+{
+	struct p11AttributeIndexKey_t *pub, *priv;
+	CK_ULONG i, cnt, best;
+	int pos = -1;
+
+	best = 0;
+	for (i = 0; i < ulCount; i++) {
+		if (!isIndexedAttribute(pTemplate[i].type)) {
+			continue;
+		}
+
+		pub = findAttributeIndexKey(token->tokenObjAttrIndex, &pTemplate[i]);
+		priv = privateKey ? findAttributeIndexKey(token->tokenPrivObjAttrIndex, &pTemplate[i]) : NULL;
+		cnt = (pub ? pub->count : 0) + (priv ? priv->count : 0);
+
+		if ((pos < 0) || (cnt < best)) {
+			pos = (int)i;
+			best = cnt;
+			*publicKey = pub;
+			if (privateKey) {
+				*privateKey = priv;
+			}
+		}
+
+		if (best == 0) {
+			break;
+		}
+	}
+
+	return pos;
+}
+
+
+
 /**
  * Find token object of given class matching the CKA_ID passed as argument
  *
@@ -241,6 +377,7 @@ int findMatchingTokenObjectById(struct p11Token_t *token, CK_OBJECT_CLASS class,
 void enumerateTokenPrivateObjects(struct p11Token_t *token, struct p11Object_t **pObject)
 {
 	if (*pObject == NULL) {
+		loadDeferredObjects(token, NULL, 0);
 		*pObject = token->tokenPrivObjList;
 	} else {
 		*pObject = (*pObject)->next;
@@ -258,6 +395,7 @@ void enumerateTokenPrivateObjects(struct p11Token_t *token, struct p11Object_t *
 void enumerateTokenPublicObjects(struct p11Token_t *token, struct p11Object_t **pObject)
 {
 	if (*pObject == NULL) {
+		loadDeferredObjects(token, NULL, 0);
 		*pObject = token->tokenObjList;
 	} else {
 		*pObject = (*pObject)->next;
@@ -277,27 +415,38 @@ void enumerateTokenPublicObjects(struct p11Token_t *token, struct p11Object_t **
  */
 int removeTokenObject(struct p11Token_t *token, CK_OBJECT_HANDLE handle, int publicObject)
 {
+	struct p11Object_t *object;
 	int rc;
 
-	p11LockMutex(token->mutex);
+	p11LockExclusive(token->objectLock);
 
 	if (publicObject) {
+		object = findObjectInIndex(token->tokenObjIndex, handle);
+		if (object != NULL) {
+			removeObjectFromAttributeIndex(token->tokenObjAttrIndex, object);
+		}
+		removeObjectFromIndex(token->tokenObjIndex, handle);
 		rc = removeObjectFromList(&token->tokenObjList, handle);
 		if (rc != CKR_OK) {
-			p11UnlockMutex(token->mutex);
+			p11UnlockExclusive(token->objectLock);
 			return rc;
 		}
 		token->numberOfTokenObjects--;
 	} else {
+		object = findObjectInIndex(token->tokenPrivObjIndex, handle);
+		if (object != NULL) {
+			removeObjectFromAttributeIndex(token->tokenPrivObjAttrIndex, object);
+		}
+		removeObjectFromIndex(token->tokenPrivObjIndex, handle);
 		rc = removeObjectFromList(&token->tokenPrivObjList, handle);
 		if (rc != CKR_OK) {
-			p11UnlockMutex(token->mutex);
+			p11UnlockExclusive(token->objectLock);
 			return rc;
 		}
 		token->numberOfPrivateTokenObjects--;
 	}
 
-	p11UnlockMutex(token->mutex);
+	p11UnlockExclusive(token->objectLock);
 	return CKR_OK;
 }
 
@@ -312,10 +461,12 @@ int removeTokenObject(struct p11Token_t *token, CK_OBJECT_HANDLE handle, int pub
  */
 static void removePrivateObjects(struct p11Token_t *token)
 {
-	p11LockMutex(token->mutex);
+	p11LockExclusive(token->objectLock);
 	removeAllObjectsFromList(&token->tokenPrivObjList);
+	freeObjectIndex(&token->tokenPrivObjIndex);
+	freeAttributeIndex(&token->tokenPrivObjAttrIndex);
 	token->numberOfPrivateTokenObjects = 0;
-	p11UnlockMutex(token->mutex);
+	p11UnlockExclusive(token->objectLock);
 }
 
 
@@ -329,55 +480,109 @@ static void removePrivateObjects(struct p11Token_t *token)
  */
 static void removePublicObjects(struct p11Token_t *token)
 {
-	p11LockMutex(token->mutex);
+	p11LockExclusive(token->objectLock);
 	removeAllObjectsFromList(&token->tokenObjList);
+	freeObjectIndex(&token->tokenObjIndex);
+	freeAttributeIndex(&token->tokenObjAttrIndex);
 	token->numberOfTokenObjects = 0;
-	p11UnlockMutex(token->mutex);
+	p11UnlockExclusive(token->objectLock);
 }
 
 
 
 /**
- * Remove object from token but keep attributes as these are transfered into a new object
+ * Turn a public token object into a private token object
+ *
+ * The object keeps handle, attributes and references held by other threads. The
+ * lookup, the change of CKA_PRIVATE and the move between lists are done under the
+ * exclusive object lock, so that no thread sees the object in a list that does not
+ * match the attribute.
+ *
+ * @param token     The token containing the object
+ * @param object    The public object
+ * @param pTemplate The CKA_PRIVATE attribute with value CK_TRUE
+ * @return          CKR_OK, CKR_OBJECT_HANDLE_INVALID if the object is no longer a public
+ *                  object of the token or any other Cryptoki error code
  */
-int removeObjectLeavingAttributes(struct p11Token_t *token, CK_OBJECT_HANDLE handle, int publicObject)
+int moveObjectToPrivate(struct p11Token_t *token, struct p11Object_t *object, CK_ATTRIBUTE_PTR pTemplate)
 {
-	struct p11Object_t *object = NULL;
-	struct p11Object_t *prev = NULL;
-	int rc;
+	struct p11Object_t **list;
+	int rc, rca;
 
-	rc = findObject(token, handle, &object, publicObject);
+	p11LockExclusive(token->objectLock);
 
-	/* no object with this handle found */
-	if (rc < 0) {
-		return rc;
+	if (findObjectInIndex(token->tokenObjIndex, object->handle) != object) {
+		p11UnlockExclusive(token->objectLock);
+		return CKR_OBJECT_HANDLE_INVALID;
 	}
 
-	if (rc > 0) {      /* there is more than one element in the pool */
-
-		prev = publicObject == TRUE ? token->tokenObjList : token->tokenPrivObjList;
+	removeObjectFromAttributeIndex(token->tokenObjAttrIndex, object);
+	removeObjectFromIndex(token->tokenObjIndex, object->handle);
 
-		while (prev->next->handle != handle) {
-			prev = prev->next;
-		}
+	list = &token->tokenObjList;
+	while (*list != object) {
+		list = &(*list)->next;
+	}
+	*list = object->next;
+	token->numberOfTokenObjects--;
 
-		prev->next = object->next;
+	rc = setAttribute(object, pTemplate);
+	object->publicObj = FALSE;
+	object->dirtyFlag = 1;
 
+	addObjectToList(&token->tokenPrivObjList, object);
+	rca = addObjectToIndex(&token->tokenPrivObjIndex, object);
+	if (rc == CKR_OK) {
+		rc = rca;
+	}
+	rca = addObjectToAttributeIndex(&token->tokenPrivObjAttrIndex, object);
+	if (rc == CKR_OK) {
+		rc = rca;
 	}
+	token->numberOfPrivateTokenObjects++;
 
-	free(object);
+	p11UnlockExclusive(token->objectLock);
 
-	token->numberOfTokenObjects--;
+	return rc;
+}
 
-	if (rc == 0) {      /* We removed the last element from the list */
-		if (publicObject) {
-			token->tokenObjList = NULL;
-		} else {
-			token->tokenPrivObjList = NULL;
-		}
+
+
+/**
+ * Change the value of an attribute of a token object and update the attribute index
+ *
+ * @param token     The token containing the object
+ * @param object    The object to change
+ * @param pTemplate The attribute with the new value
+ * @return          CKR_OK or any other Cryptoki error code
+ */
+int setObjectAttribute(struct p11Token_t *token, struct p11Object_t *object, CK_ATTRIBUTE_PTR pTemplate)
+{
+	struct p11AttributeIndex_t **ppIndex;
+	int rc, rca;
+
+	// Searches match attribute values while holding the object lock
+	p11LockExclusive(token->objectLock);
+
+	if (!isIndexedAttribute(pTemplate->type)) {
+		rc = setAttribute(object, pTemplate);
+		p11UnlockExclusive(token->objectLock);
+		return rc;
 	}
 
-	return CKR_OK;
+	if (findObjectInIndex(token->tokenObjIndex, object->handle) == object) {
+		ppIndex = &token->tokenObjAttrIndex;
+	} else {
+		ppIndex = &token->tokenPrivObjAttrIndex;
+	}
+
+	removeObjectFromAttributeIndex(*ppIndex, object);
+	rc = setAttribute(object, pTemplate);
+	rca = addObjectToAttributeIndex(ppIndex, object);
+
+	p11UnlockExclusive(token->objectLock);
+
+	return rc != CKR_OK ? rc : rca;
 }
 
 
@@ -548,7 +753,13 @@ int synchronizeToken(struct p11Slot_t *slot, struct p11Token_t *token)
  */
 int logIn(struct p11Slot_t *slot, CK_USER_TYPE userType, CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen)
 {
-	int rc = slot->token->drv->login(slot, userType, pPin, ulPinLen);
+	int rc;
+
+	// Drivers may need to reselect the application before the PIN is verified
+	rc = beginSlotTransaction(slot);
+	if (rc == CKR_OK)
+		rc = slot->token->drv->login(slot, userType, pPin, ulPinLen);
+	endSlotTransaction(slot);
 
 	if (rc == CKR_OK) {
 		slot->token->user = userType;
@@ -571,9 +782,15 @@ int logIn(struct p11Slot_t *slot, CK_USER_TYPE userType, CK_UTF8CHAR_PTR pPin, C
  */
 int logOut(struct p11Slot_t *slot)
 {
+	int rc;
+
 	slot->token->user = INT_CKU_NO_USER;
 
-	return slot->token->drv->logout(slot);
+	beginSlotTransaction(slot);
+	rc = slot->token->drv->logout(slot);
+	endSlotTransaction(slot);
+
+	return rc;
 }
 
 
@@ -641,6 +858,10 @@ int allocateToken(struct p11Token_t **token, int extraMem)
 	}
 
 	p11CreateMutex(&ptoken->mutex);
+	p11CreateRWLock(&ptoken->objectLock);
+
+	// Without an arena, attributes remain on the heap
+	createArena(&ptoken->arena);
 
 	*token = ptoken;
 	FUNC_RETURNS(CKR_OK);
@@ -663,6 +884,10 @@ int newToken(struct p11Slot_t *slot, unsigned char *atr, size_t atrlen, struct p
 
 	FUNC_CALLED();
 
+#ifndef MINIDRIVER
+	traceReader(slot, atr, atrlen);
+#endif
+
 	for (t = tokenDriver; *t != NULL; t++) {
 		drv = (*t)();
 		if (drv->isCandidate(atr, atrlen)) {
@@ -693,7 +918,9 @@ void freeToken(struct p11Token_t *token)
 
 		removePrivateObjects(token);
 		removePublicObjects(token);
+		freeArena(&token->arena);
 		p11DestroyMutex(token->mutex);
+		p11DestroyRWLock(token->objectLock);
 		free(token);
 	}
 }
@@ -85,12 +85,17 @@ int initPIN(struct p11Slot_t *slot, CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen);
 int setPIN(struct p11Slot_t *slot, CK_UTF8CHAR_PTR pOldPin, CK_ULONG ulOldPinLen, CK_UTF8CHAR_PTR pNewPin, CK_ULONG ulNewPinLen);
 int addObject(struct p11Token_t *token, struct p11Object_t *object, int publicObject);
 int findObject(struct p11Token_t *token, CK_OBJECT_HANDLE handle, struct p11Object_t **object, int publicObject);
+int referenceObject(struct p11Token_t *token, struct p11Object_t *object);
+int loadDeferredObjects(struct p11Token_t *token, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount);
 int findMatchingTokenObject(struct p11Token_t *token, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, struct p11Object_t **pObject);
+int selectIndexedObjects(struct p11Token_t *token, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount,
+		struct p11AttributeIndexKey_t **publicKey, struct p11AttributeIndexKey_t **privateKey);
 int findMatchingTokenObjectById(struct p11Token_t *token, CK_OBJECT_CLASS class, unsigned char *id, int sizelen, struct p11Object_t **pObject);
 void enumerateTokenPrivateObjects(struct p11Token_t *token, struct p11Object_t **pObject);
 void enumerateTokenPublicObjects(struct p11Token_t *token, struct p11Object_t **pObject);
 int removeTokenObject(struct p11Token_t *token, CK_OBJECT_HANDLE handle, int publicObject);
-int removeObjectLeavingAttributes(struct p11Token_t *token, CK_OBJECT_HANDLE handle, int publicObject);
+int moveObjectToPrivate(struct p11Token_t *token, struct p11Object_t *object, CK_ATTRIBUTE_PTR pTemplate);
+int setObjectAttribute(struct p11Token_t *token, struct p11Object_t *object, CK_ATTRIBUTE_PTR pTemplate);
 int saveObjects(struct p11Slot_t *slot, struct p11Token_t *token, int publicObject);
 int destroyObject(struct p11Slot_t *slot, struct p11Object_t *object);
 int generateTokenKeypair(struct p11Slot_t *slot, CK_MECHANISM_PTR pMechanism, CK_ATTRIBUTE_PTR pPublicKeyTemplate, CK_ULONG ulPublicKeyAttributeCount,
@@ -0,0 +1,231 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2020, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    verify-batch.c
+ * @author  Andreas Schwier
+ * @brief   Verification of many signatures in one call using a pool of worker threads
+ *
+ * The signatures passed to SC_VerifyBatch() are spread across the calling thread and a pool
+ * of worker threads. Each thread takes the next signature from a shared index, so that threads
+ * finishing early pick up the remaining work. The pool is started with the first batch and
+ * has PKCS11_VERIFY_THREADS - 1 workers, by default one less than the number of processors.
+ */
+
+#include <stdlib.h>
+
+#include <common/atomic.h>
+#include <common/thread.h>
+
+#include <pkcs11/p11generic.h>
+#include <pkcs11/session.h>
+#include <pkcs11/token.h>
+#include <pkcs11/verify-batch.h>
+
+#ifdef DEBUG
+#include <common/debug.h>
+#endif
+
+
+
+/**
+ * Signatures of a batch shared between the threads verifying them
+ */
+struct verify_batch {
+	struct p11Session_t *session;       // Session used to locate the keys
+	struct p11Token_t *token;           // Token in the slot of the session
+	SC_VERIFY_ITEM *items;              // Signatures to verify
+	CK_RV *results;                     // Result for each signature
+	long count;                         // Number of signatures
+	volatile long next;                 // Next signature to verify
+};
+
+
+
+static struct worker_pool *volatile workers = NULL;
+
+
+
+/**
+ * Get the number of threads verifying a batch, including the calling thread
+ *
+ * Defined by PKCS11_VERIFY_THREADS, with 1 verifying all signatures in the calling thread.
+ */
+static int getVerifyThreads()
+{
+	static int threads = 0;
+	char *po;
+
+	if (threads == 0) {
+		po = getenv("PKCS11_VERIFY_THREADS");
+		threads = po ? atoi(po) : thread_processors();
+
+		if (threads < 1)
+			threads = 1;
+
+		if (threads > MAX_VERIFY_THREADS)
+			threads = MAX_VERIFY_THREADS;
+	}
+	return threads;
+}
+
+
+
+/**
+ * Return the worker pool, which is started on first use
+ *
+ * @return the pool or NULL if signatures are verified in the calling thread only
+ */
+static struct worker_pool *getVerifyWorkers()
+{
+	struct worker_pool *pool;
+	int threads;
+
+	if (workers != NULL)
+		return workers;
+
+	threads = getVerifyThreads();
+
+	if ((threads < 2) || !p11CanCreateThreads())
+		return NULL;
+
+	if (worker_pool_create(&pool, threads - 1) != 0) {
+#ifdef DEBUG
+		debug("Could not start verification threads\n");
+#endif
+		return NULL;
+	}
+
+	if (!atomic_cas_ptr(&workers, NULL, pool)) {
+		worker_pool_destroy(pool);		// Started concurrently by another thread
+	}
+
+	return workers;
+}
+
+
+
+/**
+ * Verify a single signature with the key referenced in the item
+ */
+static CK_RV verifyItem(struct p11Session_t *session, struct p11Token_t *token, SC_VERIFY_ITEM *item)
+{
+	struct p11Object_t *pObject;
+	CK_MECHANISM mech;
+	CK_RV rv;
+
+	if (!isValidPtr(item->pData) || !isValidPtr(item->pSignature)) {
+		return CKR_ARGUMENTS_BAD;
+	}
+
+	if ((findSessionObject(session, item->hKey, &pObject) < 0) && ((token == NULL) || (findObject(token, item->hKey, &pObject, TRUE) < 0))) {
+		return CKR_KEY_HANDLE_INVALID;
+	}
+
+	if ((pObject->C_VerifyInit == NULL) || (pObject->C_Verify == NULL)) {
+		releaseObject(pObject);
+		return CKR_FUNCTION_NOT_SUPPORTED;
+	}
+
+	mech.mechanism = item->mechanism;
+	mech.pParameter = NULL;
+	mech.ulParameterLen = 0;
+
+	rv = pObject->C_VerifyInit(pObject, &mech);
+
+	if (rv == CKR_OK) {
+		rv = pObject->C_Verify(pObject, item->mechanism, item->pData, item->ulDataLen, item->pSignature, item->ulSignatureLen);
+	}
+
+	releaseObject(pObject);
+	return rv;
+}
+
+
+
+static void verifyWorker(void *arg)
+{
+	struct verify_batch *batch = (struct verify_batch *)arg;
+	long i;
+
+	while ((i = atomic_inc(&batch->next) - 1) < batch->count) {
+		batch->results[i] = verifyItem(batch->session, batch->token, &batch->items[i]);
+	}
+}
+
+
+
+/**
+ * Verify the signatures in a batch
+ *
+ * The result for each signature is stored in the results array at the same index.
+ *
+ * @param session the session used to locate the keys
+ * @param token the token in the slot of the session or NULL
+ * @param items the signatures to verify
+ * @param count the number of signatures
+ * @param results the result for each signature
+ */
+void verifyBatch(struct p11Session_t *session, struct p11Token_t *token, SC_VERIFY_ITEM *items, CK_ULONG count, CK_RV *results)
+{
+	struct verify_batch batch;
+	struct worker_pool *pool;
+
+	batch.session = session;
+	batch.token = token;
+	batch.items = items;
+	batch.results = results;
+	batch.count = (long)count;
+	batch.next = 0;
+
+	pool = count > 1 ? getVerifyWorkers() : NULL;
+
+	if (pool == NULL) {
+		verifyWorker(&batch);
+		return;
+	}
+
+	worker_pool_run(pool, verifyWorker, &batch);
+}
+
+
+
+/**
+ * Terminate the worker threads
+ *
+ * Must be called before the sessions and slots are released
+ */
+void stopVerifyWorkers()
+{
+	struct worker_pool *pool = workers;
+
+	if (pool == NULL)
+		return;
+
+	workers = NULL;
+	worker_pool_destroy(pool);
+}
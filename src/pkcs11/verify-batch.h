@@ -0,0 +1,66 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2020, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    verify-batch.h
+ * @author  Andreas Schwier
+ * @brief   Verification of many signatures in one call using a pool of worker threads
+ */
+
+#ifndef ___VERIFY_BATCH_H_INC___
+#define ___VERIFY_BATCH_H_INC___
+
+#include <pkcs11/cryptoki.h>
+
+/**
+ * Maximum number of threads verifying the signatures of a batch
+ */
+#define MAX_VERIFY_THREADS		64
+
+/**
+ * Signature to be verified with SC_VerifyBatch()
+ */
+typedef struct SC_VERIFY_ITEM {
+	CK_OBJECT_HANDLE hKey;                          /**< Public key used for verification     */
+	CK_MECHANISM_TYPE mechanism;                    /**< Verification mechanism               */
+	CK_BYTE_PTR pData;                              /**< Signed data                          */
+	CK_ULONG ulDataLen;                             /**< Length of signed data                */
+	CK_BYTE_PTR pSignature;                         /**< Signature                            */
+	CK_ULONG ulSignatureLen;                        /**< Length of signature                  */
+} SC_VERIFY_ITEM;
+
+typedef CK_RV (*SC_VerifyBatch_t)(CK_SESSION_HANDLE hSession, SC_VERIFY_ITEM *pItems, CK_ULONG ulCount, CK_RV *pResults);
+
+CK_DECLARE_FUNCTION(CK_RV, SC_VerifyBatch)(CK_SESSION_HANDLE hSession, SC_VERIFY_ITEM *pItems, CK_ULONG ulCount, CK_RV *pResults);
+
+struct p11Session_t;
+struct p11Token_t;
+
+void verifyBatch(struct p11Session_t *session, struct p11Token_t *token, SC_VERIFY_ITEM *items, CK_ULONG count, CK_RV *results);
+void stopVerifyWorkers();
+
+#endif /* ___VERIFY_BATCH_H_INC___ */
@@ -0,0 +1,915 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2020, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file sc-hsm-pkcs11-bench.c
+ * @author Andreas Schwier
+ * @brief Load generator measuring throughput and latency of the PKCS#11 module
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <common/mutex.h>
+#include <common/thread.h>
+#include <common/atomic.h>
+
+/* Default PIN unless --pin is defined */
+#define PIN_SC_HSM "648219"
+
+/* Limits for the number of slots and threads */
+#define MAX_SLOTS		32
+#define MAX_THREADS		256
+
+/* Maximum number of handles returned by a single C_FindObjects call */
+#define MAX_FOUND		64
+
+
+#ifndef _WIN32
+
+#include <unistd.h>
+#include <dlfcn.h>
+#define LIB_HANDLE void*
+#define P11LIBNAME "/usr/local/lib/libsc-hsm-pkcs11.so"
+
+#else
+
+#include <windows.h>
+#include <malloc.h>
+#define LIB_HANDLE HMODULE
+#define P11LIBNAME "sc-hsm-pkcs11.dll"
+
+#define dlopen(fn, flag) LoadLibrary(fn)
+#define dlclose(h) FreeLibrary(h)
+#define dlsym(h, n) GetProcAddress(h, n)
+
+char* dlerror()
+{
+	char* msg = "UNKNOWN";
+	FormatMessage(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM, 0, GetLastError(), 0, (char*)&msg, 0, 0);
+	return msg;
+}
+
+#endif /* _WIN32 */
+
+
+
+#include <pkcs11/cryptoki.h>
+#include <sc-hsm/sc-hsm-pkcs11.h>
+
+enum operation { OP_SIGN, OP_VERIFY, OP_DECRYPT, OP_RANDOM, OP_FIND };
+
+static char *operationName[] = { "sign", "verify", "decrypt", "random", "find" };
+
+struct mechanism {
+	char *name;
+	CK_MECHANISM_TYPE type;
+	CK_KEY_TYPE keyType;
+	int inputLength;                    // 0 for any message, -1 for the length of the modulus
+};
+
+static struct mechanism mechanisms[] = {
+		{ "CKM_RSA_PKCS", CKM_RSA_PKCS, CKK_RSA, 32 },
+		{ "CKM_RSA_PKCS_OAEP", CKM_RSA_PKCS_OAEP, CKK_RSA, 32 },
+		{ "CKM_RSA_X_509", CKM_RSA_X_509, CKK_RSA, -1 },
+		{ "CKM_SHA1_RSA_PKCS", CKM_SHA1_RSA_PKCS, CKK_RSA, 0 },
+		{ "CKM_SHA256_RSA_PKCS", CKM_SHA256_RSA_PKCS, CKK_RSA, 0 },
+		{ "CKM_SHA256_RSA_PKCS_PSS", CKM_SHA256_RSA_PKCS_PSS, CKK_RSA, 0 },
+		{ "CKM_SC_HSM_PSS_SHA1", CKM_SC_HSM_PSS_SHA1, CKK_RSA, 20 },
+		{ "CKM_SC_HSM_PSS_SHA256", CKM_SC_HSM_PSS_SHA256, CKK_RSA, 32 },
+		{ "CKM_ECDSA", CKM_ECDSA, CKK_EC, 32 },
+		{ "CKM_ECDSA_SHA1", CKM_ECDSA_SHA1, CKK_EC, 0 },
+		{ "CKM_SC_HSM_ECDSA_SHA224", CKM_SC_HSM_ECDSA_SHA224, CKK_EC, 0 },
+		{ "CKM_SC_HSM_ECDSA_SHA256", CKM_SC_HSM_ECDSA_SHA256, CKK_EC, 0 },
+		{ NULL, 0, 0, 0 }
+};
+
+/**
+ * Slot under load, shared by all threads using the slot
+ */
+struct bench_slot {
+	CK_SLOT_ID slotid;
+	char label[33];
+	CK_SESSION_HANDLE session;          // Session holding the login for the duration of the run
+	MUTEX lock;
+	int inflight;                       // Number of operations currently running
+	unsigned long long busySince;       // Start of the period with operations running
+	unsigned long long busy;            // Accumulated time with operations running
+	unsigned long ops;
+	unsigned long failed;
+};
+
+/**
+ * Load generating thread with the latencies it measured
+ */
+struct bench_thread {
+	THREAD thread;
+	int id;
+	struct bench_slot *slot;
+	CK_SESSION_HANDLE session;
+	CK_OBJECT_HANDLE key;
+	CK_BYTE input[512];
+	CK_ULONG inputLength;
+	CK_BYTE output[512];                // Signature to verify or cryptogram to decrypt
+	CK_ULONG outputLength;
+	CK_RV rc;                           // Result of the preparation
+	unsigned long *latency;             // Latency of each successful operation in microseconds
+	size_t count;
+	size_t size;
+	unsigned long failed;
+};
+
+static CK_FUNCTION_LIST_PTR p11;
+
+static char *p11libname = P11LIBNAME;
+static CK_UTF8CHAR_PTR pin = (CK_UTF8CHAR_PTR)PIN_SC_HSM;
+static CK_ULONG pinlen = 6;
+
+static enum operation optOperation = OP_SIGN;
+static struct mechanism *optMechanism = NULL;
+static int optDuration = 10;
+static int optThreadsPerSlot = 1;
+static CK_SLOT_ID optSlots[MAX_SLOTS];
+static int optSlotCount = 0;
+static char *optTokenFilter = NULL;
+static char *optKeyLabel = NULL;
+static int optRandomSize = 32;
+static char *optJSON = NULL;
+
+static volatile long ready = 0;
+static volatile long running = 0;
+static unsigned long long deadline;
+
+
+
+/**
+ * Return a monotonic time stamp in microseconds
+ */
+static unsigned long long now()
+{
+#ifdef _WIN32
+	LARGE_INTEGER freq, cnt;
+
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&cnt);
+	return (unsigned long long)(cnt.QuadPart / freq.QuadPart) * 1000000 + (cnt.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+
+
+static struct mechanism *getMechanism(char *name)
+{
+	struct mechanism *m;
+	CK_MECHANISM_TYPE type;
+
+	type = (CK_MECHANISM_TYPE)strtoul(name, NULL, 0);
+
+	for (m = mechanisms; m->name; m++) {
+		if (!strcmp(m->name, name) || (type && (m->type == type)))
+			return m;
+	}
+	return NULL;
+}
+
+
+
+/**
+ * Open a session for the thread and find the key and data it operates on
+ */
+static CK_RV prepareThread(struct bench_thread *t)
+{
+	CK_OBJECT_CLASS class = CKO_PRIVATE_KEY, classpuk = CKO_PUBLIC_KEY;
+	CK_BBOOL _true = CK_TRUE;
+	CK_BYTE keyid[256];
+	CK_ATTRIBUTE template[] = {
+			{ CKA_CLASS, &class, sizeof(class) },
+			{ CKA_KEY_TYPE, NULL, sizeof(CK_KEY_TYPE) },
+			{ CKA_SIGN, &_true, sizeof(_true) },
+			{ CKA_LABEL, NULL, 0 }
+	};
+	CK_ATTRIBUTE puktemplate[] = {
+			{ CKA_CLASS, &classpuk, sizeof(classpuk) },
+			{ CKA_ID, keyid, sizeof(keyid) }
+	};
+	CK_ATTRIBUTE modulus = { CKA_MODULUS, NULL, 0 };
+	CK_MECHANISM mech = { 0, NULL, 0 };
+	CK_OBJECT_HANDLE hnd, pubhnd;
+	CK_ULONG cnt, len;
+	CK_RV rc;
+	int i;
+
+	rc = p11->C_OpenSession(t->slot->slotid, CKF_RW_SESSION | CKF_SERIAL_SESSION, NULL, NULL, &t->session);
+
+	if (rc != CKR_OK)
+		return rc;
+
+	if ((optOperation == OP_RANDOM) || (optOperation == OP_FIND))
+		return CKR_OK;
+
+	mech.mechanism = optMechanism->type;
+	template[1].pValue = &optMechanism->keyType;
+
+	if (optOperation == OP_DECRYPT)
+		template[2].type = CKA_DECRYPT;
+
+	cnt = 3;
+	if (optKeyLabel) {
+		template[3].pValue = optKeyLabel;
+		template[3].ulValueLen = (CK_ULONG)strlen(optKeyLabel);
+		cnt++;
+	}
+
+	rc = p11->C_FindObjectsInit(t->session, template, cnt);
+
+	if (rc != CKR_OK)
+		return rc;
+
+	rc = p11->C_FindObjects(t->session, &hnd, 1, &cnt);
+	p11->C_FindObjectsFinal(t->session);
+
+	if (rc != CKR_OK)
+		return rc;
+
+	if (cnt == 0)
+		return CKR_KEY_HANDLE_INVALID;
+
+	t->key = hnd;
+
+	if (optMechanism->inputLength < 0) {
+		modulus.pValue = t->input;
+		modulus.ulValueLen = sizeof(t->input);
+		rc = p11->C_GetAttributeValue(t->session, hnd, &modulus, 1);
+
+		if (rc != CKR_OK)
+			return rc;
+
+		t->inputLength = modulus.ulValueLen;
+	} else {
+		t->inputLength = optMechanism->inputLength ? optMechanism->inputLength : 64;
+	}
+
+	for (i = 0; i < (int)t->inputLength; i++)
+		t->input[i] = (CK_BYTE)(i + t->id);
+
+	if (optMechanism->inputLength < 0)
+		t->input[0] = 0;			// Input must be smaller than the modulus
+
+	if (optOperation == OP_SIGN)
+		return CKR_OK;
+
+	if (optOperation == OP_VERIFY) {
+		rc = p11->C_SignInit(t->session, &mech, hnd);
+
+		if (rc != CKR_OK)
+			return rc;
+
+		t->outputLength = sizeof(t->output);
+		rc = p11->C_Sign(t->session, t->input, t->inputLength, t->output, &t->outputLength);
+
+		if (rc != CKR_OK)
+			return rc;
+	}
+
+	rc = p11->C_GetAttributeValue(t->session, hnd, &puktemplate[1], 1);
+
+	if (rc != CKR_OK)
+		return rc;
+
+	rc = p11->C_FindObjectsInit(t->session, puktemplate, 2);
+
+	if (rc != CKR_OK)
+		return rc;
+
+	rc = p11->C_FindObjects(t->session, &pubhnd, 1, &cnt);
+	p11->C_FindObjectsFinal(t->session);
+
+	if (rc != CKR_OK)
+		return rc;
+
+	if (cnt == 0)
+		return CKR_KEY_HANDLE_INVALID;
+
+	if (optOperation == OP_VERIFY) {
+		t->key = pubhnd;
+		return CKR_OK;
+	}
+
+	rc = p11->C_EncryptInit(t->session, &mech, pubhnd);
+
+	if (rc != CKR_OK)
+		return rc;
+
+	len = sizeof(t->output);
+	rc = p11->C_Encrypt(t->session, t->input, t->inputLength, t->output, &len);
+	t->outputLength = len;
+
+	return rc;
+}
+
+
+
+/**
+ * Perform a single operation
+ */
+static CK_RV runOperation(struct bench_thread *t)
+{
+	CK_MECHANISM mech = { 0, NULL, 0 };
+	CK_OBJECT_CLASS class = CKO_PRIVATE_KEY;
+	CK_ATTRIBUTE template[] = {
+			{ CKA_CLASS, &class, sizeof(class) },
+			{ CKA_LABEL, NULL, 0 }
+	};
+	CK_OBJECT_HANDLE found[MAX_FOUND];
+	CK_BYTE scr[512];
+	CK_ULONG len, cnt;
+	CK_RV rc;
+
+	if (optMechanism)
+		mech.mechanism = optMechanism->type;
+
+	switch(optOperation) {
+	case OP_SIGN:
+		rc = p11->C_SignInit(t->session, &mech, t->key);
+
+		if (rc != CKR_OK)
+			return rc;
+
+		len = sizeof(scr);
+		return p11->C_Sign(t->session, t->input, t->inputLength, scr, &len);
+
+	case OP_VERIFY:
+		rc = p11->C_VerifyInit(t->session, &mech, t->key);
+
+		if (rc != CKR_OK)
+			return rc;
+
+		return p11->C_Verify(t->session, t->input, t->inputLength, t->output, t->outputLength);
+
+	case OP_DECRYPT:
+		rc = p11->C_DecryptInit(t->session, &mech, t->key);
+
+		if (rc != CKR_OK)
+			return rc;
+
+		len = sizeof(scr);
+		return p11->C_Decrypt(t->session, t->output, t->outputLength, scr, &len);
+
+	case OP_RANDOM:
+		return p11->C_GenerateRandom(t->session, scr, optRandomSize);
+
+	case OP_FIND:
+		cnt = 1;
+		if (optKeyLabel) {
+			template[1].pValue = optKeyLabel;
+			template[1].ulValueLen = (CK_ULONG)strlen(optKeyLabel);
+			cnt++;
+		}
+
+		rc = p11->C_FindObjectsInit(t->session, template, cnt);
+
+		if (rc != CKR_OK)
+			return rc;
+
+		rc = p11->C_FindObjects(t->session, found, MAX_FOUND, &cnt);
+		p11->C_FindObjectsFinal(t->session);
+		return rc;
+	}
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+
+
+static void enterSlot(struct bench_slot *slot, unsigned long long ts)
+{
+	mutex_lock(&slot->lock);
+	if (slot->inflight++ == 0)
+		slot->busySince = ts;
+	mutex_unlock(&slot->lock);
+}
+
+
+
+static void leaveSlot(struct bench_slot *slot, unsigned long long ts, CK_RV rc)
+{
+	mutex_lock(&slot->lock);
+	if (--slot->inflight == 0)
+		slot->busy += ts - slot->busySince;
+
+	if (rc == CKR_OK) {
+		slot->ops++;
+	} else {
+		slot->failed++;
+	}
+	mutex_unlock(&slot->lock);
+}
+
+
+
+static void addLatency(struct bench_thread *t, unsigned long usec)
+{
+	unsigned long *p;
+
+	if (t->count == t->size) {
+		p = (unsigned long *)realloc(t->latency, (t->size + 4096) * sizeof(*t->latency));
+
+		if (p == NULL) {
+			t->failed++;
+			return;
+		}
+		t->latency = p;
+		t->size += 4096;
+	}
+	t->latency[t->count++] = usec;
+}
+
+
+
+static void benchThread(void *arg)
+{
+	struct bench_thread *t = (struct bench_thread *)arg;
+	unsigned long long start, stop;
+	CK_RV rc;
+
+	t->rc = prepareThread(t);
+	atomic_inc(&ready);
+
+	while (!atomic_get(&running))
+		thread_sleep(1);
+
+	if (t->rc != CKR_OK)
+		return;
+
+	do	{
+		start = now();
+		enterSlot(t->slot, start);
+
+		rc = runOperation(t);
+
+		stop = now();
+		leaveSlot(t->slot, stop, rc);
+
+		if (rc == CKR_OK) {
+			addLatency(t, (unsigned long)(stop - start));
+		} else {
+			t->failed++;
+			if ((rc == CKR_DEVICE_REMOVED) || (rc == CKR_TOKEN_NOT_PRESENT) || (rc == CKR_SESSION_HANDLE_INVALID))
+				break;
+		}
+	} while (stop < deadline);
+}
+
+
+
+static int compareLatency(const void *a, const void *b)
+{
+	unsigned long la = *(const unsigned long *)a, lb = *(const unsigned long *)b;
+
+	return la < lb ? -1 : la > lb ? 1 : 0;
+}
+
+
+
+/**
+ * Return the latency below which the given fraction of all operations completed
+ */
+static double percentile(unsigned long *sorted, size_t count, double fraction)
+{
+	size_t i;
+
+	if (count == 0)
+		return 0;
+
+	i = (size_t)(fraction * count + 0.999999);
+	if (i > 0)
+		i--;
+	if (i >= count)
+		i = count - 1;
+
+	return sorted[i] / 1000.0;
+}
+
+
+
+static void jsonString(FILE *fp, char *str)
+{
+	fputc('"', fp);
+	for (; *str; str++) {
+		if ((*str == '"') || (*str == '\\')) {
+			fprintf(fp, "\\%c", *str);
+		} else if ((unsigned char)*str < 0x20) {
+			fprintf(fp, "\\u%04x", *str);
+		} else {
+			fputc(*str, fp);
+		}
+	}
+	fputc('"', fp);
+}
+
+
+
+static void report(struct bench_slot *slots, int slotcnt, struct bench_thread *threads, int threadcnt, unsigned long long elapsed)
+{
+	unsigned long *all, failed;
+	size_t count, i;
+	double secs, p50, p99, p999, mean;
+	FILE *fp;
+	int s;
+
+	count = 0;
+	failed = 0;
+	for (i = 0; i < (size_t)threadcnt; i++) {
+		count += threads[i].count;
+		failed += threads[i].failed;
+	}
+
+	all = (unsigned long *)malloc((count ? count : 1) * sizeof(*all));
+
+	if (all == NULL) {
+		printf("Out of memory\n");
+		return;
+	}
+
+	count = 0;
+	mean = 0;
+	for (i = 0; i < (size_t)threadcnt; i++) {
+		memcpy(all + count, threads[i].latency, threads[i].count * sizeof(*all));
+		count += threads[i].count;
+	}
+
+	qsort(all, count, sizeof(*all), compareLatency);
+
+	for (i = 0; i < count; i++)
+		mean += all[i];
+
+	if (count)
+		mean = mean / count / 1000.0;
+
+	p50 = percentile(all, count, 0.50);
+	p99 = percentile(all, count, 0.99);
+	p999 = percentile(all, count, 0.999);
+
+	secs = elapsed / 1000000.0;
+
+	if (!optJSON || strcmp(optJSON, "-")) {
+		printf("Operation       : %s\n", operationName[optOperation]);
+		if (optMechanism)
+			printf("Mechanism       : %s\n", optMechanism->name);
+		printf("Threads         : %d on %d slots\n", threadcnt, slotcnt);
+		printf("Duration        : %.2f s\n", secs);
+		printf("Operations      : %lu (%lu failed)\n", (unsigned long)count, failed);
+		printf("Throughput      : %.1f ops/s\n", count / secs);
+		printf("Latency mean    : %.2f ms\n", mean);
+		printf("Latency p50     : %.2f ms\n", p50);
+		printf("Latency p99     : %.2f ms\n", p99);
+		printf("Latency p99.9   : %.2f ms\n", p999);
+		printf("Latency max     : %.2f ms\n", count ? all[count - 1] / 1000.0 : 0);
+		printf("\n%-6s %-32s %10s %8s %10s %6s\n", "Slot", "Token", "Ops", "Failed", "Ops/s", "Util");
+
+		for (s = 0; s < slotcnt; s++) {
+			printf("%-6lu %-32s %10lu %8lu %10.1f %5.1f%%\n", slots[s].slotid, slots[s].label,
+					slots[s].ops, slots[s].failed, slots[s].ops / secs, 100.0 * slots[s].busy / elapsed);
+		}
+	}
+
+	if (optJSON) {
+		if (!strcmp(optJSON, "-")) {
+			fp = stdout;
+		} else {
+			fp = fopen(optJSON, "w");
+			if (fp == NULL) {
+				printf("Can not create %s\n", optJSON);
+				free(all);
+				return;
+			}
+		}
+
+		fprintf(fp, "{\n  \"operation\": \"%s\",\n", operationName[optOperation]);
+		if (optMechanism)
+			fprintf(fp, "  \"mechanism\": \"%s\",\n", optMechanism->name);
+		fprintf(fp, "  \"threads\": %d,\n  \"duration\": %.3f,\n", threadcnt, secs);
+		fprintf(fp, "  \"operations\": %lu,\n  \"failed\": %lu,\n", (unsigned long)count, failed);
+		fprintf(fp, "  \"opsPerSecond\": %.2f,\n", count / secs);
+		fprintf(fp, "  \"latencyMs\": { \"mean\": %.3f, \"p50\": %.3f, \"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f },\n",
+				mean, p50, p99, p999, count ? all[count - 1] / 1000.0 : 0);
+		fprintf(fp, "  \"slots\": [");
+
+		for (s = 0; s < slotcnt; s++) {
+			fprintf(fp, "%s\n    { \"slot\": %lu, \"token\": ", s ? "," : "", slots[s].slotid);
+			jsonString(fp, slots[s].label);
+			fprintf(fp, ", \"operations\": %lu, \"failed\": %lu, \"opsPerSecond\": %.2f, \"utilisation\": %.4f }",
+					slots[s].ops, slots[s].failed, slots[s].ops / secs, (double)slots[s].busy / elapsed);
+		}
+		fprintf(fp, "\n  ]\n}\n");
+
+		if (fp != stdout)
+			fclose(fp);
+	}
+
+	free(all);
+}
+
+
+
+/**
+ * Select the slots to put under load and log into each token
+ */
+static int selectSlots(struct bench_slot *slots)
+{
+	CK_SLOT_ID slotlist[MAX_SLOTS];
+	CK_TOKEN_INFO tokeninfo;
+	CK_ULONG cnt;
+	CK_RV rc;
+	int i, j, slotcnt;
+
+	cnt = MAX_SLOTS;
+	rc = p11->C_GetSlotList(TRUE, slotlist, &cnt);
+
+	if (rc != CKR_OK) {
+		printf("C_GetSlotList failed with 0x%lx\n", rc);
+		return -1;
+	}
+
+	slotcnt = 0;
+	for (i = 0; i < (int)cnt; i++) {
+		if (optSlotCount) {
+			for (j = 0; (j < optSlotCount) && (optSlots[j] != slotlist[i]); j++);
+			if (j == optSlotCount)
+				continue;
+		}
+
+		rc = p11->C_GetTokenInfo(slotlist[i], &tokeninfo);
+
+		if (rc != CKR_OK)
+			continue;
+
+		if (optTokenFilter && strncmp(optTokenFilter, (const char *)tokeninfo.label, strlen(optTokenFilter)))
+			continue;
+
+		memset(&slots[slotcnt], 0, sizeof(*slots));
+		slots[slotcnt].slotid = slotlist[i];
+		memcpy(slots[slotcnt].label, tokeninfo.label, sizeof(tokeninfo.label));
+		for (j = sizeof(tokeninfo.label); (j > 0) && (slots[slotcnt].label[j - 1] == ' '); j--)
+			slots[slotcnt].label[j - 1] = 0;
+
+		rc = p11->C_OpenSession(slotlist[i], CKF_RW_SESSION | CKF_SERIAL_SESSION, NULL, NULL, &slots[slotcnt].session);
+
+		if (rc != CKR_OK) {
+			printf("C_OpenSession for slot %lu failed with 0x%lx\n", slotlist[i], rc);
+			continue;
+		}
+
+		if (optOperation != OP_RANDOM) {
+			rc = p11->C_Login(slots[slotcnt].session, CKU_USER, pin, pinlen);
+
+			if ((rc != CKR_OK) && (rc != CKR_USER_ALREADY_LOGGED_IN)) {
+				printf("C_Login for slot %lu failed with 0x%lx\n", slotlist[i], rc);
+				p11->C_CloseSession(slots[slotcnt].session);
+				continue;
+			}
+		}
+
+		mutex_init(&slots[slotcnt].lock);
+		slotcnt++;
+	}
+
+	return slotcnt;
+}
+
+
+
+static void usage()
+{
+	printf("sc-hsm-pkcs11-bench [--module <p11-file>] [--pin <user-pin>] [--operation <op>] [--mechanism <mech>]\n");
+	printf("                    [--duration <seconds>] [--threads <count>] [--slotid <id>] [--token <tokenname>]\n");
+	printf("  --operation <op>     One of sign, verify, decrypt, random or find (default sign)\n");
+	printf("  --mechanism <mech>   Mechanism name or number (default CKM_SHA256_RSA_PKCS or CKM_RSA_PKCS)\n");
+	printf("  --duration <seconds> Duration of the run (default %d)\n", optDuration);
+	printf("  --threads <count>    Number of threads per slot (default %d)\n", optThreadsPerSlot);
+	printf("  --slotid <id>        Put slot under load, can be repeated (default all slots with a token)\n");
+	printf("  --token <tokenname>  Only use tokens with label starting with tokenname\n");
+	printf("  --label <keylabel>   Use key with given label\n");
+	printf("  --size <bytes>       Number of random bytes per C_GenerateRandom (default %d)\n", optRandomSize);
+	printf("  --json <file>        Write results as JSON to file, - for stdout\n");
+}
+
+
+
+static char *nextArg(int *argc, char ***argv)
+{
+	char *opt = **argv;
+
+	if (*argc < 1) {
+		printf("Argument for %s missing\n", opt);
+		exit(1);
+	}
+	(*argc)--;
+	(*argv)++;
+	return **argv;
+}
+
+
+
+static void decodeArgs(int argc, char **argv)
+{
+	char *arg;
+	int i;
+
+	argv++;
+	argc--;
+
+	while (argc--) {
+		if (!strcmp(*argv, "--module")) {
+			p11libname = nextArg(&argc, &argv);
+		} else if (!strcmp(*argv, "--pin")) {
+			pin = (CK_UTF8CHAR_PTR)nextArg(&argc, &argv);
+			pinlen = (CK_ULONG)strlen((char *)pin);
+		} else if (!strcmp(*argv, "--operation")) {
+			arg = nextArg(&argc, &argv);
+			for (i = 0; (i <= OP_FIND) && strcmp(arg, operationName[i]); i++);
+			if (i > OP_FIND) {
+				printf("Unknown operation %s\n", arg);
+				exit(1);
+			}
+			optOperation = (enum operation)i;
+		} else if (!strcmp(*argv, "--mechanism")) {
+			arg = nextArg(&argc, &argv);
+			optMechanism = getMechanism(arg);
+			if (optMechanism == NULL) {
+				printf("Unknown mechanism %s\n", arg);
+				exit(1);
+			}
+		} else if (!strcmp(*argv, "--duration")) {
+			optDuration = atoi(nextArg(&argc, &argv));
+		} else if (!strcmp(*argv, "--threads")) {
+			optThreadsPerSlot = atoi(nextArg(&argc, &argv));
+		} else if (!strcmp(*argv, "--slotid")) {
+			arg = nextArg(&argc, &argv);
+			if (optSlotCount < MAX_SLOTS)
+				optSlots[optSlotCount++] = (CK_SLOT_ID)atol(arg);
+		} else if (!strcmp(*argv, "--token")) {
+			optTokenFilter = nextArg(&argc, &argv);
+		} else if (!strcmp(*argv, "--label")) {
+			optKeyLabel = nextArg(&argc, &argv);
+		} else if (!strcmp(*argv, "--size")) {
+			optRandomSize = atoi(nextArg(&argc, &argv));
+		} else if (!strcmp(*argv, "--json")) {
+			optJSON = nextArg(&argc, &argv);
+		} else {
+			printf("Unknown argument %s\n", *argv);
+			usage();
+			exit(1);
+		}
+		argv++;
+	}
+
+	if ((optDuration < 1) || (optThreadsPerSlot < 1) || (optRandomSize < 1) || (optRandomSize > 512)) {
+		usage();
+		exit(1);
+	}
+
+	if ((optOperation == OP_RANDOM) || (optOperation == OP_FIND)) {
+		optMechanism = NULL;
+	} else if (optMechanism == NULL) {
+		optMechanism = getMechanism(optOperation == OP_DECRYPT ? "CKM_RSA_PKCS" : "CKM_SHA256_RSA_PKCS");
+	}
+}
+
+
+
+int main(int argc, char *argv[])
+{
+	struct bench_slot slots[MAX_SLOTS];
+	struct bench_thread *threads;
+	CK_C_INITIALIZE_ARGS initArgs;
+	CK_RV (*C_GetFunctionList)(CK_FUNCTION_LIST_PTR_PTR);
+	LIB_HANDLE dlhandle;
+	unsigned long long start, stop;
+	CK_RV rc;
+	int i, slotcnt, threadcnt;
+
+	decodeArgs(argc, argv);
+
+	dlhandle = dlopen(p11libname, RTLD_NOW);
+
+	if (!dlhandle) {
+		printf("dlopen failed with %s\n", dlerror());
+		exit(1);
+	}
+
+	C_GetFunctionList = (CK_RV (*)(CK_FUNCTION_LIST_PTR_PTR))dlsym(dlhandle, "C_GetFunctionList");
+
+	if (!C_GetFunctionList) {
+		printf("C_GetFunctionList not found in %s\n", p11libname);
+		exit(1);
+	}
+
+	(*C_GetFunctionList)(&p11);
+
+	memset(&initArgs, 0, sizeof(initArgs));
+	initArgs.flags = CKF_OS_LOCKING_OK;
+
+	rc = p11->C_Initialize(&initArgs);
+
+	if (rc != CKR_OK) {
+		printf("C_Initialize failed with 0x%lx\n", rc);
+		exit(1);
+	}
+
+	slotcnt = selectSlots(slots);
+
+	if (slotcnt <= 0) {
+		printf("No slot with a token found\n");
+		p11->C_Finalize(NULL);
+		exit(1);
+	}
+
+	threadcnt = slotcnt * optThreadsPerSlot;
+	if (threadcnt > MAX_THREADS)
+		threadcnt = MAX_THREADS;
+
+	threads = (struct bench_thread *)calloc(threadcnt, sizeof(struct bench_thread));
+
+	if (threads == NULL) {
+		printf("Out of memory\n");
+		exit(1);
+	}
+
+	for (i = 0; i < threadcnt; i++) {
+		threads[i].id = i;
+		threads[i].slot = &slots[i % slotcnt];
+
+		if (thread_create(&threads[i].thread, benchThread, &threads[i]) != 0) {
+			printf("Could not create thread %d\n", i);
+			threadcnt = i;
+			break;
+		}
+	}
+
+	// Start all threads at the same time once the keys were located
+	while (atomic_get(&ready) < threadcnt)
+		thread_sleep(1);
+
+	for (i = 0; i < threadcnt; i++) {
+		if (threads[i].rc != CKR_OK)
+			printf("Thread %d on slot %lu could not be prepared: 0x%lx\n", i, threads[i].slot->slotid, threads[i].rc);
+	}
+
+	start = now();
+	deadline = start + (unsigned long long)optDuration * 1000000;
+	atomic_set(&running, 1);
+
+	for (i = 0; i < threadcnt; i++)
+		thread_join(&threads[i].thread);
+
+	stop = now();
+
+	report(slots, slotcnt, threads, threadcnt, stop - start);
+
+	for (i = 0; i < threadcnt; i++) {
+		p11->C_CloseSession(threads[i].session);
+		free(threads[i].latency);
+	}
+	free(threads);
+
+	for (i = 0; i < slotcnt; i++) {
+		p11->C_CloseSession(slots[i].session);
+		mutex_destroy(&slots[i].lock);
+	}
+
+	p11->C_Finalize(NULL);
+	dlclose(dlhandle);
+
+	return 0;
+}
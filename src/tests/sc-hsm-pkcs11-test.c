@@ -41,6 +41,8 @@
 
 #include <common/mutex.h>
 #include <common/asn1.h>
+#include <common/thread.h>
+#include <common/atomic.h>
 
 /* Number of threads used for multi-threading test */
 #define NUM_THREADS		30
@@ -121,8 +123,19 @@ void usleep(unsigned int usec)
 
 
 #include <pkcs11/cryptoki.h>
+#include <pkcs11/verify-batch.h>
+#include <pkcs11/slot-statistics.h>
 #include <sc-hsm/sc-hsm-pkcs11.h>
 
+/* Number of signatures passed to SC_VerifyBatch() */
+#define VERIFY_BATCH_ITEMS	48
+
+/* Number of work units per job in the worker pool test */
+#define WORKER_POOL_ITEMS	1000
+
+/* Length of the multi-part AES-CBC test data, which exceeds the largest command APDU */
+#define AES_MULTIPART_LEN	(3 * 4096 + 64)
+
 struct id2name_t {
 	unsigned long       id;
 	char                *name;
@@ -366,6 +379,11 @@ static int optUnlockPIN = 0;
 static int optFailFast = 0;
 static long optSlotId = -1;
 static char *optTokenFilter = "";
+static char *optEmulatedSlots = NULL;
+
+/* Vendor extensions obtained with dlsym(), NULL if not exported by the module */
+static SC_VerifyBatch_t pSC_VerifyBatch = NULL;
+static SC_GetAPDUStatistics_t pSC_GetAPDUStatistics = NULL;
 
 static char namebuf[40]; /* used by main thread */
 
@@ -2363,6 +2381,7 @@ void usage()
 	printf("  --fail-fast                Abort at first failed test\n");
 	printf("  --invasive                 Enable tests that chnages keys on the device\n");
 	printf("  --unlock-pin               Unlock PIN without setting a new value\n");
+	printf("  --emulated-slots <count>   Add emulated SmartCard-HSM slots if the module was built with --enable-emulator\n");
 }
 
 
@@ -2415,6 +2434,14 @@ void decodeArgs(int argc, char **argv)
 			argv++;
 			optSlotId = atol(*argv);
 			argc--;
+		} else if (!strcmp(*argv, "--emulated-slots")) {
+			if (argc < 0) {
+				printf("Argument for --emulated-slots missing\n");
+				exit(1);
+			}
+			argv++;
+			optEmulatedSlots = *argv;
+			argc--;
 		} else if (!strcmp(*argv, "--threads")) {
 			if (argc < 0) {
 				printf("Argument for --threads missing\n");
@@ -2569,6 +2596,504 @@ int testAES(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session)
 
 
 
+
+void testVerifyBatch(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session)
+{
+	CK_OBJECT_CLASS class = CKO_PRIVATE_KEY;
+	CK_KEY_TYPE keyType = CKK_ECDSA;
+	CK_ATTRIBUTE template[] = {
+			{ CKA_CLASS, &class, sizeof(class) },
+			{ CKA_KEY_TYPE, &keyType, sizeof(keyType) }
+	};
+	CK_OBJECT_CLASS classpuk = CKO_PUBLIC_KEY;
+	CK_BYTE keyid[256];
+	CK_ATTRIBUTE puktemplate[] = {
+			{ CKA_CLASS, &classpuk, sizeof(classpuk) },
+			{ CKA_ID, keyid, sizeof(keyid) }
+	};
+	CK_OBJECT_HANDLE hnd, pubhnd;
+	CK_MECHANISM mech = { CKM_ECDSA, 0, 0 };
+	CK_BYTE hash[VERIFY_BATCH_ITEMS][32];
+	CK_BYTE signature[VERIFY_BATCH_ITEMS][128];
+	SC_VERIFY_ITEM items[VERIFY_BATCH_ITEMS];
+	CK_RV results[VERIFY_BATCH_ITEMS], expected[VERIFY_BATCH_ITEMS];
+	CK_ULONG len;
+	int rc, i;
+
+	if (pSC_VerifyBatch == NULL) {
+		printf("SC_VerifyBatch not exported by module, skipping batch verification\n");
+		return;
+	}
+
+	rc = findObject(p11, session, (CK_ATTRIBUTE_PTR)&template, sizeof(template) / sizeof(CK_ATTRIBUTE), 0, &hnd);
+
+	if (rc != CKR_OK) {
+		printf("No EC key found, skipping batch verification\n");
+		return;
+	}
+
+	printf("Calling C_GetAttributeValue(CKA_ID) ");
+	rc = p11->C_GetAttributeValue(session, hnd, (CK_ATTRIBUTE_PTR)&puktemplate[1], 1);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+	rc = findObject(p11, session, (CK_ATTRIBUTE_PTR)&puktemplate, sizeof(puktemplate) / sizeof(CK_ATTRIBUTE), 0, &pubhnd);
+
+	if (rc != CKR_OK) {
+		printf("No public key found for EC key, skipping batch verification\n");
+		return;
+	}
+
+	printf("Signing %d hash values with C_Sign() ", VERIFY_BATCH_ITEMS);
+
+	for (i = 0; i < VERIFY_BATCH_ITEMS; i++) {
+		memset(hash[i], i, sizeof(hash[i]));
+
+		rc = p11->C_SignInit(session, &mech, hnd);
+
+		if (rc == CKR_OK) {
+			len = sizeof(signature[i]);
+			rc = p11->C_Sign(session, hash[i], sizeof(hash[i]), signature[i], &len);
+		}
+
+		if (rc != CKR_OK)
+			break;
+
+		items[i].hKey = pubhnd;
+		items[i].mechanism = CKM_ECDSA;
+		items[i].pData = hash[i];
+		items[i].ulDataLen = sizeof(hash[i]);
+		items[i].pSignature = signature[i];
+		items[i].ulSignatureLen = len;
+		expected[i] = CKR_OK;
+
+		// Mix valid signatures with signatures and data modified after signing and an unknown key
+		switch(i % 4) {
+		case 1:
+			signature[i][len >> 1] ^= 0x5A;
+			expected[i] = CKR_SIGNATURE_INVALID;
+			break;
+		case 2:
+			hash[i][0] ^= 0xFF;
+			expected[i] = CKR_SIGNATURE_INVALID;
+			break;
+		}
+
+		if (i == 7) {
+			items[i].hKey = 0x7FFFFFFF;
+			expected[i] = CKR_KEY_HANDLE_INVALID;
+		}
+	}
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+	if (rc != CKR_OK)
+		return;
+
+	printf("Calling SC_VerifyBatch() without items ");
+	rc = pSC_VerifyBatch(session, items, 0, results);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+	printf("Calling SC_VerifyBatch() without results ");
+	rc = pSC_VerifyBatch(session, items, VERIFY_BATCH_ITEMS, NULL);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_ARGUMENTS_BAD));
+
+	for (i = 0; i < VERIFY_BATCH_ITEMS; i++) {
+		results[i] = CKR_GENERAL_ERROR;
+	}
+
+	printf("Calling SC_VerifyBatch() with %d signatures ", VERIFY_BATCH_ITEMS);
+	rc = pSC_VerifyBatch(session, items, VERIFY_BATCH_ITEMS, results);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+	for (i = 0; i < VERIFY_BATCH_ITEMS; i++) {
+		printf("Result for signature %d ", i);
+		printf("- %s : %s\n", id2name(p11CKRName, results[i], 0, namebuf), verdict(results[i] == expected[i]));
+	}
+
+	// The verification must not affect an operation active in the session
+	printf("Calling C_SignInit() ");
+	rc = p11->C_SignInit(session, &mech, hnd);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+	rc = pSC_VerifyBatch(session, items, 1, results);
+
+	printf("Calling C_Sign() after SC_VerifyBatch() ");
+	len = sizeof(signature[0]);
+	rc = p11->C_Sign(session, hash[0], sizeof(hash[0]), signature[0], &len);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+}
+
+
+
+void testAPDUStatistics(CK_FUNCTION_LIST_PTR p11, CK_SLOT_ID slotid, CK_SESSION_HANDLE session)
+{
+	CK_OBJECT_CLASS class = CKO_PRIVATE_KEY;
+	CK_KEY_TYPE keyType = CKK_ECDSA;
+	CK_ATTRIBUTE template[] = {
+			{ CKA_CLASS, &class, sizeof(class) },
+			{ CKA_KEY_TYPE, &keyType, sizeof(keyType) }
+	};
+	CK_OBJECT_HANDLE hnd;
+	CK_MECHANISM mech = { CKM_ECDSA, 0, 0 };
+	CK_BYTE hash[32], signature[128];
+	SC_APDU_STATISTICS *before, *after, *ins;
+	unsigned long long sum;
+	CK_ULONG len;
+	int rc, i;
+
+	if (pSC_GetAPDUStatistics == NULL) {
+		printf("SC_GetAPDUStatistics not exported by module, skipping APDU statistics\n");
+		return;
+	}
+
+	rc = findObject(p11, session, (CK_ATTRIBUTE_PTR)&template, sizeof(template) / sizeof(CK_ATTRIBUTE), 0, &hnd);
+
+	if (rc != CKR_OK) {
+		printf("No EC key found, skipping APDU statistics\n");
+		return;
+	}
+
+	before = (SC_APDU_STATISTICS *)calloc(3, sizeof(SC_APDU_STATISTICS));
+	after = before + 1;
+	ins = before + 2;
+
+	printf("Calling SC_GetAPDUStatistics() with invalid INS ");
+	rc = pSC_GetAPDUStatistics(slotid, SC_STATS_ALL_INS + 1, ins);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_ARGUMENTS_BAD));
+
+	printf("Calling SC_GetAPDUStatistics() without buffer ");
+	rc = pSC_GetAPDUStatistics(slotid, SC_STATS_ALL_INS, NULL);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_ARGUMENTS_BAD));
+
+	printf("Calling SC_GetAPDUStatistics() for all instructions ");
+	rc = pSC_GetAPDUStatistics(slotid, SC_STATS_ALL_INS, before);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+	memset(hash, 0x5A, sizeof(hash));
+
+	printf("Signing with C_Sign() ");
+	rc = p11->C_SignInit(session, &mech, hnd);
+	if (rc == CKR_OK) {
+		len = sizeof(signature);
+		rc = p11->C_Sign(session, hash, sizeof(hash), signature, &len);
+	}
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+	printf("Calling SC_GetAPDUStatistics() after signing ");
+	rc = pSC_GetAPDUStatistics(slotid, SC_STATS_ALL_INS, after);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+	printf("APDU count %llu -> %llu : %s\n", before->count, after->count, verdict(after->count > before->count));
+	printf("Bytes sent %llu -> %llu : %s\n", before->bytesSent, after->bytesSent, verdict(after->bytesSent > before->bytesSent));
+	printf("Bytes received %llu -> %llu : %s\n", before->bytesReceived, after->bytesReceived, verdict(after->bytesReceived > before->bytesReceived));
+
+	sum = 0;
+	for (i = 0; i < SC_STATS_BUCKETS; i++) {
+		sum += after->histogram[i];
+	}
+	printf("Histogram sum %llu for %llu APDUs : %s\n", sum, after->count, verdict(sum == after->count));
+
+	// Other threads of the module may transmit APDUs while the instructions are summed up
+	sum = 0;
+	for (i = 0; i < SC_STATS_ALL_INS; i++) {
+		rc = pSC_GetAPDUStatistics(slotid, i, ins);
+		if (rc != CKR_OK)
+			break;
+		sum += ins->count;
+	}
+
+	printf("Calling SC_GetAPDUStatistics() for each instruction ");
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+	rc = pSC_GetAPDUStatistics(slotid, SC_STATS_ALL_INS, before);
+	printf("Sum over instructions %llu for %llu APDUs : %s\n", sum, after->count, verdict((sum >= after->count) && (sum <= before->count)));
+
+	free(before);
+}
+
+
+
+struct workerPoolTestJob {
+	volatile long next;
+	volatile long processed[WORKER_POOL_ITEMS];
+};
+
+
+
+static void workerPoolTestFunc(void *arg)
+{
+	struct workerPoolTestJob *job = (struct workerPoolTestJob *)arg;
+	long i;
+
+	while ((i = atomic_inc(&job->next) - 1) < WORKER_POOL_ITEMS) {
+		atomic_inc(&job->processed[i]);
+	}
+}
+
+
+
+struct workerPoolTestSubmitter {
+	struct worker_pool *pool;
+	int jobs;
+	int errors;
+};
+
+
+
+static void workerPoolTestSubmit(void *arg)
+{
+	struct workerPoolTestSubmitter *sub = (struct workerPoolTestSubmitter *)arg;
+	struct workerPoolTestJob job;
+	int i, j;
+
+	for (j = 0; j < sub->jobs; j++) {
+		memset((void *)&job, 0, sizeof(job));
+
+		worker_pool_run(sub->pool, workerPoolTestFunc, (void *)&job);
+
+		// All work must be complete and no worker may still use the job when worker_pool_run() returns
+		for (i = 0; i < WORKER_POOL_ITEMS; i++) {
+			if (job.processed[i] != 1)
+				sub->errors++;
+		}
+	}
+}
+
+
+
+void testWorkerPool()
+{
+	struct worker_pool *pool;
+	struct workerPoolTestSubmitter sub[4];
+	THREAD thread[4];
+	int rc, i, errors;
+
+	printf("Calling worker_pool_create() ");
+	rc = worker_pool_create(&pool, 4);
+	printf("- %d : %s\n", rc, verdict(rc == 0));
+
+	if (rc != 0)
+		return;
+
+	sub[0].pool = pool;
+	sub[0].jobs = 10;
+	sub[0].errors = 0;
+
+	printf("Calling worker_pool_run() from one thread ");
+	workerPoolTestSubmit(&sub[0]);
+	printf("- %d errors : %s\n", sub[0].errors, verdict(sub[0].errors == 0));
+
+	// Jobs submitted concurrently are queued and closed independently of each other
+	for (i = 0; i < 4; i++) {
+		sub[i].pool = pool;
+		sub[i].jobs = 50;
+		sub[i].errors = 0;
+		thread_create(&thread[i], workerPoolTestSubmit, &sub[i]);
+	}
+
+	errors = 0;
+	for (i = 0; i < 4; i++) {
+		thread_join(&thread[i]);
+		errors += sub[i].errors;
+	}
+
+	printf("Calling worker_pool_run() from 4 threads ");
+	printf("- %d errors : %s\n", errors, verdict(errors == 0));
+
+	worker_pool_destroy(pool);
+}
+
+
+
+
+/* Part sizes for multi-part AES-CBC, leaving partial blocks and exceeding a command APDU */
+static CK_ULONG aesPartSizes[] = { 37, 4999, 5, 4107 };
+
+
+
+static CK_RV aesCBCMultiPart(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session, int encrypt, CK_BYTE_PTR in, CK_ULONG inLen, CK_BYTE_PTR out, CK_ULONG_PTR outLen, int *queryMatches)
+{
+	CK_ULONG ofsIn, ofsOut, part, len, query;
+	CK_RV rc;
+	int i;
+
+	ofsIn = 0;
+	ofsOut = 0;
+	*queryMatches = TRUE;
+
+	for (i = 0; ofsIn < inLen; i++) {
+		part = i < sizeof(aesPartSizes) / sizeof(*aesPartSizes) ? aesPartSizes[i] : inLen;
+		if (part > inLen - ofsIn) {
+			part = inLen - ofsIn;
+		}
+
+		// The length query must not consume the input
+		query = 0;
+		if (encrypt) {
+			rc = p11->C_EncryptUpdate(session, in + ofsIn, part, NULL, &query);
+		} else {
+			rc = p11->C_DecryptUpdate(session, in + ofsIn, part, NULL, &query);
+		}
+
+		if (rc != CKR_OK)
+			return rc;
+
+		// Output trails input, so the update works in place if in and out are the same buffer
+		len = *outLen - ofsOut;
+		if (encrypt) {
+			rc = p11->C_EncryptUpdate(session, in + ofsIn, part, out + ofsOut, &len);
+		} else {
+			rc = p11->C_DecryptUpdate(session, in + ofsIn, part, out + ofsOut, &len);
+		}
+
+		if (rc != CKR_OK)
+			return rc;
+
+		if ((len != query) || (len != ((ofsIn + part) & ~15) - ofsOut)) {
+			*queryMatches = FALSE;
+		}
+
+		ofsIn += part;
+		ofsOut += len;
+	}
+
+	len = *outLen - ofsOut;
+	if (encrypt) {
+		rc = p11->C_EncryptFinal(session, out + ofsOut, &len);
+	} else {
+		rc = p11->C_DecryptFinal(session, out + ofsOut, &len);
+	}
+
+	*outLen = ofsOut + len;
+	return rc;
+}
+
+
+
+int testAESMultiPart(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session)
+{
+	CK_OBJECT_CLASS class = CKO_SECRET_KEY;
+	CK_KEY_TYPE keyType = CKK_AES;
+	CK_ATTRIBUTE template[] = {
+			{ CKA_CLASS, &class, sizeof(class) },
+			{ CKA_KEY_TYPE, &keyType, sizeof(keyType) }
+	};
+	CK_OBJECT_HANDLE hnd;
+	CK_BYTE iv[16];
+	CK_MECHANISM mech = { CKM_AES_CBC, iv, sizeof(iv) };
+	CK_MECHANISM zeroIVMech = { CKM_AES_CBC, NULL, 0 };
+	CK_BYTE_PTR plain, single, multi, buf;
+	CK_ULONG len;
+	int rc, i, queryMatches;
+
+	rc = findObject(p11, session, (CK_ATTRIBUTE_PTR)&template, sizeof(template) / sizeof(CK_ATTRIBUTE), 0, &hnd);
+
+	if (rc != CKR_OK) {
+		printf("No AES key found, skipping multi-part AES-CBC\n");
+		return CKR_OK;
+	}
+
+	plain = (CK_BYTE_PTR)malloc(4 * AES_MULTIPART_LEN);
+	single = plain + AES_MULTIPART_LEN;
+	multi = single + AES_MULTIPART_LEN;
+	buf = multi + AES_MULTIPART_LEN;
+
+	for (i = 0; i < AES_MULTIPART_LEN; i++) {
+		plain[i] = (CK_BYTE)(i * 7 + (i >> 8));
+	}
+
+	for (i = 0; i < sizeof(iv); i++) {
+		iv[i] = (CK_BYTE)(0xA5 ^ (i * 17));
+	}
+
+	printf("Calling C_EncryptInit() for single-part AES-CBC with IV ");
+	rc = p11->C_EncryptInit(session, &mech, hnd);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+	printf("Calling C_Encrypt() with %d bytes ", AES_MULTIPART_LEN);
+	len = AES_MULTIPART_LEN;
+	rc = p11->C_Encrypt(session, plain, AES_MULTIPART_LEN, single, &len);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict((rc == CKR_OK) && (len == AES_MULTIPART_LEN)));
+
+	// CBC applies the IV to the first block only, which a zero IV must reproduce
+	printf("Calling C_EncryptInit() for AES-CBC with zero IV ");
+	rc = p11->C_EncryptInit(session, &zeroIVMech, hnd);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+	for (i = 0; i < sizeof(iv); i++) {
+		buf[i] = plain[i] ^ iv[i];
+	}
+
+	printf("Calling C_Encrypt() with IV applied to the first block ");
+	len = sizeof(iv);
+	rc = p11->C_Encrypt(session, buf, sizeof(iv), buf, &len);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict((rc == CKR_OK) && !memcmp(buf, single, sizeof(iv))));
+
+	printf("Calling C_EncryptInit() for multi-part AES-CBC with IV ");
+	rc = p11->C_EncryptInit(session, &mech, hnd);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+	printf("Calling C_EncryptUpdate() and C_EncryptFinal() ");
+	len = AES_MULTIPART_LEN;
+	rc = aesCBCMultiPart(p11, session, TRUE, plain, AES_MULTIPART_LEN, multi, &len, &queryMatches);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict((rc == CKR_OK) && (len == AES_MULTIPART_LEN)));
+
+	printf("Length query through C_EncryptUpdate() : %s\n", verdict(queryMatches));
+	printf("Multi-part cipher matches single-part cipher : %s\n", verdict(!memcmp(single, multi, AES_MULTIPART_LEN)));
+
+	printf("Calling C_EncryptInit() for in-place multi-part AES-CBC ");
+	rc = p11->C_EncryptInit(session, &mech, hnd);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+	memcpy(buf, plain, AES_MULTIPART_LEN);
+
+	printf("Calling C_EncryptUpdate() and C_EncryptFinal() in place ");
+	len = AES_MULTIPART_LEN;
+	rc = aesCBCMultiPart(p11, session, TRUE, buf, AES_MULTIPART_LEN, buf, &len, &queryMatches);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict((rc == CKR_OK) && (len == AES_MULTIPART_LEN)));
+
+	printf("In-place cipher matches single-part cipher : %s\n", verdict(!memcmp(single, buf, AES_MULTIPART_LEN)));
+
+	printf("Calling C_DecryptInit() for in-place multi-part AES-CBC ");
+	rc = p11->C_DecryptInit(session, &mech, hnd);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+	printf("Calling C_DecryptUpdate() and C_DecryptFinal() in place ");
+	len = AES_MULTIPART_LEN;
+	rc = aesCBCMultiPart(p11, session, FALSE, buf, AES_MULTIPART_LEN, buf, &len, &queryMatches);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict((rc == CKR_OK) && (len == AES_MULTIPART_LEN)));
+
+	printf("Length query through C_DecryptUpdate() : %s\n", verdict(queryMatches));
+	printf("In-place plain matches input : %s\n", verdict(!memcmp(plain, buf, AES_MULTIPART_LEN)));
+
+	printf("Calling C_DecryptInit() for single-part AES-CBC with IV ");
+	rc = p11->C_DecryptInit(session, &mech, hnd);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+	printf("Calling C_Decrypt() with multi-part cipher ");
+	len = AES_MULTIPART_LEN;
+	rc = p11->C_Decrypt(session, multi, AES_MULTIPART_LEN, buf, &len);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict((rc == CKR_OK) && (len == AES_MULTIPART_LEN)));
+
+	printf("Single-part plain matches input : %s\n", verdict(!memcmp(plain, buf, AES_MULTIPART_LEN)));
+
+	printf("Calling C_EncryptInit() for incomplete block ");
+	rc = p11->C_EncryptInit(session, &mech, hnd);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+	len = AES_MULTIPART_LEN;
+	rc = p11->C_EncryptUpdate(session, plain, 21, buf, &len);
+
+	printf("Calling C_EncryptFinal() with incomplete block ");
+	len = AES_MULTIPART_LEN;
+	rc = p11->C_EncryptFinal(session, buf, &len);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_DATA_LEN_RANGE));
+
+	free(plain);
+	return CKR_OK;
+}
+
+
+
 int main(int argc, char *argv[])
 {
 	int i;
@@ -2588,6 +3113,14 @@ int main(int argc, char *argv[])
 
 	decodeArgs(argc, argv);
 
+	if (optEmulatedSlots != NULL) {
+#ifdef _WIN32
+		_putenv_s("PKCS11_EMULATED_SLOTS", optEmulatedSlots);
+#else
+		setenv("PKCS11_EMULATED_SLOTS", optEmulatedSlots, 1);
+#endif
+	}
+
 	printf("PKCS11 unittest running.\n");
 
 	dlhandle = dlopen(p11libname, RTLD_NOW);
@@ -2603,6 +3136,9 @@ int main(int argc, char *argv[])
 
 	(*C_GetFunctionList)(&p11);
 
+	pSC_VerifyBatch = (SC_VerifyBatch_t)dlsym(dlhandle, "SC_VerifyBatch");
+	pSC_GetAPDUStatistics = (SC_GetAPDUStatistics_t)dlsym(dlhandle, "SC_GetAPDUStatistics");
+
 	memset(&initArgs, 0, sizeof(initArgs));
 	initArgs.flags = CKF_OS_LOCKING_OK;
 
@@ -2770,6 +3306,8 @@ int main(int argc, char *argv[])
 
 				testAES(p11, session);
 
+				testAESMultiPart(p11, session);
+
 				testRSASigning(p11, slotid, 0, CKM_RSA_PKCS);
 
 				if (strncmp("STARCOS", (char *)tokeninfo.label, 7) || !strncmp("3.5ID ECC C1 BNK", (char *)tokeninfo.model, 16)) {
@@ -2798,6 +3336,11 @@ int main(int argc, char *argv[])
 					testECSigning(p11, slotid, 0, CKM_SC_HSM_ECDSA_SHA256);
 				}
 
+#ifdef ENABLE_LIBCRYPTO
+				testVerifyBatch(p11, session);
+#endif
+				testAPDUStatistics(p11, slotid, session);
+
 				printf("Calling C_CloseSession ");
 				rc = p11->C_CloseSession(session);
 				printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
@@ -2809,6 +3352,8 @@ int main(int argc, char *argv[])
 		if (optMultiThreadingTests)
 			testSigningMultiThreading(p11);
 #endif
+
+		testWorkerPool();
 	}
 
 	printf("Calling C_Finalize ");